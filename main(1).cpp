@@ -1,4 +1,24 @@
 #include <iostream>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <tuple>
+#include <cmath>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include <GL/glew.h>
 #include <GL/freeglut.h>
 #include <SOIL.h>
@@ -18,6 +38,467 @@
 
 using namespace std;
 
+/*
+ * GL call statistics and state cache. When either is on, the GL entry
+ * points the renderer uses for state, uniforms, uploads and draws are
+ * redirected through wrappers that count calls and keep a shadow copy of
+ * the bound state. With GL_STATE_CACHE the wrappers also skip binds and
+ * enables that would set what is already set; glStateCache turns that off
+ * at runtime for comparison. Build with both at 0 to call GL directly.
+ */
+#ifndef GL_CALL_STATISTICS
+#define GL_CALL_STATISTICS 1
+#endif
+#ifndef GL_STATE_CACHE
+#define GL_STATE_CACHE 1
+#endif
+
+bool glStateCache = GL_STATE_CACHE != 0;
+
+struct UGLStatistics {
+	long calls, draws, vertices;
+	long programBinds, vertexArrayBinds, textureBinds, bufferBinds, enables;
+	long uniformSets, uniformLookups;
+	long redundantPrograms, redundantVertexArrays, redundantTextures, redundantBuffers, redundantEnables, redundantUniforms;
+	// Redundant calls the state cache kept from reaching GL.
+	long elided;
+	long long uniformBytes, bufferBytes, textureBytes;
+};
+
+// Counts for the frame in progress and for the last finished frame.
+UGLStatistics glStatistics, glFrameStatistics;
+
+#define GL_SHADOW_TEXTURE_UNITS 16
+#define GL_SHADOW_BUFFER_TARGETS 16
+#define GL_SHADOW_CAPABILITIES 16
+#define GL_SHADOW_UNIFORMS 256
+
+/*
+ * What the wrappers last saw bound. Zero is also what GL starts with, except
+ * for capabilities, which are unknown until first set, and the element
+ * buffer, which belongs to the bound vertex array and is unknown after a
+ * vertex array bind.
+ */
+#define GL_SHADOW_UNKNOWN 0xFFFFFFFFu
+
+struct UGLShadowState {
+	GLuint program, vertexArray;
+	GLenum activeTexture;
+	GLenum textureTargets[GL_SHADOW_TEXTURE_UNITS];
+	GLuint textures[GL_SHADOW_TEXTURE_UNITS];
+	GLenum bufferTargets[GL_SHADOW_BUFFER_TARGETS];
+	GLuint buffers[GL_SHADOW_BUFFER_TARGETS];
+	GLenum capabilities[GL_SHADOW_CAPABILITIES];
+	bool capabilitiesKnown[GL_SHADOW_CAPABILITIES];
+	bool capabilitiesEnabled[GL_SHADOW_CAPABILITIES];
+};
+
+/* Last value sent to a uniform, hashed by program and location. */
+struct UGLUniformValue {
+	GLuint program;
+	GLint location;
+	int size;
+	GLfloat data[16];
+};
+
+UGLShadowState glShadow;
+UGLUniformValue glShadowUniforms[GL_SHADOW_UNIFORMS];
+
+#if GL_CALL_STATISTICS || GL_STATE_CACHE
+
+/* Finds the shadow slot for a buffer target, claiming a free one the first time. */
+int UGLBufferSlot (GLenum target) {
+	for (int i = 0; i < GL_SHADOW_BUFFER_TARGETS; i++) {
+		if (glShadow.bufferTargets[i] == target || glShadow.bufferTargets[i] == 0) {
+			glShadow.bufferTargets[i] = target;
+			return i;
+		}
+	}
+	return -1;
+}
+
+int UGLCapabilitySlot (GLenum capability) {
+	for (int i = 0; i < GL_SHADOW_CAPABILITIES; i++) {
+		if (glShadow.capabilities[i] == capability) {
+			return i;
+		}
+		if (glShadow.capabilities[i] == 0) {
+			glShadow.capabilities[i] = capability;
+			glShadow.capabilitiesKnown[i] = false;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Records a uniform value and returns whether it was already the current one. Arrays are only counted. */
+bool UGLUniformUnchanged (GLint location, const GLfloat* data, int size) {
+	glStatistics.calls++;
+	glStatistics.uniformSets++;
+	glStatistics.uniformBytes += size * sizeof(GLfloat);
+	if (location < 0 || size > 16) {
+		return false;
+	}
+
+	UGLUniformValue& value = glShadowUniforms[(glShadow.program * 31 + location) & (GL_SHADOW_UNIFORMS - 1)];
+	if (value.program == glShadow.program && value.location == location && value.size == size
+		&& memcmp(value.data, data, size * sizeof(GLfloat)) == 0) {
+		glStatistics.redundantUniforms++;
+		return true;
+	}
+	value.program = glShadow.program;
+	value.location = location;
+	value.size = size;
+	memcpy(value.data, data, size * sizeof(GLfloat));
+	return false;
+}
+
+/* Counts a redundant call and says whether the cache drops it. */
+bool UGLElide (long& redundantCounter) {
+	redundantCounter++;
+	if (glStateCache) {
+		glStatistics.elided++;
+		return true;
+	}
+	return false;
+}
+
+void UGLUseProgram (GLuint program) {
+	glStatistics.calls++;
+	glStatistics.programBinds++;
+	if (program == glShadow.program && UGLElide(glStatistics.redundantPrograms)) {
+		return;
+	}
+	glShadow.program = program;
+	glUseProgram(program);
+}
+
+void UGLBindVertexArray (GLuint array) {
+	glStatistics.calls++;
+	glStatistics.vertexArrayBinds++;
+	if (array == glShadow.vertexArray && UGLElide(glStatistics.redundantVertexArrays)) {
+		return;
+	}
+	glShadow.vertexArray = array;
+	int slot = UGLBufferSlot(GL_ELEMENT_ARRAY_BUFFER);
+	if (slot >= 0) {
+		glShadow.buffers[slot] = GL_SHADOW_UNKNOWN;
+	}
+	glBindVertexArray(array);
+}
+
+void UGLActiveTexture (GLenum unit) {
+	glStatistics.calls++;
+	if (unit - GL_TEXTURE0 == glShadow.activeTexture && glStateCache) {
+		glStatistics.elided++;
+		return;
+	}
+	glShadow.activeTexture = unit - GL_TEXTURE0;
+	glActiveTexture(unit);
+}
+
+void UGLBindTexture (GLenum target, GLuint texture) {
+	glStatistics.calls++;
+	glStatistics.textureBinds++;
+	GLenum unit = glShadow.activeTexture;
+	if (unit < GL_SHADOW_TEXTURE_UNITS) {
+		if (glShadow.textureTargets[unit] == target && glShadow.textures[unit] == texture && UGLElide(glStatistics.redundantTextures)) {
+			return;
+		}
+		glShadow.textureTargets[unit] = target;
+		glShadow.textures[unit] = texture;
+	}
+	glBindTexture(target, texture);
+}
+
+void UGLBindBuffer (GLenum target, GLuint buffer) {
+	glStatistics.calls++;
+	glStatistics.bufferBinds++;
+	int slot = UGLBufferSlot(target);
+	if (slot >= 0) {
+		if (glShadow.buffers[slot] == buffer && UGLElide(glStatistics.redundantBuffers)) {
+			return;
+		}
+		glShadow.buffers[slot] = buffer;
+	}
+	glBindBuffer(target, buffer);
+}
+
+/* Binding to an indexed target also binds the generic one. */
+void UGLBindBufferBase (GLenum target, GLuint index, GLuint buffer) {
+	glStatistics.calls++;
+	glStatistics.bufferBinds++;
+	int slot = UGLBufferSlot(target);
+	if (slot >= 0) {
+		glShadow.buffers[slot] = buffer;
+	}
+	glBindBufferBase(target, index, buffer);
+}
+
+/* Image units are separate from texture units, so nothing in the shadow changes. */
+void UGLBindImageTexture (GLuint unit, GLuint texture, GLint level, GLboolean layered, GLint layer, GLenum access, GLenum format) {
+	glStatistics.calls++;
+	glStatistics.textureBinds++;
+	glBindImageTexture(unit, texture, level, layered, layer, access, format);
+}
+
+/* Returns whether the capability is already in the requested state and the call can go. */
+bool UGLSetCapability (GLenum capability, bool enabled) {
+	glStatistics.calls++;
+	glStatistics.enables++;
+	int slot = UGLCapabilitySlot(capability);
+	if (slot < 0) {
+		return false;
+	}
+	if (glShadow.capabilitiesKnown[slot] && glShadow.capabilitiesEnabled[slot] == enabled && UGLElide(glStatistics.redundantEnables)) {
+		return true;
+	}
+	glShadow.capabilitiesKnown[slot] = true;
+	glShadow.capabilitiesEnabled[slot] = enabled;
+	return false;
+}
+
+void UGLEnable (GLenum capability) {
+	if (!UGLSetCapability(capability, true)) {
+		glEnable(capability);
+	}
+}
+
+void UGLDisable (GLenum capability) {
+	if (!UGLSetCapability(capability, false)) {
+		glDisable(capability);
+	}
+}
+
+GLint UGLGetUniformLocation (GLuint program, const GLchar* name) {
+	glStatistics.calls++;
+	glStatistics.uniformLookups++;
+	return glGetUniformLocation(program, name);
+}
+
+void UGLUniform1i (GLint location, GLint x) {
+	GLfloat data[1];
+	memcpy(data, &x, sizeof(x));
+	UGLUniformUnchanged(location, data, 1);
+	glUniform1i(location, x);
+}
+
+void UGLUniform1f (GLint location, GLfloat x) {
+	UGLUniformUnchanged(location, &x, 1);
+	glUniform1f(location, x);
+}
+
+void UGLUniform3f (GLint location, GLfloat x, GLfloat y, GLfloat z) {
+	GLfloat data[3] = { x, y, z };
+	UGLUniformUnchanged(location, data, 3);
+	glUniform3f(location, x, y, z);
+}
+
+void UGLUniform2f (GLint location, GLfloat x, GLfloat y) {
+	GLfloat data[2] = { x, y };
+	UGLUniformUnchanged(location, data, 2);
+	glUniform2f(location, x, y);
+}
+
+void UGLUniform4f (GLint location, GLfloat x, GLfloat y, GLfloat z, GLfloat w) {
+	GLfloat data[4] = { x, y, z, w };
+	UGLUniformUnchanged(location, data, 4);
+	glUniform4f(location, x, y, z, w);
+}
+
+void UGLUniform1fv (GLint location, GLsizei count, const GLfloat* value) {
+	UGLUniformUnchanged(location, value, count);
+	glUniform1fv(location, count, value);
+}
+
+void UGLUniform3fv (GLint location, GLsizei count, const GLfloat* value) {
+	UGLUniformUnchanged(location, value, count * 3);
+	glUniform3fv(location, count, value);
+}
+
+void UGLUniform4fv (GLint location, GLsizei count, const GLfloat* value) {
+	UGLUniformUnchanged(location, value, count * 4);
+	glUniform4fv(location, count, value);
+}
+
+void UGLUniformMatrix3fv (GLint location, GLsizei count, GLboolean transpose, const GLfloat* value) {
+	UGLUniformUnchanged(location, value, count * 9);
+	glUniformMatrix3fv(location, count, transpose, value);
+}
+
+void UGLUniformMatrix4fv (GLint location, GLsizei count, GLboolean transpose, const GLfloat* value) {
+	UGLUniformUnchanged(location, value, count * 16);
+	glUniformMatrix4fv(location, count, transpose, value);
+}
+
+void UGLDrawArrays (GLenum mode, GLint first, GLsizei count) {
+	glStatistics.calls++;
+	glStatistics.draws++;
+	glStatistics.vertices += count;
+	glDrawArrays(mode, first, count);
+}
+
+void UGLDrawArraysInstanced (GLenum mode, GLint first, GLsizei count, GLsizei instances) {
+	glStatistics.calls++;
+	glStatistics.draws++;
+	glStatistics.vertices += (long) count * instances;
+	glDrawArraysInstanced(mode, first, count, instances);
+}
+
+/* Vertex counts of indirect draws are only known to the GPU, so only the call is counted. */
+void UGLMultiDrawArraysIndirect (GLenum mode, const void* indirect, GLsizei drawCount, GLsizei stride) {
+	glStatistics.calls++;
+	glStatistics.draws++;
+	glMultiDrawArraysIndirect(mode, indirect, drawCount, stride);
+}
+
+void UGLMultiDrawArraysIndirectCountARB (GLenum mode, const void* indirect, GLintptr drawCount, GLsizei maxDrawCount, GLsizei stride) {
+	glStatistics.calls++;
+	glStatistics.draws++;
+	glMultiDrawArraysIndirectCountARB(mode, indirect, drawCount, maxDrawCount, stride);
+}
+
+void UGLBufferData (GLenum target, GLsizeiptr size, const void* data, GLenum usage) {
+	glStatistics.calls++;
+	glStatistics.bufferBytes += data != NULL ? size : 0;
+	glBufferData(target, size, data, usage);
+}
+
+void UGLBufferSubData (GLenum target, GLintptr offset, GLsizeiptr size, const void* data) {
+	glStatistics.calls++;
+	glStatistics.bufferBytes += size;
+	glBufferSubData(target, offset, size, data);
+}
+
+void UGLTexImage2D (GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height, GLint border,
+	GLenum format, GLenum type, const void* pixels) {
+	glStatistics.calls++;
+	if (pixels != NULL) {
+		// Close enough for the byte formats used here.
+		int components = (format == GL_RGBA || format == GL_BGRA) ? 4 : (format == GL_RGB || format == GL_BGR) ? 3 : 1;
+		int size = (type == GL_FLOAT || type == GL_UNSIGNED_INT) ? 4 : (type == GL_UNSIGNED_SHORT || type == GL_HALF_FLOAT) ? 2 : 1;
+		glStatistics.textureBytes += (long long) width * height * components * size;
+	}
+	glTexImage2D(target, level, internalFormat, width, height, border, format, type, pixels);
+}
+
+/* Deleted objects are unbound by GL, so the shadow forgets them too. */
+void UGLDeleteBuffers (GLsizei count, const GLuint* buffers) {
+	glStatistics.calls++;
+	for (int i = 0; i < count; i++) {
+		for (int slot = 0; slot < GL_SHADOW_BUFFER_TARGETS; slot++) {
+			if (glShadow.buffers[slot] == buffers[i]) {
+				glShadow.buffers[slot] = 0;
+			}
+		}
+	}
+	glDeleteBuffers(count, buffers);
+}
+
+void UGLDeleteTextures (GLsizei count, const GLuint* textures) {
+	glStatistics.calls++;
+	for (int i = 0; i < count; i++) {
+		for (int unit = 0; unit < GL_SHADOW_TEXTURE_UNITS; unit++) {
+			if (glShadow.textures[unit] == textures[i]) {
+				glShadow.textures[unit] = 0;
+			}
+		}
+	}
+	glDeleteTextures(count, textures);
+}
+
+void UGLDeleteVertexArrays (GLsizei count, const GLuint* arrays) {
+	glStatistics.calls++;
+	for (int i = 0; i < count; i++) {
+		if (glShadow.vertexArray == arrays[i]) {
+			glShadow.vertexArray = 0;
+		}
+	}
+	glDeleteVertexArrays(count, arrays);
+}
+
+// GLEW defines its entry points as macros, so each is replaced rather than redefined.
+#undef glUseProgram
+#undef glBindVertexArray
+#undef glActiveTexture
+#undef glBindTexture
+#undef glBindBuffer
+#undef glBindBufferBase
+#undef glBindImageTexture
+#undef glEnable
+#undef glDisable
+#undef glGetUniformLocation
+#undef glUniform1i
+#undef glUniform1f
+#undef glUniform3f
+#undef glUniform2f
+#undef glUniform4f
+#undef glUniform1fv
+#undef glUniform3fv
+#undef glUniform4fv
+#undef glUniformMatrix3fv
+#undef glUniformMatrix4fv
+#undef glDrawArrays
+#undef glDrawArraysInstanced
+#undef glMultiDrawArraysIndirect
+#undef glMultiDrawArraysIndirectCountARB
+#undef glBufferData
+#undef glBufferSubData
+#undef glTexImage2D
+#undef glDeleteBuffers
+#undef glDeleteTextures
+#undef glDeleteVertexArrays
+#define glUseProgram UGLUseProgram
+#define glBindVertexArray UGLBindVertexArray
+#define glActiveTexture UGLActiveTexture
+#define glBindTexture UGLBindTexture
+#define glBindBuffer UGLBindBuffer
+#define glBindBufferBase UGLBindBufferBase
+#define glBindImageTexture UGLBindImageTexture
+#define glEnable UGLEnable
+#define glDisable UGLDisable
+#define glGetUniformLocation UGLGetUniformLocation
+#define glUniform1i UGLUniform1i
+#define glUniform1f UGLUniform1f
+#define glUniform3f UGLUniform3f
+#define glUniform2f UGLUniform2f
+#define glUniform4f UGLUniform4f
+#define glUniform1fv UGLUniform1fv
+#define glUniform3fv UGLUniform3fv
+#define glUniform4fv UGLUniform4fv
+#define glUniformMatrix3fv UGLUniformMatrix3fv
+#define glUniformMatrix4fv UGLUniformMatrix4fv
+#define glDrawArrays UGLDrawArrays
+#define glDrawArraysInstanced UGLDrawArraysInstanced
+#define glMultiDrawArraysIndirect UGLMultiDrawArraysIndirect
+#define glMultiDrawArraysIndirectCountARB UGLMultiDrawArraysIndirectCountARB
+#define glBufferData UGLBufferData
+#define glBufferSubData UGLBufferSubData
+#define glTexImage2D UGLTexImage2D
+#define glDeleteBuffers UGLDeleteBuffers
+#define glDeleteTextures UGLDeleteTextures
+#define glDeleteVertexArrays UGLDeleteVertexArrays
+
+#endif
+
+/* Ends a frame's GL statistics, keeping them for the report. */
+void UGLStatisticsEndFrame (void) {
+	glFrameStatistics = glStatistics;
+	memset(&glStatistics, 0, sizeof(glStatistics));
+}
+
+void UGLStatisticsPrint (const UGLStatistics& stats) {
+#if GL_CALL_STATISTICS || GL_STATE_CACHE
+	printf("INFO: GL %ld calls, %ld draws (%ld vertices), %ld uniform lookups, %ld elided by the state cache%s.\n",
+		stats.calls, stats.draws, stats.vertices, stats.uniformLookups, stats.elided, glStateCache ? "" : " (off)");
+	printf("  redundant: programs %ld/%ld, vertex arrays %ld/%ld, textures %ld/%ld, buffers %ld/%ld, enables %ld/%ld, uniforms %ld/%ld\n",
+		stats.redundantPrograms, stats.programBinds, stats.redundantVertexArrays, stats.vertexArrayBinds,
+		stats.redundantTextures, stats.textureBinds, stats.redundantBuffers, stats.bufferBinds,
+		stats.redundantEnables, stats.enables, stats.redundantUniforms, stats.uniformSets);
+	printf("  uploaded: uniforms %lld bytes, buffers %lld bytes, textures %lld bytes\n", stats.uniformBytes, stats.bufferBytes, stats.textureBytes);
+#endif
+}
+
 GLint shaderProgram, lampProgram, WindowWidth = 800, WindowHeight = 600;
 // Buffer and Array objects
 GLuint VBO, VAO, lightVAO, texture;
@@ -41,6 +522,207 @@ void UMouseClick (int button, int state, int x, int y);
 void UMouseMove (int x, int y);
 void UMousePressedMove (int x, int y);
 
+/* Input queue functions. */
+double UNowMilliseconds (void);
+void UQueueMotion (int action, GLfloat deltaX, GLfloat deltaY);
+void UProcessInput (void);
+void URecordInputLatency (void);
+void UPrintInputLatency (void);
+
+/* Job system functions. */
+struct UJob;
+typedef void (*UJobFunction) (void* data, int begin, int end);
+void UJobSystemStart (int workerCount);
+void UJobSystemStop (void);
+UJob* UJobCreate (UJobFunction function, void* data, int begin, int end, UJob* parent);
+void UJobRun (UJob* job);
+void UJobWait (UJob* job);
+void UJobParallelFor (int count, int grain, UJobFunction function, void* data);
+void UDecodeTexture (void* data, int begin, int end);
+
+/* Scene graph functions. */
+struct USceneGraph;
+glm::mat4 UComposeTransform (glm::vec3 position, GLfloat pitch, GLfloat yaw, glm::vec3 scale);
+void UComposeTransforms (const glm::vec3* positions, const GLfloat* pitches, const GLfloat* yaws, const glm::vec3* scales,
+	int count, glm::mat4* models, glm::mat3* normals);
+void UCreateScene (void);
+int USceneAddNode (USceneGraph* graph, int parent, glm::vec3 position, glm::vec3 scale);
+void USceneSetPosition (USceneGraph* graph, int node, glm::vec3 position);
+void USceneSetRotation (USceneGraph* graph, int node, GLfloat pitch, GLfloat yaw);
+void USceneUpdate (USceneGraph* graph);
+
+/* Bounds and culling functions. */
+struct UBoundingVolumeHierarchy;
+struct UFrustum;
+void UAddMeshPart (const GLfloat* verts, int first, int count, int stride);
+void UBVHBuild (UBoundingVolumeHierarchy* bvh, const glm::vec3* boundsMin, const glm::vec3* boundsMax, int count);
+void UBVHRefit (UBoundingVolumeHierarchy* bvh, const glm::vec3* boundsMin, const glm::vec3* boundsMax);
+void UExtractFrustum (const glm::mat4& viewProjection, UFrustum* frustum);
+int UFrustumTestBox (const UFrustum* frustum, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+int UCullObjects (const UBoundingVolumeHierarchy* bvh, const glm::vec3* boundsMin, const glm::vec3* boundsMax,
+	const UFrustum* frustum, unsigned char* visible, int count);
+void UUpdateObjectBounds (void);
+
+/* Occlusion culling functions. */
+struct UDepthPyramid;
+void UReadDepthAsync (const glm::mat4& viewProjection);
+void UUpdateDepthPyramid (void);
+void UBuildDepthPyramid (UDepthPyramid* pyramid, const GLfloat* depth, int width, int height, const glm::mat4& viewProjection);
+bool UDepthPyramidOccludes (const UDepthPyramid* pyramid, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+int UOcclusionCull (const UDepthPyramid* pyramid, const glm::vec3* boundsMin, const glm::vec3* boundsMax, unsigned char* visible, int count);
+void UClearDepth (GLfloat* depth, int width, int height);
+void URasterizeTriangles (GLfloat* depth, int width, int height, const glm::vec3* positions, int vertexCount, const glm::mat4& transform, bool simd);
+void URasterizeOccluders (const glm::mat4& viewProjection);
+
+/* Level of detail functions. */
+void UGenerateLODs (const GLfloat* verts, int stride, struct UMeshPart* part, std::vector<GLfloat>& vertexData);
+int USelectLOD (const struct UMeshPart& part, const glm::mat4& world, const glm::mat4& view, const glm::mat4& projection);
+
+/* Streaming buffer functions. */
+struct UStreamBuffer;
+void UStreamCreate (UStreamBuffer* stream, GLsizeiptr regionSize);
+void UStreamDestroy (UStreamBuffer* stream);
+void UStreamBeginFrame (UStreamBuffer* stream);
+void* UStreamAllocate (UStreamBuffer* stream, GLsizeiptr size, GLsizeiptr alignment, GLintptr* bufferOffset);
+void UStreamUnmap (UStreamBuffer* stream);
+void UStreamEndFrame (UStreamBuffer* stream);
+
+/* Memory functions. */
+struct UArena;
+struct UPool;
+void UArenaCreate (UArena* arena, size_t capacity);
+void* UArenaAllocate (UArena* arena, size_t size, size_t alignment);
+void UArenaReset (UArena* arena);
+void UPoolCreate (UPool* pool, size_t blockSize, int blocksPerSlab);
+void* UPoolAllocate (UPool* pool);
+void UPoolFree (UPool* pool, void* block);
+void UPoolDestroy (UPool* pool);
+
+/* Profiling functions. */
+void UProfileInit (void);
+void UProfileBeginFrame (void);
+void UProfileEndFrame (void);
+void UProfileBegin (const char* name, bool gpu);
+void UProfileEnd (void);
+void UProfilePrintFrame (void);
+bool UProfileExport (const char* path);
+double UProfileGpuTime (long frame);
+
+/* Render queue functions. */
+struct URenderQueue;
+struct URenderCommand;
+struct URadixItem;
+unsigned long long URenderKey (int pass, GLuint program, GLuint texture, GLuint vertexArray, GLfloat depth);
+void URenderQueueBegin (URenderQueue* queue, UArena* arena, int capacity);
+void URenderQueueSubmit (URenderQueue* queue, unsigned long long key, int object, int lod, GLuint program, GLuint texture, GLuint vertexArray);
+URenderCommand* URadixSort (URenderCommand* commands, URenderCommand* scratch, URadixItem* items, int count);
+void URenderQueueSort (URenderQueue* queue, UArena* arena);
+
+/* Offscreen rendering functions. */
+bool UParseOffscreen (int argc, char** argv);
+void UOffscreenCreateFramebuffer (void);
+void UOffscreenCreate (void);
+void UOffscreenCapture (void);
+void UOffscreenFinish (void);
+void UOffscreenRun (void);
+bool UWritePNG (const char* path, const unsigned char* rgba, int width, int height, unsigned char* row);
+bool UWritePPM (const char* path, const unsigned char* rgba, int width, int height, unsigned char* row);
+
+/* Lighting functions. */
+GLuint UCompileProgram (const char* vertexSource, const char* fragmentSource, const char* name);
+void UCreatePointLights (void);
+void USendLights (GLuint program, const glm::vec3& lightPosition, const glm::vec3& lightPosition2);
+void UForwardPointLights (GLuint program);
+GLuint UCreateTarget (GLenum internalFormat, GLenum format, GLenum type, int width, int height);
+bool ULightScreenRect (const glm::vec3& position, GLfloat radius, const glm::mat4& view, const glm::mat4& projection, glm::vec4& rect);
+void UDeferredCreate (void);
+void UDeferredResize (int width, int height);
+void UDeferredBeginGeometry (void);
+void UDeferredLighting (const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightPosition, const glm::vec3& lightPosition2);
+void UAddTableCopy (glm::vec3 position);
+void UVisibilityCreate (void);
+void UVisibilityResize (int width, int height);
+void UVisibilityBeginGeometry (void);
+void UVisibilityUploadTransforms (const glm::vec4* transforms, int objectCount);
+void UVisibilityResolve (const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightPosition, const glm::vec3& lightPosition2);
+
+/* Shadow functions. */
+void UShadowCreate (void);
+void UShadowUpdate (void);
+void UShadowRenderFace (GLuint cube, int face, const glm::mat4& viewProjection, const unsigned char* casters, bool clear);
+
+/* Lightmap functions. */
+struct ULightmapBake;
+bool URayIntersectTriangles (const UBoundingVolumeHierarchy* bvh, const glm::vec3* triangles, glm::vec3 origin, glm::vec3 direction,
+	float maxDistance, bool anyHit, float* hitDistance, int* hitTriangle);
+glm::vec3 ULightmapDirect (const ULightmapBake* bake, glm::vec3 position, glm::vec3 normal);
+void ULightmapBakeTexels (void* data, int begin, int end);
+int ULightmapFindChart (std::vector<int>& parents, int triangle);
+void UBakeLightmap (void);
+void ULightmapCheck (void);
+
+/* Depth pre-pass functions. */
+struct URenderQueue;
+bool UDepthPrepassBegin (void);
+void UDepthPrepassDraw (const URenderQueue* queue, const glm::mat4& view, const glm::mat4& projection);
+void UDepthPrepassEnd (void);
+
+/* Texture table functions. */
+void UTextureTableSetup (GLuint program);
+void UTextureTableCreate (const GLuint* textures, int count);
+void UTextureTableBind (void);
+
+/* GPU culling functions. */
+GLuint UCompileComputeProgram (const char* source, const char* name);
+void UGpuCullCreate (void);
+void UGpuCullUpload (void);
+void UGpuCullDispatch (const glm::mat4& view, const glm::mat4& projection);
+void UGpuCullDraw (void);
+void UGpuCullReadStats (void);
+void UGpuCullBuildPyramid (const glm::mat4& viewProjection);
+
+/* Frame budget functions. */
+void UGovernorUpdate (void);
+void UGovernorDecide (double cpuTime, double gpuTime);
+void UGovernorLog (const char* decision, double cpuTime, double gpuTime);
+void UGovernorResize (int width, int height);
+void UGovernorPresent (void);
+
+/* Benchmarks, run from the command line instead of opening a window. */
+bool URunBenchmark (int argc, char** argv);
+void UBenchmarkJobs (void);
+void UBenchmarkScene (void);
+void UBenchmarkTransforms (void);
+void UBenchmarkCulling (void);
+void UBenchmarkRasterizer (void);
+void UBenchmarkStream (int argc, char** argv);
+void UBenchmarkSort (void);
+void UBenchmarkShading (void);
+void UBenchmarkGpuCulling (void);
+
+/* Debug draw functions. */
+void UDebugDrawCreate (void);
+void UDebugLine (glm::vec3 from, glm::vec3 to, glm::vec3 color);
+void UDebugBox (glm::vec3 boundsMin, glm::vec3 boundsMax, glm::vec3 color);
+void UDebugSphere (glm::vec3 center, GLfloat radius, glm::vec3 color);
+void UDebugLight (glm::vec3 position, GLfloat radius, glm::vec3 color);
+void UDebugFrustum (const glm::mat4& viewProjection, glm::vec3 color);
+void UDebugDrawScene (const glm::mat4& viewProjection, const glm::vec3& lightPosition, const glm::vec3& lightPosition2, bool culledOnCPU);
+void UDebugDrawFlush (const glm::mat4& viewProjection);
+
+/* Picking functions. */
+struct URayBoxes;
+void UPickCreate (void);
+glm::vec3 URayInverse (glm::vec3 direction);
+int URayTestBoxes (const URayBoxes* boxes, int count, const glm::vec3& origin, const glm::vec3& inverse, float maxDistance, float* entries);
+bool UPickTestObject (int object, glm::vec3 origin, glm::vec3 direction, float maxDistance, float* hitDistance);
+int UPickRay (glm::vec3 origin, glm::vec3 direction, float* hitDistance);
+void UPickCursorRay (int x, int y, glm::vec3* origin, glm::vec3* direction);
+void UPickAt (int x, int y);
+void UPickSelect (int object);
+void UPickReadIds (void);
+void UBenchmarkPicking (void);
+
 /* Keeps track of where the camera is looking and how fast it moves*/
 GLfloat cameraSpeed = 0.01f;
 GLchar currentKey;
@@ -49,21 +731,13 @@ GLchar currentKey;
 glm::vec3 CameraForwardZ = glm::vec3(0.0f, 0.0f, -5.0f);
 glm::vec3 front = glm::vec3(0.0f, 0.0f, -5.0f);
 
-// Information about where the object is.
-glm::vec3 objectPosition(0, 0, 0);
-glm::vec3 objectScale(2.0f);
+// Information about what the object looks like.
 glm::vec3 objectColor(0.6, 0.5, 0.75);
 
 // Stores light information.
 glm::vec3 lightColor(1.0, 0, 0.0);
 glm::vec3 lightColor2(1.0, 1.0, 1.0);
 
-glm::vec3 lightPosition(0.0, 0.5, -3);
-glm::vec3 lightPosition2(-3, 0.5, 0);
-
-glm::vec3 lightScale(0.3);
-glm::vec3 lightScale2(0.3);
-
 // Camera information.
 glm::vec3 cameraPosition(0.0, 0.0, -6);
 float cameraRotation = glm::radians(330.0);
@@ -71,7 +745,7 @@ float cameraRotation = glm::radians(330.0);
 
 /* Maintaining the direction of the both the camera and the cube. */
 GLfloat lastMouseX = 400, lastMouseY = 300;
-GLfloat mouseXOffset, mouseYOffset, object_yaw = 0.0f, object_pitch = 0.0f, camera_yaw = 90.0f, camera_pitch = 0.0f;
+GLfloat mouseXOffset, mouseYOffset, camera_yaw = 90.0f, camera_pitch = 0.0f;
 GLfloat sensitivity = 0.05f;
 bool mouseDetected = true;
 /* Used to track the key combination ALT+CLICK*/
@@ -82,825 +756,8211 @@ bool altIsPressed = false;
 /* Keeps track of if user wants ortho or not.*/
 bool isOrtho = false;
 
-const char* vertexShaderSource = 1 + R"GLSL(
-	#version 330 core
+/*
+ * Mouse motion is not applied as it arrives. Each event is timestamped and
+ * merged into the newest queued entry with the same action, then the queue
+ * is drained once per frame at the start of URenderGraphics.
+ */
+#define INPUT_ROTATE_OBJECT 0
+#define INPUT_ZOOM_CAMERA 1
+#define INPUT_QUEUE_SIZE 64
+
+struct UInputEvent {
+	int action;
+	// Node being rotated and the yaw and pitch it ends at, clamped after every merged event.
+	int node;
+	GLfloat yaw, pitch;
+	// Net number of zoom steps (forward is positive).
+	int zoomSteps;
+	// Number of raw motion events merged into this entry.
+	int eventCount;
+	// Time the first merged event arrived, in milliseconds.
+	double timestamp;
+};
+
+UInputEvent inputQueue[INPUT_QUEUE_SIZE];
+int inputQueueCount = 0;
+
+/* Event-to-present latency histogram, one bucket per millisecond plus overflow. */
+#define LATENCY_BUCKETS 32
+unsigned long latencyHistogram[LATENCY_BUCKETS + 1];
+unsigned long motionEventsReceived = 0, motionEntriesApplied = 0, latencySamples = 0;
+double latencyTotal = 0.0, latencyWorst = 0.0;
+// Oldest input applied since the last present, negative when there was none.
+double frameInputTimestamp = -1.0;
 
-	layout(location=0) in vec3 position;
-	layout(location=1) in vec3 normal;
-	layout(location=2) in vec2 texture_coordinates;
+/*
+ * Work-stealing job system. Every thread owns a fixed ring of jobs and a
+ * Chase-Lev deque: the owner pushes and pops at the bottom, idle threads
+ * steal from the top. The main thread is worker 0 and helps run jobs while
+ * it waits, so no thread ever blocks on a job that is sitting in a queue.
+ */
+#define JOB_MAX_WORKERS 64
+#define JOB_POOL_SIZE 4096
+#define JOB_QUEUE_SIZE 4096
+
+struct alignas(64) UJob {
+	UJobFunction function;
+	UJob* parent;
+	void* data;
+	int begin, end;
+	// Counts this job plus every child that has not finished yet.
+	std::atomic<int> unfinishedJobs;
+};
+
+struct alignas(64) UJobQueue {
+	std::atomic<long> top, bottom;
+	std::atomic<UJob*> jobs[JOB_QUEUE_SIZE];
+};
+
+UJob* jobPools[JOB_MAX_WORKERS];
+unsigned int jobPoolNext[JOB_MAX_WORKERS];
+UJobQueue* jobQueues[JOB_MAX_WORKERS];
+std::thread* jobThreads[JOB_MAX_WORKERS];
+int jobWorkerCount = 0;
+std::atomic<bool> jobSystemRunning(false);
+thread_local int jobWorkerIndex = 0;
+
+/* Idle workers sleep here instead of spinning when every queue is empty. */
+std::mutex jobSleepMutex;
+std::condition_variable jobWakeCondition;
+std::atomic<int> jobSleepingWorkers(0);
+
+/* Texture decoded by a worker while the main thread sets up GL objects. */
+struct UTextureImage {
+	const char* path;
+	unsigned char* pixels;
+	int width, height;
+};
 
-	// Outgoing coordinates for the texture.
-	out vec2 texture_position;
+#define TEXTURE_FILES 2
+UTextureImage textureImages[TEXTURE_FILES] = { { "wood.jpg", NULL, 0, 0 }, { "brick.jpg", NULL, 0, 0 } };
+UJob* textureJob = NULL;
 
-	// Outgoing surface normals to shader.
-	out vec3 Normal;
+/*
+ * Texture table. Draws name their texture by an index into the table
+ * instead of binding it, so draws with different textures share the same
+ * state and can go out in one multi-draw. With bindless textures the
+ * table is a storage buffer of resident handles; without, the textures
+ * are copied into the layers of one array texture at the first one's size.
+ */
+#define TEXTURE_TABLE_UNIT 10
+#define TEXTURE_TABLE_BINDING 4
 
-	// Outgoing colors and pixels to fragment shader.
-	out vec3 FragmentPos;
+struct UTextureTable {
+	bool bindless;
+	int count;
+	GLuint64 handles[TEXTURE_FILES];
+	GLuint handleBuffer, array;
+};
 
-	uniform mat4 model;
-	uniform mat4 view;
-	uniform mat4 projection;
+UTextureTable textureTable = { false, 0, { 0 }, 0, 0 };
 
-	void main() {
-		// Calculates positioning.
-		gl_Position = projection * view * model * vec4(position, 1.0f);
-		// Calculates where the texture is.
-		texture_position = vec2(texture_coordinates.x, 1.0f - texture_coordinates.y);
-		// Calculates normals.
-		Normal = mat3(transpose(inverse(model))) * normal;
-		// Calculates fragment positions.
-		FragmentPos = vec3(model * vec4(position, 1.0f));
-	}
-)GLSL";
+/*
+ * Transform hierarchy stored as structure-of-arrays. A node is always added
+ * after its parent, so a single forward pass over the arrays visits parents
+ * first. Only nodes whose local transform changed, or whose parent's world
+ * matrix changed, recompute their world matrix.
+ */
+#define NODE_LOCAL_DIRTY 1
+#define NODE_WORLD_CHANGED 2
+
+/* Node rows are reserved at least a block at a time, so adding nodes rarely touches the heap. */
+#define SCENE_NODE_BLOCK 1024
+
+struct USceneGraph {
+	std::vector<int> parents;
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> scales;
+	// Rotation angles in radians, applied pitch then yaw.
+	std::vector<GLfloat> pitches;
+	std::vector<GLfloat> yaws;
+	std::vector<unsigned char> flags;
+	std::vector<glm::mat4> locals;
+	std::vector<glm::mat4> worlds;
+	// Inverse transpose of the upper 3x3 of locals and worlds, for normals.
+	std::vector<glm::mat3> localNormals;
+	std::vector<glm::mat3> worldNormals;
+	// Number of world matrices recomputed by the last update.
+	int updatedNodes;
+};
+
+USceneGraph scene;
+// Nodes for the table and the two lights.
+int tableNode, lightNode, lightNode2;
+
+/* Number of transforms UComposeTransforms handles per SIMD step. */
+#if defined(__AVX2__)
+#define TRANSFORM_BATCH 8
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define TRANSFORM_BATCH 4
+#else
+#define TRANSFORM_BATCH 8
+#endif
 
-// FRAGMENT SHADER SOURCE CODE
-const char* fragmentShaderSource = 1 + R"GLSL(
-	#version 330 core
+/*
+ * A range of verts[] drawn as one piece, with bounds in model space and a
+ * chain of simplified versions generated at load time. LOD 0 is the
+ * original range; each later LOD has about half the triangles of the one
+ * before and is stored after the original data in the same buffer.
+ */
+#define MESH_LOD_COUNT 3
+
+struct UMeshLOD {
+	GLint first;
+	GLsizei count;
+};
+
+struct UMeshPart {
+	GLint first;
+	GLsizei count;
+	glm::vec3 boundsMin, boundsMax;
+	glm::vec3 sphereCenter;
+	GLfloat sphereRadius;
+	UMeshLOD lods[MESH_LOD_COUNT];
+	int lodCount;
+};
+
+std::vector<UMeshPart> meshParts;
+// Model space positions and normals of every vertex in verts[], kept for CPU work on the geometry.
+std::vector<glm::vec3> meshPositions;
+std::vector<glm::vec3> meshNormals;
+
+/* Something drawn in the scene: a mesh part placed by a scene node. */
+struct USceneObject {
+	int node;
+	int part;
+	// Index into the texture table.
+	int texture;
+};
+
+std::vector<USceneObject> sceneObjects;
+// World space bounds and per-frame visibility, indexed like sceneObjects.
+std::vector<glm::vec3> objectBoundsMin, objectBoundsMax;
+std::vector<unsigned char> objectVisible;
 
-	in vec2 texture_position;
-	in vec3 Normal;
-	in vec3 FragmentPos;
+/*
+ * LODs are picked by the radius of an object's bounding sphere on screen,
+ * in pixels. lodBias shifts every choice: each whole step halves the
+ * apparent size. forcedLOD pins every object to one level when not negative.
+ */
+const GLfloat lodScreenRadius[MESH_LOD_COUNT] = { 1e30f, 80.0f, 30.0f };
+GLfloat lodBias = 0.0f;
+int forcedLOD = -1;
 
-	out vec4 gpuColor;
+/*
+ * Bounding volume hierarchy over items with axis aligned bounds. The item
+ * list is partitioned in place while building, so every node covers the
+ * contiguous range items[first, first + count). Children are stored after
+ * their parent, which lets a refit walk the nodes backwards.
+ */
+#define BVH_LEAF_SIZE 4
+
+struct UBVHNode {
+	glm::vec3 boundsMin, boundsMax;
+	// Index of the left child, the right child follows it. Negative for leaves.
+	int left;
+	int first, count;
+};
+
+struct UBoundingVolumeHierarchy {
+	std::vector<UBVHNode> nodes;
+	std::vector<int> items;
+};
+
+UBoundingVolumeHierarchy sceneBVH;
+
+/* Frustum planes in structure-of-arrays form, padded to eight with planes that reject nothing. */
+#define FRUSTUM_OUTSIDE 0
+#define FRUSTUM_INTERSECTS 1
+#define FRUSTUM_INSIDE 2
+
+struct UFrustum {
+	alignas(32) float nx[8];
+	alignas(32) float ny[8];
+	alignas(32) float nz[8];
+	alignas(32) float d[8];
+};
+
+/* Culling and drawing results for the last frame, printed every frame when frameReport is on. */
+struct UCullStats {
+	int objects, visible, culled, occluded;
+	int triangles;
+	int lodObjects[MESH_LOD_COUNT];
+};
+
+UCullStats cullStats;
+bool frameReport = false;
+// CPU time between the starts of the last two frames.
+double lastFrameStart = 0.0, frameTime = 0.0;
 
-	uniform sampler2D uTexture;
-	uniform vec3 viewPosition;
+/*
+ * Hierarchical depth for occlusion culling. Level 0 is a depth buffer in
+ * window coordinates and each level above keeps the farthest depth of a 2x2
+ * block below it, so one texel at any level bounds everything it covers.
+ * An object is hidden when its nearest depth is behind every texel its
+ * screen rectangle touches.
+ */
+#define PYRAMID_MAX_LEVELS 16
 
-	// Light 1 info.
-	uniform vec3 lightColor;
-	uniform vec3 lightPos;
-	uniform float ambientStrength;
-	uniform float specularIntensity;
-	uniform float highlightSize;
+struct UDepthPyramid {
+	int levelCount;
+	int widths[PYRAMID_MAX_LEVELS], heights[PYRAMID_MAX_LEVELS];
+	std::vector<GLfloat> levels[PYRAMID_MAX_LEVELS];
+	// Matrix the depth was rendered with, used to project bounds into it.
+	glm::mat4 viewProjection;
+	bool valid;
+};
 
-	// Light 2 info.
-	uniform vec3 lightColor2;
-	uniform vec3 lightPos2;
-	uniform float ambientStrength2;
-	uniform float specularIntensity2;
-	uniform float highlightSize2;
+UDepthPyramid depthPyramid;
+bool occlusionCulling = true;
 
-	void main() {
-		// Calculates ambient lighting for both light sources.
-		vec3 ambient = ambientStrength * lightColor;
-		vec3 ambient2 = ambientStrength2 * lightColor2;
+/*
+ * Occlusion depth can come from the GPU (last frame's depth buffer) or from
+ * a small CPU rasterizer drawing this frame's occluders. The CPU path needs
+ * no GPU readback, so it also works on headless machines and as a reference
+ * for the GPU path.
+ */
+#define OCCLUSION_FROM_GPU 0
+#define OCCLUSION_FROM_CPU 1
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
 
-		// Calculates diffuse lighting for both light sources.
-		vec3 norm = normalize(Normal);
-		// Calulates the distance between the light source and position of pixel.
-		vec3 lightDirection = normalize(lightPos - FragmentPos);
-		// Finds diffuse impact.
-		float impact = max(dot(norm, lightDirection), 0.0);
-		vec3 diffuse = impact * lightColor;
+int occlusionSource = OCCLUSION_FROM_GPU;
+alignas(32) GLfloat occlusionDepth[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
 
-		vec3 norm2 = normalize(Normal);
-		// Calulates the distance between the light source and position of pixel.
-		vec3 lightDirection2 = normalize(lightPos2 - FragmentPos);
-		// Finds diffuse impact.
-		float impact2 = max(dot(norm2, lightDirection2), 0.0);
-		vec3 diffuse2 = impact2 * lightColor2;
+/*
+ * The previous frame's depth is read into one of two pixel pack buffers and
+ * only mapped once its fence has signaled, so the readback never stalls.
+ * Culling therefore runs one frame behind what is on screen.
+ */
+GLuint depthReadBuffers[2];
+GLsync depthReadFences[2];
+glm::mat4 depthReadViewProjections[2];
+int depthReadWidth = 0, depthReadHeight = 0, depthReadIndex = 0;
 
-		// Calulates specular lighting for both light sources.
-		// Finds view direction and reflection vector.
-		vec3 viewDir = normalize(viewPosition - FragmentPos);
-		vec3 reflectDir = reflect(-lightDirection, norm);
-		// Uses these values to calculate specular compoenent.
-		float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-		vec3 specular = specularIntensity * specularComponent * lightColor;
+/*
+ * Ring buffer for data written by the CPU every frame. The buffer holds one
+ * region per frame in flight and stays mapped for its whole life, so a
+ * write is a plain memcpy. Each region is fenced when its frame is
+ * submitted and waited on before it is reused, three frames later, which
+ * in practice never blocks. Without ARB_buffer_storage each region is
+ * mapped unsynchronized at the start of its frame instead.
+ */
+#define STREAM_REGIONS 3
+
+struct UStreamBuffer {
+	GLuint buffer;
+	GLsizeiptr regionSize;
+	int region;
+	GLsizeiptr offset;
+	unsigned char* mapped;
+	bool persistent;
+	GLsync fences[STREAM_REGIONS];
+	// Totals since creation.
+	unsigned long long bytesWritten;
+	int stalls, overflows;
+};
+
+UStreamBuffer frameStream;
 
-		// Finds view direction and reflection vector.
-		vec3 viewDir2 = normalize(viewPosition - FragmentPos);
-		vec3 reflectDir2 = reflect(-lightDirection2, norm2);
-		// Uses these values to calculate specular compoenent.
-		float specularComponent2 = pow(max(dot(viewDir2, reflectDir2), 0.0), highlightSize2);
-		vec3 specular2 = specularIntensity2 * specularComponent2 * lightColor2;
+/*
+ * Every C++ heap allocation in the program is counted, so a frame can check
+ * that it made none. Allocations by the driver, GLUT or C library calls
+ * such as printf are not seen.
+ */
+std::atomic<long long> heapAllocations(0), heapFrees(0);
 
-		// Uses calculated values to assemble phong lighting.
-		// Applies texture as well to complete image.
-		vec3 phong = (ambient + diffuse + specular) + (ambient2 + diffuse2 + specular2);
-		gpuColor = vec4(phong, 1.0f) * texture(uTexture, texture_position);
+// GCC sees the free() below inlined next to a new expression and warns, though the pair matches.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
 
+void* operator new (size_t size) {
+	heapAllocations++;
+	void* memory = malloc(size ? size : 1);
+	if (memory == NULL) {
+		throw std::bad_alloc();
 	}
-)GLSL";
-
+	return memory;
+}
 
-int main (int argc, char** argv) {
-	GLenum GlewInitResult;
-	// Initializes window with size.
-	glutInit(&argc, argv);
-	// Initializes memory display buffer.
-	glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGBA);
-	glutInitWindowSize(WindowWidth, WindowHeight);
-	// Sets window title and creates window.
-	glutCreateWindow(WINDOW_TITLE);
-	// Binds user defined functions for reshaping and displaying windows.
-	glutReshapeFunc(UResizeWindow);
+void* operator new[] (size_t size) {
+	return operator new(size);
+}
 
-	// Initializes glew and checks for errors.
-	GlewInitResult = glewInit();
-	if (GlewInitResult != GLEW_OK) {
-		fprintf(stderr, "ERROR: %s\n", glewGetErrorString(GlewInitResult));
-		exit(EXIT_FAILURE);
+void operator delete (void* memory) noexcept {
+	if (memory != NULL) {
+		heapFrees++;
+		free(memory);
 	}
+}
 
-	fprintf(stdout, "INFO: OpenGL Version: %s\n", glGetString(GL_VERSION));
+void operator delete[] (void* memory) noexcept {
+	operator delete(memory);
+}
 
-	// Creates shader program.
-	UCreateShader();
-	// Creates Vertex Buffer Object
-	UCreateBuffers();
+void operator delete (void* memory, size_t) noexcept {
+	operator delete(memory);
+}
 
-	UGenerateTexture();
+void operator delete[] (void* memory, size_t) noexcept {
+	operator delete(memory);
+}
 
-	// Uses shader program.
-    glUseProgram(shaderProgram);
-
-	// Sets background color.
-	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-
-	glutDisplayFunc(URenderGraphics);
+// Over-aligned types such as UJob come here. The block is over-allocated through the counted path and
+// malloc's pointer is kept just before the aligned address for the matching delete.
+void* operator new (size_t size, std::align_val_t alignment) {
+	size_t align = std::max((size_t) alignment, sizeof(void*));
+	void* memory = operator new(size + align);
+	uintptr_t aligned = ((uintptr_t) memory + align) & ~(uintptr_t) (align - 1);
+	((void**) aligned)[-1] = memory;
+	return (void*) aligned;
+}
 
-	/* Sets mouse callbacks.*/
-	glutMouseFunc(UMouseClick);
-	glutMotionFunc(UMousePressedMove);
-	/* Sets keyboard callback. */
-	glutKeyboardFunc(UKeyboard);
+void* operator new[] (size_t size, std::align_val_t alignment) {
+	return operator new(size, alignment);
+}
 
-	glutMainLoop();
+void operator delete (void* memory, std::align_val_t) noexcept {
+	if (memory != NULL) {
+		operator delete(((void**) memory)[-1]);
+	}
+}
 
-    // Garbage Collection
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
+void operator delete[] (void* memory, std::align_val_t alignment) noexcept {
+	operator delete(memory, alignment);
+}
 
-	return 0;
+void operator delete (void* memory, size_t, std::align_val_t alignment) noexcept {
+	operator delete(memory, alignment);
 }
 
-void UResizeWindow (int Width, int Height) {
-    WindowWidth = Width;
-    WindowHeight = Height;
-	glViewport(0, 0, Width, Height);
+void operator delete[] (void* memory, size_t, std::align_val_t alignment) noexcept {
+	operator delete(memory, alignment);
 }
 
-void URenderGraphics (void) {
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
 
-	// Enables the z axis.
-	glEnable(GL_DEPTH_TEST);
-	// Clear screen.
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+/*
+ * Bump allocator for data that only lives for one frame. Allocating moves
+ * an offset forward and URenderGraphics resets it when the frame ends, so
+ * nothing is freed one piece at a time. Running out spills to the heap for
+ * the rest of the frame, and the reset grows the arena to fit, so a larger
+ * scene costs a few heap allocations during warm-up and none afterwards.
+ */
+#define ARENA_MAX_SPILLS 64
+
+struct UArena {
+	unsigned char* base;
+	size_t capacity, offset;
+	// Heap blocks handed out after the arena filled, freed at the reset.
+	void* spills[ARENA_MAX_SPILLS];
+	int spillCount;
+	size_t spilled;
+	// Largest size needed in one frame and number of failed allocations.
+	size_t peak;
+	int overflows;
+};
+
+UArena frameArena;
+
+template <typename T> T* UArenaArray (UArena* arena, int count) {
+	return (T*) UArenaAllocate(arena, sizeof(T) * count, alignof(T));
+}
 
-    // Activation VBO before manipulating it.
-    glBindVertexArray(VAO);
-	/* Moves camera based on key press. */
+/*
+ * Fixed-size block allocator. Blocks come from slabs that are never
+ * returned to the heap while the pool lives; freed blocks go on a free list
+ * threaded through the blocks themselves.
+ */
+struct UPool {
+	size_t blockSize;
+	int blocksPerSlab;
+	void* freeList;
+	std::vector<unsigned char*> slabs;
+	int used, peak;
+};
 
-	GLint lightColorLoc, lightPositionLoc, viewPositionLoc;
-	GLint ambientLoc, specularLoc, highlightLoc;
+/*
+ * Heap allocations made by the last frame. Frames after a warm-up should
+ * make none; anything that resizes per-frame storage restarts the warm-up.
+ */
+#define ALLOCATION_WARMUP_FRAMES 8
 
-	CameraForwardZ = front;
+long long frameHeapAllocations = 0;
+int allocationWarmup = ALLOCATION_WARMUP_FRAMES;
 
-    // Transforms object.
-    glm::mat4 model(1.0);
-    // Centers object in viewport.
-    model = glm::translate(model, objectPosition);
+/*
+ * Frame profiler. Zones time CPU work on the main thread and may nest. A
+ * zone opened with gpu set also wraps its GL commands in a GL_TIME_ELAPSED
+ * query; those cannot nest, so only passes at the top level ask for one.
+ * Query sets alternate between frames and are read back two frames later,
+ * when the results are normally ready, so reading never stalls. The last
+ * PROFILE_HISTORY frames are kept for export as a Chrome trace.
+ */
+#define PROFILE_MAX_ZONES 32
+#define PROFILE_MAX_DEPTH 8
+#define PROFILE_HISTORY 240
+
+struct UProfileZone {
+	const char* name;
+	double start, duration;
+	// Milliseconds on the GPU, or negative when not measured or not back yet.
+	double gpuDuration;
+	int depth;
+	// Set while this zone's GL_TIME_ELAPSED query is open.
+	bool timing;
+};
+
+struct UProfileFrame {
+	long frame;
+	double start, duration;
+	UProfileZone zones[PROFILE_MAX_ZONES];
+	int zoneCount;
+};
+
+UProfileFrame profileFrames[PROFILE_HISTORY];
+long profileFrameCount = 0;
+int profileStack[PROFILE_MAX_DEPTH], profileDepth = 0;
+
+// Query sets for the two frames in flight, with the zone each query belongs to.
+GLuint profileQueries[2][PROFILE_MAX_ZONES];
+int profileQueryZones[2][PROFILE_MAX_ZONES], profileQueryCounts[2];
+long profileQueryFrames[2] = { -1, -1 };
+bool profileGpuTimers = false, profileQueryOpen = false;
 
-	// NOTE: THIS MAY CAUSE PROBLEMS.
-	model = glm::rotate(model, (float) (glm::radians(object_pitch) * RADIANS_TO_DEGREES), glm::vec3(1.0f, 0.0f, 0.0f));
-	model = glm::rotate(model, (float) (glm::radians(object_yaw) * RADIANS_TO_DEGREES), glm::vec3(0.0f, 1.0f, 0.0f));
+/*
+ * Draws are queued with a 64 bit key and issued in key order. From the top
+ * bit down an opaque key holds the pass, program, texture, vertex array and
+ * view depth, so draws sharing state end up together and, within the same
+ * state, nearest first to cut overdraw. A transparent key moves depth,
+ * reversed, right below the pass so those draws go back to front.
+ */
+#define RENDER_PASS_OPAQUE 0
+#define RENDER_PASS_TRANSPARENT 1
+#define RENDER_DEPTH_BITS 24
+#define RENDER_DEPTH_RANGE 100.0f
+
+struct URenderCommand {
+	unsigned long long key;
+	int object, lod;
+	GLuint program, texture, vertexArray;
+};
+
+struct URenderQueue {
+	URenderCommand* commands;
+	int count, capacity;
+};
+
+// Sort cost and state changes for the last frame, for the report.
+struct URenderQueueStats {
+	int commands;
+	int programChanges, textureChanges, vertexArrayChanges;
+	double sortTime;
+};
+
+URenderQueueStats renderQueueStats;
 
-    model = glm::scale(model, objectScale);
+/*
+ * Offscreen mode renders a fixed number of frames into a framebuffer
+ * object and writes each one to a file. Color is read into a ring of pixel
+ * pack buffers, each fenced, and a buffer is only mapped once it comes
+ * round again, so the GPU is never waited on while it still has work
+ * queued. Mapped pixels are copied into a pooled block and handed to
+ * writer threads, which flip, encode and write frames in parallel.
+ */
+#define OFFSCREEN_READBACKS 4
+#define OFFSCREEN_QUEUE 16
+#define OFFSCREEN_MAX_WRITERS 8
+#define OFFSCREEN_FORMAT_PNG 0
+#define OFFSCREEN_FORMAT_PPM 1
+
+struct UOffscreenFrame {
+	unsigned char* pixels;
+	int index;
+};
+
+struct UOffscreenTarget {
+	int width, height, format, frames;
+	const char* directory;
+	GLuint framebuffer, colorBuffer, depthBuffer;
+	GLuint packBuffers[OFFSCREEN_READBACKS];
+	GLsync fences[OFFSCREEN_READBACKS];
+	int frameIndices[OFFSCREEN_READBACKS];
+	int nextReadback, captured, written, failed;
+	// Frames waiting for a writer, and the pool their pixels come from. Both are guarded by lock.
+	UOffscreenFrame queue[OFFSCREEN_QUEUE];
+	int queueHead, queueCount;
+	UPool framePool;
+	std::mutex lock;
+	std::condition_variable queueReady, queueSpace;
+	std::thread* writers[OFFSCREEN_MAX_WRITERS];
+	int writerCount;
+	bool stopping;
+	// Times the main thread had to wait for the GPU or for the writers.
+	int readbackStalls, queueStalls;
+};
+
+UOffscreenTarget offscreen;
 
-	// Transforms camera.
-	glm::mat4 view(1.0);
-	view = glm::translate(view, cameraPosition);
-	view = glm::rotate(view, cameraRotation, glm::vec3(0.0f, 1.0f, 0.0f));
+/*
+ * Point lights beyond the two scene lights, for scenes with many lights.
+ * All of them are generated up front; pointLightCount says how many are on.
+ * Forward and visibility buffer shading read them from a texture buffer,
+ * two RGBA32F texels per light, so they take as many as deferred does.
+ */
+#define MAX_POINT_LIGHTS 1024
+#define POINT_LIGHT_UNIT 11
 
-	//Creates perspective.
-	glm::mat4 projection(1.0);
-	if (isOrtho) {
-		projection = glm::ortho(-3.0f, 3.0f, -3.0f, 3.0f, 0.1f, 100.0f);
-	} else {
-		projection = glm::perspective(45.0f, (GLfloat) WindowWidth / (GLfloat) WindowHeight, 0.1f, 100.0f);
-	}
+struct UPointLight {
+	glm::vec3 position;
+	GLfloat radius;
+	glm::vec3 color;
+};
 
-	// Sends matrices to shader program.
-	GLint modelLoc = glGetUniformLocation(shaderProgram, "model");
-	GLint viewLoc = glGetUniformLocation(shaderProgram, "view");
-	GLint projLoc = glGetUniformLocation(shaderProgram, "projection");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+UPointLight pointLights[MAX_POINT_LIGHTS];
+GLuint pointLightBuffer, pointLightTexture;
+int pointLightCount = 0;
+// Lights shaded this frame: pointLightCount, unless the frame governor has lowered it.
+int activePointLights = 0;
 
-	// Tells the shader the viewing position.
-	viewPositionLoc = glGetUniformLocation(shaderProgram, "viewPosition");
-	glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+/*
+ * Deferred shading. The geometry pass writes surface attributes to a
+ * G-buffer: albedo in an RGBA8 target, and an octahedral normal with the
+ * material's specular strength and shininess in an RGBA16F target, plus
+ * depth, from which position is rebuilt. Lighting then draws one
+ * screen-space quad per light, covering only the light's projected
+ * bounds, and adds the results. The first, full-screen, pass also writes
+ * the G-buffer depth to the target so later passes can depth test.
+ */
+struct UGBuffer {
+	GLuint framebuffer, albedo, normal, depth;
+	int width, height;
+};
 
-	// Sends data for initial light source.
-	lightColorLoc = glGetUniformLocation(shaderProgram, "lightColor");
-	lightPositionLoc = glGetUniformLocation(shaderProgram, "lightPos");
-	ambientLoc = glGetUniformLocation(shaderProgram, "ambientStrength");
-	specularLoc = glGetUniformLocation(shaderProgram, "specularIntensity");
-	highlightLoc = glGetUniformLocation(shaderProgram, "highlightSize");
+UGBuffer gbuffer;
+GLuint gbufferProgram, lightingProgram, lightingVAO;
 
-	glUniform3f(lightColorLoc, lightColor.r, lightColor.g, lightColor.b);
-	glUniform3f(lightPositionLoc, lightPosition.x, lightPosition.y, lightPosition.z);
-	glUniform1f(ambientLoc, 0.1);
-	glUniform1f(specularLoc, 1.0);
-	glUniform1f(highlightLoc, 16.0);
+// Light quads drawn by the last deferred frame.
+int deferredLightQuads = 0;
 
-	// Sends data for second light source.
-	lightColorLoc = glGetUniformLocation(shaderProgram, "lightColor2");
-	lightPositionLoc = glGetUniformLocation(shaderProgram, "lightPos2");
-	ambientLoc = glGetUniformLocation(shaderProgram, "ambientStrength2");
-	specularLoc = glGetUniformLocation(shaderProgram, "specularIntensity2");
-	highlightLoc = glGetUniformLocation(shaderProgram, "highlightSize2");
+/*
+ * Visibility buffer. The geometry pass writes only which object and
+ * triangle covers each pixel, in an RG32UI target. One full-screen pass
+ * then fetches that triangle's vertices from the vertex buffer through a
+ * texture buffer, intersects the pixel's view ray with it to rebuild the
+ * attributes, and shades every pixel exactly once.
+ */
+struct UVisibilityBuffer {
+	GLuint framebuffer, ids, depth;
+	int width, height;
+	// Texture buffers over the vertex buffer and this frame's object transforms.
+	GLuint vertexTexture, transformTexture, transformBuffer;
+	int transformCapacity;
+};
 
-	glUniform3f(lightColorLoc, lightColor2.r, lightColor2.g, lightColor2.b);
-	glUniform3f(lightPositionLoc, lightPosition2.x, lightPosition2.y, lightPosition2.z);
-	glUniform1f(ambientLoc, 0.1);
-	glUniform1f(specularLoc, 0.1 );
-	glUniform1f(highlightLoc, 16.0);
+// Texels per object in the transform buffer: the model matrix, then the normal matrix with the texture index in the first w.
+#define VISIBILITY_TRANSFORM_TEXELS 7
 
-	glBindTexture(GL_TEXTURE_2D, texture);
-	// Draws array data to screen.
-	glDrawArrays(GL_TRIANGLES, 0, 36 * 8);
-    // Deactivate VAO
-    glBindVertexArray(0);
-	glutPostRedisplay();
-	// Flips front and back buffers.
-	glutSwapBuffers();
-}
+UVisibilityBuffer visibility;
+GLuint visibilityIdProgram, visibilityResolveProgram;
 
-void UCreateShader (void) {
-	// Create Vertex shader object.
-	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-	glCompileShader(vertexShader);
+#define SHADING_FORWARD 0
+#define SHADING_DEFERRED 1
+#define SHADING_VISIBILITY 2
+#define SHADING_MODES 3
 
-	GLint success = 0;
-	glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-	// Error checking for shader.
-	if (success == GL_FALSE) {
-		int size;
-		char* str = (char*) calloc(1024, 1);
-		glGetShaderInfoLog(vertexShader, 1024, &size, str);
-		printf("ERROR COMPILING VERTEX SHADER.\n%s\n", str);
-	}
+const char* shadingModeNames[SHADING_MODES] = { "Forward", "Deferred", "Visibility buffer" };
+int shadingMode = SHADING_FORWARD;
 
+/*
+ * Omnidirectional shadows for the two scene lights, as cube maps of the
+ * distance to the nearest caster. Objects that have not moved for
+ * SHADOW_STATIC_FRAMES frames are static: they are drawn once into a cached
+ * cube, which is redrawn only when a light moves or an object changes
+ * between static and dynamic. Each frame the cached cube is copied and the
+ * dynamic casters are drawn over the copy. The copy needs ARB_copy_image;
+ * without it the static casters are drawn again in place of the copy.
+ */
+#define SHADOW_LIGHTS 2
+#define SHADOW_MAP_SIZE 512
+#define SHADOW_STATIC_FRAMES 60
+
+struct UShadowLight {
+	glm::vec3 position;
+	// Static casters only, and static plus dynamic casters.
+	GLuint staticMap, dynamicMap;
+	bool staticValid;
+	// The cube shaded with this frame.
+	GLuint sampled;
+};
+
+struct UShadowStats {
+	// Shadow draws issued, and draws that redrawing every caster would have added.
+	int draws, saved;
+	int dynamicCasters;
+	long staticRebuilds;
+};
+
+UShadowLight shadowLights[SHADOW_LIGHTS];
+UShadowStats shadowStats;
+GLuint shadowProgram, shadowFramebuffer;
+// Frames since each object last moved, up to SHADOW_STATIC_FRAMES.
+std::vector<int> objectStillFrames;
+const GLfloat shadowFar = 20.0f;
+bool shadowMapping = true;
+bool shadowCaching = true;
+bool shadowCopyImage;
 
-	GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	// Retrieves shader and frag source code.
-	glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-	// Compiles shader source code.
-	glCompileShader(fragmentShader);
+/*
+ * Lightmap for the two scene lights, baked on the CPU. Charts are groups
+ * of neighbouring triangles facing the same way, flattened onto their
+ * plane and packed on shelves into one atlas, which gives every vertex a
+ * second set of texture coordinates. Each texel is path traced against a
+ * BVH of the scene's triangles for direct light with shadows plus
+ * LIGHTMAP_BOUNCES diffuse bounces, then filtered, written to
+ * lightmap.ppm and sampled by forward shading in place of the scene
+ * lights' Phong terms. It holds only while nothing it was baked with moves.
+ */
+#define LIGHTMAP_SIZE 512
+#define LIGHTMAP_PADDING 2
+#define LIGHTMAP_SAMPLES 64
+#define LIGHTMAP_BOUNCES 2
+#define LIGHTMAP_ALBEDO 0.6f
+// Rays start this far off the surface so they do not hit it.
+#define LIGHTMAP_OFFSET 1e-3f
+// Light from zero to LIGHTMAP_RANGE maps onto the 8 bit file.
+#define LIGHTMAP_RANGE 2.0f
+#define LIGHTMAP_FILTER_SIGMA 0.05f
+
+struct ULightmapChart {
+	glm::vec3 normal, tangent, bitangent;
+	// Extent on the chart's plane, and the rectangle it was given in the atlas.
+	glm::vec2 low, high;
+	int x, y, width, height;
+};
+
+struct ULightmapTexel {
+	glm::vec3 position;
+	int chart;
+};
+
+// Everything one bake works on; only the result outlives it.
+struct ULightmapBake {
+	glm::vec3 lightPositions[2], lightColors[2];
+	// Corners of the full detail triangles, three per triangle, and a BVH over them.
+	std::vector<glm::vec3> occluders;
+	UBoundingVolumeHierarchy bvh;
+	std::vector<ULightmapChart> charts;
+	std::vector<ULightmapTexel> texels;
+	std::vector<glm::vec3> colors;
+	// Atlas texels per world unit.
+	float density;
+};
+
+struct ULightmap {
+	GLuint texture, coordinateBuffer;
+	// Set for the objects that were baked.
+	std::vector<unsigned char> objects;
+	bool valid;
+};
+
+ULightmap lightmap;
+bool useLightmap = false;
 
-	glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-	// Error checking for shader.
-	if (success == GL_FALSE) {
-		int size;
-		char* str = (char*) calloc(1024, 1);
-		glGetShaderInfoLog(fragmentShader, 1024, &size, str);
-		printf("ERROR COMPILING FRAGMENT SHADER.\n%s\n", str);
-	}
+/*
+ * Depth pre-pass for forward shading. Every draw first goes through a
+ * depth-only program fed by a position-only vertex buffer, then the color
+ * pass tests GL_EQUAL against that depth, so the lighting shader runs once
+ * per pixel however much the scene overdraws. Both shaders declare
+ * gl_Position invariant so their depths match exactly.
+ *
+ * In automatic mode the pre-pass is on while measured overdraw is high.
+ * Overdraw is what passed the depth pre-pass over what passed the equal
+ * test, counted with samples-passed queries read a few frames late. While
+ * the pre-pass is off a single frame runs it every PREPASS_PROBE_INTERVAL
+ * frames to measure again.
+ */
+#define DEPTH_PREPASS_OFF 0
+#define DEPTH_PREPASS_ON 1
+#define DEPTH_PREPASS_AUTO 2
+
+#define PREPASS_QUERY_SETS 3
+#define PREPASS_PROBE_INTERVAL 60
+#define PREPASS_ENABLE_OVERDRAW 1.5
+#define PREPASS_DISABLE_OVERDRAW 1.25
+
+struct UDepthPrepassState {
+	int mode;
+	// The automatic choice, and whether this frame runs only to measure.
+	bool active, probing;
+	// Samples from the depth pass and from the color pass, per set.
+	GLuint queries[PREPASS_QUERY_SETS][2];
+	bool pending[PREPASS_QUERY_SETS];
+	// Set measured this frame, or -1.
+	int set, nextSet;
+	double overdraw;
+	long lastProbe, switches;
+};
+
+const char* depthPrepassModeNames[3] = { "off", "on", "automatic" };
+UDepthPrepassState depthPrepass = { DEPTH_PREPASS_AUTO, false, false, { { 0 } }, { false }, -1, 0, 0.0, -1000, 0 };
+GLuint positionVBO, depthVAO, depthProgram;
 
-    // Create shader program object.
-	shaderProgram = glCreateProgram();
-	// Attach shaders to program.
-	glAttachShader(shaderProgram, vertexShader);
-	glAttachShader(shaderProgram, fragmentShader);
+/*
+ * GPU-driven culling. Every object's transforms and world bounds live in a
+ * buffer on the GPU, rewritten only for objects that moved. A compute
+ * shader tests all of them against the frustum and last frame's depth
+ * pyramid, picks the level of detail the way USelectLOD does and appends
+ * an indirect draw for each survivor, which forward and deferred shading
+ * then submit as one multi-draw. The object index reaches the vertex
+ * shader as the draw's base instance, through an instanced attribute
+ * holding 0, 1, 2 and so on. The pyramid is reduced from the depth buffer
+ * on the GPU after each frame, so nothing comes back to the CPU unless the
+ * frame report asks for the counts.
+ */
+#define GPU_CULL_GROUP_SIZE 64
+// Model matrix, normal matrix, then bounds with the mesh part and texture index in their w.
+#define GPU_CULL_OBJECT_TEXELS 9
+// Moved objects are uploaded in runs of up to this many per call.
+#define GPU_CULL_UPLOAD_BATCH 64
+
+struct UGpuCulling {
+	bool enabled, supported;
+	// Whether the draw count can come from a buffer; otherwise unused commands are zeroed.
+	bool drawCount;
+	GLuint cullProgram, pyramidProgram, forwardProgram, gbufferProgram;
+	// Object data, read as a storage buffer when culling and as a buffer texture when drawing.
+	GLuint objectBuffer, objectTexture;
+	GLuint partBuffer, commandBuffer, counterBuffer, instanceBuffer;
+	int capacity, uploaded;
+	// Set when the buffer may be out of date, so every object is written again.
+	bool reupload;
+	// A copy of last frame's depth and the farthest depth pyramid built from it.
+	GLuint depthCopy, pyramid;
+	int pyramidWidth, pyramidHeight, pyramidLevels;
+	glm::mat4 pyramidViewProjection;
+	bool pyramidValid;
+};
+
+UGpuCulling gpuCulling;
 
-	// Link program
-	glLinkProgram(shaderProgram);
+/*
+ * Debug drawing. Lines, boxes, spheres and light markers can be added from
+ * anywhere and are kept on the CPU until the frame flushes them. The flush
+ * copies them into the frame's stream buffer region and draws them with
+ * lampProgram in two instanced draws: one for lines, and one for boxes and
+ * spheres, whose outlines the vertex shader builds from the vertex index.
+ */
+#define DEBUG_MAX_LINES 65536
+#define DEBUG_MAX_SHAPES 16384
+// Segments in each of a sphere's three circles.
+#define DEBUG_SPHERE_SEGMENTS 16
+
+struct UDebugPrimitive {
+	// Line ends, box corners, or a sphere's center with its radius in the x of b.
+	glm::vec3 a;
+	GLuint color;
+	glm::vec3 b;
+	GLfloat sphere;
+};
+
+struct UDebugDraw {
+	bool enabled;
+	UDebugPrimitive* lines;
+	UDebugPrimitive* shapes;
+	int lineCount, shapeCount;
+	// The camera frustum when drawing was turned on, so it can be looked at from outside.
+	glm::mat4 frozenViewProjection;
+	bool frustumFrozen;
+	// What the last flush drew, and what did not fit since creation.
+	int drawnLines, drawnShapes, draws;
+	long dropped;
+};
+
+UDebugDraw debugDraw = { false, NULL, NULL, 0, 0, glm::mat4(1.0f), false, 0, 0, 0, 0 };
 
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-}
+/*
+ * Object picking. Alt+click casts a ray from the cursor down the scene BVH,
+ * testing a node's two children or a leaf's objects together in SIMD lanes
+ * and visiting the nearer child first, so subtrees behind a hit are never
+ * opened. Objects whose boxes the ray enters are tested triangle by
+ * triangle in model space, against a BVH built once per mesh part and
+ * shared by every object using it. In visibility buffer shading the object
+ * can instead be read from the ID target under the cursor through a pixel
+ * pack buffer, arriving a frame later without stalling.
+ */
+#define PICK_NONE -1
+
+// Up to four boxes in structure-of-arrays form, one per lane. BVH leaves never hold more than BVH_LEAF_SIZE.
+struct URayBoxes {
+	alignas(16) float minX[4];
+	alignas(16) float minY[4];
+	alignas(16) float minZ[4];
+	alignas(16) float maxX[4];
+	alignas(16) float maxY[4];
+	alignas(16) float maxZ[4];
+};
+
+struct UPickMesh {
+	UBoundingVolumeHierarchy bvh;
+	// Three model space corners per triangle of the part at full detail.
+	std::vector<glm::vec3> triangles;
+};
+
+struct UPicking {
+	std::vector<UPickMesh> meshes;
+	int selected;
+	// Node that Alt+drag turns: the root above the selected object, or the table.
+	int node;
+	// Matrix of the last frame drawn, so rays go through what is on screen.
+	glm::mat4 viewProjection;
+	// Time of the last ray pick, and how many boxes and meshes it tested.
+	double time;
+	int boxTests, meshTests;
+	// Read of the visibility buffer's object ID under the cursor.
+	bool fromIds, requested;
+	int requestX, requestY;
+	long requestFrame;
+	GLuint idBuffer;
+	GLsync idFence;
+};
+
+UPicking picking;
 
-void UCreateBuffers (void) {
-	// Sets vertex coordinates.
-	GLfloat verts[] = {
-		// New prism.
-		// TOP
-		-0.75, 1, 1, 	0, 1, 0, 	0, 1,
-		-0.75, 1, -1, 	0, 1, 0, 	0, 0,
-		0.75, 1, -1, 	0, 1, 0, 	1, 0,
-		0.75, 1, -1, 	0, 1, 0, 	1, 0,
-		0.75, 1, 1, 	0, 1, 0, 	1, 1,
-		-0.75, 1, 1, 	0, 1, 0, 	0, 1,
+/*
+ * Frame budget governor. Watches CPU and GPU time per frame against a
+ * budget and trades quality for time: when over budget it lowers the
+ * internal render resolution first if the GPU is the bottleneck, then the
+ * point light count, then detail through lodBias; with headroom it gives
+ * them back in reverse. Scaled frames render into their own framebuffer
+ * and are stretched to the window at the end. Each decision waits out
+ * GOVERNOR_COOLDOWN frames so its effect, which GPU timers report two
+ * frames late, is measured before the next one, and every decision is
+ * appended to governor.csv.
+ */
+#define GOVERNOR_COOLDOWN 15
+#define GOVERNOR_MIN_SCALE 50
+#define GOVERNOR_SCALE_STEP 10
+#define GOVERNOR_MAX_LOD_BIAS 2.0f
+
+struct UGovernor {
+	bool enabled;
+	// Milliseconds per frame to stay under, and the fraction of it below which quality returns.
+	double budget, headroom;
+	double cpuTime, gpuTime;
+	int cooldown;
+	// Render resolution as a percentage of the window, and the point light cap.
+	int scale, lightLimit;
+	// Scaled render target.
+	GLuint framebuffer, color, depth;
+	int width, height;
+	FILE* log;
+	long decisions;
+};
 
-		// BOTTOM
-		-0.7, 0.95, 0.95, 	0, -1, 0, 	0, 0,
-		-0.7, 0.95, -0.95, 	0, -1, 0, 	0, 1,
-		0.7, 0.95, -0.95, 	0, -1, 0, 	1, 1,
-		0.7, 0.95, -0.95, 	0, -1, 0, 	1, 1,
-		0.7, 0.95, 0.95, 	0, -1, 0, 	1, 0,
-		-0.7, 0.95, 0.95, 	0, -1, 0, 	0, 0,
+UGovernor governor = { false, 16.6, 0.75, 0.0, 0.0, 0, 100, MAX_POINT_LIGHTS, 0, 0, 0, 0, 0, NULL, 0 };
 
-		// BACK
-		-0.75, 1, 1, 	0, 0, 1, 	1, 1,
-		-0.7, 0.95, 0.95, 	0, 0, 1, 	1, 0,
-		0.7, 0.95, 0.95, 	0, 0, 1, 	0, 0,
-		0.7, 0.95, 0.95, 	0, 0, 1, 	0, 0,
-		0.75, 1, 1, 	0, 0, 1, 	0, 1,
-		-0.75, 1, 1, 	0, 0, 1, 	1, 1,
+// Where this frame renders and at what size: the window, or the governor's scaled target.
+GLuint renderTarget = 0;
+int renderWidth = 800, renderHeight = 600;
+// CPU time the last frame spent before presenting, so waiting on vsync is not counted.
+double frameWorkTime = 0.0;
 
-		// RIGHT
-		0.75, 1, 1, 	1, 0, 0, 	1, 1,
-		0.7, 0.95, 0.95, 	1, 0, 0, 	1, 0,
-		0.7, 0.95, -0.95, 	1, 0, 0, 	0, 0,
-		0.7, 0.95, -0.95, 	1, 0, 0, 	0, 0,
-		0.75, 1, -1, 	1, 0, 0, 	0, 1,
-		0.75, 1, 1, 	1, 0, 0, 	1, 1,
+/*
+ * Fragments that passed the depth test in the geometry pass and in the
+ * lighting or resolve pass, counted only while measureShadingSamples is
+ * set since waiting on the queries stalls.
+ */
+GLuint shadingSampleQueries[2];
+bool measureShadingSamples = false;
 
-		// FRONT
-		0.7, 0.95, -0.95, 	0, 0, -1, 	1, 0,
-		-0.7, 0.95, -0.95, 	0, 0, -1, 	0, 0,
-		-0.75, 1, -1, 	0, 0, -1, 	0, 1,
-		-0.75, 1, -1, 	0, 0, -1, 	0, 1,
-		0.75, 1, -1, 	0, 0, -1, 	1, 1,
-		0.7, 0.95, -0.95, 	0, 0, -1, 	1, 0,
+/* Times the enclosing block as a CPU zone. */
+struct UProfileScope {
+	UProfileScope (const char* name) {
+		UProfileBegin(name, false);
+	}
+	~UProfileScope () {
+		UProfileEnd();
+	}
+};
 
-		// LEFT
-		-0.75, 1, 1, 	-1, 0, 0, 	1, 1,
-		-0.7, 0.95, 0.95, 	-1, 0, 0, 	1, 0,
-		-0.7, 0.95, -0.95, 	-1, 0, 0, 	0, 0,
-		-0.7, 0.95, -0.95, 	-1, 0, 0, 	0, 0,
-		-0.75, 1, -1, 	-1, 0, 0, 	0, 1,
-		-0.75, 1, 1, 	-1, 0, 0, 	1, 1,
+const char* vertexShaderSource = 1 + R"GLSL(
+	#version 330 core
 
-		// New prism.
-		// TOP
-		-0.65, 0.95, 0.9, 	0, 1, 0, 	0, 1,
-		-0.65, 0.95, 0.8, 	0, 1, 0, 	0, 0,
-		-0.55, 0.95, 0.8, 	0, 1, 0, 	1, 0,
-		-0.55, 0.95, 0.8, 	0, 1, 0, 	1, 0,
-		-0.55, 0.95, 0.9, 	0, 1, 0, 	1, 1,
-		-0.65, 0.95, 0.9, 	0, 1, 0, 	0, 1,
+	layout(location=0) in vec3 position;
+	layout(location=1) in vec3 normal;
+	layout(location=2) in vec2 texture_coordinates;
+	layout(location=3) in vec2 lightmap_coordinates;
 
-		// BOTTOM
-		-0.64, -1, 0.89, 	0, -1, 0, 	0, 0,
-		-0.64, -1, 0.81, 	0, -1, 0, 	0, 1,
-		-0.56, -1, 0.81, 	0, -1, 0, 	1, 1,
-		-0.56, -1, 0.81, 	0, -1, 0, 	1, 1,
-		-0.56, -1, 0.89, 	0, -1, 0, 	1, 0,
-		-0.64, -1, 0.89, 	0, -1, 0, 	0, 0,
+	// Outgoing coordinates for the texture.
+	out vec2 texture_position;
+	out vec2 lightmap_position;
 
-		// BACK
-		-0.65, 0.95, 0.9, 	0, 0, 1, 	1, 1,
-		-0.64, -1, 0.89, 	0, 0, 1, 	1, 0,
-		-0.56, -1, 0.89, 	0, 0, 1, 	0, 0,
-		-0.56, -1, 0.89, 	0, 0, 1, 	0, 0,
-		-0.55, 0.95, 0.9, 	0, 0, 1, 	0, 1,
-		-0.65, 0.95, 0.9, 	0, 0, 1, 	1, 1,
+	// Outgoing surface normals to shader.
+	out vec3 Normal;
 
-		// RIGHT
-		-0.55, 0.95, 0.9, 	1, 0, 0, 	1, 1,
-		-0.56, -1, 0.89, 	1, 0, 0, 	1, 0,
-		-0.56, -1, 0.81, 	1, 0, 0, 	0, 0,
-		-0.56, -1, 0.81, 	1, 0, 0, 	0, 0,
-		-0.55, 0.95, 0.8, 	1, 0, 0, 	0, 1,
-		-0.55, 0.95, 0.9, 	1, 0, 0, 	1, 1,
+	// Outgoing colors and pixels to fragment shader.
+	out vec3 FragmentPos;
 
-		// FRONT
-		-0.56, -1, 0.81, 	0, 0, -1, 	1, 0,
-		-0.64, -1, 0.81, 	0, 0, -1, 	0, 0,
-		-0.65, 0.95, 0.8, 	0, 0, -1, 	0, 1,
-		-0.65, 0.95, 0.8, 	0, 0, -1, 	0, 1,
-		-0.55, 0.95, 0.8, 	0, 0, -1, 	1, 1,
-		-0.56, -1, 0.81, 	0, 0, -1, 	1, 0,
+	// Outgoing texture table index.
+	flat out int materialIndex;
 
-		// LEFT
-		-0.65, 0.95, 0.9, 	-1, 0, 0, 	1, 1,
-		-0.64, -1, 0.89, 	-1, 0, 0, 	1, 0,
-		-0.64, -1, 0.81, 	-1, 0, 0, 	0, 0,
-		-0.64, -1, 0.81, 	-1, 0, 0, 	0, 0,
-		-0.65, 0.95, 0.8, 	-1, 0, 0, 	0, 1,
-		-0.65, 0.95, 0.9, 	-1, 0, 0, 	1, 1,
+	uniform mat4 model;
+	uniform mat4 view;
+	uniform mat4 projection;
+	// Inverse transpose of the model matrix, built on the CPU with the model.
+	uniform mat3 normalMatrix;
+	uniform int textureIndex;
 
-		// New prism.
-		// TOP
-		-0.65, 0.95, -0.8, 	0, 1, 0, 	0, 1,
-		-0.65, 0.95, -0.9, 	0, 1, 0, 	0, 0,
-		-0.55, 0.95, -0.9, 	0, 1, 0, 	1, 0,
-		-0.55, 0.95, -0.9, 	0, 1, 0, 	1, 0,
-		-0.55, 0.95, -0.8, 	0, 1, 0, 	1, 1,
-		-0.65, 0.95, -0.8, 	0, 1, 0, 	0, 1,
+	// Must match the depth pre-pass bit for bit.
+	invariant gl_Position;
 
-		// BOTTOM
-		-0.64, -1, -0.81, 	0, -1, 0, 	0, 0,
-		-0.64, -1, -0.89, 	0, -1, 0, 	0, 1,
+	void main() {
+		// Calculates positioning.
+		gl_Position = projection * view * model * vec4(position, 1.0f);
+		// Calculates where the texture is.
+		texture_position = vec2(texture_coordinates.x, 1.0f - texture_coordinates.y);
+		lightmap_position = lightmap_coordinates;
+		// Calculates normals.
+		Normal = normalMatrix * normal;
+		// Calculates fragment positions.
+		FragmentPos = vec3(model * vec4(position, 1.0f));
+		materialIndex = textureIndex;
+	}
+)GLSL";
+
+// FRAGMENT SHADER SOURCE CODE
+const char* fragmentShaderSource = 1 + R"GLSL(
+	#version 330 core
+	#ifdef GL_ARB_bindless_texture
+	#extension GL_ARB_bindless_texture : enable
+	#endif
+	#ifdef GL_ARB_shader_storage_buffer_object
+	#extension GL_ARB_shader_storage_buffer_object : enable
+	#endif
+
+	in vec2 texture_position;
+	in vec2 lightmap_position;
+	in vec3 Normal;
+	in vec3 FragmentPos;
+	flat in int materialIndex;
+
+	out vec4 gpuColor;
+
+	// Texture table: resident handles when bindless textures are available, layers of one array otherwise.
+	#if defined(GL_ARB_bindless_texture) && defined(GL_ARB_shader_storage_buffer_object)
+	layout(std430) buffer TextureHandles { uvec2 textureHandles[]; };
+	vec4 tableTexture(int index, vec2 position) {
+		return texture(sampler2D(textureHandles[index]), position);
+	}
+	#else
+	uniform sampler2DArray textureArray;
+	vec4 tableTexture(int index, vec2 position) {
+		return texture(textureArray, vec3(position, float(index)));
+	}
+	#endif
+	uniform vec3 viewPosition;
+
+	// Baked light from both scene lights, used instead of their Phong terms when set.
+	uniform sampler2D lightmap;
+	uniform bool useLightmap;
+	uniform float lightmapRange;
+
+	// Light 1 info.
+	uniform vec3 lightColor;
+	uniform vec3 lightPos;
+	uniform float ambientStrength;
+	uniform float specularIntensity;
+	uniform float highlightSize;
+
+	// Light 2 info.
+	uniform vec3 lightColor2;
+	uniform vec3 lightPos2;
+	uniform float ambientStrength2;
+	uniform float specularIntensity2;
+	uniform float highlightSize2;
+
+	// Point lights: position and radius, then color.
+	uniform int pointLightCount;
+	uniform samplerBuffer pointLights;
+	uniform float pointLightSpecular;
+
+	// Distance cube maps of the scene lights. A shadowFar of zero turns shadows off.
+	uniform samplerCube shadowMap;
+	uniform samplerCube shadowMap2;
+	uniform float shadowFar;
+
+	float shadow(samplerCube map, vec3 lightPosition) {
+		if (shadowFar <= 0.0) {
+			return 1.0;
+		}
+		vec3 fromLight = FragmentPos - lightPosition;
+		return length(fromLight) - 0.05 > texture(map, fromLight).r * shadowFar ? 0.0 : 1.0;
+	}
+
+	void main() {
+		// Calculates ambient lighting for both light sources.
+		vec3 ambient = ambientStrength * lightColor;
+		vec3 ambient2 = ambientStrength2 * lightColor2;
+
+		vec3 norm = normalize(Normal);
+		vec3 viewDir = normalize(viewPosition - FragmentPos);
+		vec3 phong;
+
+		if (useLightmap) {
+		// Direct light, shadows and bounced light were all baked.
+		phong = ambient + ambient2 + texture(lightmap, lightmap_position).rgb * lightmapRange;
+		} else {
+
+		// Calculates diffuse lighting for both light sources.
+		// Calulates the distance between the light source and position of pixel.
+		vec3 lightDirection = normalize(lightPos - FragmentPos);
+		// Finds diffuse impact.
+		float impact = max(dot(norm, lightDirection), 0.0);
+		vec3 diffuse = impact * lightColor;
+
+		vec3 norm2 = normalize(Normal);
+		// Calulates the distance between the light source and position of pixel.
+		vec3 lightDirection2 = normalize(lightPos2 - FragmentPos);
+		// Finds diffuse impact.
+		float impact2 = max(dot(norm2, lightDirection2), 0.0);
+		vec3 diffuse2 = impact2 * lightColor2;
+
+		// Calulates specular lighting for both light sources.
+		// Finds view direction and reflection vector.
+		vec3 reflectDir = reflect(-lightDirection, norm);
+		// Uses these values to calculate specular compoenent.
+		float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+		vec3 specular = specularIntensity * specularComponent * lightColor;
+
+		// Finds view direction and reflection vector.
+		vec3 viewDir2 = normalize(viewPosition - FragmentPos);
+		vec3 reflectDir2 = reflect(-lightDirection2, norm2);
+		// Uses these values to calculate specular compoenent.
+		float specularComponent2 = pow(max(dot(viewDir2, reflectDir2), 0.0), highlightSize2);
+		vec3 specular2 = specularIntensity2 * specularComponent2 * lightColor2;
+
+		// Uses calculated values to assemble phong lighting.
+		// Applies texture as well to complete image.
+		phong = (ambient + (diffuse + specular) * shadow(shadowMap, lightPos))
+			+ (ambient2 + (diffuse2 + specular2) * shadow(shadowMap2, lightPos2));
+		}
+
+		// Adds point lights, which fade out at their radius.
+		for (int i = 0; i < pointLightCount; i++) {
+			vec4 pointLight = texelFetch(pointLights, i * 2);
+			vec3 toLight = pointLight.xyz - FragmentPos;
+			float distance = length(toLight);
+			float falloff = clamp(1.0 - distance * distance / (pointLight.w * pointLight.w), 0.0, 1.0);
+			vec3 direction = toLight / max(distance, 1e-4);
+			float pointDiffuse = max(dot(norm, direction), 0.0);
+			float pointSpecular = pointLightSpecular * pow(max(dot(viewDir, reflect(-direction, norm)), 0.0), highlightSize);
+			phong += (pointDiffuse + pointSpecular) * falloff * falloff * texelFetch(pointLights, i * 2 + 1).rgb;
+		}
+
+		gpuColor = vec4(phong, 1.0f) * tableTexture(materialIndex, texture_position);
+
+	}
+)GLSL";
+
+// G-BUFFER SHADER SOURCE CODE, used with vertexShaderSource.
+const char* gbufferShaderSource = 1 + R"GLSL(
+	#version 330 core
+	#ifdef GL_ARB_bindless_texture
+	#extension GL_ARB_bindless_texture : enable
+	#endif
+	#ifdef GL_ARB_shader_storage_buffer_object
+	#extension GL_ARB_shader_storage_buffer_object : enable
+	#endif
+
+	in vec2 texture_position;
+	in vec3 Normal;
+	in vec3 FragmentPos;
+	flat in int materialIndex;
+
+	layout(location=0) out vec4 albedo;
+	layout(location=1) out vec4 normalMaterial;
+
+	// Texture table: resident handles when bindless textures are available, layers of one array otherwise.
+	#if defined(GL_ARB_bindless_texture) && defined(GL_ARB_shader_storage_buffer_object)
+	layout(std430) buffer TextureHandles { uvec2 textureHandles[]; };
+	vec4 tableTexture(int index, vec2 position) {
+		return texture(sampler2D(textureHandles[index]), position);
+	}
+	#else
+	uniform sampler2DArray textureArray;
+	vec4 tableTexture(int index, vec2 position) {
+		return texture(textureArray, vec3(position, float(index)));
+	}
+	#endif
+	uniform float materialSpecular;
+	uniform float materialShininess;
+
+	// Folds the unit sphere onto the [-1, 1] square.
+	vec2 encodeOctahedral(vec3 n) {
+		n /= abs(n.x) + abs(n.y) + abs(n.z);
+		vec2 folded = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+		return n.z >= 0.0 ? n.xy : folded;
+	}
+
+	void main() {
+		albedo = tableTexture(materialIndex, texture_position);
+		normalMaterial = vec4(encodeOctahedral(normalize(Normal)), materialSpecular, materialShininess);
+	}
+)GLSL";
+
+// LIGHTING SHADER SOURCE CODE. The quad comes from gl_VertexID, so no vertex buffer is needed.
+const char* lightingVertexShaderSource = 1 + R"GLSL(
+	#version 330 core
+
+	// Normalized device coordinates of the quad: minimum x, y, then maximum x, y.
+	uniform vec4 screenRect;
+
+	void main() {
+		vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+		gl_Position = vec4(mix(screenRect.xy, screenRect.zw, corner), 0.0, 1.0);
+	}
+)GLSL";
+
+const char* lightingShaderSource = 1 + R"GLSL(
+	#version 330 core
+
+	out vec4 gpuColor;
+
+	uniform sampler2D gAlbedo;
+	uniform sampler2D gNormal;
+	uniform sampler2D gDepth;
+	uniform mat4 inverseViewProjection;
+	uniform vec2 screenSize;
+	uniform vec3 viewPosition;
+
+	// A radius of zero means the light reaches everywhere, like the scene lights.
+	uniform vec3 lightPos;
+	uniform vec3 lightColor;
+	uniform float lightRadius;
+	uniform float ambientStrength;
+	uniform float specularIntensity;
+	// Set on the first pass, which also copies depth.
+	uniform bool writeDepth;
+	// Zero for lights without a shadow map.
+	uniform samplerCube shadowMap;
+	uniform float shadowFar;
+
+	vec3 decodeOctahedral(vec2 e) {
+		vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+		if (n.z < 0.0) {
+			n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+		}
+		return normalize(n);
+	}
+
+	void main() {
+		vec2 uv = gl_FragCoord.xy / screenSize;
+		float depth = texture(gDepth, uv).r;
+		if (depth >= 1.0) {
+			discard;
+		}
+		gl_FragDepth = writeDepth ? depth : gl_FragCoord.z;
+
+		vec4 world = inverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+		vec3 FragmentPos = world.xyz / world.w;
+		vec4 normalMaterial = texture(gNormal, uv);
+		vec3 norm = decodeOctahedral(normalMaterial.xy);
+
+		vec3 toLight = lightPos - FragmentPos;
+		float distance = length(toLight);
+		vec3 lightDirection = toLight / max(distance, 1e-4);
+		float falloff = 1.0;
+		if (lightRadius > 0.0) {
+			falloff = clamp(1.0 - distance * distance / (lightRadius * lightRadius), 0.0, 1.0);
+			falloff *= falloff;
+		}
+
+		vec3 ambient = ambientStrength * lightColor;
+		vec3 diffuse = max(dot(norm, lightDirection), 0.0) * lightColor;
+		vec3 viewDir = normalize(viewPosition - FragmentPos);
+		float specularComponent = pow(max(dot(viewDir, reflect(-lightDirection, norm)), 0.0), normalMaterial.w);
+		vec3 specular = specularIntensity * normalMaterial.z * specularComponent * lightColor;
+
+		float lit = 1.0;
+		if (shadowFar > 0.0 && distance - 0.05 > texture(shadowMap, -toLight).r * shadowFar) {
+			lit = 0.0;
+		}
+
+		gpuColor = vec4((ambient + (diffuse + specular) * lit) * falloff, 1.0) * texture(gAlbedo, uv);
+	}
+)GLSL";
+
+// VISIBILITY SHADER SOURCE CODE, used with vertexShaderSource.
+const char* visibilityIdShaderSource = 1 + R"GLSL(
+	#version 330 core
+
+	layout(location=0) out uvec2 visibilityId;
+
+	// Object index plus one, so zero means nothing was drawn.
+	uniform int objectId;
+	uniform int firstVertex;
+
+	void main() {
+		visibilityId = uvec2(objectId, firstVertex + 3 * gl_PrimitiveID);
+	}
+)GLSL";
+
+// Drawn with lightingVertexShaderSource over the whole screen.
+const char* visibilityResolveShaderSource = 1 + R"GLSL(
+	#version 330 core
+	#ifdef GL_ARB_bindless_texture
+	#extension GL_ARB_bindless_texture : enable
+	#endif
+	#ifdef GL_ARB_shader_storage_buffer_object
+	#extension GL_ARB_shader_storage_buffer_object : enable
+	#endif
+
+	out vec4 gpuColor;
+
+	uniform usampler2D visibilityIds;
+	uniform sampler2D visibilityDepth;
+	// Two texels per vertex: position and normal x, then normal yz and texture coordinates.
+	uniform samplerBuffer vertices;
+	uniform samplerBuffer transforms;
+	uniform mat4 inverseViewProjection;
+	uniform vec2 screenSize;
+	uniform vec3 viewPosition;
+
+	uniform vec3 lightColor;
+	uniform vec3 lightPos;
+	uniform float ambientStrength;
+	uniform float specularIntensity;
+	uniform float highlightSize;
+	uniform vec3 lightColor2;
+	uniform vec3 lightPos2;
+	uniform float ambientStrength2;
+	uniform float specularIntensity2;
+	uniform float highlightSize2;
+	uniform int pointLightCount;
+	uniform samplerBuffer pointLights;
+	uniform float pointLightSpecular;
+	uniform samplerCube shadowMap;
+	uniform samplerCube shadowMap2;
+	uniform float shadowFar;
+
+	// Where the view ray through ndc crosses the plane of the triangle, as barycentric weights.
+	vec3 barycentrics(vec2 ndc, vec3 p0, vec3 p1, vec3 p2) {
+		vec4 nearPoint = inverseViewProjection * vec4(ndc, -1.0, 1.0);
+		vec4 farPoint = inverseViewProjection * vec4(ndc, 1.0, 1.0);
+		vec3 origin = nearPoint.xyz / nearPoint.w;
+		vec3 direction = farPoint.xyz / farPoint.w - origin;
+
+		vec3 edge1 = p1 - p0;
+		vec3 edge2 = p2 - p0;
+		vec3 p = cross(direction, edge2);
+		float inverseDeterminant = 1.0 / dot(edge1, p);
+		vec3 s = origin - p0;
+		float u = dot(s, p) * inverseDeterminant;
+		float v = dot(direction, cross(s, edge1)) * inverseDeterminant;
+		return vec3(1.0 - u - v, u, v);
+	}
+
+	float shadow(samplerCube map, vec3 lightPosition, vec3 FragmentPos) {
+		if (shadowFar <= 0.0) {
+			return 1.0;
+		}
+		vec3 fromLight = FragmentPos - lightPosition;
+		return length(fromLight) - 0.05 > texture(map, fromLight).r * shadowFar ? 0.0 : 1.0;
+	}
+
+	vec3 phong(vec3 position, vec3 color, float ambientStrength, float specularIntensity, float highlightSize, float lit, vec3 FragmentPos, vec3 norm, vec3 viewDir) {
+		vec3 lightDirection = normalize(position - FragmentPos);
+		float impact = max(dot(norm, lightDirection), 0.0);
+		float specularComponent = pow(max(dot(viewDir, reflect(-lightDirection, norm)), 0.0), highlightSize);
+		return (ambientStrength + (impact + specularIntensity * specularComponent) * lit) * color;
+	}
+
+	// The texture table, sampled with gradients since there are no neighbouring fragments of the same triangle.
+	#if defined(GL_ARB_bindless_texture) && defined(GL_ARB_shader_storage_buffer_object)
+	layout(std430) buffer TextureHandles { uvec2 textureHandles[]; };
+	vec4 tableTextureGrad(int index, vec2 position, vec2 dx, vec2 dy) {
+		return textureGrad(sampler2D(textureHandles[index]), position, dx, dy);
+	}
+	#else
+	uniform sampler2DArray textureArray;
+	vec4 tableTextureGrad(int index, vec2 position, vec2 dx, vec2 dy) {
+		return textureGrad(textureArray, vec3(position, float(index)), dx, dy);
+	}
+	#endif
+
+	void main() {
+		ivec2 pixel = ivec2(gl_FragCoord.xy);
+		uvec2 id = texelFetch(visibilityIds, pixel, 0).xy;
+		if (id.x == 0u) {
+			discard;
+		}
+		gl_FragDepth = texelFetch(visibilityDepth, pixel, 0).r;
+
+		int object = int(id.x - 1u) * 7;
+		mat4 model = mat4(texelFetch(transforms, object), texelFetch(transforms, object + 1),
+			texelFetch(transforms, object + 2), texelFetch(transforms, object + 3));
+		mat3 normalMatrix = mat3(texelFetch(transforms, object + 4).xyz, texelFetch(transforms, object + 5).xyz,
+			texelFetch(transforms, object + 6).xyz);
+
+		vec3 world[3];
+		vec3 normals[3];
+		vec2 coordinates[3];
+		for (int i = 0; i < 3; i++) {
+			int vertex = (int(id.y) + i) * 2;
+			vec4 a = texelFetch(vertices, vertex);
+			vec4 b = texelFetch(vertices, vertex + 1);
+			world[i] = (model * vec4(a.xyz, 1.0)).xyz;
+			normals[i] = vec3(a.w, b.xy);
+			coordinates[i] = vec2(b.z, 1.0 - b.w);
+		}
+
+		// The neighbouring pixels' rays give the texture coordinate gradients.
+		vec2 ndc = gl_FragCoord.xy / screenSize * 2.0 - 1.0;
+		vec2 pixelSize = 2.0 / screenSize;
+		vec3 weights = barycentrics(ndc, world[0], world[1], world[2]);
+		vec3 weightsX = barycentrics(ndc + vec2(pixelSize.x, 0.0), world[0], world[1], world[2]);
+		vec3 weightsY = barycentrics(ndc + vec2(0.0, pixelSize.y), world[0], world[1], world[2]);
+		mat3x2 uvs = mat3x2(coordinates[0], coordinates[1], coordinates[2]);
+		vec2 texture_position = uvs * weights;
+
+		vec3 FragmentPos = mat3(world[0], world[1], world[2]) * weights;
+		vec3 norm = normalize(normalMatrix * (mat3(normals[0], normals[1], normals[2]) * weights));
+		vec3 viewDir = normalize(viewPosition - FragmentPos);
+
+		vec3 color = phong(lightPos, lightColor, ambientStrength, specularIntensity, highlightSize,
+				shadow(shadowMap, lightPos, FragmentPos), FragmentPos, norm, viewDir)
+			+ phong(lightPos2, lightColor2, ambientStrength2, specularIntensity2, highlightSize2,
+				shadow(shadowMap2, lightPos2, FragmentPos), FragmentPos, norm, viewDir);
+		for (int i = 0; i < pointLightCount; i++) {
+			vec4 pointLight = texelFetch(pointLights, i * 2);
+			vec3 toLight = pointLight.xyz - FragmentPos;
+			float distance = length(toLight);
+			float falloff = clamp(1.0 - distance * distance / (pointLight.w * pointLight.w), 0.0, 1.0);
+			vec3 direction = toLight / max(distance, 1e-4);
+			float pointDiffuse = max(dot(norm, direction), 0.0);
+			float pointSpecular = pointLightSpecular * pow(max(dot(viewDir, reflect(-direction, norm)), 0.0), highlightSize);
+			color += (pointDiffuse + pointSpecular) * falloff * falloff * texelFetch(pointLights, i * 2 + 1).rgb;
+		}
+
+		int materialIndex = int(texelFetch(transforms, object + 4).w);
+		gpuColor = vec4(color, 1.0) * tableTextureGrad(materialIndex, texture_position, uvs * weightsX - texture_position, uvs * weightsY - texture_position);
+	}
+)GLSL";
+
+// DEPTH PRE-PASS SHADER SOURCE CODE. Positions the same way vertexShaderSource does.
+const char* depthVertexShaderSource = 1 + R"GLSL(
+	#version 330 core
+	layout(location=0) in vec3 position;
+
+	uniform mat4 model;
+	uniform mat4 view;
+	uniform mat4 projection;
+
+	invariant gl_Position;
+
+	void main() {
+		gl_Position = projection * view * model * vec4(position, 1.0f);
+	}
+)GLSL";
+
+const char* depthShaderSource = 1 + R"GLSL(
+	#version 330 core
+
+	void main() {
+	}
+)GLSL";
+
+// GPU-DRIVEN VERTEX SHADER SOURCE CODE. vertexShaderSource with the matrices read from the object buffer.
+const char* gpuDrivenVertexShaderSource = 1 + R"GLSL(
+	#version 330 core
+
+	layout(location=0) in vec3 position;
+	layout(location=1) in vec3 normal;
+	layout(location=2) in vec2 texture_coordinates;
+	layout(location=3) in vec2 lightmap_coordinates;
+	// Object index, which is the draw's base instance.
+	layout(location=4) in int objectIndex;
+
+	out vec2 texture_position;
+	out vec2 lightmap_position;
+	out vec3 Normal;
+	out vec3 FragmentPos;
+	flat out int materialIndex;
+
+	// Nine texels per object: model columns, normal matrix columns, bounds with the texture index in the last w.
+	uniform samplerBuffer objects;
+	uniform mat4 view;
+	uniform mat4 projection;
+
+	void main() {
+		int base = objectIndex * 9;
+		mat4 model = mat4(texelFetch(objects, base), texelFetch(objects, base + 1),
+			texelFetch(objects, base + 2), texelFetch(objects, base + 3));
+		mat3 normalMatrix = mat3(texelFetch(objects, base + 4).xyz, texelFetch(objects, base + 5).xyz,
+			texelFetch(objects, base + 6).xyz);
+
+		gl_Position = projection * view * model * vec4(position, 1.0f);
+		texture_position = vec2(texture_coordinates.x, 1.0f - texture_coordinates.y);
+		lightmap_position = lightmap_coordinates;
+		Normal = normalMatrix * normal;
+		FragmentPos = vec3(model * vec4(position, 1.0f));
+		materialIndex = int(texelFetch(objects, base + 8).w);
+	}
+)GLSL";
+
+// GPU CULLING SHADER SOURCE CODE. One invocation per object.
+const char* gpuCullShaderSource = 1 + R"GLSL(
+	#version 430 core
+	layout(local_size_x = 64) in;
+
+	struct Part {
+		vec4 sphere;
+		ivec4 lodFirst;
+		ivec4 lodCount;
+	};
+
+	struct DrawCommand {
+		uint count;
+		uint instanceCount;
+		uint first;
+		uint baseInstance;
+	};
+
+	layout(std430, binding = 0) readonly buffer Objects { vec4 objects[]; };
+	layout(std430, binding = 1) readonly buffer Parts { Part parts[]; };
+	layout(std430, binding = 2) writeonly buffer Commands { DrawCommand commands[]; };
+	layout(std430, binding = 3) buffer Counters {
+		uint drawCount;
+		uint occludedCount;
+		uint triangleCount;
+		uint lodObjects[3];
+	};
+
+	uniform int objectCount;
+	uniform vec4 planes[6];
+	uniform mat4 view;
+	// Screen radius in pixels of a unit sphere one unit away, with lodBias applied.
+	uniform float lodScale;
+	uniform bool perspective;
+	uniform int forcedLOD;
+	uniform float lodScreenRadius[3];
+
+	uniform bool occlusion;
+	uniform sampler2D pyramid;
+	uniform int pyramidLevels;
+	uniform mat4 pyramidViewProjection;
+
+	bool outsideFrustum(vec3 boundsMin, vec3 boundsMax) {
+		vec3 center = (boundsMin + boundsMax) * 0.5;
+		vec3 extent = (boundsMax - boundsMin) * 0.5;
+		for (int i = 0; i < 6; i++) {
+			if (dot(planes[i].xyz, center) + planes[i].w + dot(abs(planes[i].xyz), extent) < 0.0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// The same test as UDepthPyramidOccludes.
+	bool hidden(vec3 boundsMin, vec3 boundsMax) {
+		vec2 low = vec2(1e30), high = vec2(-1e30);
+		float nearest = 1.0;
+		for (int corner = 0; corner < 8; corner++) {
+			vec4 clip = pyramidViewProjection * vec4((corner & 1) != 0 ? boundsMax.x : boundsMin.x,
+				(corner & 2) != 0 ? boundsMax.y : boundsMin.y, (corner & 4) != 0 ? boundsMax.z : boundsMin.z, 1.0);
+			if (clip.w <= 1e-5) {
+				return false;
+			}
+			vec3 ndc = clip.xyz / clip.w;
+			low = min(low, ndc.xy);
+			high = max(high, ndc.xy);
+			nearest = min(nearest, ndc.z * 0.5 + 0.5);
+		}
+
+		ivec2 size = textureSize(pyramid, 0);
+		ivec2 first = max(ivec2((low * 0.5 + 0.5) * vec2(size)), ivec2(0));
+		ivec2 last = min(ivec2((high * 0.5 + 0.5) * vec2(size)), size - 1);
+		if (first.x > last.x || first.y > last.y) {
+			return false;
+		}
+
+		int level = 0;
+		while (level + 1 < pyramidLevels && ((last.x >> level) - (first.x >> level) > 3 || (last.y >> level) - (first.y >> level) > 3)) {
+			level++;
+		}
+
+		// Levels round down, so the last texel of each also covers what is past it.
+		ivec2 levelLast = textureSize(pyramid, level) - 1;
+		for (int y = first.y >> level; y <= (last.y >> level); y++) {
+			for (int x = first.x >> level; x <= (last.x >> level); x++) {
+				if (nearest <= texelFetch(pyramid, min(ivec2(x, y), levelLast), level).r) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	void main() {
+		int object = int(gl_GlobalInvocationID.x);
+		if (object >= objectCount) {
+			return;
+		}
+		int base = object * 9;
+		vec4 boundsMin = objects[base + 7];
+		vec3 boundsMax = objects[base + 8].xyz;
+		if (outsideFrustum(boundsMin.xyz, boundsMax)) {
+			return;
+		}
+		if (occlusion && hidden(boundsMin.xyz, boundsMax)) {
+			atomicAdd(occludedCount, 1u);
+			return;
+		}
+
+		Part part = parts[int(boundsMin.w)];
+		int lod = forcedLOD;
+		if (lod < 0) {
+			mat4 model = mat4(objects[base], objects[base + 1], objects[base + 2], objects[base + 3]);
+			float scale = max(length(model[0].xyz), max(length(model[1].xyz), length(model[2].xyz)));
+			vec3 center = (view * model * vec4(part.sphere.xyz, 1.0)).xyz;
+			float radius = part.sphere.w * scale * lodScale;
+			if (perspective) {
+				radius /= max(length(center), 0.1);
+			}
+			lod = 0;
+			while (lod + 1 < 3 && radius < lodScreenRadius[lod + 1]) {
+				lod++;
+			}
+		}
+
+		uint slot = atomicAdd(drawCount, 1u);
+		commands[slot] = DrawCommand(uint(part.lodCount[lod]), 1u, uint(part.lodFirst[lod]), uint(object));
+		atomicAdd(triangleCount, uint(part.lodCount[lod] / 3));
+		atomicAdd(lodObjects[lod], 1u);
+	}
+)GLSL";
+
+// DEPTH PYRAMID SHADER SOURCE CODE. Copies the depth into level 0, or keeps the farthest of each block below.
+const char* depthPyramidShaderSource = 1 + R"GLSL(
+	#version 430 core
+	layout(local_size_x = 8, local_size_y = 8) in;
+
+	layout(r32f, binding = 0) uniform readonly image2D source;
+	layout(r32f, binding = 1) uniform writeonly image2D target;
+	uniform sampler2D depth;
+	uniform bool fromDepth;
+
+	void main() {
+		ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+		ivec2 size = imageSize(target);
+		if (texel.x >= size.x || texel.y >= size.y) {
+			return;
+		}
+		if (fromDepth) {
+			imageStore(target, texel, vec4(texelFetch(depth, texel, 0).r));
+			return;
+		}
+
+		// Odd sizes fold the last row or column below into the final texel.
+		ivec2 sourceSize = imageSize(source);
+		ivec2 first = texel * 2;
+		ivec2 last = min(first + 1, sourceSize - 1);
+		if (texel.x == size.x - 1) {
+			last.x = sourceSize.x - 1;
+		}
+		if (texel.y == size.y - 1) {
+			last.y = sourceSize.y - 1;
+		}
+		float farthest = 0.0;
+		for (int y = first.y; y <= last.y; y++) {
+			for (int x = first.x; x <= last.x; x++) {
+				farthest = max(farthest, imageLoad(source, ivec2(x, y)).r);
+			}
+		}
+		imageStore(target, texel, vec4(farthest));
+	}
+)GLSL";
+
+// LAMP SHADER SOURCE CODE. Debug lines, or box and sphere outlines built from gl_VertexID, one per instance.
+const char* lampVertexShaderSource = 1 + R"GLSL(
+	#version 330 core
+
+	layout(location=0) in vec3 a;
+	layout(location=1) in vec4 color;
+	layout(location=2) in vec3 b;
+	layout(location=3) in float sphere;
+
+	out vec4 lineColor;
+
+	uniform mat4 viewProjection;
+	uniform bool shapes;
+
+	// Corner pairs of a box's twelve edges; bit 0 picks x, bit 1 y, bit 2 z.
+	const int edges[24] = int[24](0, 1, 1, 3, 3, 2, 2, 0, 4, 5, 5, 7, 7, 6, 6, 4, 0, 4, 1, 5, 2, 6, 3, 7);
+
+	void main() {
+		lineColor = color;
+		vec3 position;
+		if (!shapes) {
+			position = gl_VertexID == 0 ? a : b;
+		} else if (sphere > 0.5) {
+			// Three circles of 16 segments, two vertices each.
+			int circle = gl_VertexID / 32;
+			int vertex = gl_VertexID % 32;
+			float angle = float(vertex / 2 + vertex % 2) * (6.2831853 / 16.0);
+			vec2 point = vec2(cos(angle), sin(angle)) * b.x;
+			position = a + (circle == 0 ? vec3(point, 0.0) : circle == 1 ? vec3(0.0, point) : vec3(point.x, 0.0, point.y));
+		} else if (gl_VertexID < 24) {
+			int corner = edges[gl_VertexID];
+			position = vec3((corner & 1) != 0 ? b.x : a.x, (corner & 2) != 0 ? b.y : a.y, (corner & 4) != 0 ? b.z : a.z);
+		} else {
+			// Boxes need fewer vertices than spheres; the rest are clipped away.
+			gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+			return;
+		}
+		gl_Position = viewProjection * vec4(position, 1.0);
+	}
+)GLSL";
+
+const char* lampFragmentShaderSource = 1 + R"GLSL(
+	#version 330 core
+
+	in vec4 lineColor;
+
+	out vec4 gpuColor;
+
+	void main() {
+		gpuColor = lineColor;
+	}
+)GLSL";
+
+// SHADOW SHADER SOURCE CODE. Stores the distance from the light, scaled by shadowFar, as depth.
+const char* shadowVertexShaderSource = 1 + R"GLSL(
+	#version 330 core
+	layout(location=0) in vec3 position;
+
+	out vec3 worldPosition;
+
+	uniform mat4 model;
+	uniform mat4 lightViewProjection;
+
+	void main() {
+		worldPosition = (model * vec4(position, 1.0)).xyz;
+		gl_Position = lightViewProjection * vec4(worldPosition, 1.0);
+	}
+)GLSL";
+
+const char* shadowShaderSource = 1 + R"GLSL(
+	#version 330 core
+	in vec3 worldPosition;
+
+	uniform vec3 lightPosition;
+	uniform float shadowFar;
+
+	void main() {
+		gl_FragDepth = length(worldPosition - lightPosition) / shadowFar;
+	}
+)GLSL";
+
+
+int main (int argc, char** argv) {
+	GLenum GlewInitResult;
+
+	// Runs a headless benchmark instead of the scene when one is requested.
+	if (URunBenchmark(argc, argv)) {
+		return 0;
+	}
+	bool offscreenMode = UParseOffscreen(argc, argv);
+	bool shadingBenchmark = argc > 1 && strcmp(argv[1], "--bench-shading") == 0;
+	bool gpuCullingBenchmark = argc > 1 && strcmp(argv[1], "--bench-gpu-culling") == 0;
+	bool pickingBenchmark = argc > 1 && strcmp(argv[1], "--bench-picking") == 0;
+
+	// Starts one worker per core, counting the main thread.
+	UJobSystemStart(std::thread::hardware_concurrency());
+
+	// Initializes window with size.
+	glutInit(&argc, argv);
+	// Initializes memory display buffer.
+	glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGBA);
+	glutInitWindowSize(WindowWidth, WindowHeight);
+	// Sets window title and creates window.
+	glutCreateWindow(WINDOW_TITLE);
+	// Offscreen mode only needs the window for its GL context.
+	if (offscreenMode || shadingBenchmark || gpuCullingBenchmark || pickingBenchmark) {
+		glutHideWindow();
+	} else {
+		// Binds user defined functions for reshaping and displaying windows.
+		glutReshapeFunc(UResizeWindow);
+	}
+
+	// Initializes glew and checks for errors.
+	GlewInitResult = glewInit();
+	if (GlewInitResult != GLEW_OK) {
+		fprintf(stderr, "ERROR: %s\n", glewGetErrorString(GlewInitResult));
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stdout, "INFO: OpenGL Version: %s\n", glGetString(GL_VERSION));
+	UProfileInit();
+
+	// Decodes the textures on workers while the GL objects are created.
+	textureJob = UJobCreate(NULL, NULL, 0, 0, NULL);
+	for (int i = 0; i < TEXTURE_FILES; i++) {
+		UJobRun(UJobCreate(UDecodeTexture, textureImages, i, i + 1, textureJob));
+	}
+	UJobRun(textureJob);
+
+	// Creates shader program.
+	UCreateShader();
+	// Creates Vertex Buffer Object
+	UCreateBuffers();
+
+	// Places the table parts and lights.
+	UCreateScene();
+
+	// Room for 4 MB of per-frame data on the GPU and 1 MB on the CPU.
+	UStreamCreate(&frameStream, 4 << 20);
+	UArenaCreate(&frameArena, 1 << 20);
+
+	UCreatePointLights();
+	UDeferredCreate();
+	UVisibilityCreate();
+	UShadowCreate();
+	depthProgram = UCompileProgram(depthVertexShaderSource, depthShaderSource, "DEPTH");
+	glGenQueries(PREPASS_QUERY_SETS * 2, depthPrepass.queries[0]);
+	UGpuCullCreate();
+	UDebugDrawCreate();
+	UPickCreate();
+
+	UGenerateTexture();
+
+	// Uses shader program.
+    glUseProgram(shaderProgram);
+
+	// Sets background color.
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+	if (shadingBenchmark) {
+		UBenchmarkShading();
+		UJobSystemStop();
+		return 0;
+	}
+	if (gpuCullingBenchmark) {
+		UBenchmarkGpuCulling();
+		UJobSystemStop();
+		return 0;
+	}
+	if (pickingBenchmark) {
+		UBenchmarkPicking();
+		UJobSystemStop();
+		return 0;
+	}
+	if (offscreenMode) {
+		UOffscreenCreate();
+		UOffscreenRun();
+		UOffscreenFinish();
+		UStreamDestroy(&frameStream);
+		UJobSystemStop();
+		return offscreen.failed == 0 ? 0 : EXIT_FAILURE;
+	}
+
+	glutDisplayFunc(URenderGraphics);
+
+	/* Sets mouse callbacks.*/
+	glutMouseFunc(UMouseClick);
+	glutMotionFunc(UMousePressedMove);
+	/* Sets keyboard callback. */
+	glutKeyboardFunc(UKeyboard);
+
+	glutMainLoop();
+
+    // Garbage Collection
+	UStreamDestroy(&frameStream);
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteBuffers(1, &VBO);
+	UJobSystemStop();
+
+	return 0;
+}
+
+void UResizeWindow (int Width, int Height) {
+    WindowWidth = Width;
+    WindowHeight = Height;
+	allocationWarmup = ALLOCATION_WARMUP_FRAMES;
+	glViewport(0, 0, Width, Height);
+}
+
+void URenderGraphics (void) {
+	long long allocationsBefore = heapAllocations;
+	double frameStart = UNowMilliseconds();
+	if (lastFrameStart > 0.0) {
+		frameTime = frameStart - lastFrameStart;
+	}
+	lastFrameStart = frameStart;
+	UProfileBeginFrame();
+	UStreamBeginFrame(&frameStream);
+	UGovernorUpdate();
+
+	UProfileBegin("Clear", true);
+	// Enables the z axis.
+	glEnable(GL_DEPTH_TEST);
+	// Clear screen.
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	UProfileEnd();
+
+    // Activation VBO before manipulating it.
+    glBindVertexArray(VAO);
+	/* Moves camera based on key press. */
+
+	CameraForwardZ = front;
+
+	UProfileBegin("Scene update", false);
+	// Applies all mouse motion received since the last frame.
+	UProcessInput();
+
+	// Recomputes world matrices and bounds for nodes that moved.
+	USceneUpdate(&scene);
+	UUpdateObjectBounds();
+	ULightmapCheck();
+	UProfileEnd();
+
+    glm::vec3 lightPosition(scene.worlds[lightNode][3]);
+    glm::vec3 lightPosition2(scene.worlds[lightNode2][3]);
+
+	// Transforms camera.
+	glm::mat4 view(1.0);
+	view = glm::translate(view, cameraPosition);
+	view = glm::rotate(view, cameraRotation, glm::vec3(0.0f, 1.0f, 0.0f));
+
+	//Creates perspective.
+	glm::mat4 projection(1.0);
+	if (isOrtho) {
+		projection = glm::ortho(-3.0f, 3.0f, -3.0f, 3.0f, 0.1f, 100.0f);
+	} else {
+		projection = glm::perspective(45.0f, (GLfloat) WindowWidth / (GLfloat) WindowHeight, 0.1f, 100.0f);
+	}
+	picking.viewProjection = projection * view;
+
+	// The visibility buffer tags draws per object and the lightmap is switched per object, so both stay on the CPU path.
+	bool gpuDriven = gpuCulling.enabled && shadingMode != SHADING_VISIBILITY && !(useLightmap && lightmap.valid);
+
+	UProfileBegin("Culling", false);
+	cullStats.objects = (int) sceneObjects.size();
+	int* drawList = NULL;
+	int drawCount = 0;
+	if (gpuDriven) {
+		// Culling, LOD selection and the draw list are all left to the GPU.
+		UGpuCullDispatch(view, projection);
+	} else {
+		gpuCulling.reupload = true;
+
+		// Finds which objects are inside the view.
+		UFrustum frustum;
+		UExtractFrustum(projection * view, &frustum);
+		cullStats.visible = UCullObjects(&sceneBVH, &objectBoundsMin[0], &objectBoundsMax[0], &frustum, &objectVisible[0], cullStats.objects);
+
+		// Drops objects hidden behind last frame's depth.
+		cullStats.occluded = 0;
+		if (occlusionCulling) {
+			UProfileScope scope("Occlusion");
+			if (occlusionSource == OCCLUSION_FROM_CPU) {
+				URasterizeOccluders(projection * view);
+			} else {
+				UUpdateDepthPyramid();
+			}
+			cullStats.occluded = UOcclusionCull(&depthPyramid, &objectBoundsMin[0], &objectBoundsMax[0], &objectVisible[0], cullStats.objects);
+			cullStats.visible -= cullStats.occluded;
+		}
+
+		cullStats.culled = cullStats.objects - cullStats.visible;
+
+		// Lists what survived culling for this frame's draws.
+		drawList = UArenaArray<int>(&frameArena, cullStats.objects);
+		for (int i = 0; i < cullStats.objects && drawList != NULL; i++) {
+			if (objectVisible[i]) {
+				drawList[drawCount++] = i;
+			}
+		}
+	}
+	UProfileEnd();
+
+	if (shadowMapping) {
+		UProfileBegin("Shadows", true);
+		UShadowUpdate();
+		UProfileEnd();
+	}
+
+	UProfileBegin("Draw", true);
+
+	// Deferred and visibility buffer shading draw the same geometry into their own targets and shade afterwards.
+	GLuint sceneProgram = gpuDriven ? gpuCulling.forwardProgram : shaderProgram;
+	if (shadingMode == SHADING_DEFERRED) {
+		sceneProgram = gpuDriven ? gpuCulling.gbufferProgram : gbufferProgram;
+		UDeferredBeginGeometry();
+	} else if (shadingMode == SHADING_VISIBILITY) {
+		sceneProgram = visibilityIdProgram;
+		UVisibilityBeginGeometry();
+	}
+	glUseProgram(sceneProgram);
+	if (measureShadingSamples) {
+		glBeginQuery(GL_SAMPLES_PASSED, shadingSampleQueries[0]);
+	}
+
+	// Sends matrices to shader program.
+	GLint modelLoc = glGetUniformLocation(sceneProgram, "model");
+	GLint normalMatrixLoc = glGetUniformLocation(sceneProgram, "normalMatrix");
+	GLint viewLoc = glGetUniformLocation(sceneProgram, "view");
+	GLint projLoc = glGetUniformLocation(sceneProgram, "projection");
+	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
+	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+
+	GLint useLightmapLoc = -1;
+	if (shadingMode == SHADING_FORWARD) {
+		USendLights(sceneProgram, lightPosition, lightPosition2);
+		useLightmapLoc = glGetUniformLocation(sceneProgram, "useLightmap");
+	}
+	bool lightmapped = useLightmap && lightmap.valid;
+
+	// The visibility pass tags each triangle with its object and first vertex.
+	GLint objectIdLoc = -1, firstVertexLoc = -1;
+	glm::vec4* transforms = NULL;
+	if (shadingMode == SHADING_VISIBILITY) {
+		objectIdLoc = glGetUniformLocation(sceneProgram, "objectId");
+		firstVertexLoc = glGetUniformLocation(sceneProgram, "firstVertex");
+		transforms = UArenaArray<glm::vec4>(&frameArena, cullStats.objects * VISIBILITY_TRANSFORM_TEXELS);
+	}
+
+	GLint textureIndexLoc = glGetUniformLocation(sceneProgram, "textureIndex");
+	UTextureTableBind();
+	cullStats.triangles = 0;
+	for (int lod = 0; lod < MESH_LOD_COUNT; lod++) {
+		cullStats.lodObjects[lod] = 0;
+	}
+
+	// Queues each visible object with its level of detail and distance from the camera.
+	URenderQueue queue;
+	URenderQueueBegin(&queue, &frameArena, drawCount);
+	for (int i = 0; i < drawCount; i++) {
+		const USceneObject& object = sceneObjects[drawList[i]];
+		const UMeshPart& part = meshParts[object.part];
+		int lod = USelectLOD(part, scene.worlds[object.node], view, projection);
+		glm::vec3 center(view * scene.worlds[object.node] * glm::vec4(part.sphereCenter, 1.0f));
+
+		// Textures come from the table, so the key groups by table index and nothing is bound per draw.
+		unsigned long long key = URenderKey(RENDER_PASS_OPAQUE, sceneProgram, object.texture, VAO, -center.z);
+		URenderQueueSubmit(&queue, key, drawList[i], lod, sceneProgram, 0, VAO);
+	}
+
+	double sortStart = UNowMilliseconds();
+	URenderQueueSort(&queue, &frameArena);
+	renderQueueStats.sortTime = UNowMilliseconds() - sortStart;
+	renderQueueStats.commands = queue.count;
+	renderQueueStats.programChanges = renderQueueStats.textureChanges = renderQueueStats.vertexArrayChanges = 0;
+
+	// Lays down depth first when forward shading would otherwise light overdrawn fragments.
+	bool prepass = shadingMode == SHADING_FORWARD && !gpuDriven && UDepthPrepassBegin();
+	if (prepass) {
+		UProfileBegin("Depth pre-pass", true);
+		UDepthPrepassDraw(&queue, view, projection);
+		UProfileEnd();
+		glUseProgram(sceneProgram);
+		glBindVertexArray(VAO);
+	}
+
+	// Draws in key order, changing state only between commands that differ.
+	GLuint currentProgram = sceneProgram, currentTexture = 0, currentVertexArray = VAO;
+	for (int i = 0; i < queue.count; i++) {
+		const URenderCommand& command = queue.commands[i];
+		if (command.program != currentProgram) {
+			glUseProgram(command.program);
+			currentProgram = command.program;
+			renderQueueStats.programChanges++;
+		}
+		if (command.texture != currentTexture) {
+			glBindTexture(GL_TEXTURE_2D, command.texture);
+			currentTexture = command.texture;
+			renderQueueStats.textureChanges++;
+		}
+		if (command.vertexArray != currentVertexArray) {
+			glBindVertexArray(command.vertexArray);
+			currentVertexArray = command.vertexArray;
+			renderQueueStats.vertexArrayChanges++;
+		}
+
+		const USceneObject& object = sceneObjects[command.object];
+		const UMeshPart& part = meshParts[object.part];
+		cullStats.lodObjects[command.lod]++;
+		cullStats.triangles += part.lods[command.lod].count / 3;
+
+		glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(scene.worlds[object.node]));
+		glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(scene.worldNormals[object.node]));
+		glUniform1i(textureIndexLoc, object.texture);
+		if (useLightmapLoc >= 0) {
+			glUniform1i(useLightmapLoc, lightmapped && command.object < (int) lightmap.objects.size() && lightmap.objects[command.object]);
+		}
+		if (shadingMode == SHADING_VISIBILITY) {
+			glUniform1i(objectIdLoc, command.object + 1);
+			glUniform1i(firstVertexLoc, part.lods[command.lod].first);
+			if (transforms != NULL) {
+				glm::vec4* texels = transforms + command.object * VISIBILITY_TRANSFORM_TEXELS;
+				const glm::mat4& world = scene.worlds[object.node];
+				const glm::mat3& normal = scene.worldNormals[object.node];
+				for (int c = 0; c < 4; c++) {
+					texels[c] = world[c];
+				}
+				for (int c = 0; c < 3; c++) {
+					texels[4 + c] = glm::vec4(normal[c], 0.0f);
+				}
+				texels[4].w = (GLfloat) object.texture;
+			}
+		}
+		glDrawArrays(GL_TRIANGLES, part.lods[command.lod].first, part.lods[command.lod].count);
+	}
+	if (gpuDriven) {
+		UGpuCullDraw();
+	}
+	if (prepass) {
+		UDepthPrepassEnd();
+	}
+	if (measureShadingSamples) {
+		glEndQuery(GL_SAMPLES_PASSED);
+	}
+	UProfileEnd();
+
+	if (shadingMode != SHADING_FORWARD) {
+		UProfileBegin(shadingMode == SHADING_DEFERRED ? "Lighting" : "Resolve", true);
+		if (measureShadingSamples) {
+			glBeginQuery(GL_SAMPLES_PASSED, shadingSampleQueries[1]);
+		}
+		if (shadingMode == SHADING_DEFERRED) {
+			UDeferredLighting(view, projection, lightPosition, lightPosition2);
+		} else {
+			UVisibilityUploadTransforms(transforms, cullStats.objects);
+			UVisibilityResolve(view, projection, lightPosition, lightPosition2);
+		}
+		if (measureShadingSamples) {
+			glEndQuery(GL_SAMPLES_PASSED);
+		}
+		UProfileEnd();
+	}
+
+	// Issues or collects the read of the object ID under the cursor.
+	if (picking.requested || picking.idFence != 0) {
+		UPickReadIds();
+	}
+
+	// Outlines the picked object.
+	if (picking.selected >= 0 && picking.selected < cullStats.objects) {
+		UDebugBox(objectBoundsMin[picking.selected], objectBoundsMax[picking.selected], glm::vec3(1.0f, 1.0f, 0.0f));
+	}
+	if (debugDraw.enabled) {
+		UProfileBegin("Debug draw", true);
+		UDebugDrawScene(projection * view, lightPosition, lightPosition2, !gpuDriven);
+		UProfileEnd();
+	}
+	// Anything added outside the frame goes out here too.
+	if (debugDraw.lineCount + debugDraw.shapeCount > 0) {
+		UProfileBegin("Debug flush", true);
+		UDebugDrawFlush(projection * view);
+		UProfileEnd();
+	}
+
+	// Next frame's GPU culling tests against this frame's depth.
+	if (gpuDriven) {
+		UProfileBegin("Depth pyramid", true);
+		UGpuCullBuildPyramid(projection * view);
+		UProfileEnd();
+	}
+
+	if (frameReport) {
+		if (gpuDriven) {
+			UGpuCullReadStats();
+		}
+		printf("INFO: Frame %.2f ms, culled %d of %d objects (%d occluded), %d triangles, LOD objects %d/%d/%d.\n",
+			frameTime, cullStats.culled, cullStats.objects, cullStats.occluded, cullStats.triangles,
+			cullStats.lodObjects[0], cullStats.lodObjects[1], cullStats.lodObjects[2]);
+		printf("INFO: Frame arena %zu of %zu bytes (peak %zu), %lld heap allocations last frame.\n",
+			frameArena.offset, frameArena.capacity, frameArena.peak, frameHeapAllocations);
+		printf("INFO: %s shading, %d point lights, culled on the %s", shadingModeNames[shadingMode], activePointLights, gpuDriven ? "GPU" : "CPU");
+		if (shadingMode == SHADING_DEFERRED) {
+			printf(", %d light quads", deferredLightQuads);
+		}
+		printf(".\n");
+		if (governor.enabled) {
+			printf("INFO: Governor %.1f ms budget, CPU %.2f ms, GPU %.2f ms, %d%% resolution (%dx%d), %d light cap, LOD bias %.1f.\n",
+				governor.budget, governor.cpuTime, governor.gpuTime, governor.scale, renderWidth, renderHeight,
+				governor.lightLimit, lodBias);
+		}
+		if (shadingMode == SHADING_FORWARD) {
+			printf("INFO: Depth pre-pass %s, %s this frame, measured overdraw %.2f, %ld automatic switches.\n",
+				depthPrepassModeNames[depthPrepass.mode], prepass ? "ran" : "skipped", depthPrepass.overdraw, depthPrepass.switches);
+		}
+		if (shadowMapping) {
+			printf("INFO: Shadows %d draws, %d saved by caching, %d dynamic casters, %ld static rebuilds.\n",
+				shadowStats.draws, shadowStats.saved, shadowStats.dynamicCasters, shadowStats.staticRebuilds);
+		}
+		if (debugDraw.enabled) {
+			printf("INFO: Debug draw %d lines and %d shapes in %d draws, %ld dropped.\n",
+				debugDraw.drawnLines, debugDraw.drawnShapes, debugDraw.draws, debugDraw.dropped);
+		}
+		printf("INFO: Render queue %d commands sorted in %.3f ms, %d program, %d texture and %d vertex array changes.\n",
+			renderQueueStats.commands, renderQueueStats.sortTime, renderQueueStats.programChanges,
+			renderQueueStats.textureChanges, renderQueueStats.vertexArrayChanges);
+		UProfilePrintFrame();
+		UGLStatisticsPrint(glFrameStatistics);
+	}
+
+	// Starts reading this frame's depth for next frame's occlusion tests.
+	if (occlusionCulling && occlusionSource == OCCLUSION_FROM_GPU && !gpuDriven) {
+		UProfileBegin("Depth readback", true);
+		UReadDepthAsync(projection * view);
+		UProfileEnd();
+	}
+	UStreamEndFrame(&frameStream);
+    // Deactivate VAO
+    glBindVertexArray(0);
+	frameWorkTime = UNowMilliseconds() - frameStart;
+	UGovernorPresent();
+	if (offscreen.framebuffer != 0) {
+		// Benchmarks render offscreen without writing anything.
+		if (offscreen.writerCount > 0) {
+			UProfileBegin("Capture", false);
+			UOffscreenCapture();
+			UProfileEnd();
+		}
+	} else {
+		glutPostRedisplay();
+		// Flips front and back buffers.
+		UProfileBegin("Swap", false);
+		glutSwapBuffers();
+		UProfileEnd();
+	}
+	URecordInputLatency();
+	UProfileEndFrame();
+	UGLStatisticsEndFrame();
+
+	UArenaReset(&frameArena);
+	frameHeapAllocations = heapAllocations - allocationsBefore;
+	if (allocationWarmup > 0) {
+		allocationWarmup--;
+	} else if (frameHeapAllocations != 0) {
+		printf("WARNING: %lld heap allocations in a steady-state frame.\n", frameHeapAllocations);
+	}
+}
+
+void UCreateShader (void) {
+	// Create Vertex shader object.
+	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+	glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
+	glCompileShader(vertexShader);
+
+	GLint success = 0;
+	glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
+	// Error checking for shader.
+	if (success == GL_FALSE) {
+		int size;
+		char str[1024] = { 0 };
+		glGetShaderInfoLog(vertexShader, sizeof(str), &size, str);
+		printf("ERROR COMPILING VERTEX SHADER.\n%s\n", str);
+	}
+
+
+	GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+	// Retrieves shader and frag source code.
+	glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
+	// Compiles shader source code.
+	glCompileShader(fragmentShader);
+
+	glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
+	// Error checking for shader.
+	if (success == GL_FALSE) {
+		int size;
+		char str[1024] = { 0 };
+		glGetShaderInfoLog(fragmentShader, sizeof(str), &size, str);
+		printf("ERROR COMPILING FRAGMENT SHADER.\n%s\n", str);
+	}
+
+    // Create shader program object.
+	shaderProgram = glCreateProgram();
+	// Attach shaders to program.
+	glAttachShader(shaderProgram, vertexShader);
+	glAttachShader(shaderProgram, fragmentShader);
+
+	// Link program
+	glLinkProgram(shaderProgram);
+
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+
+	glUseProgram(shaderProgram);
+	UTextureTableSetup(shaderProgram);
+}
+
+void UCreateBuffers (void) {
+	// Sets vertex coordinates.
+	GLfloat verts[] = {
+		// New prism.
+		// TOP
+		-0.75, 1, 1, 	0, 1, 0, 	0, 1,
+		-0.75, 1, -1, 	0, 1, 0, 	0, 0,
+		0.75, 1, -1, 	0, 1, 0, 	1, 0,
+		0.75, 1, -1, 	0, 1, 0, 	1, 0,
+		0.75, 1, 1, 	0, 1, 0, 	1, 1,
+		-0.75, 1, 1, 	0, 1, 0, 	0, 1,
+
+		// BOTTOM
+		-0.7, 0.95, 0.95, 	0, -1, 0, 	0, 0,
+		-0.7, 0.95, -0.95, 	0, -1, 0, 	0, 1,
+		0.7, 0.95, -0.95, 	0, -1, 0, 	1, 1,
+		0.7, 0.95, -0.95, 	0, -1, 0, 	1, 1,
+		0.7, 0.95, 0.95, 	0, -1, 0, 	1, 0,
+		-0.7, 0.95, 0.95, 	0, -1, 0, 	0, 0,
+
+		// BACK
+		-0.75, 1, 1, 	0, 0, 1, 	1, 1,
+		-0.7, 0.95, 0.95, 	0, 0, 1, 	1, 0,
+		0.7, 0.95, 0.95, 	0, 0, 1, 	0, 0,
+		0.7, 0.95, 0.95, 	0, 0, 1, 	0, 0,
+		0.75, 1, 1, 	0, 0, 1, 	0, 1,
+		-0.75, 1, 1, 	0, 0, 1, 	1, 1,
+
+		// RIGHT
+		0.75, 1, 1, 	1, 0, 0, 	1, 1,
+		0.7, 0.95, 0.95, 	1, 0, 0, 	1, 0,
+		0.7, 0.95, -0.95, 	1, 0, 0, 	0, 0,
+		0.7, 0.95, -0.95, 	1, 0, 0, 	0, 0,
+		0.75, 1, -1, 	1, 0, 0, 	0, 1,
+		0.75, 1, 1, 	1, 0, 0, 	1, 1,
+
+		// FRONT
+		0.7, 0.95, -0.95, 	0, 0, -1, 	1, 0,
+		-0.7, 0.95, -0.95, 	0, 0, -1, 	0, 0,
+		-0.75, 1, -1, 	0, 0, -1, 	0, 1,
+		-0.75, 1, -1, 	0, 0, -1, 	0, 1,
+		0.75, 1, -1, 	0, 0, -1, 	1, 1,
+		0.7, 0.95, -0.95, 	0, 0, -1, 	1, 0,
+
+		// LEFT
+		-0.75, 1, 1, 	-1, 0, 0, 	1, 1,
+		-0.7, 0.95, 0.95, 	-1, 0, 0, 	1, 0,
+		-0.7, 0.95, -0.95, 	-1, 0, 0, 	0, 0,
+		-0.7, 0.95, -0.95, 	-1, 0, 0, 	0, 0,
+		-0.75, 1, -1, 	-1, 0, 0, 	0, 1,
+		-0.75, 1, 1, 	-1, 0, 0, 	1, 1,
+
+		// New prism.
+		// TOP
+		-0.65, 0.95, 0.9, 	0, 1, 0, 	0, 1,
+		-0.65, 0.95, 0.8, 	0, 1, 0, 	0, 0,
+		-0.55, 0.95, 0.8, 	0, 1, 0, 	1, 0,
+		-0.55, 0.95, 0.8, 	0, 1, 0, 	1, 0,
+		-0.55, 0.95, 0.9, 	0, 1, 0, 	1, 1,
+		-0.65, 0.95, 0.9, 	0, 1, 0, 	0, 1,
+
+		// BOTTOM
+		-0.64, -1, 0.89, 	0, -1, 0, 	0, 0,
+		-0.64, -1, 0.81, 	0, -1, 0, 	0, 1,
+		-0.56, -1, 0.81, 	0, -1, 0, 	1, 1,
+		-0.56, -1, 0.81, 	0, -1, 0, 	1, 1,
+		-0.56, -1, 0.89, 	0, -1, 0, 	1, 0,
+		-0.64, -1, 0.89, 	0, -1, 0, 	0, 0,
+
+		// BACK
+		-0.65, 0.95, 0.9, 	0, 0, 1, 	1, 1,
+		-0.64, -1, 0.89, 	0, 0, 1, 	1, 0,
+		-0.56, -1, 0.89, 	0, 0, 1, 	0, 0,
+		-0.56, -1, 0.89, 	0, 0, 1, 	0, 0,
+		-0.55, 0.95, 0.9, 	0, 0, 1, 	0, 1,
+		-0.65, 0.95, 0.9, 	0, 0, 1, 	1, 1,
+
+		// RIGHT
+		-0.55, 0.95, 0.9, 	1, 0, 0, 	1, 1,
+		-0.56, -1, 0.89, 	1, 0, 0, 	1, 0,
+		-0.56, -1, 0.81, 	1, 0, 0, 	0, 0,
+		-0.56, -1, 0.81, 	1, 0, 0, 	0, 0,
+		-0.55, 0.95, 0.8, 	1, 0, 0, 	0, 1,
+		-0.55, 0.95, 0.9, 	1, 0, 0, 	1, 1,
+
+		// FRONT
+		-0.56, -1, 0.81, 	0, 0, -1, 	1, 0,
+		-0.64, -1, 0.81, 	0, 0, -1, 	0, 0,
+		-0.65, 0.95, 0.8, 	0, 0, -1, 	0, 1,
+		-0.65, 0.95, 0.8, 	0, 0, -1, 	0, 1,
+		-0.55, 0.95, 0.8, 	0, 0, -1, 	1, 1,
+		-0.56, -1, 0.81, 	0, 0, -1, 	1, 0,
+
+		// LEFT
+		-0.65, 0.95, 0.9, 	-1, 0, 0, 	1, 1,
+		-0.64, -1, 0.89, 	-1, 0, 0, 	1, 0,
+		-0.64, -1, 0.81, 	-1, 0, 0, 	0, 0,
+		-0.64, -1, 0.81, 	-1, 0, 0, 	0, 0,
+		-0.65, 0.95, 0.8, 	-1, 0, 0, 	0, 1,
+		-0.65, 0.95, 0.9, 	-1, 0, 0, 	1, 1,
+
+		// New prism.
+		// TOP
+		-0.65, 0.95, -0.8, 	0, 1, 0, 	0, 1,
+		-0.65, 0.95, -0.9, 	0, 1, 0, 	0, 0,
+		-0.55, 0.95, -0.9, 	0, 1, 0, 	1, 0,
+		-0.55, 0.95, -0.9, 	0, 1, 0, 	1, 0,
+		-0.55, 0.95, -0.8, 	0, 1, 0, 	1, 1,
+		-0.65, 0.95, -0.8, 	0, 1, 0, 	0, 1,
+
+		// BOTTOM
+		-0.64, -1, -0.81, 	0, -1, 0, 	0, 0,
+		-0.64, -1, -0.89, 	0, -1, 0, 	0, 1,
 		-0.56, -1, -0.89, 	0, -1, 0, 	1, 1,
 		-0.56, -1, -0.89, 	0, -1, 0, 	1, 1,
 		-0.56, -1, -0.81, 	0, -1, 0, 	1, 0,
 		-0.64, -1, -0.81, 	0, -1, 0, 	0, 0,
 
-		// BACK
-		-0.65, 0.95, -0.8, 	0, 0, 1, 	1, 1,
-		-0.64, -1, -0.81, 	0, 0, 1, 	1, 0,
-		-0.56, -1, -0.81, 	0, 0, 1, 	0, 0,
-		-0.56, -1, -0.81, 	0, 0, 1, 	0, 0,
-		-0.55, 0.95, -0.8, 	0, 0, 1, 	0, 1,
-		-0.65, 0.95, -0.8, 	0, 0, 1, 	1, 1,
+		// BACK
+		-0.65, 0.95, -0.8, 	0, 0, 1, 	1, 1,
+		-0.64, -1, -0.81, 	0, 0, 1, 	1, 0,
+		-0.56, -1, -0.81, 	0, 0, 1, 	0, 0,
+		-0.56, -1, -0.81, 	0, 0, 1, 	0, 0,
+		-0.55, 0.95, -0.8, 	0, 0, 1, 	0, 1,
+		-0.65, 0.95, -0.8, 	0, 0, 1, 	1, 1,
+
+		// RIGHT
+		-0.55, 0.95, -0.8, 	1, 0, 0, 	1, 1,
+		-0.56, -1, -0.81, 	1, 0, 0, 	1, 0,
+		-0.56, -1, -0.89, 	1, 0, 0, 	0, 0,
+		-0.56, -1, -0.89, 	1, 0, 0, 	0, 0,
+		-0.55, 0.95, -0.9, 	1, 0, 0, 	0, 1,
+		-0.55, 0.95, -0.8, 	1, 0, 0, 	1, 1,
+
+		// FRONT
+		-0.56, -1, -0.89, 	0, 0, -1, 	1, 0,
+		-0.64, -1, -0.89, 	0, 0, -1, 	0, 0,
+		-0.65, 0.95, -0.9, 	0, 0, -1, 	0, 1,
+		-0.65, 0.95, -0.9, 	0, 0, -1, 	0, 1,
+		-0.55, 0.95, -0.9, 	0, 0, -1, 	1, 1,
+		-0.56, -1, -0.89, 	0, 0, -1, 	1, 0,
+
+		// LEFT
+		-0.65, 0.95, -0.8, 	-1, 0, 0, 	1, 1,
+		-0.64, -1, -0.81, 	-1, 0, 0, 	1, 0,
+		-0.64, -1, -0.89, 	-1, 0, 0, 	0, 0,
+		-0.64, -1, -0.89, 	-1, 0, 0, 	0, 0,
+		-0.65, 0.95, -0.9, 	-1, 0, 0, 	0, 1,
+		-0.65, 0.95, -0.8, 	-1, 0, 0, 	1, 1,
+
+		// New prism.
+		// TOP
+		0.55, 0.95, -0.8, 	0, 1, 0, 	0, 1,
+		0.55, 0.95, -0.9, 	0, 1, 0, 	0, 0,
+		0.65, 0.95, -0.9, 	0, 1, 0, 	1, 0,
+		0.65, 0.95, -0.9, 	0, 1, 0, 	1, 0,
+		0.65, 0.95, -0.8, 	0, 1, 0, 	1, 1,
+		0.55, 0.95, -0.8, 	0, 1, 0, 	0, 1,
+
+		// BOTTOM
+		0.56, -1, -0.81, 	0, -1, 0, 	0, 0,
+		0.56, -1, -0.89, 	0, -1, 0, 	0, 1,
+		0.64, -1, -0.89, 	0, -1, 0, 	1, 1,
+		0.64, -1, -0.89, 	0, -1, 0, 	1, 1,
+		0.64, -1, -0.81, 	0, -1, 0, 	1, 0,
+		0.56, -1, -0.81, 	0, -1, 0, 	0, 0,
+
+		// BACK
+		0.55, 0.95, -0.8, 	0, 0, 1, 	1, 1,
+		0.56, -1, -0.81, 	0, 0, 1, 	1, 0,
+		0.64, -1, -0.81, 	0, 0, 1, 	0, 0,
+		0.64, -1, -0.81, 	0, 0, 1, 	0, 0,
+		0.65, 0.95, -0.8, 	0, 0, 1, 	0, 1,
+		0.55, 0.95, -0.8, 	0, 0, 1, 	1, 1,
+
+		// RIGHT
+		0.65, 0.95, -0.8, 	1, 0, 0, 	1, 1,
+		0.64, -1, -0.81, 	1, 0, 0, 	1, 0,
+		0.64, -1, -0.89, 	1, 0, 0, 	0, 0,
+		0.64, -1, -0.89, 	1, 0, 0, 	0, 0,
+		0.65, 0.95, -0.9, 	1, 0, 0, 	0, 1,
+		0.65, 0.95, -0.8, 	1, 0, 0, 	1, 1,
+
+		// FRONT
+		0.64, -1, -0.89, 	0, 0, -1, 	1, 0,
+		0.56, -1, -0.89, 	0, 0, -1, 	0, 0,
+		0.55, 0.95, -0.9, 	0, 0, -1, 	0, 1,
+		0.55, 0.95, -0.9, 	0, 0, -1, 	0, 1,
+		0.65, 0.95, -0.9, 	0, 0, -1, 	1, 1,
+		0.64, -1, -0.89, 	0, 0, -1, 	1, 0,
+
+		// LEFT
+		0.55, 0.95, -0.8, 	-1, 0, 0, 	1, 1,
+		0.56, -1, -0.81, 	-1, 0, 0, 	1, 0,
+		0.56, -1, -0.89, 	-1, 0, 0, 	0, 0,
+		0.56, -1, -0.89, 	-1, 0, 0, 	0, 0,
+		0.55, 0.95, -0.9, 	-1, 0, 0, 	0, 1,
+		0.55, 0.95, -0.8, 	-1, 0, 0, 	1, 1,
+
+		// New prism.
+		// TOP
+		0.55, 0.95, 0.9, 	0, 1, 0, 	0, 1,
+		0.55, 0.95, 0.8, 	0, 1, 0, 	0, 0,
+		0.65, 0.95, 0.8, 	0, 1, 0, 	1, 0,
+		0.65, 0.95, 0.8, 	0, 1, 0, 	1, 0,
+		0.65, 0.95, 0.9, 	0, 1, 0, 	1, 1,
+		0.55, 0.95, 0.9, 	0, 1, 0, 	0, 1,
+
+		// BOTTOM
+		0.56, -1, 0.89, 	0, -1, 0, 	0, 0,
+		0.56, -1, 0.81, 	0, -1, 0, 	0, 1,
+		0.64, -1, 0.81, 	0, -1, 0, 	1, 1,
+		0.64, -1, 0.81, 	0, -1, 0, 	1, 1,
+		0.64, -1, 0.89, 	0, -1, 0, 	1, 0,
+		0.56, -1, 0.89, 	0, -1, 0, 	0, 0,
+
+		// BACK
+		0.55, 0.95, 0.9, 	0, 0, 1, 	1, 1,
+		0.56, -1, 0.89, 	0, 0, 1, 	1, 0,
+		0.64, -1, 0.89, 	0, 0, 1, 	0, 0,
+		0.64, -1, 0.89, 	0, 0, 1, 	0, 0,
+		0.65, 0.95, 0.9, 	0, 0, 1, 	0, 1,
+		0.55, 0.95, 0.9, 	0, 0, 1, 	1, 1,
+
+		// RIGHT
+		0.65, 0.95, 0.9, 	1, 0, 0, 	1, 1,
+		0.64, -1, 0.89, 	1, 0, 0, 	1, 0,
+		0.64, -1, 0.81, 	1, 0, 0, 	0, 0,
+		0.64, -1, 0.81, 	1, 0, 0, 	0, 0,
+		0.65, 0.95, 0.8, 	1, 0, 0, 	0, 1,
+		0.65, 0.95, 0.9, 	1, 0, 0, 	1, 1,
+
+		// FRONT
+		0.64, -1, 0.81, 	0, 0, -1, 	1, 0,
+		0.56, -1, 0.81, 	0, 0, -1, 	0, 0,
+		0.55, 0.95, 0.8, 	0, 0, -1, 	0, 1,
+		0.55, 0.95, 0.8, 	0, 0, -1, 	0, 1,
+		0.65, 0.95, 0.8, 	0, 0, -1, 	1, 1,
+		0.64, -1, 0.81, 	0, 0, -1, 	1, 0,
+
+		// LEFT
+		0.55, 0.95, 0.9, 	-1, 0, 0, 	1, 1,
+		0.56, -1, 0.89, 	-1, 0, 0, 	1, 0,
+		0.56, -1, 0.81, 	-1, 0, 0, 	0, 0,
+		0.56, -1, 0.81, 	-1, 0, 0, 	0, 0,
+		0.55, 0.95, 0.8, 	-1, 0, 0, 	0, 1,
+		0.55, 0.95, 0.9, 	-1, 0, 0, 	1, 1,
+
+		// New prism.
+		// TOP
+		-0.6, -0.65, 0.85, 	0, 1, 0, 	0, 1,
+		-0.6, -0.65, -0.85, 	0, 1, 0, 	0, 0,
+		0.6, -0.65, -0.85, 	0, 1, 0, 	1, 0,
+		0.6, -0.65, -0.85, 	0, 1, 0, 	1, 0,
+		0.6, -0.65, 0.85, 	0, 1, 0, 	1, 1,
+		-0.6, -0.65, 0.85, 	0, 1, 0, 	0, 1,
+
+		// BOTTOM
+		-0.6, -0.7, 0.85, 	0, -1, 0, 	0, 0,
+		-0.6, -0.7, -0.85, 	0, -1, 0, 	0, 1,
+		0.6, -0.7, -0.85, 	0, -1, 0, 	1, 1,
+		0.6, -0.7, -0.85, 	0, -1, 0, 	1, 1,
+		0.6, -0.7, 0.85, 	0, -1, 0, 	1, 0,
+		-0.6, -0.7, 0.85, 	0, -1, 0, 	0, 0,
+
+		// BACK
+		-0.6, -0.65, 0.85, 	0, 0, 1, 	1, 1,
+		-0.6, -0.7, 0.85, 	0, 0, 1, 	1, 0,
+		0.6, -0.7, 0.85, 	0, 0, 1, 	0, 0,
+		0.6, -0.7, 0.85, 	0, 0, 1, 	0, 0,
+		0.6, -0.65, 0.85, 	0, 0, 1, 	0, 1,
+		-0.6, -0.65, 0.85, 	0, 0, 1, 	1, 1,
+
+		// RIGHT
+		0.6, -0.65, 0.85, 	1, 0, 0, 	1, 1,
+		0.6, -0.7, 0.85, 	1, 0, 0, 	1, 0,
+		0.6, -0.7, -0.85, 	1, 0, 0, 	0, 0,
+		0.6, -0.7, -0.85, 	1, 0, 0, 	0, 0,
+		0.6, -0.65, -0.85, 	1, 0, 0, 	0, 1,
+		0.6, -0.65, 0.85, 	1, 0, 0, 	1, 1,
+
+		// FRONT
+		0.6, -0.7, -0.85, 	0, 0, -1, 	1, 0,
+		-0.6, -0.7, -0.85, 	0, 0, -1, 	0, 0,
+		-0.6, -0.65, -0.85, 	0, 0, -1, 	0, 1,
+		-0.6, -0.65, -0.85, 	0, 0, -1, 	0, 1,
+		0.6, -0.65, -0.85, 	0, 0, -1, 	1, 1,
+		0.6, -0.7, -0.85, 	0, 0, -1, 	1, 0,
+
+		// LEFT
+		-0.6, -0.65, 0.85, 	-1, 0, 0, 	1, 1,
+		-0.6, -0.7, 0.85, 	-1, 0, 0, 	1, 0,
+		-0.6, -0.7, -0.85, 	-1, 0, 0, 	0, 0,
+		-0.6, -0.7, -0.85, 	-1, 0, 0, 	0, 0,
+		-0.6, -0.65, -0.85, 	-1, 0, 0, 	0, 1,
+		-0.6, -0.65, 0.85, 	-1, 0, 0, 	1, 1,
+
+		// New prism.
+		// TOP
+		-0.6, 0.95, 0.85, 	0, 1, 0, 	0, 1,
+		-0.6, 0.95, -0.85, 	0, 1, 0, 	0, 0,
+		0.6, 0.95, -0.85, 	0, 1, 0, 	1, 0,
+		0.6, 0.95, -0.85, 	0, 1, 0, 	1, 0,
+		0.6, 0.95, 0.85, 	0, 1, 0, 	1, 1,
+		-0.6, 0.95, 0.85, 	0, 1, 0, 	0, 1,
+
+		// BOTTOM
+		-0.6, 0.25, 0.85, 	0, -1, 0, 	0, 0,
+		-0.6, 0.25, -0.85, 	0, -1, 0, 	0, 1,
+		0.6, 0.25, -0.85, 	0, -1, 0, 	1, 1,
+		0.6, 0.25, -0.85, 	0, -1, 0, 	1, 1,
+		0.6, 0.25, 0.85, 	0, -1, 0, 	1, 0,
+		-0.6, 0.25, 0.85, 	0, -1, 0, 	0, 0,
+
+		// BACK
+		-0.6, 0.95, 0.85, 	0, 0, 1, 	1, 1,
+		-0.6, 0.25, 0.85, 	0, 0, 1, 	1, 0,
+		0.6, 0.25, 0.85, 	0, 0, 1, 	0, 0,
+		0.6, 0.25, 0.85, 	0, 0, 1, 	0, 0,
+		0.6, 0.95, 0.85, 	0, 0, 1, 	0, 1,
+		-0.6, 0.95, 0.85, 	0, 0, 1, 	1, 1,
+
+		// RIGHT
+		0.6, 0.95, 0.85, 	1, 0, 0, 	1, 1,
+		0.6, 0.25, 0.85, 	1, 0, 0, 	1, 0,
+		0.6, 0.25, -0.85, 	1, 0, 0, 	0, 0,
+		0.6, 0.25, -0.85, 	1, 0, 0, 	0, 0,
+		0.6, 0.95, -0.85, 	1, 0, 0, 	0, 1,
+		0.6, 0.95, 0.85, 	1, 0, 0, 	1, 1,
+
+		// FRONT
+		0.6, 0.25, -0.85, 	0, 0, -1, 	1, 0,
+		-0.6, 0.25, -0.85, 	0, 0, -1, 	0, 0,
+		-0.6, 0.95, -0.85, 	0, 0, -1, 	0, 1,
+		-0.6, 0.95, -0.85, 	0, 0, -1, 	0, 1,
+		0.6, 0.95, -0.85, 	0, 0, -1, 	1, 1,
+		0.6, 0.25, -0.85, 	0, 0, -1, 	1, 0,
+
+		// LEFT
+		-0.6, 0.95, 0.85, 	-1, 0, 0, 	1, 1,
+		-0.6, 0.25, 0.85, 	-1, 0, 0, 	1, 0,
+		-0.6, 0.25, -0.85, 	-1, 0, 0, 	0, 0,
+		-0.6, 0.25, -0.85, 	-1, 0, 0, 	0, 0,
+		-0.6, 0.95, -0.85, 	-1, 0, 0, 	0, 1,
+		-0.6, 0.95, 0.85, 	-1, 0, 0, 	1, 1,
+
+		// New prism.
+		// TOP
+		-0.65, 0.85, 0.65, 	0, 1, 0, 	0, 1,
+		-0.65, 0.85, -0.65, 	0, 1, 0, 	0, 0,
+		-0.6, 0.85, -0.65, 	0, 1, 0, 	1, 0,
+		-0.6, 0.85, -0.65, 	0, 1, 0, 	1, 0,
+		-0.6, 0.85, 0.65, 	0, 1, 0, 	1, 1,
+		-0.65, 0.85, 0.65, 	0, 1, 0, 	0, 1,
+
+		// BOTTOM
+		-0.65, 0.35, 0.65, 	0, -1, 0, 	0, 0,
+		-0.65, 0.35, -0.65, 	0, -1, 0, 	0, 1,
+		-0.6, 0.35, -0.65, 	0, -1, 0, 	1, 1,
+		-0.6, 0.35, -0.65, 	0, -1, 0, 	1, 1,
+		-0.6, 0.35, 0.65, 	0, -1, 0, 	1, 0,
+		-0.65, 0.35, 0.65, 	0, -1, 0, 	0, 0,
+
+		// BACK
+		-0.65, 0.85, 0.65, 	0, 0, 1, 	1, 1,
+		-0.65, 0.35, 0.65, 	0, 0, 1, 	1, 0,
+		-0.6, 0.35, 0.65, 	0, 0, 1, 	0, 0,
+		-0.6, 0.35, 0.65, 	0, 0, 1, 	0, 0,
+		-0.6, 0.85, 0.65, 	0, 0, 1, 	0, 1,
+		-0.65, 0.85, 0.65, 	0, 0, 1, 	1, 1,
+
+		// RIGHT
+		-0.6, 0.85, 0.65, 	1, 0, 0, 	1, 1,
+		-0.6, 0.35, 0.65, 	1, 0, 0, 	1, 0,
+		-0.6, 0.35, -0.65, 	1, 0, 0, 	0, 0,
+		-0.6, 0.35, -0.65, 	1, 0, 0, 	0, 0,
+		-0.6, 0.85, -0.65, 	1, 0, 0, 	0, 1,
+		-0.6, 0.85, 0.65, 	1, 0, 0, 	1, 1,
+
+		// FRONT
+		-0.6, 0.35, -0.65, 	0, 0, -1, 	1, 0,
+		-0.65, 0.35, -0.65, 	0, 0, -1, 	0, 0,
+		-0.65, 0.85, -0.65, 	0, 0, -1, 	0, 1,
+		-0.65, 0.85, -0.65, 	0, 0, -1, 	0, 1,
+		-0.6, 0.85, -0.65, 	0, 0, -1, 	1, 1,
+		-0.6, 0.35, -0.65, 	0, 0, -1, 	1, 0,
+
+		// LEFT
+		-0.65, 0.85, 0.65, 	-1, 0, 0, 	1, 1,
+		-0.65, 0.35, 0.65, 	-1, 0, 0, 	1, 0,
+		-0.65, 0.35, -0.65, 	-1, 0, 0, 	0, 0,
+		-0.65, 0.35, -0.65, 	-1, 0, 0, 	0, 0,
+		-0.65, 0.85, -0.65, 	-1, 0, 0, 	0, 1,
+		-0.65, 0.85, 0.65, 	-1, 0, 0, 	1, 1
+
+	};
+	// Each prism is 36 vertices and is bounded, culled and drawn on its own.
+	int vertexCount = sizeof(verts) / (sizeof(GLfloat) * 8);
+	for (int i = 0; i < vertexCount; i++) {
+		meshPositions.push_back(glm::vec3(verts[i * 8], verts[i * 8 + 1], verts[i * 8 + 2]));
+		meshNormals.push_back(glm::vec3(verts[i * 8 + 3], verts[i * 8 + 4], verts[i * 8 + 5]));
+	}
+	for (int first = 0; first < vertexCount; first += 36) {
+		UAddMeshPart(verts, first, 36, 8);
+	}
+
+	// Simplified versions of every part go after the original vertices.
+	std::vector<GLfloat> vertexData(verts, verts + vertexCount * 8);
+	for (int i = 0; i < (int) meshParts.size(); i++) {
+		UGenerateLODs(verts, 8, &meshParts[i], vertexData);
+	}
+	for (int i = vertexCount; i < (int) vertexData.size() / 8; i++) {
+		meshPositions.push_back(glm::vec3(vertexData[i * 8], vertexData[i * 8 + 1], vertexData[i * 8 + 2]));
+		meshNormals.push_back(glm::vec3(vertexData[i * 8 + 3], vertexData[i * 8 + 4], vertexData[i * 8 + 5]));
+	}
+
+	// Generate buffer IDs
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+
+	// Activation of VAO before binding.
+    glBindVertexArray(VAO);
+
+	// Activates the buffer.
+	glBindBuffer(GL_ARRAY_BUFFER, VBO);
+	// Sends data to GPU
+	glBufferData(GL_ARRAY_BUFFER, vertexData.size() * sizeof(GLfloat), &vertexData[0], GL_STATIC_DRAW);
+
+	// Tells GPU how to handle VBO.
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 8, (GLvoid*) 0);
+	glEnableVertexAttribArray(0); // Sets initial position of rgba in buffer.
+
+    // Tells GPU how to handle VBO.
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 8, (GLvoid*) (3 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(1); // Sets initial position of rgba in buffer.
+
+	// Tells GPU the Surface Normal values.
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 8, (GLvoid*) (6 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(2); // Sets initial position of rgba in buffer.
+
+	// Positions alone, in the same order, for the depth pre-pass.
+	glGenVertexArrays(1, &depthVAO);
+	glGenBuffers(1, &positionVBO);
+	glBindVertexArray(depthVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, positionVBO);
+	glBufferData(GL_ARRAY_BUFFER, meshPositions.size() * sizeof(glm::vec3), &meshPositions[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*) 0);
+	glEnableVertexAttribArray(0);
+
+    glBindVertexArray(0);
+}
+
+void UMouseClick (int button, int state, int x, int y) {
+	/*
+	 * Possible button values:
+	 * 	GLUT_LEFT_BUTTON
+	 *	GLUT_RIGHT_BUTTON
+	 *	GLUT_MIDDLE_BUTTON
+	 *
+	 *  Possible states:
+	 * 	GLUT_DOWN
+	 * 	GLUT_UP
+	 */
+
+	/* Used to create a more intuitive looking action. */
+	if (state == GLUT_UP) {
+		mouseDetected = true;
+	}
+
+	switch (button) {
+		case GLUT_LEFT_BUTTON:
+			leftIsPressed = (state == GLUT_DOWN);
+			/* Determines if the alt key is also being pressed. */
+			altIsPressed = (leftIsPressed && (glutGetModifiers() == GLUT_ACTIVE_ALT));
+			/* Selects the object under the cursor, which dragging then turns. */
+			if (altIsPressed) {
+				UPickAt(x, y);
+			}
+			break;
+		case GLUT_RIGHT_BUTTON:
+			rightIsPressed = (state == GLUT_DOWN);
+			/* Determines if the alt key is also being pressed. */
+			altIsPressed = (rightIsPressed && (glutGetModifiers() == GLUT_ACTIVE_ALT));
+			break;
+		default:
+			break;
+	}
+
+}
+void UMousePressedMove (int x, int y) {
+	/* This first portion just updates the state of the mouse and how it has moved. */
+	if (mouseDetected) {
+		lastMouseX = x;
+		lastMouseY = y;
+		mouseDetected = false;
+	}
+
+	mouseXOffset = x - lastMouseX;
+	mouseYOffset = lastMouseY - y;
+
+	lastMouseX = x;
+	lastMouseY = y;
+
+	mouseXOffset *= sensitivity;
+	mouseYOffset *= sensitivity;
+
+	/* Handles what type of action is being performed. */
+	if (altIsPressed) {
+		if (leftIsPressed) {
+			/* Changes orientation of object on the next frame. */
+			UQueueMotion(INPUT_ROTATE_OBJECT, mouseXOffset, mouseYOffset);
+		} else if (rightIsPressed) {
+			/* Zooms in and out in non-ortho mode on the next frame. */
+			UQueueMotion(INPUT_ZOOM_CAMERA, mouseXOffset, mouseYOffset);
+		}
+	}
+}
+
+void UKeyboard (unsigned char key, GLint x, GLint y) {
+	// Switching modes may resize per-frame storage once.
+	allocationWarmup = ALLOCATION_WARMUP_FRAMES;
+
+	if (key == 'o') {
+		/* Toggles orthogonal view with 'o'. */
+		isOrtho = !isOrtho;
+	} else if (key == 'h') {
+		/* Prints the input latency histogram with 'h'. */
+		UPrintInputLatency();
+	} else if (key == 'c') {
+		/* Toggles the per-frame culling, triangle and timing report with 'c'. */
+		frameReport = !frameReport;
+	} else if (key == 'p') {
+		/* Writes the recent frame profiles as a Chrome trace with 'p'. */
+		if (UProfileExport("trace.json")) {
+			printf("INFO: Wrote %ld frames to trace.json.\n", std::min(profileFrameCount, (long) PROFILE_HISTORY));
+		}
+	} else if (key == 's') {
+		/* Turns the GL state cache off and on with 's'. */
+		glStateCache = !glStateCache;
+		printf("INFO: GL state cache %s.\n", glStateCache ? "on" : "off");
+	} else if (key == 'd') {
+		/* Cycles through forward, deferred and visibility buffer shading with 'd'. */
+		shadingMode = (shadingMode + 1) % SHADING_MODES;
+		printf("INFO: %s shading.\n", shadingModeNames[shadingMode]);
+	} else if (key == '+' || key == '-') {
+		/* Doubles or halves the number of point lights with '+' and '-'. */
+		if (key == '+') {
+			pointLightCount = std::min(std::max(pointLightCount * 2, 1), MAX_POINT_LIGHTS);
+		} else {
+			pointLightCount /= 2;
+		}
+		printf("INFO: %d point lights.\n", pointLightCount);
+	} else if (key == 'm') {
+		/* Toggles shadow maps with 'm'. */
+		shadowMapping = !shadowMapping;
+		printf("INFO: Shadow maps %s.\n", shadowMapping ? "on" : "off");
+	} else if (key == 'k') {
+		/* Turns caching of static shadow casters off and on with 'k'. */
+		shadowCaching = !shadowCaching;
+		printf("INFO: Shadow caching %s.\n", shadowCaching ? "on" : "off");
+	} else if (key == 'g') {
+		/* Toggles the frame budget governor with 'g'; turning it off restores full quality. */
+		governor.enabled = !governor.enabled;
+		if (governor.enabled) {
+			if (governor.log == NULL && (governor.log = fopen("governor.csv", "a")) != NULL) {
+				// Appending streams may report position zero until the first write.
+				fseek(governor.log, 0, SEEK_END);
+			}
+			UGovernorLog("enable", governor.cpuTime, governor.gpuTime);
+		} else {
+			UGovernorLog("disable", governor.cpuTime, governor.gpuTime);
+			governor.scale = 100;
+			governor.lightLimit = MAX_POINT_LIGHTS;
+			lodBias = 0.0f;
+		}
+		printf("INFO: Frame governor %s, %.1f ms budget, logging to governor.csv.\n", governor.enabled ? "on" : "off", governor.budget);
+	} else if (key == '[' || key == ']') {
+		/* Lowers or raises the governor's frame budget by a millisecond with '[' and ']'. */
+		governor.budget = std::max(governor.budget + (key == ']' ? 1.0 : -1.0), 1.0);
+		printf("INFO: Frame budget %.1f ms.\n", governor.budget);
+	} else if (key == 'b') {
+		/* Bakes the scene lights into a lightmap with 'b'. */
+		UBakeLightmap();
+	} else if (key == 'u') {
+		/* Switches between the baked lightmap and live lighting with 'u'. */
+		useLightmap = !useLightmap;
+		printf("INFO: %s lighting.\n", useLightmap && lightmap.valid ? "Baked" : "Live");
+	} else if (key == 'e') {
+		/* Cycles the depth pre-pass between off, on and automatic with 'e'. */
+		depthPrepass.mode = (depthPrepass.mode + 1) % 3;
+		printf("INFO: Depth pre-pass %s.\n", depthPrepassModeNames[depthPrepass.mode]);
+	} else if (key == 'i') {
+		/* Moves culling and draw submission to the GPU and back with 'i'. */
+		gpuCulling.enabled = !gpuCulling.enabled && gpuCulling.supported;
+		printf("INFO: %s culling%s.\n", gpuCulling.enabled ? "GPU" : "CPU", gpuCulling.supported ? "" : ", GPU culling is not supported");
+	} else if (key == 'x') {
+		/* Shows lights, object bounds and the current view's frustum with 'x'. */
+		debugDraw.enabled = !debugDraw.enabled;
+		debugDraw.frustumFrozen = false;
+		printf("INFO: Debug drawing %s.\n", debugDraw.enabled ? "on" : "off");
+	} else if (key == 'n') {
+		/* Switches picking between casting rays and reading visibility buffer IDs with 'n'. */
+		picking.fromIds = !picking.fromIds;
+		printf("INFO: Picking %s.\n", picking.fromIds ? "reads object IDs in visibility buffer shading" : "casts rays");
+	} else if (key == 'l') {
+		/* Cycles between automatic LOD selection and forcing each level with 'l'. */
+		forcedLOD = (forcedLOD + 2) % (MESH_LOD_COUNT + 1) - 1;
+	} else if (key == 'z') {
+		/* Toggles occlusion culling with 'z'. */
+		occlusionCulling = !occlusionCulling;
+		depthPyramid.valid = false;
+	} else if (key == 'r') {
+		/* Switches occlusion depth between the GPU and the CPU rasterizer with 'r'. */
+		occlusionSource = (occlusionSource == OCCLUSION_FROM_GPU) ? OCCLUSION_FROM_CPU : OCCLUSION_FROM_GPU;
+		depthPyramid.valid = false;
+	}
+}
+
+void UGenerateTexture (void) {
+	// Waits for the workers reading the textures from file.
+	UJobWait(textureJob);
+
+	GLuint textures[TEXTURE_FILES];
+	int count = 0;
+	for (int i = 0; i < TEXTURE_FILES; i++) {
+		UTextureImage& image = textureImages[i];
+		if (image.pixels == NULL) {
+			printf("WARNING: Could not load %s.\n", image.path);
+			continue;
+		}
+
+		// Creates and binds texture.
+		glGenTextures(1, &textures[count]);
+		glBindTexture(GL_TEXTURE_2D, textures[count]);
+
+		// Writes image data to texture.
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image.width, image.height, 0, GL_RGB, GL_UNSIGNED_BYTE, image.pixels);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		count++;
+	}
+	texture = count > 0 ? textures[0] : 0;
+
+	// The array texture fallback copies from the images, so they are freed after.
+	UTextureTableCreate(textures, count);
+	for (int i = 0; i < TEXTURE_FILES; i++) {
+		if (textureImages[i].pixels != NULL) {
+			SOIL_free_image_data(textureImages[i].pixels);
+			textureImages[i].pixels = NULL;
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/* Points program's texture table at the array texture's unit or the handle buffer. The program must be in use. */
+void UTextureTableSetup (GLuint program) {
+	textureTable.bindless = GLEW_ARB_bindless_texture && GLEW_ARB_shader_storage_buffer_object;
+	glUniform1i(glGetUniformLocation(program, "textureArray"), TEXTURE_TABLE_UNIT);
+	if (textureTable.bindless) {
+		GLuint block = glGetProgramResourceIndex(program, GL_SHADER_STORAGE_BLOCK, "TextureHandles");
+		if (block != GL_INVALID_INDEX) {
+			glShaderStorageBlockBinding(program, block, TEXTURE_TABLE_BINDING);
+		}
+	}
+}
+
+/* Fills the table with textures, created from the loaded textureImages in the same order. */
+void UTextureTableCreate (const GLuint* textures, int count) {
+	textureTable.bindless = GLEW_ARB_bindless_texture && GLEW_ARB_shader_storage_buffer_object;
+	textureTable.count = count;
+	if (count == 0) {
+		return;
+	}
+
+	if (textureTable.bindless) {
+		// Resident handles stay valid for as long as the textures live.
+		for (int i = 0; i < count; i++) {
+			textureTable.handles[i] = glGetTextureHandleARB(textures[i]);
+			glMakeTextureHandleResidentARB(textureTable.handles[i]);
+		}
+		glGenBuffers(1, &textureTable.handleBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, textureTable.handleBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, count * sizeof(GLuint64), textureTable.handles, GL_STATIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		printf("INFO: Texture table of %d bindless handles.\n", count);
+	} else {
+		// Layers share one size, so textures of another size are resampled to the first's.
+		int width = 0, height = 0;
+		std::vector<unsigned char> resampled;
+		glGenTextures(1, &textureTable.array);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textureTable.array);
+		for (int i = 0, layer = 0; i < TEXTURE_FILES; i++) {
+			const UTextureImage& image = textureImages[i];
+			if (image.pixels == NULL) {
+				continue;
+			}
+			const unsigned char* pixels = image.pixels;
+			if (layer == 0) {
+				width = image.width;
+				height = image.height;
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB, width, height, count, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+			} else if (image.width != width || image.height != height) {
+				resampled.resize((size_t) width * height * 3);
+				for (int y = 0; y < height; y++) {
+					for (int x = 0; x < width; x++) {
+						const unsigned char* source = image.pixels + ((size_t) (y * image.height / height) * image.width + x * image.width / width) * 3;
+						memcpy(&resampled[((size_t) y * width + x) * 3], source, 3);
+					}
+				}
+				pixels = &resampled[0];
+			}
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer++, width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		}
+		glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		printf("INFO: Texture table of %d array layers at %dx%d.\n", count, width, height);
+	}
+	UTextureTableBind();
+}
+
+/* Makes the table visible to the textured programs. */
+void UTextureTableBind (void) {
+	if (textureTable.bindless) {
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, TEXTURE_TABLE_BINDING, textureTable.handleBuffer);
+	} else {
+		glActiveTexture(GL_TEXTURE0 + TEXTURE_TABLE_UNIT);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textureTable.array);
+		glActiveTexture(GL_TEXTURE0);
+	}
+}
+
+double UNowMilliseconds (void) {
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+void UQueueMotion (int action, GLfloat deltaX, GLfloat deltaY) {
+	motionEventsReceived++;
+
+	// Starts a new entry unless the newest one is the same kind of motion on the same node.
+	if (inputQueueCount == 0 || inputQueue[inputQueueCount - 1].action != action || inputQueue[inputQueueCount - 1].node != picking.node) {
+		// A full queue is applied early so no motion is ever dropped.
+		if (inputQueueCount == INPUT_QUEUE_SIZE) {
+			UProcessInput();
+		}
+
+		// Rotation continues from the newest queued rotation of the node, or from the node itself.
+		GLfloat yaw = scene.yaws[picking.node], pitch = scene.pitches[picking.node];
+		for (int i = inputQueueCount - 1; i >= 0; i--) {
+			if (inputQueue[i].action == INPUT_ROTATE_OBJECT && inputQueue[i].node == picking.node) {
+				yaw = inputQueue[i].yaw;
+				pitch = inputQueue[i].pitch;
+				break;
+			}
+		}
+
+		UInputEvent* event = &inputQueue[inputQueueCount++];
+		event->action = action;
+		event->node = picking.node;
+		event->yaw = yaw;
+		event->pitch = pitch;
+		event->zoomSteps = 0;
+		event->eventCount = 0;
+		event->timestamp = UNowMilliseconds();
+	}
+
+	UInputEvent* event = &inputQueue[inputQueueCount - 1];
+	if (action == INPUT_ROTATE_OBJECT) {
+		/* CLAMPING to 180 degrees per event, as when each event was applied on its own. */
+		/* 3.14159 is approximately 180 degrees in radians.*/
+		event->yaw = std::min(std::max(event->yaw + deltaX, -3.14159f), 3.14159f);
+		event->pitch = std::min(std::max(event->pitch + deltaY, -3.14159f), 3.14159f);
+	}
+	// Matches the old per-event behavior where any non-upward motion zooms out.
+	event->zoomSteps += (deltaY > 0) ? 1 : -1;
+	event->eventCount++;
+}
+
+void UProcessInput (void) {
+	for (int i = 0; i < inputQueueCount; i++) {
+		UInputEvent* event = &inputQueue[i];
+
+		if (frameInputTimestamp < 0.0 || event->timestamp < frameInputTimestamp) {
+			frameInputTimestamp = event->timestamp;
+		}
+
+		if (event->action == INPUT_ROTATE_OBJECT) {
+			/* Changes orientation of objet based on mouse movement. */
+			USceneSetRotation(&scene, event->node, event->pitch, event->yaw);
+		} else {
+			/* Moves the camera by the net number of zoom steps. */
+			cameraPosition += (cameraSpeed * event->zoomSteps) * CameraForwardZ;
+		}
+	}
+
+	motionEntriesApplied += inputQueueCount;
+	inputQueueCount = 0;
+}
+
+void URecordInputLatency (void) {
+	if (frameInputTimestamp < 0.0) {
+		return;
+	}
+
+	// Swap return is the closest point to present that GLUT exposes.
+	double latency = UNowMilliseconds() - frameInputTimestamp;
+	int bucket = (int) latency;
+	if (bucket > LATENCY_BUCKETS) {
+		bucket = LATENCY_BUCKETS;
+	}
+
+	latencyHistogram[bucket]++;
+	latencySamples++;
+	latencyTotal += latency;
+	if (latency > latencyWorst) {
+		latencyWorst = latency;
+	}
+	frameInputTimestamp = -1.0;
+}
+
+void UPrintInputLatency (void) {
+	printf("INFO: Input latency over %lu frames (%lu motion events, %lu applied entries).\n",
+		latencySamples, motionEventsReceived, motionEntriesApplied);
+	if (latencySamples == 0) {
+		return;
+	}
+
+	printf("INFO: Average %.2f ms, worst %.2f ms.\n", latencyTotal / latencySamples, latencyWorst);
+	for (int i = 0; i <= LATENCY_BUCKETS; i++) {
+		if (latencyHistogram[i] == 0) {
+			continue;
+		}
+		if (i == LATENCY_BUCKETS) {
+			printf("  >=%2d ms: %lu\n", i, latencyHistogram[i]);
+		} else {
+			printf("  %2d-%2d ms: %lu\n", i, i + 1, latencyHistogram[i]);
+		}
+	}
+}
+
+void UDecodeTexture (void* data, int begin, int end) {
+	UTextureImage* textures = (UTextureImage*) data;
+	for (int i = begin; i < end; i++) {
+		textures[i].pixels = SOIL_load_image(textures[i].path, &textures[i].width, &textures[i].height, 0, SOIL_LOAD_RGB);
+	}
+}
+
+/* Pushes onto the bottom of the calling thread's deque. Only the owner calls this. */
+bool UJobPush (UJobQueue* queue, UJob* job) {
+	long bottom = queue->bottom.load(std::memory_order_relaxed);
+	long top = queue->top.load(std::memory_order_acquire);
+	if (bottom - top >= JOB_QUEUE_SIZE) {
+		return false;
+	}
+
+	queue->jobs[bottom & (JOB_QUEUE_SIZE - 1)].store(job, std::memory_order_relaxed);
+	queue->bottom.store(bottom + 1, std::memory_order_release);
+	return true;
+}
+
+/* Pops from the bottom of the calling thread's deque. Only the owner calls this. */
+UJob* UJobPop (UJobQueue* queue) {
+	long bottom = queue->bottom.load(std::memory_order_relaxed) - 1;
+	queue->bottom.store(bottom, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	long top = queue->top.load(std::memory_order_relaxed);
+
+	if (top > bottom) {
+		// Queue was already empty.
+		queue->bottom.store(bottom + 1, std::memory_order_relaxed);
+		return NULL;
+	}
+
+	UJob* job = queue->jobs[bottom & (JOB_QUEUE_SIZE - 1)].load(std::memory_order_relaxed);
+	if (top != bottom) {
+		return job;
+	}
+
+	// Last job left, so this races with thieves for it.
+	if (!queue->top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+		job = NULL;
+	}
+	queue->bottom.store(bottom + 1, std::memory_order_relaxed);
+	return job;
+}
+
+/* Takes from the top of another thread's deque. */
+UJob* UJobSteal (UJobQueue* queue) {
+	long top = queue->top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	long bottom = queue->bottom.load(std::memory_order_acquire);
+
+	if (top >= bottom) {
+		return NULL;
+	}
+
+	UJob* job = queue->jobs[top & (JOB_QUEUE_SIZE - 1)].load(std::memory_order_relaxed);
+	if (!queue->top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+		return NULL;
+	}
+	return job;
+}
+
+/* Finds work for the calling thread: its own deque first, then a random victim. */
+UJob* UJobFetch (void) {
+	UJob* job = UJobPop(jobQueues[jobWorkerIndex]);
+	if (job != NULL || jobWorkerCount < 2) {
+		return job;
+	}
+
+	thread_local unsigned int seed = 2463534242u + jobWorkerIndex;
+	for (int attempt = 0; attempt < jobWorkerCount; attempt++) {
+		// Xorshift keeps victim selection cheap and uncorrelated between threads.
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		int victim = seed % jobWorkerCount;
+		if (victim == jobWorkerIndex) {
+			continue;
+		}
+
+		job = UJobSteal(jobQueues[victim]);
+		if (job != NULL) {
+			return job;
+		}
+	}
+	return NULL;
+}
+
+void UJobFinish (UJob* job) {
+	if (job->unfinishedJobs.fetch_sub(1, std::memory_order_acq_rel) == 1 && job->parent != NULL) {
+		UJobFinish(job->parent);
+	}
+}
+
+void UJobExecute (UJob* job) {
+	if (job->function != NULL) {
+		job->function(job->data, job->begin, job->end);
+	}
+	UJobFinish(job);
+}
+
+void UJobWorkerLoop (int index) {
+	jobWorkerIndex = index;
+	int idleSpins = 0;
+
+	while (jobSystemRunning.load(std::memory_order_acquire)) {
+		UJob* job = UJobFetch();
+		if (job != NULL) {
+			UJobExecute(job);
+			idleSpins = 0;
+		} else if (++idleSpins < 64) {
+			std::this_thread::yield();
+		} else {
+			// Sleeps until new work is pushed, rechecking periodically in case a wake was missed.
+			std::unique_lock<std::mutex> lock(jobSleepMutex);
+			jobSleepingWorkers++;
+			jobWakeCondition.wait_for(lock, std::chrono::milliseconds(1));
+			jobSleepingWorkers--;
+			idleSpins = 0;
+		}
+	}
+}
+
+void UJobSystemStart (int workerCount) {
+	if (workerCount < 1) {
+		workerCount = 1;
+	} else if (workerCount > JOB_MAX_WORKERS) {
+		workerCount = JOB_MAX_WORKERS;
+	}
+
+	jobWorkerCount = workerCount;
+	for (int i = 0; i < workerCount; i++) {
+		if (jobQueues[i] == NULL) {
+			jobQueues[i] = new UJobQueue();
+			jobPools[i] = new UJob[JOB_POOL_SIZE];
+		}
+		jobQueues[i]->top = 0;
+		jobQueues[i]->bottom = 0;
+		jobPoolNext[i] = 0;
+	}
+
+	// Worker 0 is the calling thread.
+	jobWorkerIndex = 0;
+	jobSystemRunning = true;
+	for (int i = 1; i < workerCount; i++) {
+		jobThreads[i] = new std::thread(UJobWorkerLoop, i);
+	}
+}
+
+void UJobSystemStop (void) {
+	jobSystemRunning = false;
+	jobWakeCondition.notify_all();
+	for (int i = 1; i < jobWorkerCount; i++) {
+		jobThreads[i]->join();
+		delete jobThreads[i];
+		jobThreads[i] = NULL;
+	}
+	jobWorkerCount = 0;
+}
+
+UJob* UJobCreate (UJobFunction function, void* data, int begin, int end, UJob* parent) {
+	// Jobs come from a per-thread ring, so a job must finish before its slot comes around again.
+	UJob* job = &jobPools[jobWorkerIndex][jobPoolNext[jobWorkerIndex]++ & (JOB_POOL_SIZE - 1)];
+	job->function = function;
+	job->parent = parent;
+	job->data = data;
+	job->begin = begin;
+	job->end = end;
+	job->unfinishedJobs.store(1, std::memory_order_relaxed);
+
+	if (parent != NULL) {
+		parent->unfinishedJobs.fetch_add(1, std::memory_order_relaxed);
+	}
+	return job;
+}
+
+void UJobRun (UJob* job) {
+	if (!UJobPush(jobQueues[jobWorkerIndex], job)) {
+		// Queue is full, so the job runs right away.
+		UJobExecute(job);
+		return;
+	}
+
+	if (jobSleepingWorkers.load(std::memory_order_relaxed) > 0) {
+		jobWakeCondition.notify_one();
+	}
+}
+
+void UJobWait (UJob* job) {
+	// Helps with queued work instead of blocking until the job completes.
+	while (job->unfinishedJobs.load(std::memory_order_acquire) > 0) {
+		UJob* next = UJobFetch();
+		if (next != NULL) {
+			UJobExecute(next);
+		} else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void UJobParallelFor (int count, int grain, UJobFunction function, void* data) {
+	// Keeps the ranges well inside one thread's job ring. The grain only grows
+	// by whole multiples, so ranges stay aligned to whatever the caller chose.
+	if (grain < 1) {
+		grain = 1;
+	}
+	if (count / grain > JOB_POOL_SIZE / 2) {
+		grain *= count / (grain * (JOB_POOL_SIZE / 2)) + 1;
+	}
+
+	// A parent with no work of its own, finished once every range is done.
+	UJob* root = UJobCreate(NULL, NULL, 0, 0, NULL);
+	for (int begin = 0; begin < count; begin += grain) {
+		int end = (begin + grain < count) ? begin + grain : count;
+		UJobRun(UJobCreate(function, data, begin, end, root));
+	}
+	UJobRun(root);
+	UJobWait(root);
+}
+
+bool URunBenchmark (int argc, char** argv) {
+	if (argc < 2) {
+		return false;
+	}
+
+	if (strcmp(argv[1], "--bench-jobs") == 0) {
+		UBenchmarkJobs();
+	} else if (strcmp(argv[1], "--bench-scene") == 0) {
+		UBenchmarkScene();
+	} else if (strcmp(argv[1], "--bench-transforms") == 0) {
+		UBenchmarkTransforms();
+	} else if (strcmp(argv[1], "--bench-culling") == 0) {
+		UBenchmarkCulling();
+	} else if (strcmp(argv[1], "--bench-raster") == 0) {
+		UBenchmarkRasterizer();
+	} else if (strcmp(argv[1], "--bench-stream") == 0) {
+		UBenchmarkStream(argc, argv);
+	} else if (strcmp(argv[1], "--bench-sort") == 0) {
+		UBenchmarkSort();
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/* Transform inputs and outputs shared by the job benchmark ranges. */
+struct UTransformBatch {
+	glm::vec3* positions;
+	glm::vec3* scales;
+	GLfloat* pitches;
+	GLfloat* yaws;
+	glm::mat4* models;
+};
+
+void UBuildModelMatrices (void* data, int begin, int end) {
+	UTransformBatch* batch = (UTransformBatch*) data;
+	for (int i = begin; i < end; i++) {
+		batch->models[i] = UComposeTransform(batch->positions[i], batch->pitches[i], batch->yaws[i], batch->scales[i]);
+	}
+}
+
+void UBenchmarkJobs (void) {
+	const int count = 1 << 20, grain = 2048, repeats = 5;
+	int cores = std::thread::hardware_concurrency();
+	if (cores < 1) {
+		cores = 1;
+	}
+
+	UTransformBatch batch;
+	batch.positions = new glm::vec3[count];
+	batch.scales = new glm::vec3[count];
+	batch.pitches = new GLfloat[count];
+	batch.yaws = new GLfloat[count];
+	batch.models = new glm::mat4[count];
+	for (int i = 0; i < count; i++) {
+		batch.positions[i] = glm::vec3(i % 100, (i / 100) % 100, i / 10000);
+		batch.scales[i] = glm::vec3(1.0f + (i % 7) * 0.1f);
+		batch.pitches[i] = (i % 360) * 0.01f;
+		batch.yaws[i] = (i % 180) * 0.02f;
+	}
+
+	printf("INFO: Job scaling, %d model matrices, grain %d, %d cores.\n", count, grain, cores);
+	double baseline = 0.0;
+	for (int workers = 1; workers <= cores; workers++) {
+		UJobSystemStart(workers);
+
+		double best = 1e30;
+		for (int r = 0; r < repeats; r++) {
+			double start = UNowMilliseconds();
+			UJobParallelFor(count, grain, UBuildModelMatrices, &batch);
+			double elapsed = UNowMilliseconds() - start;
+			if (elapsed < best) {
+				best = elapsed;
+			}
+		}
+
+		UJobSystemStop();
+		if (workers == 1) {
+			baseline = best;
+		}
+		printf("  %2d workers: %8.2f ms  %5.2fx\n", workers, best, baseline / best);
+	}
+
+	delete[] batch.positions;
+	delete[] batch.scales;
+	delete[] batch.pitches;
+	delete[] batch.yaws;
+	delete[] batch.models;
+}
+
+glm::mat4 UComposeTransform (glm::vec3 position, GLfloat pitch, GLfloat yaw, glm::vec3 scale) {
+	glm::mat4 model(1.0);
+	// Centers object in viewport.
+	model = glm::translate(model, position);
+	model = glm::rotate(model, pitch, glm::vec3(1.0f, 0.0f, 0.0f));
+	model = glm::rotate(model, yaw, glm::vec3(0.0f, 1.0f, 0.0f));
+	model = glm::scale(model, scale);
+	return model;
+}
+
+void UCreateScene (void) {
+	tableNode = USceneAddNode(&scene, -1, glm::vec3(0, 0, 0), glm::vec3(2.0f));
+	lightNode = USceneAddNode(&scene, -1, glm::vec3(0.0, 0.5, -3), glm::vec3(0.3));
+	lightNode2 = USceneAddNode(&scene, -1, glm::vec3(-3, 0.5, 0), glm::vec3(0.3));
+
+	// Every part of the table follows the table node.
+	for (int i = 0; i < (int) meshParts.size(); i++) {
+		USceneObject object;
+		object.node = USceneAddNode(&scene, tableNode, glm::vec3(0.0f), glm::vec3(1.0f));
+		object.part = i;
+		object.texture = 0;
+		sceneObjects.push_back(object);
+	}
+	objectBoundsMin.resize(sceneObjects.size());
+	objectBoundsMax.resize(sceneObjects.size());
+	objectVisible.resize(sceneObjects.size());
+
+	USceneUpdate(&scene);
+	UUpdateObjectBounds();
+	UBVHBuild(&sceneBVH, &objectBoundsMin[0], &objectBoundsMax[0], (int) sceneObjects.size());
+}
+
+int USceneAddNode (USceneGraph* graph, int parent, glm::vec3 position, glm::vec3 scale) {
+	// Doubles every column once the current one is full, so building a large scene copies each row a few times at most.
+	if (graph->parents.size() == graph->parents.capacity()) {
+		size_t capacity = std::max(2 * graph->parents.capacity(), graph->parents.size() + SCENE_NODE_BLOCK);
+		graph->parents.reserve(capacity);
+		graph->positions.reserve(capacity);
+		graph->scales.reserve(capacity);
+		graph->pitches.reserve(capacity);
+		graph->yaws.reserve(capacity);
+		graph->flags.reserve(capacity);
+		graph->locals.reserve(capacity);
+		graph->worlds.reserve(capacity);
+		graph->localNormals.reserve(capacity);
+		graph->worldNormals.reserve(capacity);
+	}
+
+	graph->parents.push_back(parent);
+	graph->positions.push_back(position);
+	graph->scales.push_back(scale);
+	graph->pitches.push_back(0.0f);
+	graph->yaws.push_back(0.0f);
+	graph->flags.push_back(NODE_LOCAL_DIRTY);
+	graph->locals.push_back(glm::mat4(1.0));
+	graph->worlds.push_back(glm::mat4(1.0));
+	graph->localNormals.push_back(glm::mat3(1.0));
+	graph->worldNormals.push_back(glm::mat3(1.0));
+	return (int) graph->parents.size() - 1;
+}
+
+void USceneSetPosition (USceneGraph* graph, int node, glm::vec3 position) {
+	if (graph->positions[node] != position) {
+		graph->positions[node] = position;
+		graph->flags[node] |= NODE_LOCAL_DIRTY;
+	}
+}
+
+void USceneSetRotation (USceneGraph* graph, int node, GLfloat pitch, GLfloat yaw) {
+	if (graph->pitches[node] != pitch || graph->yaws[node] != yaw) {
+		graph->pitches[node] = pitch;
+		graph->yaws[node] = yaw;
+		graph->flags[node] |= NODE_LOCAL_DIRTY;
+	}
+}
+
+void USceneUpdateLocals (void* data, int begin, int end) {
+	USceneGraph* graph = (USceneGraph*) data;
+
+	// Finds runs of blocks holding at least one dirty node and composes each run in one batch.
+	// Clean nodes inside a run are recomputed to the same matrices they already have.
+	int runStart = -1;
+	for (int block = begin; block < end; block += TRANSFORM_BATCH) {
+		int blockEnd = (block + TRANSFORM_BATCH < end) ? block + TRANSFORM_BATCH : end;
+		bool dirty = false;
+		for (int i = block; i < blockEnd; i++) {
+			dirty |= (graph->flags[i] & NODE_LOCAL_DIRTY) != 0;
+		}
+
+		if (dirty && runStart < 0) {
+			runStart = block;
+		} else if (!dirty && runStart >= 0) {
+			UComposeTransforms(&graph->positions[runStart], &graph->pitches[runStart], &graph->yaws[runStart], &graph->scales[runStart],
+				block - runStart, &graph->locals[runStart], &graph->localNormals[runStart]);
+			runStart = -1;
+		}
+	}
+
+	if (runStart >= 0) {
+		UComposeTransforms(&graph->positions[runStart], &graph->pitches[runStart], &graph->yaws[runStart], &graph->scales[runStart],
+			end - runStart, &graph->locals[runStart], &graph->localNormals[runStart]);
+	}
+}
+
+void USceneUpdate (USceneGraph* graph) {
+	int count = (int) graph->parents.size();
+
+	// Local matrices are independent, so large scenes build them in parallel.
+	// The grain is a multiple of the batch width so ranges never split a block.
+	if (count >= 16384 && jobWorkerCount > 1) {
+		UJobParallelFor(count, 4096, USceneUpdateLocals, graph);
+	} else {
+		USceneUpdateLocals(graph, 0, count);
+	}
+
+	// Parents come first, so their flags are already current when a child is reached.
+	int updated = 0;
+	for (int i = 0; i < count; i++) {
+		int parent = graph->parents[i];
+		bool parentChanged = parent >= 0 && (graph->flags[parent] & NODE_WORLD_CHANGED);
+
+		if ((graph->flags[i] & NODE_LOCAL_DIRTY) || parentChanged) {
+			if (parent >= 0) {
+				// Inverse transposes compose the same way the matrices do.
+				graph->worlds[i] = graph->worlds[parent] * graph->locals[i];
+				graph->worldNormals[i] = graph->worldNormals[parent] * graph->localNormals[i];
+			} else {
+				graph->worlds[i] = graph->locals[i];
+				graph->worldNormals[i] = graph->localNormals[i];
+			}
+			graph->flags[i] = NODE_WORLD_CHANGED;
+			updated++;
+		} else {
+			graph->flags[i] = 0;
+		}
+	}
+	graph->updatedNodes = updated;
+}
+
+void UBenchmarkScene (void) {
+	const int count = 1000000, repeats = 5;
+	UJobSystemStart(std::thread::hardware_concurrency());
+
+	// Wide hierarchy where every node has up to eight children.
+	USceneGraph graph;
+	for (int i = 0; i < count; i++) {
+		int parent = (i == 0) ? -1 : (i - 1) / 8;
+		USceneAddNode(&graph, parent, glm::vec3(i % 10, 0.1f, 0.0f), glm::vec3(1.0f));
+	}
+	USceneUpdate(&graph);
+
+	printf("INFO: Scene graph update, %d nodes, %d workers.\n", count, jobWorkerCount);
+
+	// Percent of nodes whose local transform changes before each update.
+	const double dirtyPercents[] = { 100.0, 10.0, 1.0, 0.01, 0.0 };
+	unsigned int seed = 12345;
+	for (double percent : dirtyPercents) {
+		int dirtyCount = (int) (count * percent / 100.0);
+		double best = 1e30;
+		int updated = 0;
+
+		for (int r = 0; r < repeats; r++) {
+			for (int d = 0; d < dirtyCount; d++) {
+				seed = seed * 1664525u + 1013904223u;
+				int node = seed % count;
+				USceneSetRotation(&graph, node, graph.pitches[node] + 0.01f, graph.yaws[node]);
+			}
+
+			double start = UNowMilliseconds();
+			USceneUpdate(&graph);
+			double elapsed = UNowMilliseconds() - start;
+			if (elapsed < best) {
+				best = elapsed;
+			}
+			updated = graph.updatedNodes;
+		}
+		printf("  %7.2f%% dirty: %8.2f ms, %7d world matrices recomputed\n", percent, best, updated);
+	}
+
+	// Rebuilding every matrix each frame, as URenderGraphics used to.
+	double start = UNowMilliseconds();
+	for (int i = 0; i < count; i++) {
+		int parent = graph.parents[i];
+		glm::mat4 local = UComposeTransform(graph.positions[i], graph.pitches[i], graph.yaws[i], graph.scales[i]);
+		graph.worlds[i] = (parent >= 0) ? graph.worlds[parent] * local : local;
+	}
+	printf("  full rebuild:  %8.2f ms\n", UNowMilliseconds() - start);
+
+	UJobSystemStop();
+}
+
+/*
+ * Batch version of UComposeTransform. Expanding translate * rotateX *
+ * rotateY * scale by hand gives each column directly, so no 4x4 products
+ * are needed:
+ *   column 0 = ( cos(yaw), sin(yaw) sin(pitch), -sin(yaw) cos(pitch)) * scale.x
+ *   column 1 = ( 0, cos(pitch), sin(pitch)) * scale.y
+ *   column 2 = ( sin(yaw), -cos(yaw) sin(pitch), cos(yaw) cos(pitch)) * scale.z
+ *   column 3 = position
+ * The rotation is orthonormal, so the normal matrix is the same rotation
+ * with each column divided by its scale instead.
+ */
+void UComposeTransformScalar (const glm::vec3& position, GLfloat pitch, GLfloat yaw, const glm::vec3& scale, glm::mat4& model, glm::mat3& normal) {
+	GLfloat sp = sinf(pitch), cp = cosf(pitch), sy = sinf(yaw), cy = cosf(yaw);
+	glm::vec3 c0(cy, sy * sp, -sy * cp), c1(0.0f, cp, sp), c2(sy, -cy * sp, cy * cp);
+
+	model[0] = glm::vec4(c0 * scale.x, 0.0f);
+	model[1] = glm::vec4(c1 * scale.y, 0.0f);
+	model[2] = glm::vec4(c2 * scale.z, 0.0f);
+	model[3] = glm::vec4(position, 1.0f);
+	normal[0] = c0 / scale.x;
+	normal[1] = c1 / scale.y;
+	normal[2] = c2 / scale.z;
+}
+
+#if defined(__AVX2__)
+/* Sine and cosine of eight angles, accurate to a few float ulps. */
+void USinCos8 (__m256 x, __m256* sine, __m256* cosine) {
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	__m256 sign = _mm256_and_ps(x, signMask);
+	__m256 ax = _mm256_andnot_ps(signMask, x);
+
+	// Reduces to r in [-pi/4, pi/4] with x = k * pi/2 + r, using a three part pi/2.
+	__m256 kf = _mm256_round_ps(_mm256_mul_ps(ax, _mm256_set1_ps(0.63661977236f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m256i k = _mm256_cvtps_epi32(kf);
+	__m256 r = _mm256_sub_ps(ax, _mm256_mul_ps(kf, _mm256_set1_ps(1.5703125f)));
+	r = _mm256_sub_ps(r, _mm256_mul_ps(kf, _mm256_set1_ps(4.837512969970703125e-4f)));
+	r = _mm256_sub_ps(r, _mm256_mul_ps(kf, _mm256_set1_ps(7.54978995489188216e-8f)));
+	__m256 z = _mm256_mul_ps(r, r);
+
+	// Minimax polynomials for sine and cosine on the reduced range.
+	__m256 s = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(-1.9515295891e-4f), z), _mm256_set1_ps(8.3321608736e-3f));
+	s = _mm256_add_ps(_mm256_mul_ps(s, z), _mm256_set1_ps(-1.6666654611e-1f));
+	s = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(s, z), r), r);
+	__m256 c = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.443315711809948e-5f), z), _mm256_set1_ps(-1.388731625493765e-3f));
+	c = _mm256_add_ps(_mm256_mul_ps(c, z), _mm256_set1_ps(4.166664568298827e-2f));
+	c = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(c, z), z), _mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(_mm256_set1_ps(0.5f), z)));
+
+	// Odd quadrants swap sine and cosine; quadrant bits pick the signs.
+	__m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(k, _mm256_set1_epi32(1)), _mm256_set1_epi32(1)));
+	__m256 sinResult = _mm256_blendv_ps(s, c, swap);
+	__m256 cosResult = _mm256_blendv_ps(c, s, swap);
+	__m256 sinSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(k, _mm256_set1_epi32(2)), 30));
+	__m256 cosSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(k, _mm256_set1_epi32(1)), _mm256_set1_epi32(2)), 30));
+
+	*sine = _mm256_xor_ps(sinResult, _mm256_xor_ps(sinSign, sign));
+	*cosine = _mm256_xor_ps(cosResult, cosSign);
+}
+
+/* Transposes eight rows of eight floats in place. */
+void UTranspose8 (__m256* rows) {
+	__m256 t[8], u[8];
+	for (int i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_ps(rows[i], rows[i + 1]);
+		t[i + 1] = _mm256_unpackhi_ps(rows[i], rows[i + 1]);
+	}
+	for (int i = 0; i < 8; i += 4) {
+		u[i] = _mm256_shuffle_ps(t[i], t[i + 2], 0x44);
+		u[i + 1] = _mm256_shuffle_ps(t[i], t[i + 2], 0xEE);
+		u[i + 2] = _mm256_shuffle_ps(t[i + 1], t[i + 3], 0x44);
+		u[i + 3] = _mm256_shuffle_ps(t[i + 1], t[i + 3], 0xEE);
+	}
+	for (int i = 0; i < 4; i++) {
+		rows[i] = _mm256_permute2f128_ps(u[i], u[i + 4], 0x20);
+		rows[i + 4] = _mm256_permute2f128_ps(u[i], u[i + 4], 0x31);
+	}
+}
+#endif
+
+void UComposeTransforms (const glm::vec3* positions, const GLfloat* pitches, const GLfloat* yaws, const glm::vec3* scales,
+	int count, glm::mat4* models, glm::mat3* normals) {
+	int i = 0;
+
+#if defined(__AVX2__)
+	// Gathers x, y or z of eight tightly packed vec3s.
+	const __m256i vec3Stride = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+
+	for (; i + 8 <= count; i += 8) {
+		const float* p = &positions[i].x;
+		const float* s = &scales[i].x;
+		__m256 px = _mm256_i32gather_ps(p, vec3Stride, 4);
+		__m256 py = _mm256_i32gather_ps(p + 1, vec3Stride, 4);
+		__m256 pz = _mm256_i32gather_ps(p + 2, vec3Stride, 4);
+		__m256 sx = _mm256_i32gather_ps(s, vec3Stride, 4);
+		__m256 sy = _mm256_i32gather_ps(s + 1, vec3Stride, 4);
+		__m256 sz = _mm256_i32gather_ps(s + 2, vec3Stride, 4);
+
+		__m256 sinPitch, cosPitch, sinYaw, cosYaw;
+		USinCos8(_mm256_loadu_ps(pitches + i), &sinPitch, &cosPitch);
+		USinCos8(_mm256_loadu_ps(yaws + i), &sinYaw, &cosYaw);
+
+		// Rotation columns, shared by the model and normal matrices.
+		__m256 r00 = cosYaw, r01 = _mm256_mul_ps(sinYaw, sinPitch), r02 = _mm256_sub_ps(zero, _mm256_mul_ps(sinYaw, cosPitch));
+		__m256 r11 = cosPitch, r12 = sinPitch;
+		__m256 r20 = sinYaw, r21 = _mm256_sub_ps(zero, _mm256_mul_ps(cosYaw, sinPitch)), r22 = _mm256_mul_ps(cosYaw, cosPitch);
+
+		// One row per matrix element, columns 0-1 then 2-3, transposed to one row per object.
+		__m256 rows[8] = {
+			_mm256_mul_ps(r00, sx), _mm256_mul_ps(r01, sx), _mm256_mul_ps(r02, sx), zero,
+			zero, _mm256_mul_ps(r11, sy), _mm256_mul_ps(r12, sy), zero
+		};
+		UTranspose8(rows);
+		for (int lane = 0; lane < 8; lane++) {
+			_mm256_storeu_ps(&models[i + lane][0][0], rows[lane]);
+		}
+
+		rows[0] = _mm256_mul_ps(r20, sz);
+		rows[1] = _mm256_mul_ps(r21, sz);
+		rows[2] = _mm256_mul_ps(r22, sz);
+		rows[3] = zero;
+		rows[4] = px;
+		rows[5] = py;
+		rows[6] = pz;
+		rows[7] = one;
+		UTranspose8(rows);
+		for (int lane = 0; lane < 8; lane++) {
+			_mm256_storeu_ps(&models[i + lane][2][0], rows[lane]);
+		}
+
+		// Normal matrices are nine floats each, so they go out through a small staging block.
+		__m256 isx = _mm256_div_ps(one, sx), isy = _mm256_div_ps(one, sy), isz = _mm256_div_ps(one, sz);
+		alignas(32) float normal[9][8];
+		_mm256_store_ps(normal[0], _mm256_mul_ps(r00, isx));
+		_mm256_store_ps(normal[1], _mm256_mul_ps(r01, isx));
+		_mm256_store_ps(normal[2], _mm256_mul_ps(r02, isx));
+		_mm256_store_ps(normal[3], zero);
+		_mm256_store_ps(normal[4], _mm256_mul_ps(r11, isy));
+		_mm256_store_ps(normal[5], _mm256_mul_ps(r12, isy));
+		_mm256_store_ps(normal[6], _mm256_mul_ps(r20, isz));
+		_mm256_store_ps(normal[7], _mm256_mul_ps(r21, isz));
+		_mm256_store_ps(normal[8], _mm256_mul_ps(r22, isz));
+		for (int lane = 0; lane < 8; lane++) {
+			float* out = &normals[i + lane][0][0];
+			for (int element = 0; element < 9; element++) {
+				out[element] = normal[element][lane];
+			}
+		}
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 4 <= count; i += 4) {
+		// Deinterleaves four vec3s into x, y and z vectors.
+		float32x4x3_t p = vld3q_f32(&positions[i].x);
+		float32x4x3_t s = vld3q_f32(&scales[i].x);
+
+		// NEON has no sine, so the angles are evaluated per lane.
+		alignas(16) float sinPitch[4], cosPitch[4], sinYaw[4], cosYaw[4];
+		for (int lane = 0; lane < 4; lane++) {
+			sinPitch[lane] = sinf(pitches[i + lane]);
+			cosPitch[lane] = cosf(pitches[i + lane]);
+			sinYaw[lane] = sinf(yaws[i + lane]);
+			cosYaw[lane] = cosf(yaws[i + lane]);
+		}
+		float32x4_t sp = vld1q_f32(sinPitch), cp = vld1q_f32(cosPitch), sy = vld1q_f32(sinYaw), cy = vld1q_f32(cosYaw);
+
+		float32x4_t r[9] = {
+			cy, vmulq_f32(sy, sp), vnegq_f32(vmulq_f32(sy, cp)),
+			vdupq_n_f32(0.0f), cp, sp,
+			sy, vnegq_f32(vmulq_f32(cy, sp)), vmulq_f32(cy, cp)
+		};
+		float32x4_t inverse[3] = { vdivq_f32(vdupq_n_f32(1.0f), s.val[0]), vdivq_f32(vdupq_n_f32(1.0f), s.val[1]), vdivq_f32(vdupq_n_f32(1.0f), s.val[2]) };
+
+		alignas(16) float model[16][4], normal[9][4];
+		for (int column = 0; column < 3; column++) {
+			for (int row = 0; row < 3; row++) {
+				vst1q_f32(model[column * 4 + row], vmulq_f32(r[column * 3 + row], s.val[column]));
+				vst1q_f32(normal[column * 3 + row], vmulq_f32(r[column * 3 + row], inverse[column]));
+			}
+			vst1q_f32(model[column * 4 + 3], vdupq_n_f32(0.0f));
+		}
+		vst1q_f32(model[12], p.val[0]);
+		vst1q_f32(model[13], p.val[1]);
+		vst1q_f32(model[14], p.val[2]);
+		vst1q_f32(model[15], vdupq_n_f32(1.0f));
+
+		for (int lane = 0; lane < 4; lane++) {
+			float* outModel = &models[i + lane][0][0];
+			float* outNormal = &normals[i + lane][0][0];
+			for (int element = 0; element < 16; element++) {
+				outModel[element] = model[element][lane];
+			}
+			for (int element = 0; element < 9; element++) {
+				outNormal[element] = normal[element][lane];
+			}
+		}
+	}
+#endif
+
+	// Remaining transforms, or all of them without SIMD support.
+	for (; i < count; i++) {
+		UComposeTransformScalar(positions[i], pitches[i], yaws[i], scales[i], models[i], normals[i]);
+	}
+}
+
+void UBenchmarkTransforms (void) {
+	const int count = 1 << 16, repeats = 50;
+	std::vector<glm::vec3> positions(count), scales(count);
+	std::vector<GLfloat> pitches(count), yaws(count);
+	std::vector<glm::mat4> reference(count), models(count);
+	std::vector<glm::mat3> referenceNormals(count), normals(count);
+
+	for (int i = 0; i < count; i++) {
+		positions[i] = glm::vec3(i % 100, (i / 100) % 100, i / 10000);
+		scales[i] = glm::vec3(0.5f + (i % 7) * 0.25f, 1.0f + (i % 5) * 0.5f, 2.0f);
+		// Covers the full clamped mouse range of -pi to pi.
+		pitches[i] = -3.14159f + 6.28318f * (i % 997) / 996.0f;
+		yaws[i] = 3.14159f - 6.28318f * (i % 991) / 990.0f;
+	}
+
+	// GLM chain plus the inverse transpose the vertex shader used to compute.
+	double glmBest = 1e30;
+	for (int r = 0; r < repeats; r++) {
+		double start = UNowMilliseconds();
+		for (int i = 0; i < count; i++) {
+			reference[i] = UComposeTransform(positions[i], pitches[i], yaws[i], scales[i]);
+			referenceNormals[i] = glm::transpose(glm::inverse(glm::mat3(reference[i])));
+		}
+		glmBest = std::min(glmBest, UNowMilliseconds() - start);
+	}
+
+	double glmModelBest = 1e30;
+	for (int r = 0; r < repeats; r++) {
+		double start = UNowMilliseconds();
+		for (int i = 0; i < count; i++) {
+			reference[i] = UComposeTransform(positions[i], pitches[i], yaws[i], scales[i]);
+		}
+		glmModelBest = std::min(glmModelBest, UNowMilliseconds() - start);
+	}
+
+	double scalarBest = 1e30;
+	for (int r = 0; r < repeats; r++) {
+		double start = UNowMilliseconds();
+		for (int i = 0; i < count; i++) {
+			UComposeTransformScalar(positions[i], pitches[i], yaws[i], scales[i], models[i], normals[i]);
+		}
+		scalarBest = std::min(scalarBest, UNowMilliseconds() - start);
+	}
+
+	double batchBest = 1e30;
+	for (int r = 0; r < repeats; r++) {
+		double start = UNowMilliseconds();
+		UComposeTransforms(&positions[0], &pitches[0], &yaws[0], &scales[0], count, &models[0], &normals[0]);
+		batchBest = std::min(batchBest, UNowMilliseconds() - start);
+	}
+
+	// Largest difference from the GLM results, so a broken kernel shows up here.
+	float modelError = 0.0f, normalError = 0.0f;
+	for (int i = 0; i < count; i++) {
+		for (int c = 0; c < 4; c++) {
+			for (int r = 0; r < 4; r++) {
+				modelError = std::max(modelError, fabsf(models[i][c][r] - reference[i][c][r]));
+			}
+		}
+		for (int c = 0; c < 3; c++) {
+			for (int r = 0; r < 3; r++) {
+				normalError = std::max(normalError, fabsf(normals[i][c][r] - referenceNormals[i][c][r]));
+			}
+		}
+	}
+
+	printf("INFO: Transform composition, %d objects, batch width %d.\n", count, TRANSFORM_BATCH);
+	printf("  GLM chain + inverse transpose: %7.3f ms (%6.2f ns/object)\n", glmBest, glmBest * 1e6 / count);
+	printf("  GLM chain, model only:         %7.3f ms (%6.2f ns/object)\n", glmModelBest, glmModelBest * 1e6 / count);
+	printf("  closed form, scalar:           %7.3f ms (%6.2f ns/object)\n", scalarBest, scalarBest * 1e6 / count);
+	printf("  closed form, batch kernel:     %7.3f ms (%6.2f ns/object), %.2fx over GLM\n", batchBest, batchBest * 1e6 / count, glmBest / batchBest);
+	printf("  max error: model %g, normal %g\n", modelError, normalError);
+}
+
+void UAddMeshPart (const GLfloat* verts, int first, int count, int stride) {
+	UMeshPart part;
+	part.first = first;
+	part.count = count;
+
+	part.boundsMin = part.boundsMax = glm::vec3(verts[first * stride], verts[first * stride + 1], verts[first * stride + 2]);
+	for (int i = first; i < first + count; i++) {
+		glm::vec3 position(verts[i * stride], verts[i * stride + 1], verts[i * stride + 2]);
+		part.boundsMin = glm::min(part.boundsMin, position);
+		part.boundsMax = glm::max(part.boundsMax, position);
+	}
+
+	// Sphere around the box center, tightened to the farthest vertex.
+	part.sphereCenter = (part.boundsMin + part.boundsMax) * 0.5f;
+	part.sphereRadius = 0.0f;
+	for (int i = first; i < first + count; i++) {
+		glm::vec3 position(verts[i * stride], verts[i * stride + 1], verts[i * stride + 2]);
+		part.sphereRadius = std::max(part.sphereRadius, glm::length(position - part.sphereCenter));
+	}
+
+	// Only the original until UGenerateLODs adds simplified levels.
+	part.lods[0].first = first;
+	part.lods[0].count = count;
+	part.lodCount = 1;
+
+	meshParts.push_back(part);
+}
+
+/* Bounds of a model space box after a transform, from its center and half extents. */
+void UTransformBounds (const glm::mat4& transform, const glm::vec3& boundsMin, const glm::vec3& boundsMax, glm::vec3& outMin, glm::vec3& outMax) {
+	glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+	glm::vec3 extent = (boundsMax - boundsMin) * 0.5f;
+
+	glm::vec3 worldCenter(transform * glm::vec4(center, 1.0f));
+	glm::vec3 worldExtent;
+	for (int axis = 0; axis < 3; axis++) {
+		worldExtent[axis] = fabsf(transform[0][axis]) * extent.x + fabsf(transform[1][axis]) * extent.y + fabsf(transform[2][axis]) * extent.z;
+	}
+
+	outMin = worldCenter - worldExtent;
+	outMax = worldCenter + worldExtent;
+}
+
+void UUpdateObjectBounds (void) {
+	bool moved = false;
+	for (int i = 0; i < (int) sceneObjects.size(); i++) {
+		const USceneObject& object = sceneObjects[i];
+		if (scene.flags[object.node] & NODE_WORLD_CHANGED) {
+			const UMeshPart& part = meshParts[object.part];
+			UTransformBounds(scene.worlds[object.node], part.boundsMin, part.boundsMax, objectBoundsMin[i], objectBoundsMax[i]);
+			moved = true;
+		}
+	}
+
+	if (moved && !sceneBVH.nodes.empty()) {
+		UBVHRefit(&sceneBVH, &objectBoundsMin[0], &objectBoundsMax[0]);
+	}
+}
+
+void UBVHBuildNode (UBoundingVolumeHierarchy* bvh, const glm::vec3* boundsMin, const glm::vec3* boundsMax, int index, int first, int count) {
+	glm::vec3 nodeMin = boundsMin[bvh->items[first]], nodeMax = boundsMax[bvh->items[first]];
+	glm::vec3 centerMin = (nodeMin + nodeMax) * 0.5f, centerMax = centerMin;
+	for (int i = first; i < first + count; i++) {
+		int item = bvh->items[i];
+		glm::vec3 center = (boundsMin[item] + boundsMax[item]) * 0.5f;
+		nodeMin = glm::min(nodeMin, boundsMin[item]);
+		nodeMax = glm::max(nodeMax, boundsMax[item]);
+		centerMin = glm::min(centerMin, center);
+		centerMax = glm::max(centerMax, center);
+	}
+
+	UBVHNode node;
+	node.boundsMin = nodeMin;
+	node.boundsMax = nodeMax;
+	node.left = -1;
+	node.first = first;
+	node.count = count;
+
+	if (count > BVH_LEAF_SIZE) {
+		// Splits at the median center along the widest axis of the centers.
+		glm::vec3 spread = centerMax - centerMin;
+		int axis = (spread.x > spread.y && spread.x > spread.z) ? 0 : (spread.y > spread.z ? 1 : 2);
+		int* items = &bvh->items[first];
+		std::nth_element(items, items + count / 2, items + count, [&](int a, int b) {
+			return boundsMin[a][axis] + boundsMax[a][axis] < boundsMin[b][axis] + boundsMax[b][axis];
+		});
+
+		// Both children are allocated together so the right child is always left + 1.
+		node.left = (int) bvh->nodes.size();
+		bvh->nodes.resize(node.left + 2);
+		UBVHBuildNode(bvh, boundsMin, boundsMax, node.left, first, count / 2);
+		UBVHBuildNode(bvh, boundsMin, boundsMax, node.left + 1, first + count / 2, count - count / 2);
+	}
+
+	bvh->nodes[index] = node;
+}
+
+void UBVHBuild (UBoundingVolumeHierarchy* bvh, const glm::vec3* boundsMin, const glm::vec3* boundsMax, int count) {
+	bvh->nodes.clear();
+	bvh->items.resize(count);
+	for (int i = 0; i < count; i++) {
+		bvh->items[i] = i;
+	}
+
+	if (count > 0) {
+		bvh->nodes.reserve(2 * (count / BVH_LEAF_SIZE + 1));
+		bvh->nodes.resize(1);
+		UBVHBuildNode(bvh, boundsMin, boundsMax, 0, 0, count);
+	}
+}
+
+void UBVHRefit (UBoundingVolumeHierarchy* bvh, const glm::vec3* boundsMin, const glm::vec3* boundsMax) {
+	// Children always come after their parent, so walking backwards refits them first.
+	for (int i = (int) bvh->nodes.size() - 1; i >= 0; i--) {
+		UBVHNode& node = bvh->nodes[i];
+		if (node.left < 0) {
+			int item = bvh->items[node.first];
+			node.boundsMin = boundsMin[item];
+			node.boundsMax = boundsMax[item];
+			for (int j = node.first + 1; j < node.first + node.count; j++) {
+				item = bvh->items[j];
+				node.boundsMin = glm::min(node.boundsMin, boundsMin[item]);
+				node.boundsMax = glm::max(node.boundsMax, boundsMax[item]);
+			}
+		} else {
+			const UBVHNode& left = bvh->nodes[node.left];
+			const UBVHNode& right = bvh->nodes[node.left + 1];
+			node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+			node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+		}
+	}
+}
+
+void UExtractFrustum (const glm::mat4& viewProjection, UFrustum* frustum) {
+	// Planes come from sums and differences of the matrix rows (Gribb and Hartmann).
+	glm::vec4 rows[4];
+	for (int r = 0; r < 4; r++) {
+		rows[r] = glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+	}
+	glm::vec4 planes[6] = {
+		rows[3] + rows[0], rows[3] - rows[0],
+		rows[3] + rows[1], rows[3] - rows[1],
+		rows[3] + rows[2], rows[3] - rows[2]
+	};
+
+	for (int i = 0; i < 8; i++) {
+		if (i < 6) {
+			GLfloat length = glm::length(glm::vec3(planes[i]));
+			frustum->nx[i] = planes[i].x / length;
+			frustum->ny[i] = planes[i].y / length;
+			frustum->nz[i] = planes[i].z / length;
+			frustum->d[i] = planes[i].w / length;
+		} else {
+			frustum->nx[i] = frustum->ny[i] = frustum->nz[i] = 0.0f;
+			frustum->d[i] = 1.0f;
+		}
+	}
+}
+
+int UFrustumTestBoxScalar (const UFrustum* frustum, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+	glm::vec3 extent = (boundsMax - boundsMin) * 0.5f;
+	int result = FRUSTUM_INSIDE;
+
+	for (int i = 0; i < 6; i++) {
+		float distance = frustum->nx[i] * center.x + frustum->ny[i] * center.y + frustum->nz[i] * center.z + frustum->d[i];
+		float radius = fabsf(frustum->nx[i]) * extent.x + fabsf(frustum->ny[i]) * extent.y + fabsf(frustum->nz[i]) * extent.z;
+		if (distance + radius < 0.0f) {
+			return FRUSTUM_OUTSIDE;
+		}
+		if (distance - radius < 0.0f) {
+			result = FRUSTUM_INTERSECTS;
+		}
+	}
+	return result;
+}
+
+int UFrustumTestBox (const UFrustum* frustum, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+#if defined(__AVX2__)
+	// Tests the box against all planes at once, one plane per lane.
+	const __m256 half = _mm256_set1_ps(0.5f), signMask = _mm256_set1_ps(-0.0f);
+	__m256 cx = _mm256_mul_ps(_mm256_set1_ps(boundsMin.x + boundsMax.x), half);
+	__m256 cy = _mm256_mul_ps(_mm256_set1_ps(boundsMin.y + boundsMax.y), half);
+	__m256 cz = _mm256_mul_ps(_mm256_set1_ps(boundsMin.z + boundsMax.z), half);
+	__m256 ex = _mm256_mul_ps(_mm256_set1_ps(boundsMax.x - boundsMin.x), half);
+	__m256 ey = _mm256_mul_ps(_mm256_set1_ps(boundsMax.y - boundsMin.y), half);
+	__m256 ez = _mm256_mul_ps(_mm256_set1_ps(boundsMax.z - boundsMin.z), half);
+
+	__m256 nx = _mm256_load_ps(frustum->nx), ny = _mm256_load_ps(frustum->ny), nz = _mm256_load_ps(frustum->nz);
+	__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, cx), _mm256_mul_ps(ny, cy)),
+		_mm256_add_ps(_mm256_mul_ps(nz, cz), _mm256_load_ps(frustum->d)));
+	__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_andnot_ps(signMask, nx), ex), _mm256_mul_ps(_mm256_andnot_ps(signMask, ny), ey)),
+		_mm256_mul_ps(_mm256_andnot_ps(signMask, nz), ez));
+
+	if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_add_ps(distance, radius), _mm256_setzero_ps(), _CMP_LT_OQ)) != 0) {
+		return FRUSTUM_OUTSIDE;
+	}
+	if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_sub_ps(distance, radius), _mm256_setzero_ps(), _CMP_LT_OQ)) != 0) {
+		return FRUSTUM_INTERSECTS;
+	}
+	return FRUSTUM_INSIDE;
+#else
+	return UFrustumTestBoxScalar(frustum, boundsMin, boundsMax);
+#endif
+}
+
+/* Culls the subtree under one node, writing a visibility byte per item. Returns the number visible. */
+int UCullSubtree (const UBoundingVolumeHierarchy* bvh, const glm::vec3* boundsMin, const glm::vec3* boundsMax,
+	const UFrustum* frustum, unsigned char* visible, int root) {
+	int stack[64], stackSize = 0, visibleCount = 0;
+	stack[stackSize++] = root;
+
+	while (stackSize > 0) {
+		const UBVHNode& node = bvh->nodes[stack[--stackSize]];
+		int result = UFrustumTestBox(frustum, node.boundsMin, node.boundsMax);
+		if (result == FRUSTUM_OUTSIDE) {
+			continue;
+		}
+
+		if (result == FRUSTUM_INSIDE) {
+			// Everything below a node fully inside is visible without further tests.
+			for (int i = node.first; i < node.first + node.count; i++) {
+				visible[bvh->items[i]] = 1;
+			}
+			visibleCount += node.count;
+		} else if (node.left < 0) {
+			for (int i = node.first; i < node.first + node.count; i++) {
+				int item = bvh->items[i];
+				if (UFrustumTestBox(frustum, boundsMin[item], boundsMax[item]) != FRUSTUM_OUTSIDE) {
+					visible[item] = 1;
+					visibleCount++;
+				}
+			}
+		} else {
+			stack[stackSize++] = node.left;
+			stack[stackSize++] = node.left + 1;
+		}
+	}
+	return visibleCount;
+}
+
+/* Arguments shared by the culling jobs, one job per subtree root. */
+struct UCullBatch {
+	const UBoundingVolumeHierarchy* bvh;
+	const glm::vec3* boundsMin;
+	const glm::vec3* boundsMax;
+	const UFrustum* frustum;
+	unsigned char* visible;
+	int roots[256];
+	std::atomic<int> visibleCount;
+};
+
+void UCullRoots (void* data, int begin, int end) {
+	UCullBatch* batch = (UCullBatch*) data;
+	int visibleCount = 0;
+	for (int i = begin; i < end; i++) {
+		visibleCount += UCullSubtree(batch->bvh, batch->boundsMin, batch->boundsMax, batch->frustum, batch->visible, batch->roots[i]);
+	}
+	batch->visibleCount += visibleCount;
+}
+
+int UCullObjects (const UBoundingVolumeHierarchy* bvh, const glm::vec3* boundsMin, const glm::vec3* boundsMax,
+	const UFrustum* frustum, unsigned char* visible, int count) {
+	memset(visible, 0, count);
+	if (bvh->nodes.empty()) {
+		return 0;
+	}
+
+	// Small scenes are not worth splitting across workers.
+	if (count < 4096 || jobWorkerCount < 2) {
+		return UCullSubtree(bvh, boundsMin, boundsMax, frustum, visible, 0);
+	}
+
+	// Splits the top of the tree into subtrees, one job each.
+	static UCullBatch batch;
+	batch.bvh = bvh;
+	batch.boundsMin = boundsMin;
+	batch.boundsMax = boundsMax;
+	batch.frustum = frustum;
+	batch.visible = visible;
+	batch.visibleCount = 0;
+
+	int rootCount = 1, target = std::min(jobWorkerCount * 8, 128);
+	batch.roots[0] = 0;
+	while (rootCount < target) {
+		// Replaces each interior root with its two children.
+		int nextCount = 0, next[256];
+		for (int i = 0; i < rootCount; i++) {
+			const UBVHNode& node = bvh->nodes[batch.roots[i]];
+			if (node.left < 0) {
+				next[nextCount++] = batch.roots[i];
+			} else {
+				next[nextCount++] = node.left;
+				next[nextCount++] = node.left + 1;
+			}
+		}
+		if (nextCount == rootCount) {
+			break;
+		}
+		memcpy(batch.roots, next, sizeof(int) * nextCount);
+		rootCount = nextCount;
+	}
+
+	UJobParallelFor(rootCount, 1, UCullRoots, &batch);
+	return batch.visibleCount;
+}
+
+void UBenchmarkCulling (void) {
+	const int count = 200000, repeats = 20;
+	UJobSystemStart(std::thread::hardware_concurrency());
+
+	// Small boxes scattered through a large volume around the camera.
+	std::vector<glm::vec3> boundsMin(count), boundsMax(count);
+	unsigned int seed = 7;
+	for (int i = 0; i < count; i++) {
+		glm::vec3 position;
+		for (int axis = 0; axis < 3; axis++) {
+			seed = seed * 1664525u + 1013904223u;
+			position[axis] = (seed >> 8) / 16777216.0f * 400.0f - 200.0f;
+		}
+		boundsMin[i] = position - glm::vec3(0.5f);
+		boundsMax[i] = position + glm::vec3(0.5f);
+	}
+
+	UBoundingVolumeHierarchy bvh;
+	double start = UNowMilliseconds();
+	UBVHBuild(&bvh, &boundsMin[0], &boundsMax[0], count);
+	double buildTime = UNowMilliseconds() - start;
+
+	glm::mat4 view = glm::rotate(glm::mat4(1.0), 0.5f, glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 projection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
+	UFrustum frustum;
+	UExtractFrustum(projection * view, &frustum);
+
+	std::vector<unsigned char> visible(count);
+	double scalarBest = 1e30, simdBest = 1e30, bvhBest = 1e30;
+	int scalarVisible = 0, simdVisible = 0, bvhVisible = 0;
+	for (int r = 0; r < repeats; r++) {
+		start = UNowMilliseconds();
+		scalarVisible = 0;
+		for (int i = 0; i < count; i++) {
+			scalarVisible += UFrustumTestBoxScalar(&frustum, boundsMin[i], boundsMax[i]) != FRUSTUM_OUTSIDE;
+		}
+		scalarBest = std::min(scalarBest, UNowMilliseconds() - start);
+
+		start = UNowMilliseconds();
+		simdVisible = 0;
+		for (int i = 0; i < count; i++) {
+			simdVisible += UFrustumTestBox(&frustum, boundsMin[i], boundsMax[i]) != FRUSTUM_OUTSIDE;
+		}
+		simdBest = std::min(simdBest, UNowMilliseconds() - start);
+
+		start = UNowMilliseconds();
+		bvhVisible = UCullObjects(&bvh, &boundsMin[0], &boundsMax[0], &frustum, &visible[0], count);
+		bvhBest = std::min(bvhBest, UNowMilliseconds() - start);
+	}
+
+	printf("INFO: Frustum culling, %d boxes, %d workers, BVH built in %.2f ms.\n", count, jobWorkerCount, buildTime);
+	printf("  brute force, scalar: %7.3f ms, %d visible\n", scalarBest, scalarVisible);
+	printf("  brute force, SIMD:   %7.3f ms, %d visible\n", simdBest, simdVisible);
+	printf("  BVH:                 %7.3f ms, %d visible\n", bvhBest, bvhVisible);
+
+	UJobSystemStop();
+}
+
+void UReadDepthAsync (const glm::mat4& viewProjection) {
+	// Buffers are sized for the render target, so a resize starts over.
+	if (depthReadWidth != renderWidth || depthReadHeight != renderHeight) {
+		if (depthReadBuffers[0] == 0) {
+			glGenBuffers(2, depthReadBuffers);
+		}
+		for (int i = 0; i < 2; i++) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, depthReadBuffers[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, renderWidth * renderHeight * sizeof(GLfloat), NULL, GL_STREAM_READ);
+			if (depthReadFences[i] != 0) {
+				glDeleteSync(depthReadFences[i]);
+				depthReadFences[i] = 0;
+			}
+		}
+		depthReadWidth = renderWidth;
+		depthReadHeight = renderHeight;
+		depthPyramid.valid = false;
+	}
+
+	// Skips the read while the buffer still holds depth nobody has consumed.
+	int index = depthReadIndex;
+	if (depthReadFences[index] != 0) {
+		return;
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, depthReadBuffers[index]);
+	glReadPixels(0, 0, depthReadWidth, depthReadHeight, GL_DEPTH_COMPONENT, GL_FLOAT, (GLvoid*) 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	depthReadFences[index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	depthReadViewProjections[index] = viewProjection;
+	depthReadIndex = 1 - index;
+}
+
+void UUpdateDepthPyramid (void) {
+	// Builds from the newest read that has finished, without waiting on one that has not.
+	// An older finished read is released unused, since the newer one supersedes it.
+	bool built = false;
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int index = (depthReadIndex + 1 + attempt) % 2;
+		if (depthReadFences[index] == 0) {
+			continue;
+		}
+
+		GLenum status = glClientWaitSync(depthReadFences[index], 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+			continue;
+		}
+
+		if (!built) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, depthReadBuffers[index]);
+			const GLfloat* depth = (const GLfloat*) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+				depthReadWidth * depthReadHeight * sizeof(GLfloat), GL_MAP_READ_BIT);
+			if (depth != NULL) {
+				UBuildDepthPyramid(&depthPyramid, depth, depthReadWidth, depthReadHeight, depthReadViewProjections[index]);
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			built = true;
+		}
+
+		glDeleteSync(depthReadFences[index]);
+		depthReadFences[index] = 0;
+	}
+}
+
+void UBuildDepthPyramid (UDepthPyramid* pyramid, const GLfloat* depth, int width, int height, const glm::mat4& viewProjection) {
+	pyramid->widths[0] = width;
+	pyramid->heights[0] = height;
+	pyramid->levels[0].assign(depth, depth + width * height);
+
+	int level = 1;
+	while (level < PYRAMID_MAX_LEVELS && (width > 1 || height > 1)) {
+		int nextWidth = (width + 1) / 2, nextHeight = (height + 1) / 2;
+		const GLfloat* source = &pyramid->levels[level - 1][0];
+		pyramid->levels[level].resize(nextWidth * nextHeight);
+		GLfloat* target = &pyramid->levels[level][0];
+
+		for (int y = 0; y < nextHeight; y++) {
+			// Odd sizes fold the last row or column into the final texel.
+			int y0 = 2 * y, y1 = std::min(2 * y + 1, height - 1);
+			for (int x = 0; x < nextWidth; x++) {
+				int x0 = 2 * x, x1 = std::min(2 * x + 1, width - 1);
+				target[y * nextWidth + x] = std::max(std::max(source[y0 * width + x0], source[y0 * width + x1]),
+					std::max(source[y1 * width + x0], source[y1 * width + x1]));
+			}
+		}
+
+		width = nextWidth;
+		height = nextHeight;
+		pyramid->widths[level] = width;
+		pyramid->heights[level] = height;
+		level++;
+	}
+
+	pyramid->levelCount = level;
+	pyramid->viewProjection = viewProjection;
+	pyramid->valid = true;
+}
+
+bool UDepthPyramidOccludes (const UDepthPyramid* pyramid, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	// Projects the eight corners to find the screen rectangle and nearest depth.
+	GLfloat minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, nearest = 1.0f;
+	for (int corner = 0; corner < 8; corner++) {
+		glm::vec4 position((corner & 1) ? boundsMax.x : boundsMin.x, (corner & 2) ? boundsMax.y : boundsMin.y,
+			(corner & 4) ? boundsMax.z : boundsMin.z, 1.0f);
+		glm::vec4 clip = pyramid->viewProjection * position;
+
+		// Boxes reaching behind the camera are never treated as hidden.
+		if (clip.w <= 1e-5f) {
+			return false;
+		}
+
+		glm::vec3 ndc(clip.x / clip.w, clip.y / clip.w, clip.z / clip.w);
+		minX = std::min(minX, ndc.x);
+		maxX = std::max(maxX, ndc.x);
+		minY = std::min(minY, ndc.y);
+		maxY = std::max(maxY, ndc.y);
+		nearest = std::min(nearest, ndc.z * 0.5f + 0.5f);
+	}
+
+	// Window coordinates at level 0, clamped to the screen.
+	int width = pyramid->widths[0], height = pyramid->heights[0];
+	int x0 = std::max(0, (int) ((minX * 0.5f + 0.5f) * width));
+	int x1 = std::min(width - 1, (int) ((maxX * 0.5f + 0.5f) * width));
+	int y0 = std::max(0, (int) ((minY * 0.5f + 0.5f) * height));
+	int y1 = std::min(height - 1, (int) ((maxY * 0.5f + 0.5f) * height));
+	if (x0 > x1 || y0 > y1) {
+		// Entirely off screen, which frustum culling already handles.
+		return false;
+	}
+
+	// Picks the level where the rectangle spans at most four texels a side.
+	int level = 0;
+	while (level + 1 < pyramid->levelCount && ((x1 >> level) - (x0 >> level) > 3 || (y1 >> level) - (y0 >> level) > 3)) {
+		level++;
+	}
+
+	int levelWidth = pyramid->widths[level];
+	const GLfloat* depth = &pyramid->levels[level][0];
+	for (int y = y0 >> level; y <= (y1 >> level); y++) {
+		for (int x = x0 >> level; x <= (x1 >> level); x++) {
+			if (nearest <= depth[y * levelWidth + x]) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int UOcclusionCull (const UDepthPyramid* pyramid, const glm::vec3* boundsMin, const glm::vec3* boundsMax, unsigned char* visible, int count) {
+	if (!pyramid->valid) {
+		return 0;
+	}
+
+	int occluded = 0;
+	for (int i = 0; i < count; i++) {
+		if (visible[i] && UDepthPyramidOccludes(pyramid, boundsMin[i], boundsMax[i])) {
+			visible[i] = 0;
+			occluded++;
+		}
+	}
+	return occluded;
+}
+
+void UClearDepth (GLfloat* depth, int width, int height) {
+	for (int i = 0; i < width * height; i++) {
+		depth[i] = 1.0f;
+	}
+}
+
+/*
+ * Depth-only rasterizer for occluders. A pixel is written only when the
+ * triangle covers all of it, and with the farthest depth the triangle has
+ * inside it, so an occluder never hides more than it really covers. Both
+ * come from edge functions and a screen space depth plane evaluated at the
+ * pixel center and pushed half a pixel outward. The SIMD path does eight pixels of a row at a time and
+ * needs the width to be a multiple of eight. Both paths evaluate exactly the
+ * same expressions, so the scalar one can check the SIMD one.
+ * Triangles with a vertex behind the camera or nearer than the near plane
+ * are skipped rather than clipped. The GPU clips that geometry away, so
+ * drawing it here would occlude things that are on screen; skipping it only
+ * ever makes culling less aggressive.
+ */
+void URasterizeTriangles (GLfloat* depth, int width, int height, const glm::vec3* positions, int vertexCount, const glm::mat4& transform, bool simd) {
+#if !defined(__AVX2__)
+	// Only AVX2 builds have a SIMD path.
+	(void) simd;
+#endif
+	for (int t = 0; t + 2 < vertexCount; t += 3) {
+		GLfloat sx[3], sy[3], sz[3];
+		bool clipped = false;
+		for (int v = 0; v < 3; v++) {
+			glm::vec4 clip = transform * glm::vec4(positions[t + v], 1.0f);
+			// Orthographic projections keep w at 1, so only the near plane test catches what is behind them.
+			if (clip.w <= 1e-5f || clip.z < -clip.w) {
+				clipped = true;
+				break;
+			}
+			sx[v] = (clip.x / clip.w * 0.5f + 0.5f) * width;
+			sy[v] = (clip.y / clip.w * 0.5f + 0.5f) * height;
+			sz[v] = clip.z / clip.w * 0.5f + 0.5f;
+		}
+		if (clipped) {
+			continue;
+		}
+
+		// Orders the vertices counter-clockwise so inside is where all edges are positive.
+		GLfloat area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sx[2] - sx[0]) * (sy[1] - sy[0]);
+		if (fabsf(area) < 1e-8f) {
+			continue;
+		}
+		if (area < 0.0f) {
+			std::swap(sx[1], sx[2]);
+			std::swap(sy[1], sy[2]);
+			std::swap(sz[1], sz[2]);
+			area = -area;
+		}
+
+		int minX = std::max(0, (int) floorf(std::min(sx[0], std::min(sx[1], sx[2]))));
+		int maxX = std::min(width - 1, (int) ceilf(std::max(sx[0], std::max(sx[1], sx[2]))));
+		int minY = std::max(0, (int) floorf(std::min(sy[0], std::min(sy[1], sy[2]))));
+		int maxY = std::min(height - 1, (int) ceilf(std::max(sy[0], std::max(sy[1], sy[2]))));
+		if (minX > maxX || minY > maxY) {
+			continue;
+		}
+
+		// Edge i runs from vertex i to vertex i + 1 and is A x + B y + C.
+		GLfloat edgeA[3], edgeB[3], edgeC[3];
+		for (int e = 0; e < 3; e++) {
+			int a = e, b = (e + 1) % 3;
+			edgeA[e] = sy[a] - sy[b];
+			edgeB[e] = sx[b] - sx[a];
+			edgeC[e] = -edgeA[e] * sx[a] - edgeB[e] * sy[a];
+		}
+
+		// Depth plane from barycentrics: edge 1 weighs vertex 0, edge 2 vertex 1, edge 0 vertex 2.
+		GLfloat inverseArea = 1.0f / area;
+		GLfloat depthA = (edgeA[1] * sz[0] + edgeA[2] * sz[1] + edgeA[0] * sz[2]) * inverseArea;
+		GLfloat depthB = (edgeB[1] * sz[0] + edgeB[2] * sz[1] + edgeB[0] * sz[2]) * inverseArea;
+		GLfloat depthC = (edgeC[1] * sz[0] + edgeC[2] * sz[1] + edgeC[0] * sz[2]) * inverseArea;
+
+		// Moves each edge inward, and the depth away, by the most they change from the center to a corner.
+		for (int e = 0; e < 3; e++) {
+			edgeC[e] -= 0.5f * (fabsf(edgeA[e]) + fabsf(edgeB[e]));
+		}
+		depthC += 0.5f * (fabsf(depthA) + fabsf(depthB));
+
+#if defined(__AVX2__)
+		if (simd) {
+			const __m256 laneOffsets = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+			const __m256 zero = _mm256_setzero_ps();
+			__m256 a0 = _mm256_set1_ps(edgeA[0]), a1 = _mm256_set1_ps(edgeA[1]), a2 = _mm256_set1_ps(edgeA[2]), da = _mm256_set1_ps(depthA);
+			int startX = minX & ~7;
+
+			for (int y = minY; y <= maxY; y++) {
+				GLfloat py = y + 0.5f;
+				__m256 r0 = _mm256_set1_ps(edgeB[0] * py + edgeC[0]);
+				__m256 r1 = _mm256_set1_ps(edgeB[1] * py + edgeC[1]);
+				__m256 r2 = _mm256_set1_ps(edgeB[2] * py + edgeC[2]);
+				__m256 rz = _mm256_set1_ps(depthB * py + depthC);
+				GLfloat* row = depth + y * width;
+
+				for (int x = startX; x <= maxX; x += 8) {
+					__m256 px = _mm256_add_ps(_mm256_set1_ps((GLfloat) x), laneOffsets);
+					__m256 e0 = _mm256_add_ps(_mm256_mul_ps(a0, px), r0);
+					__m256 e1 = _mm256_add_ps(_mm256_mul_ps(a1, px), r1);
+					__m256 e2 = _mm256_add_ps(_mm256_mul_ps(a2, px), r2);
+					__m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ), _mm256_cmp_ps(e1, zero, _CMP_GE_OQ)),
+						_mm256_cmp_ps(e2, zero, _CMP_GE_OQ));
+					if (_mm256_movemask_ps(inside) == 0) {
+						continue;
+					}
+
+					__m256 z = _mm256_add_ps(_mm256_mul_ps(da, px), rz);
+					__m256 current = _mm256_load_ps(row + x);
+					__m256 closer = _mm256_and_ps(inside, _mm256_cmp_ps(z, current, _CMP_LT_OQ));
+					_mm256_store_ps(row + x, _mm256_blendv_ps(current, z, closer));
+				}
+			}
+			continue;
+		}
+#endif
+
+		for (int y = minY; y <= maxY; y++) {
+			GLfloat py = y + 0.5f;
+			GLfloat r0 = edgeB[0] * py + edgeC[0], r1 = edgeB[1] * py + edgeC[1], r2 = edgeB[2] * py + edgeC[2];
+			GLfloat rz = depthB * py + depthC;
+			GLfloat* row = depth + y * width;
+
+			for (int x = minX; x <= maxX; x++) {
+				GLfloat px = (GLfloat) x + 0.5f;
+				if (edgeA[0] * px + r0 >= 0.0f && edgeA[1] * px + r1 >= 0.0f && edgeA[2] * px + r2 >= 0.0f) {
+					GLfloat z = depthA * px + rz;
+					if (z < row[x]) {
+						row[x] = z;
+					}
+				}
+			}
+		}
+	}
+}
+
+void URasterizeOccluders (const glm::mat4& viewProjection) {
+	UClearDepth(occlusionDepth, OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+
+	// Every object that survived frustum culling doubles as an occluder.
+	for (int i = 0; i < (int) sceneObjects.size(); i++) {
+		if (!objectVisible[i]) {
+			continue;
+		}
+		const UMeshPart& part = meshParts[sceneObjects[i].part];
+		URasterizeTriangles(occlusionDepth, OCCLUSION_WIDTH, OCCLUSION_HEIGHT, &meshPositions[part.first], part.count,
+			viewProjection * scene.worlds[sceneObjects[i].node], true);
+	}
+
+	UBuildDepthPyramid(&depthPyramid, occlusionDepth, OCCLUSION_WIDTH, OCCLUSION_HEIGHT, viewProjection);
+}
+
+void UBenchmarkRasterizer (void) {
+	const int cubes = 20000, repeats = 10;
+
+	// Unit cube as 12 triangles.
+	const GLfloat corners[8][3] = {
+		{ -0.5f, -0.5f, -0.5f }, { 0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, -0.5f }, { -0.5f, 0.5f, -0.5f },
+		{ -0.5f, -0.5f, 0.5f }, { 0.5f, -0.5f, 0.5f }, { 0.5f, 0.5f, 0.5f }, { -0.5f, 0.5f, 0.5f }
+	};
+	const int faces[12][3] = {
+		{ 0, 1, 2 }, { 2, 3, 0 }, { 4, 6, 5 }, { 6, 4, 7 }, { 0, 4, 5 }, { 5, 1, 0 },
+		{ 3, 2, 6 }, { 6, 7, 3 }, { 0, 3, 7 }, { 7, 4, 0 }, { 1, 5, 6 }, { 6, 2, 1 }
+	};
+
+	// Cubes scattered in front of the camera, already placed in world space.
+	std::vector<glm::vec3> positions;
+	positions.reserve(cubes * 36);
+	unsigned int seed = 99;
+	for (int c = 0; c < cubes; c++) {
+		glm::vec3 offset;
+		for (int axis = 0; axis < 3; axis++) {
+			seed = seed * 1664525u + 1013904223u;
+			offset[axis] = (seed >> 8) / 16777216.0f;
+		}
+		offset = glm::vec3(offset.x * 40.0f - 20.0f, offset.y * 20.0f - 10.0f, -5.0f - offset.z * 60.0f);
+		for (int t = 0; t < 12; t++) {
+			for (int v = 0; v < 3; v++) {
+				const GLfloat* corner = corners[faces[t][v]];
+				positions.push_back(offset + glm::vec3(corner[0], corner[1], corner[2]));
+			}
+		}
+	}
+
+	glm::mat4 viewProjection = glm::perspective(glm::radians(45.0f), 2.0f, 0.1f, 100.0f);
+	std::vector<GLfloat> reference(OCCLUSION_WIDTH * OCCLUSION_HEIGHT);
+	int triangles = (int) positions.size() / 3;
+
+	double scalarBest = 1e30, simdBest = 1e30;
+	for (int r = 0; r < repeats; r++) {
+		UClearDepth(&reference[0], OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+		double start = UNowMilliseconds();
+		URasterizeTriangles(&reference[0], OCCLUSION_WIDTH, OCCLUSION_HEIGHT, &positions[0], (int) positions.size(), viewProjection, false);
+		scalarBest = std::min(scalarBest, UNowMilliseconds() - start);
+
+		UClearDepth(occlusionDepth, OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+		start = UNowMilliseconds();
+		URasterizeTriangles(occlusionDepth, OCCLUSION_WIDTH, OCCLUSION_HEIGHT, &positions[0], (int) positions.size(), viewProjection, true);
+		simdBest = std::min(simdBest, UNowMilliseconds() - start);
+	}
+
+	// The scalar path is the oracle for the SIMD one.
+	GLfloat maxError = 0.0f;
+	int covered = 0;
+	for (int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; i++) {
+		maxError = std::max(maxError, fabsf(reference[i] - occlusionDepth[i]));
+		covered += reference[i] < 1.0f;
+	}
+
+	printf("INFO: Occlusion rasterizer, %d triangles at %dx%d, %d%% coverage.\n", triangles, OCCLUSION_WIDTH, OCCLUSION_HEIGHT,
+		covered * 100 / (OCCLUSION_WIDTH * OCCLUSION_HEIGHT));
+	printf("  scalar: %8.3f ms, %8.0f tris/ms\n", scalarBest, triangles / scalarBest);
+#if defined(__AVX2__)
+	printf("  AVX2:   %8.3f ms, %8.0f tris/ms\n", simdBest, triangles / simdBest);
+#else
+	printf("  AVX2 not enabled in this build, second pass was scalar: %8.3f ms\n", simdBest);
+#endif
+	printf("  max depth difference from scalar: %g\n", maxError);
+}
+
+/* Symmetric 4x4 error quadric, stored as its upper triangle. */
+struct UQuadric {
+	double q[10];
+};
+
+void UQuadricAddPlane (UQuadric& quadric, double a, double b, double c, double d, double weight) {
+	double plane[4] = { a, b, c, d };
+	int k = 0;
+	for (int i = 0; i < 4; i++) {
+		for (int j = i; j < 4; j++) {
+			quadric.q[k++] += weight * plane[i] * plane[j];
+		}
+	}
+}
+
+void UQuadricAdd (UQuadric& target, const UQuadric& source) {
+	for (int i = 0; i < 10; i++) {
+		target.q[i] += source.q[i];
+	}
+}
+
+double UQuadricError (const UQuadric& quadric, const glm::vec3& v) {
+	const double* q = quadric.q;
+	double x = v.x, y = v.y, z = v.z;
+	return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+		+ q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+		+ q[7] * z * z + 2 * q[8] * z + q[9];
+}
+
+/* Position minimizing the error, false when the quadric is too close to singular. */
+bool UQuadricOptimum (const UQuadric& quadric, glm::vec3& result) {
+	const double* q = quadric.q;
+	double a = q[0], b = q[1], c = q[2], d = q[4], e = q[5], f = q[7];
+	double det = a * (d * f - e * e) - b * (b * f - c * e) + c * (b * e - c * d);
+	if (fabs(det) < 1e-12) {
+		return false;
+	}
+
+	// Cramer's rule on the gradient equations.
+	double rx = -q[3], ry = -q[6], rz = -q[8];
+	result.x = (float) ((rx * (d * f - e * e) - b * (ry * f - e * rz) + c * (ry * e - d * rz)) / det);
+	result.y = (float) ((a * (ry * f - e * rz) - rx * (b * f - c * e) + c * (b * rz - ry * c)) / det);
+	result.z = (float) ((a * (d * rz - ry * e) - b * (b * rz - ry * c) + rx * (b * e - c * d)) / det);
+	return true;
+}
+
+/* A candidate edge collapse. Versions detect candidates made stale by later collapses. */
+struct UCollapse {
+	double cost;
+	int a, b;
+	unsigned int versionA, versionB;
+	glm::vec3 target;
+
+	bool operator> (const UCollapse& other) const {
+		return cost > other.cost;
+	}
+};
+
+/*
+ * Quadric error edge collapse (Garland and Heckbert). Positions are welded
+ * first so faces that share a corner share a vertex. Each collapse merges
+ * one vertex into another at the position of least summed plane error,
+ * unless that would flip a neighboring face. Every triangle corner keeps its
+ * original normal and texture coordinates, so texture seams survive.
+ */
+void UGenerateLODs (const GLfloat* verts, int stride, UMeshPart* part, std::vector<GLfloat>& vertexData) {
+	int cornerCount = part->count, triangleCount = cornerCount / 3;
+
+	// Welds identical positions into shared vertices.
+	std::map<std::tuple<float, float, float>, int> welded;
+	std::vector<glm::vec3> positions;
+	std::vector<int> corners(cornerCount);
+	for (int c = 0; c < cornerCount; c++) {
+		const GLfloat* v = verts + (part->first + c) * stride;
+		std::tuple<float, float, float> key(v[0], v[1], v[2]);
+		std::map<std::tuple<float, float, float>, int>::iterator found = welded.find(key);
+		if (found == welded.end()) {
+			found = welded.insert(std::make_pair(key, (int) positions.size())).first;
+			positions.push_back(glm::vec3(v[0], v[1], v[2]));
+		}
+		corners[c] = found->second;
+	}
+
+	int vertexCount = (int) positions.size();
+	std::vector<UQuadric> quadrics(vertexCount);
+	std::vector<std::vector<int> > vertexTriangles(vertexCount);
+	std::vector<unsigned int> versions(vertexCount, 0);
+	std::vector<bool> vertexRemoved(vertexCount, false), triangleRemoved(triangleCount, false);
+	memset(&quadrics[0], 0, sizeof(UQuadric) * vertexCount);
+
+	// Face planes weighted by area, plus a steep plane along open edges to hold the outline.
+	std::map<std::pair<int, int>, int> edgeUses;
+	for (int t = 0; t < triangleCount; t++) {
+		glm::vec3 p0 = positions[corners[3 * t]], p1 = positions[corners[3 * t + 1]], p2 = positions[corners[3 * t + 2]];
+		glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+		GLfloat area = glm::length(normal);
+		for (int i = 0; i < 3; i++) {
+			vertexTriangles[corners[3 * t + i]].push_back(t);
+			int a = corners[3 * t + i], b = corners[3 * t + (i + 1) % 3];
+			edgeUses[std::make_pair(std::min(a, b), std::max(a, b))]++;
+		}
+		if (area <= 0.0f) {
+			continue;
+		}
+		normal /= area;
+		for (int i = 0; i < 3; i++) {
+			UQuadricAddPlane(quadrics[corners[3 * t + i]], normal.x, normal.y, normal.z, -glm::dot(normal, p0), area * 0.5);
+		}
+	}
+	for (int t = 0; t < triangleCount; t++) {
+		glm::vec3 p0 = positions[corners[3 * t]], p1 = positions[corners[3 * t + 1]], p2 = positions[corners[3 * t + 2]];
+		glm::vec3 faceNormal = glm::cross(p1 - p0, p2 - p0);
+		for (int i = 0; i < 3; i++) {
+			int a = corners[3 * t + i], b = corners[3 * t + (i + 1) % 3];
+			if (edgeUses[std::make_pair(std::min(a, b), std::max(a, b))] != 1 || glm::length(faceNormal) <= 0.0f) {
+				continue;
+			}
+			glm::vec3 edge = positions[b] - positions[a];
+			glm::vec3 normal = glm::cross(edge, faceNormal);
+			if (glm::length(normal) <= 0.0f) {
+				continue;
+			}
+			normal = glm::normalize(normal);
+			double weight = 1000.0 * glm::dot(edge, edge);
+			UQuadricAddPlane(quadrics[a], normal.x, normal.y, normal.z, -glm::dot(normal, positions[a]), weight);
+			UQuadricAddPlane(quadrics[b], normal.x, normal.y, normal.z, -glm::dot(normal, positions[a]), weight);
+		}
+	}
+
+	std::priority_queue<UCollapse, std::vector<UCollapse>, std::greater<UCollapse> > heap;
+	auto pushCollapse = [&](int a, int b) {
+		UQuadric quadric = quadrics[a];
+		UQuadricAdd(quadric, quadrics[b]);
+
+		// Tries the optimum, then falls back to the best of the ends and the middle.
+		UCollapse collapse;
+		glm::vec3 candidates[4] = { positions[a], positions[b], (positions[a] + positions[b]) * 0.5f, glm::vec3(0.0f) };
+		int candidateCount = UQuadricOptimum(quadric, candidates[3]) ? 4 : 3;
+		collapse.cost = 1e300;
+		for (int i = 0; i < candidateCount; i++) {
+			double error = UQuadricError(quadric, candidates[i]);
+			if (error < collapse.cost) {
+				collapse.cost = error;
+				collapse.target = candidates[i];
+			}
+		}
+		collapse.a = a;
+		collapse.b = b;
+		collapse.versionA = versions[a];
+		collapse.versionB = versions[b];
+		heap.push(collapse);
+	};
+	for (std::map<std::pair<int, int>, int>::iterator edge = edgeUses.begin(); edge != edgeUses.end(); ++edge) {
+		pushCollapse(edge->first.first, edge->first.second);
+	}
+
+	// A collapse is rejected when a surviving neighbor face would turn over.
+	auto flips = [&](const UCollapse& collapse) {
+		for (int side = 0; side < 2; side++) {
+			int moved = side ? collapse.b : collapse.a;
+			for (int t : vertexTriangles[moved]) {
+				if (triangleRemoved[t]) {
+					continue;
+				}
+				glm::vec3 before[3], after[3];
+				bool shared = false;
+				for (int i = 0; i < 3; i++) {
+					int v = corners[3 * t + i];
+					shared |= (v == (side ? collapse.a : collapse.b));
+					before[i] = positions[v];
+					after[i] = (v == collapse.a || v == collapse.b) ? collapse.target : positions[v];
+				}
+				if (shared) {
+					continue;
+				}
+				glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+				glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+				if (glm::dot(normalBefore, normalAfter) <= 0.0f) {
+					return true;
+				}
+			}
+		}
+		return false;
+	};
+
+	int liveTriangles = triangleCount;
+	for (int lod = 1; lod < MESH_LOD_COUNT; lod++) {
+		int target = std::max(1, triangleCount >> lod);
+
+		while (liveTriangles > target && !heap.empty()) {
+			UCollapse collapse = heap.top();
+			heap.pop();
+			int a = collapse.a, b = collapse.b;
+			if (vertexRemoved[a] || vertexRemoved[b] || collapse.versionA != versions[a] || collapse.versionB != versions[b] || flips(collapse)) {
+				continue;
+			}
+
+			// Faces using both ends vanish; faces using b now use a.
+			for (int t : vertexTriangles[b]) {
+				if (triangleRemoved[t]) {
+					continue;
+				}
+				bool hasA = false;
+				for (int i = 0; i < 3; i++) {
+					hasA |= corners[3 * t + i] == a;
+				}
+				if (hasA) {
+					triangleRemoved[t] = true;
+					liveTriangles--;
+				} else {
+					for (int i = 0; i < 3; i++) {
+						if (corners[3 * t + i] == b) {
+							corners[3 * t + i] = a;
+						}
+					}
+					vertexTriangles[a].push_back(t);
+				}
+			}
+
+			positions[a] = collapse.target;
+			UQuadricAdd(quadrics[a], quadrics[b]);
+			vertexRemoved[b] = true;
+			versions[a]++;
+
+			// Re-scores every edge still touching the merged vertex.
+			std::vector<int> neighbors;
+			for (int t : vertexTriangles[a]) {
+				if (triangleRemoved[t]) {
+					continue;
+				}
+				for (int i = 0; i < 3; i++) {
+					int v = corners[3 * t + i];
+					if (v != a && std::find(neighbors.begin(), neighbors.end(), v) == neighbors.end()) {
+						neighbors.push_back(v);
+					}
+				}
+			}
+			for (int v : neighbors) {
+				versions[v]++;
+			}
+			for (int v : neighbors) {
+				pushCollapse(a, v);
+			}
+		}
+
+		// Stops once a level could not be simplified any further.
+		if (liveTriangles == part->lods[lod - 1].count / 3) {
+			break;
+		}
+
+		UMeshLOD& level = part->lods[lod];
+		level.first = (GLint) (vertexData.size() / stride);
+		level.count = 0;
+		for (int t = 0; t < triangleCount; t++) {
+			if (triangleRemoved[t]) {
+				continue;
+			}
+			for (int i = 0; i < 3; i++) {
+				// Original normal and texture coordinates at the moved position.
+				const GLfloat* source = verts + (part->first + 3 * t + i) * stride;
+				glm::vec3 position = positions[corners[3 * t + i]];
+				vertexData.push_back(position.x);
+				vertexData.push_back(position.y);
+				vertexData.push_back(position.z);
+				vertexData.insert(vertexData.end(), source + 3, source + stride);
+			}
+			level.count += 3;
+		}
+		part->lodCount = lod + 1;
+	}
+
+	// Levels that could not be generated reuse the coarsest one that was.
+	for (int lod = part->lodCount; lod < MESH_LOD_COUNT; lod++) {
+		part->lods[lod] = part->lods[part->lodCount - 1];
+	}
+}
+
+int USelectLOD (const UMeshPart& part, const glm::mat4& world, const glm::mat4& view, const glm::mat4& projection) {
+	if (forcedLOD >= 0) {
+		return forcedLOD;
+	}
+
+	// World radius uses the largest axis scale so the sphere stays conservative.
+	GLfloat scale = std::max(glm::length(glm::vec3(world[0])), std::max(glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))));
+	glm::vec3 center(view * world * glm::vec4(part.sphereCenter, 1.0f));
+
+	// projection[1][1] maps view space height to clip space; perspective also divides by distance.
+	GLfloat radius = part.sphereRadius * scale * projection[1][1] * renderHeight * 0.5f;
+	if (projection[2][3] != 0.0f) {
+		radius /= std::max(glm::length(center), 0.1f);
+	}
+	radius *= exp2f(-lodBias);
+
+	int lod = 0;
+	while (lod + 1 < MESH_LOD_COUNT && radius < lodScreenRadius[lod + 1]) {
+		lod++;
+	}
+	return lod;
+}
+
+void UStreamCreate (UStreamBuffer* stream, GLsizeiptr regionSize) {
+	memset(stream, 0, sizeof(UStreamBuffer));
+	stream->regionSize = regionSize;
+	stream->region = STREAM_REGIONS - 1;
+
+	glGenBuffers(1, &stream->buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+	if (GLEW_ARB_buffer_storage) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, regionSize * STREAM_REGIONS, NULL, flags);
+		stream->mapped = (unsigned char*) glMapBufferRange(GL_ARRAY_BUFFER, 0, regionSize * STREAM_REGIONS, flags);
+		stream->persistent = stream->mapped != NULL;
+	}
+	if (!stream->persistent) {
+		glBufferData(GL_ARRAY_BUFFER, regionSize * STREAM_REGIONS, NULL, GL_STREAM_DRAW);
+		stream->mapped = NULL;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	printf("INFO: Stream buffer, %d regions of %.1f MB, %s.\n", STREAM_REGIONS, regionSize / 1048576.0,
+		stream->persistent ? "persistently mapped" : "mapped per frame");
+}
+
+void UStreamDestroy (UStreamBuffer* stream) {
+	if (stream->buffer == 0) {
+		return;
+	}
+	for (int i = 0; i < STREAM_REGIONS; i++) {
+		if (stream->fences[i] != 0) {
+			glDeleteSync(stream->fences[i]);
+		}
+	}
+	if (stream->persistent || stream->mapped != NULL) {
+		glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	glDeleteBuffers(1, &stream->buffer);
+	memset(stream, 0, sizeof(UStreamBuffer));
+}
+
+void UStreamBeginFrame (UStreamBuffer* stream) {
+	if (stream->buffer == 0) {
+		return;
+	}
+	stream->region = (stream->region + 1) % STREAM_REGIONS;
+	stream->offset = 0;
+
+	// Waits for the GPU to finish the frame that last used this region.
+	GLsync fence = stream->fences[stream->region];
+	if (fence != 0) {
+		if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+			stream->stalls++;
+			glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		}
+		glDeleteSync(fence);
+		stream->fences[stream->region] = 0;
+	}
+
+	if (!stream->persistent) {
+		glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+		unsigned char* region = (unsigned char*) glMapBufferRange(GL_ARRAY_BUFFER, stream->region * stream->regionSize, stream->regionSize,
+			GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		// Offsets count from the start of the buffer, so the pointer is moved back by the region's offset.
+		// A failed map stays NULL, which makes every allocation this frame fail.
+		stream->mapped = region != NULL ? region - stream->region * stream->regionSize : NULL;
+	}
+}
+
+/*
+ * Returns where to write size bytes this frame and their offset in the
+ * buffer, or NULL when the frame's region is full.
+ */
+void* UStreamAllocate (UStreamBuffer* stream, GLsizeiptr size, GLsizeiptr alignment, GLintptr* bufferOffset) {
+	GLsizeiptr offset = (stream->offset + alignment - 1) / alignment * alignment;
+	if (stream->buffer == 0 || stream->mapped == NULL || offset + size > stream->regionSize) {
+		stream->overflows++;
+		return NULL;
+	}
+	stream->offset = offset + size;
+	stream->bytesWritten += size;
+
+	*bufferOffset = stream->region * stream->regionSize + offset;
+	return stream->mapped + *bufferOffset;
+}
+
+/*
+ * Ends this frame's writes. Without persistent mapping the region is
+ * unmapped here, which has to happen before anything draws from it.
+ */
+void UStreamUnmap (UStreamBuffer* stream) {
+	if (stream->buffer == 0 || stream->persistent || stream->mapped == NULL) {
+		return;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	stream->mapped = NULL;
+}
+
+void UStreamEndFrame (UStreamBuffer* stream) {
+	if (stream->buffer == 0) {
+		return;
+	}
+	UStreamUnmap(stream);
+	stream->fences[stream->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/*
+ * Streams a fixed amount per frame and has the GPU consume it by copying it
+ * into a static buffer, then compares against glBufferSubData into one
+ * buffer. Needs a GL context, so it opens a window.
+ */
+void UBenchmarkStream (int argc, char** argv) {
+	const int frames = 200;
+	const int sizes[] = { 1, 4, 16, 64 };
+
+	glutInit(&argc, argv);
+	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGBA);
+	glutInitWindowSize(64, 64);
+	glutCreateWindow(WINDOW_TITLE);
+	if (glewInit() != GLEW_OK) {
+		fprintf(stderr, "ERROR: Could not initialize GLEW.\n");
+		return;
+	}
+
+	printf("INFO: Streaming %d frames through %s.\n", frames, glGetString(GL_RENDERER));
+	for (int s = 0; s < (int) (sizeof(sizes) / sizeof(sizes[0])); s++) {
+		GLsizeiptr frameSize = (GLsizeiptr) sizes[s] << 20;
+		std::vector<unsigned char> source(frameSize);
+		for (GLsizeiptr i = 0; i < frameSize; i++) {
+			source[i] = (unsigned char) i;
+		}
+
+		GLuint target, upload;
+		glGenBuffers(1, &target);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, target);
+		glBufferData(GL_COPY_WRITE_BUFFER, frameSize, NULL, GL_STATIC_DRAW);
+		glGenBuffers(1, &upload);
+		glBindBuffer(GL_COPY_READ_BUFFER, upload);
+		glBufferData(GL_COPY_READ_BUFFER, frameSize, NULL, GL_STREAM_DRAW);
+
+		UStreamBuffer stream;
+		UStreamCreate(&stream, frameSize);
+
+		// Ring: write the region, copy it on the GPU, fence after the copy so reuse waits for its read.
+		glFinish();
+		double start = UNowMilliseconds();
+		for (int frame = 0; frame < frames; frame++) {
+			UStreamBeginFrame(&stream);
+			GLintptr offset = 0;
+			void* data = UStreamAllocate(&stream, frameSize, 256, &offset);
+			if (data != NULL) {
+				memcpy(data, &source[0], frameSize);
+				UStreamUnmap(&stream);
+				glBindBuffer(GL_COPY_READ_BUFFER, stream.buffer);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offset, 0, frameSize);
+			}
+			UStreamEndFrame(&stream);
+			glFlush();
+		}
+		glFinish();
+		double ringTime = UNowMilliseconds() - start;
+		if (stream.overflows > 0) {
+			printf("WARNING: %d of %d frames could not map the stream buffer.\n", stream.overflows, frames);
+		}
+
+		// Reference: the driver copies and synchronizes every upload.
+		glBindBuffer(GL_COPY_READ_BUFFER, upload);
+		start = UNowMilliseconds();
+		for (int frame = 0; frame < frames; frame++) {
+			glBufferSubData(GL_COPY_READ_BUFFER, 0, frameSize, &source[0]);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, frameSize);
+			glFlush();
+		}
+		glFinish();
+		double subDataTime = UNowMilliseconds() - start;
+
+		printf("  %3d MB/frame: ring %7.3f ms/frame (%6.2f GB/s, %d stalls), glBufferSubData %7.3f ms/frame (%6.2f GB/s)\n",
+			sizes[s], ringTime / frames, frameSize * frames / ringTime / 1e6, stream.stalls,
+			subDataTime / frames, frameSize * frames / subDataTime / 1e6);
+
+		UStreamDestroy(&stream);
+		glDeleteBuffers(1, &upload);
+		glDeleteBuffers(1, &target);
+	}
+}
+
+void UArenaCreate (UArena* arena, size_t capacity) {
+	arena->base = (unsigned char*) malloc(capacity);
+	arena->capacity = arena->base != NULL ? capacity : 0;
+	heapAllocations += arena->base != NULL;
+	arena->offset = 0;
+	arena->spillCount = 0;
+	arena->spilled = 0;
+	arena->peak = 0;
+	arena->overflows = 0;
+}
+
+void* UArenaAllocate (UArena* arena, size_t size, size_t alignment) {
+	size_t offset = (arena->offset + alignment - 1) & ~(alignment - 1);
+	if (offset + size > arena->capacity) {
+		// Spills to the heap until the reset makes room; malloc already aligns for any type.
+		void* memory = arena->spillCount < ARENA_MAX_SPILLS && alignment <= alignof(std::max_align_t) ? malloc(size) : NULL;
+		if (memory == NULL) {
+			// Warns once; the caller decides how to do without.
+			if (arena->overflows++ == 0) {
+				printf("WARNING: Frame arena of %zu bytes is full.\n", arena->capacity);
+			}
+			return NULL;
+		}
+		// Counted by hand, as malloc bypasses the counting operator new.
+		heapAllocations++;
+		arena->spills[arena->spillCount++] = memory;
+		arena->spilled += size + alignment;
+		arena->peak = std::max(arena->peak, arena->offset + arena->spilled);
+		return memory;
+	}
+	arena->offset = offset + size;
+	arena->peak = std::max(arena->peak, arena->offset + arena->spilled);
+	return arena->base + offset;
+}
+
+void UArenaReset (UArena* arena) {
+	for (int i = 0; i < arena->spillCount; i++) {
+		free(arena->spills[i]);
+		heapFrees++;
+	}
+
+	// Grows to the next power of two that would have held the whole frame.
+	if (arena->spillCount > 0) {
+		size_t capacity = std::max(arena->capacity, (size_t) 1);
+		while (capacity < arena->offset + arena->spilled) {
+			capacity *= 2;
+		}
+		unsigned char* base = (unsigned char*) malloc(capacity);
+		if (base != NULL) {
+			heapAllocations++;
+			heapFrees++;
+			free(arena->base);
+			arena->base = base;
+			arena->capacity = capacity;
+			printf("INFO: Frame arena grown to %zu bytes.\n", capacity);
+		}
+	}
+	arena->spillCount = 0;
+	arena->spilled = 0;
+	arena->offset = 0;
+}
+
+void UPoolCreate (UPool* pool, size_t blockSize, int blocksPerSlab) {
+	// Every block must be able to hold the free list link.
+	pool->blockSize = std::max(blockSize, sizeof(void*));
+	pool->blockSize = (pool->blockSize + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+	pool->blocksPerSlab = blocksPerSlab;
+	pool->freeList = NULL;
+	pool->slabs.clear();
+	pool->used = 0;
+	pool->peak = 0;
+}
+
+void* UPoolAllocate (UPool* pool) {
+	if (pool->freeList == NULL) {
+		// Adds a slab and threads all of its blocks onto the free list.
+		unsigned char* slab = (unsigned char*) malloc(pool->blockSize * pool->blocksPerSlab);
+		if (slab == NULL) {
+			return NULL;
+		}
+		pool->slabs.push_back(slab);
+		for (int i = pool->blocksPerSlab - 1; i >= 0; i--) {
+			void* block = slab + i * pool->blockSize;
+			*(void**) block = pool->freeList;
+			pool->freeList = block;
+		}
+	}
+
+	void* block = pool->freeList;
+	pool->freeList = *(void**) block;
+	pool->used++;
+	pool->peak = std::max(pool->peak, pool->used);
+	return block;
+}
+
+void UPoolFree (UPool* pool, void* block) {
+	if (block == NULL) {
+		return;
+	}
+	*(void**) block = pool->freeList;
+	pool->freeList = block;
+	pool->used--;
+}
+
+void UPoolDestroy (UPool* pool) {
+	for (int i = 0; i < (int) pool->slabs.size(); i++) {
+		free(pool->slabs[i]);
+	}
+	pool->slabs.clear();
+	pool->freeList = NULL;
+	pool->used = 0;
+}
+
+void UProfileInit (void) {
+	profileGpuTimers = GLEW_ARB_timer_query;
+	if (profileGpuTimers) {
+		glGenQueries(PROFILE_MAX_ZONES, profileQueries[0]);
+		glGenQueries(PROFILE_MAX_ZONES, profileQueries[1]);
+	}
+}
+
+/* Copies finished GPU times from a query set into the frame that issued them. */
+void UProfileCollect (int set) {
+	long frame = profileQueryFrames[set];
+	if (frame < 0) {
+		return;
+	}
+	profileQueryFrames[set] = -1;
+
+	// A frame that has left the history is not worth reading.
+	UProfileFrame& record = profileFrames[frame % PROFILE_HISTORY];
+	if (record.frame != frame) {
+		return;
+	}
+	for (int i = 0; i < profileQueryCounts[set]; i++) {
+		GLint available = 0;
+		glGetQueryObjectiv(profileQueries[set][i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			continue;
+		}
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(profileQueries[set][i], GL_QUERY_RESULT, &elapsed);
+		record.zones[profileQueryZones[set][i]].gpuDuration = elapsed / 1e6;
+	}
+}
+
+void UProfileBeginFrame (void) {
+	// This frame reuses the query set from two frames ago, so collects it first.
+	int set = profileFrameCount % 2;
+	if (profileGpuTimers) {
+		UProfileCollect(set);
+	}
+	profileQueryCounts[set] = 0;
+	profileQueryFrames[set] = profileFrameCount;
+
+	UProfileFrame& record = profileFrames[profileFrameCount % PROFILE_HISTORY];
+	record.frame = profileFrameCount;
+	record.start = UNowMilliseconds();
+	record.duration = 0.0;
+	record.zoneCount = 0;
+	profileDepth = 0;
+}
+
+void UProfileEndFrame (void) {
+	UProfileFrame& record = profileFrames[profileFrameCount % PROFILE_HISTORY];
+	record.duration = UNowMilliseconds() - record.start;
+	profileFrameCount++;
+}
+
+void UProfileBegin (const char* name, bool gpu) {
+	UProfileFrame& record = profileFrames[profileFrameCount % PROFILE_HISTORY];
+
+	// Zones past the limits are dropped, but still balance their UProfileEnd.
+	int zone = -1;
+	if (record.zoneCount < PROFILE_MAX_ZONES && profileDepth < PROFILE_MAX_DEPTH) {
+		zone = record.zoneCount++;
+		UProfileZone& entry = record.zones[zone];
+		entry.name = name;
+		entry.depth = profileDepth;
+		entry.gpuDuration = -1.0;
+		entry.timing = false;
+
+		int set = profileFrameCount % 2;
+		if (gpu && profileGpuTimers && !profileQueryOpen) {
+			int query = profileQueryCounts[set]++;
+			profileQueryZones[set][query] = zone;
+			glBeginQuery(GL_TIME_ELAPSED, profileQueries[set][query]);
+			profileQueryOpen = true;
+			entry.timing = true;
+		}
+		entry.start = UNowMilliseconds();
+	}
+	if (profileDepth < PROFILE_MAX_DEPTH) {
+		profileStack[profileDepth] = zone;
+	}
+	profileDepth++;
+}
+
+void UProfileEnd (void) {
+	if (profileDepth == 0) {
+		return;
+	}
+	profileDepth--;
+	if (profileDepth >= PROFILE_MAX_DEPTH || profileStack[profileDepth] < 0) {
+		return;
+	}
+
+	UProfileZone& entry = profileFrames[profileFrameCount % PROFILE_HISTORY].zones[profileStack[profileDepth]];
+	entry.duration = UNowMilliseconds() - entry.start;
+	if (entry.timing) {
+		glEndQuery(GL_TIME_ELAPSED);
+		profileQueryOpen = false;
+		entry.timing = false;
+	}
+}
+
+/* GPU milliseconds of a finished frame, or a negative value when none came back. */
+double UProfileGpuTime (long frame) {
+	if (frame < 0 || frame <= profileFrameCount - PROFILE_HISTORY) {
+		return -1.0;
+	}
+	const UProfileFrame& record = profileFrames[frame % PROFILE_HISTORY];
+	double total = -1.0;
+	for (int i = 0; i < record.zoneCount; i++) {
+		if (record.zones[i].gpuDuration >= 0.0) {
+			total = std::max(total, 0.0) + record.zones[i].gpuDuration;
+		}
+	}
+	return total;
+}
+
+/* Prints the newest frame whose GPU times have come back, which is two frames old. */
+void UProfilePrintFrame (void) {
+	if (profileFrameCount < 2) {
+		return;
+	}
+	const UProfileFrame& record = profileFrames[(profileFrameCount - 2) % PROFILE_HISTORY];
+	printf("INFO: Frame %ld took %.3f ms on the CPU.\n", record.frame, record.duration);
+	for (int i = 0; i < record.zoneCount; i++) {
+		const UProfileZone& zone = record.zones[i];
+		if (zone.gpuDuration >= 0.0) {
+			printf("  %*s%-*s CPU %7.3f ms  GPU %7.3f ms\n", zone.depth * 2, "", 16 - zone.depth * 2, zone.name, zone.duration, zone.gpuDuration);
+		} else {
+			printf("  %*s%-*s CPU %7.3f ms\n", zone.depth * 2, "", 16 - zone.depth * 2, zone.name, zone.duration);
+		}
+	}
+}
+
+/*
+ * Writes the history in the Chrome trace_event format, viewable in
+ * chrome://tracing or Perfetto. CPU zones are on thread 1 and GPU times on
+ * thread 2. GPU zones start where the CPU submitted them, since elapsed
+ * time queries do not say when the GPU began.
+ */
+bool UProfileExport (const char* path) {
+	FILE* file = fopen(path, "w");
+	if (file == NULL) {
+		printf("ERROR: Could not write %s.\n", path);
+		return false;
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}");
+
+	// Oldest frame first; the frame in progress is incomplete and left out.
+	long first = std::max(0L, profileFrameCount - PROFILE_HISTORY);
+	for (long frame = first; frame < profileFrameCount; frame++) {
+		const UProfileFrame& record = profileFrames[frame % PROFILE_HISTORY];
+		fprintf(file, ",\n{\"name\":\"Frame %ld\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+			frame, record.start * 1000.0, record.duration * 1000.0);
+		for (int i = 0; i < record.zoneCount; i++) {
+			const UProfileZone& zone = record.zones[i];
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+				zone.name, zone.start * 1000.0, zone.duration * 1000.0);
+			if (zone.gpuDuration >= 0.0) {
+				fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":%.3f,\"dur\":%.3f}",
+					zone.name, zone.start * 1000.0, zone.gpuDuration * 1000.0);
+			}
+		}
+	}
+
+	fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(file);
+	return true;
+}
+
+unsigned long long URenderKey (int pass, GLuint program, GLuint texture, GLuint vertexArray, GLfloat depth) {
+	const unsigned long long depthMax = (1ull << RENDER_DEPTH_BITS) - 1;
+	GLfloat scaled = std::min(std::max(depth / RENDER_DEPTH_RANGE, 0.0f), 1.0f);
+	unsigned long long quantized = (unsigned long long) (scaled * depthMax);
+
+	// GL names are small in practice; only their low bits go in the key.
+	unsigned long long state = ((unsigned long long) (program & 0xFF) << 20) | ((unsigned long long) (texture & 0xFFF) << 8) | (vertexArray & 0xFF);
+	unsigned long long key = (unsigned long long) (pass & 0xF) << 60;
+	if (pass >= RENDER_PASS_TRANSPARENT) {
+		key |= (depthMax - quantized) << 36 | state << 8;
+	} else {
+		key |= state << 32 | quantized << 8;
+	}
+	return key;
+}
+
+/* Commands live in the frame arena, so the queue is gone when the frame ends. */
+void URenderQueueBegin (URenderQueue* queue, UArena* arena, int capacity) {
+	queue->commands = UArenaArray<URenderCommand>(arena, capacity);
+	queue->capacity = queue->commands != NULL ? capacity : 0;
+	queue->count = 0;
+}
+
+void URenderQueueSubmit (URenderQueue* queue, unsigned long long key, int object, int lod, GLuint program, GLuint texture, GLuint vertexArray) {
+	if (queue->count >= queue->capacity) {
+		return;
+	}
+	URenderCommand& command = queue->commands[queue->count++];
+	command.key = key;
+	command.object = object;
+	command.lod = lod;
+	command.program = program;
+	command.texture = texture;
+	command.vertexArray = vertexArray;
+}
+
+/*
+ * Least significant digit radix sort on the key, one byte per pass. All
+ * eight histograms are counted in one read, and passes where every key has
+ * the same byte are skipped, which with few distinct states is most of
+ * them. The passes move only keys and indices, through items, which holds
+ * twice count; whole commands are moved once at the end. Returns whichever
+ * buffer ends up sorted.
+ */
+struct URadixItem {
+	unsigned long long key;
+	int index;
+};
+
+URenderCommand* URadixSort (URenderCommand* commands, URenderCommand* scratch, URadixItem* items, int count) {
+	URadixItem* source = items;
+	URadixItem* target = items + count;
+
+	int counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < count; i++) {
+		unsigned long long key = commands[i].key;
+		source[i].key = key;
+		source[i].index = i;
+		for (int digit = 0; digit < 8; digit++) {
+			counts[digit][(key >> (digit * 8)) & 0xFF]++;
+		}
+	}
+
+	bool moved = false;
+	for (int digit = 0; digit < 8; digit++) {
+		int shift = digit * 8;
+		if (counts[digit][(source[0].key >> shift) & 0xFF] == count) {
+			continue;
+		}
+
+		int offset = 0;
+		for (int value = 0; value < 256; value++) {
+			int valueCount = counts[digit][value];
+			counts[digit][value] = offset;
+			offset += valueCount;
+		}
+		for (int i = 0; i < count; i++) {
+			target[counts[digit][(source[i].key >> shift) & 0xFF]++] = source[i];
+		}
+		std::swap(source, target);
+		moved = true;
+	}
+
+	if (moved) {
+		for (int i = 0; i < count; i++) {
+			scratch[i] = commands[source[i].index];
+		}
+	}
+	return moved ? scratch : commands;
+}
+
+void URenderQueueSort (URenderQueue* queue, UArena* arena) {
+	if (queue->count < 2) {
+		return;
+	}
+
+	// Small queues sort faster by insertion than by eight counting passes.
+	if (queue->count <= 64) {
+		for (int i = 1; i < queue->count; i++) {
+			URenderCommand command = queue->commands[i];
+			int j = i - 1;
+			while (j >= 0 && queue->commands[j].key > command.key) {
+				queue->commands[j + 1] = queue->commands[j];
+				j--;
+			}
+			queue->commands[j + 1] = command;
+		}
+		return;
+	}
+
+	URenderCommand* scratch = UArenaArray<URenderCommand>(arena, queue->count);
+	URadixItem* items = UArenaArray<URadixItem>(arena, queue->count * 2);
+	if (scratch == NULL || items == NULL) {
+		return;
+	}
+	queue->commands = URadixSort(queue->commands, scratch, items, queue->count);
+}
+
+void UBenchmarkSort (void) {
+	const int count = 1 << 20, repeats = 5;
+	std::vector<URenderCommand> input(count), commands(count), scratch(count);
+	std::vector<URadixItem> items(count * 2);
+
+	// A handful of programs, textures and arrays at random depths, like a busy frame.
+	unsigned int seed = 12345;
+	for (int i = 0; i < count; i++) {
+		seed = seed * 1664525u + 1013904223u;
+		GLuint program = 1 + (seed >> 8) % 4, texture = 1 + (seed >> 12) % 32, vertexArray = 1 + (seed >> 20) % 8;
+		seed = seed * 1664525u + 1013904223u;
+		GLfloat depth = (seed >> 8) / 16777216.0f * RENDER_DEPTH_RANGE;
+		input[i].key = URenderKey(RENDER_PASS_OPAQUE, program, texture, vertexArray, depth);
+		input[i].object = i;
+		input[i].lod = 0;
+		input[i].program = program;
+		input[i].texture = texture;
+		input[i].vertexArray = vertexArray;
+	}
+
+	double radixBest = 1e30, stdBest = 1e30;
+	URenderCommand* sorted = NULL;
+	for (int repeat = 0; repeat < repeats; repeat++) {
+		commands = input;
+		double start = UNowMilliseconds();
+		sorted = URadixSort(&commands[0], &scratch[0], &items[0], count);
+		radixBest = std::min(radixBest, UNowMilliseconds() - start);
+	}
+	std::vector<URenderCommand> reference = input;
+	for (int repeat = 0; repeat < repeats; repeat++) {
+		reference = input;
+		double start = UNowMilliseconds();
+		std::stable_sort(reference.begin(), reference.end(), [](const URenderCommand& a, const URenderCommand& b) {
+			return a.key < b.key;
+		});
+		stdBest = std::min(stdBest, UNowMilliseconds() - start);
+	}
+
+	// Both sorts are stable, so the orders must match exactly.
+	int mismatches = 0, textureChanges = 0, programChanges = 0;
+	for (int i = 0; i < count; i++) {
+		mismatches += sorted[i].object != reference[i].object;
+		if (i > 0) {
+			programChanges += sorted[i].program != sorted[i - 1].program;
+			textureChanges += sorted[i].texture != sorted[i - 1].texture;
+		}
+	}
+
+	printf("INFO: Sorting %d render commands.\n", count);
+	printf("  radix sort:       %7.3f ms\n", radixBest);
+	printf("  std::stable_sort: %7.3f ms, %d mismatches\n", stdBest, mismatches);
+	printf("  state changes after sorting: %d program, %d texture\n", programChanges, textureChanges);
+}
+
+/* Reads --offscreen FRAMES [png|ppm] [DIRECTORY] [WIDTHxHEIGHT]. */
+bool UParseOffscreen (int argc, char** argv) {
+	if (argc < 2 || strcmp(argv[1], "--offscreen") != 0) {
+		return false;
+	}
+
+	offscreen.frames = argc > 2 ? atoi(argv[2]) : 100;
+	offscreen.format = (argc > 3 && strcmp(argv[3], "ppm") == 0) ? OFFSCREEN_FORMAT_PPM : OFFSCREEN_FORMAT_PNG;
+	offscreen.directory = argc > 4 ? argv[4] : ".";
+	offscreen.width = WindowWidth;
+	offscreen.height = WindowHeight;
+	if (argc > 5 && sscanf(argv[5], "%dx%d", &offscreen.width, &offscreen.height) != 2) {
+		offscreen.width = WindowWidth;
+		offscreen.height = WindowHeight;
+	}
+	WindowWidth = offscreen.width;
+	WindowHeight = offscreen.height;
+	return true;
+}
+
+void UOffscreenWriterLoop (void) {
+	// Each writer keeps one row of encoded output for its whole life.
+	std::vector<unsigned char> row(offscreen.width * 3 + 1);
+	const char* extension = offscreen.format == OFFSCREEN_FORMAT_PPM ? "ppm" : "png";
+
+	for (;;) {
+		UOffscreenFrame frame;
+		{
+			std::unique_lock<std::mutex> guard(offscreen.lock);
+			offscreen.queueReady.wait(guard, [] { return offscreen.queueCount > 0 || offscreen.stopping; });
+			if (offscreen.queueCount == 0) {
+				return;
+			}
+			frame = offscreen.queue[offscreen.queueHead];
+			offscreen.queueHead = (offscreen.queueHead + 1) % OFFSCREEN_QUEUE;
+			offscreen.queueCount--;
+		}
+		offscreen.queueSpace.notify_one();
+
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/frame_%05d.%s", offscreen.directory, frame.index, extension);
+		bool written = offscreen.format == OFFSCREEN_FORMAT_PPM
+			? UWritePPM(path, frame.pixels, offscreen.width, offscreen.height, &row[0])
+			: UWritePNG(path, frame.pixels, offscreen.width, offscreen.height, &row[0]);
+
+		std::lock_guard<std::mutex> guard(offscreen.lock);
+		UPoolFree(&offscreen.framePool, frame.pixels);
+		offscreen.written += written;
+		offscreen.failed += !written;
+	}
+}
+
+void UOffscreenCreateFramebuffer (void) {
+	glGenRenderbuffers(1, &offscreen.colorBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, offscreen.colorBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, offscreen.width, offscreen.height);
+	glGenRenderbuffers(1, &offscreen.depthBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, offscreen.depthBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, offscreen.width, offscreen.height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &offscreen.framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, offscreen.framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, offscreen.colorBuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, offscreen.depthBuffer);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "ERROR: Offscreen framebuffer is incomplete.\n");
+		exit(EXIT_FAILURE);
+	}
+	glViewport(0, 0, offscreen.width, offscreen.height);
+}
+
+void UOffscreenCreate (void) {
+	UOffscreenCreateFramebuffer();
+
+	GLsizeiptr frameSize = (GLsizeiptr) offscreen.width * offscreen.height * 4;
+	glGenBuffers(OFFSCREEN_READBACKS, offscreen.packBuffers);
+	for (int i = 0; i < OFFSCREEN_READBACKS; i++) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, offscreen.packBuffers[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, frameSize, NULL, GL_STREAM_READ);
+		offscreen.fences[i] = 0;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	UPoolCreate(&offscreen.framePool, frameSize, 4);
+
+	// Leaves cores for the job workers, but always at least one writer.
+	int cores = std::thread::hardware_concurrency();
+	offscreen.writerCount = std::min(std::max(cores / 2, 1), OFFSCREEN_MAX_WRITERS);
+	offscreen.stopping = false;
+	for (int i = 0; i < offscreen.writerCount; i++) {
+		offscreen.writers[i] = new std::thread(UOffscreenWriterLoop);
+	}
+
+	printf("INFO: Rendering %d frames of %dx%d to %s as %s with %d writers.\n", offscreen.frames, offscreen.width, offscreen.height,
+		offscreen.directory, offscreen.format == OFFSCREEN_FORMAT_PPM ? "PPM" : "PNG", offscreen.writerCount);
+}
+
+/* Maps a finished readback, copies it out and queues it for a writer. */
+void UOffscreenCollect (int slot) {
+	GLsync fence = offscreen.fences[slot];
+	if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+		offscreen.readbackStalls++;
+		glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	}
+	glDeleteSync(fence);
+	offscreen.fences[slot] = 0;
+
+	// Waits for a writer to free a queue entry when encoding falls behind.
+	unsigned char* pixels;
+	{
+		std::unique_lock<std::mutex> guard(offscreen.lock);
+		if (offscreen.queueCount == OFFSCREEN_QUEUE) {
+			offscreen.queueStalls++;
+			offscreen.queueSpace.wait(guard, [] { return offscreen.queueCount < OFFSCREEN_QUEUE; });
+		}
+		pixels = (unsigned char*) UPoolAllocate(&offscreen.framePool);
+	}
+	if (pixels == NULL) {
+		offscreen.failed++;
+		return;
+	}
+
+	size_t frameSize = (size_t) offscreen.width * offscreen.height * 4;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, offscreen.packBuffers[slot]);
+	const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameSize, GL_MAP_READ_BIT);
+	if (mapped != NULL) {
+		memcpy(pixels, mapped, frameSize);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	{
+		std::lock_guard<std::mutex> guard(offscreen.lock);
+		if (mapped == NULL) {
+			UPoolFree(&offscreen.framePool, pixels);
+			offscreen.failed++;
+			return;
+		}
+		UOffscreenFrame& frame = offscreen.queue[(offscreen.queueHead + offscreen.queueCount) % OFFSCREEN_QUEUE];
+		frame.pixels = pixels;
+		frame.index = offscreen.frameIndices[slot];
+		offscreen.queueCount++;
+	}
+	offscreen.queueReady.notify_one();
+}
+
+void UOffscreenCapture (void) {
+	// The slot about to be reused holds the oldest readback, issued OFFSCREEN_READBACKS frames ago.
+	int slot = offscreen.nextReadback;
+	if (offscreen.fences[slot] != 0) {
+		UOffscreenCollect(slot);
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, offscreen.packBuffers[slot]);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glReadPixels(0, 0, offscreen.width, offscreen.height, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*) 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	offscreen.fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	offscreen.frameIndices[slot] = offscreen.captured++;
+	offscreen.nextReadback = (slot + 1) % OFFSCREEN_READBACKS;
+	glFlush();
+}
+
+/* Turns the table once over the whole run so every frame differs. */
+void UOffscreenRun (void) {
+	double start = UNowMilliseconds();
+	GLfloat pitch = scene.pitches[tableNode];
+	for (int frame = 0; frame < offscreen.frames; frame++) {
+		USceneSetRotation(&scene, tableNode, pitch, 6.2831853f * frame / std::max(offscreen.frames, 1));
+		URenderGraphics();
+	}
+	double renderTime = UNowMilliseconds() - start;
+	printf("INFO: Rendered %d frames in %.1f ms (%.1f frames/s).\n", offscreen.frames, renderTime, offscreen.frames * 1000.0 / renderTime);
+}
+
+void UOffscreenFinish (void) {
+	double start = UNowMilliseconds();
+
+	// Collects the readbacks still in flight, oldest first.
+	for (int i = 0; i < OFFSCREEN_READBACKS; i++) {
+		int slot = (offscreen.nextReadback + i) % OFFSCREEN_READBACKS;
+		if (offscreen.fences[slot] != 0) {
+			UOffscreenCollect(slot);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(offscreen.lock);
+		offscreen.stopping = true;
+	}
+	offscreen.queueReady.notify_all();
+	for (int i = 0; i < offscreen.writerCount; i++) {
+		offscreen.writers[i]->join();
+		delete offscreen.writers[i];
+	}
+	offscreen.writerCount = 0;
+
+	printf("INFO: Wrote %d frames (%d failed), %.1f ms draining; %d readback stalls, %d writer stalls.\n",
+		offscreen.written, offscreen.failed, UNowMilliseconds() - start, offscreen.readbackStalls, offscreen.queueStalls);
+
+	UPoolDestroy(&offscreen.framePool);
+	glDeleteBuffers(OFFSCREEN_READBACKS, offscreen.packBuffers);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &offscreen.framebuffer);
+	glDeleteRenderbuffers(1, &offscreen.colorBuffer);
+	glDeleteRenderbuffers(1, &offscreen.depthBuffer);
+	offscreen.framebuffer = 0;
+}
+
+/* Writes big-endian words and keeps the running CRC of the current chunk. */
+struct UPNGStream {
+	FILE* file;
+	unsigned int crc;
+	// zlib checksum of the uncompressed data.
+	unsigned int adlerA, adlerB;
+	// Uncompressed bytes still to come in total and in the current stored block.
+	size_t rawRemaining, blockRemaining;
+};
+
+const unsigned int* UCRCTable (void) {
+	static unsigned int table[256];
+	static std::once_flag once;
+	std::call_once(once, [] {
+		for (unsigned int n = 0; n < 256; n++) {
+			unsigned int c = n;
+			for (int k = 0; k < 8; k++) {
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			table[n] = c;
+		}
+	});
+	return table;
+}
+
+void UPNGPut (UPNGStream* stream, const unsigned char* data, size_t size) {
+	const unsigned int* table = UCRCTable();
+	unsigned int crc = stream->crc;
+	for (size_t i = 0; i < size; i++) {
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	stream->crc = crc;
+	fwrite(data, 1, size, stream->file);
+}
+
+void UPNGPutWord (UPNGStream* stream, unsigned int word) {
+	unsigned char bytes[4] = { (unsigned char) (word >> 24), (unsigned char) (word >> 16), (unsigned char) (word >> 8), (unsigned char) word };
+	UPNGPut(stream, bytes, 4);
+}
+
+void UPNGBeginChunk (UPNGStream* stream, unsigned int length, const char* type) {
+	unsigned char bytes[4] = { (unsigned char) (length >> 24), (unsigned char) (length >> 16), (unsigned char) (length >> 8), (unsigned char) length };
+	fwrite(bytes, 1, 4, stream->file);
+	stream->crc = 0xFFFFFFFFu;
+	UPNGPut(stream, (const unsigned char*) type, 4);
+}
+
+void UPNGEndChunk (UPNGStream* stream) {
+	unsigned int crc = stream->crc ^ 0xFFFFFFFFu;
+	unsigned char bytes[4] = { (unsigned char) (crc >> 24), (unsigned char) (crc >> 16), (unsigned char) (crc >> 8), (unsigned char) crc };
+	fwrite(bytes, 1, 4, stream->file);
+}
+
+/* Feeds image data through stored deflate blocks of at most 65535 bytes. */
+void UPNGPutRaw (UPNGStream* stream, const unsigned char* data, size_t size) {
+	while (size > 0) {
+		if (stream->blockRemaining == 0) {
+			size_t length = std::min(stream->rawRemaining, (size_t) 65535);
+			unsigned char header[5] = { (unsigned char) (length == stream->rawRemaining), (unsigned char) length, (unsigned char) (length >> 8),
+				(unsigned char) ~length, (unsigned char) (~length >> 8) };
+			UPNGPut(stream, header, 5);
+			stream->blockRemaining = length;
+		}
+
+		size_t part = std::min(size, stream->blockRemaining);
+		for (size_t i = 0; i < part; i++) {
+			stream->adlerA += data[i];
+			stream->adlerB += stream->adlerA;
+			// Reduces well before the 32 bit sums could overflow.
+			if ((i & 4095) == 4095) {
+				stream->adlerA %= 65521;
+				stream->adlerB %= 65521;
+			}
+		}
+		stream->adlerA %= 65521;
+		stream->adlerB %= 65521;
+
+		UPNGPut(stream, data, part);
+		stream->blockRemaining -= part;
+		stream->rawRemaining -= part;
+		data += part;
+		size -= part;
+	}
+}
+
+/*
+ * Writes an 8 bit RGB PNG without compression: one zlib stream of stored
+ * blocks inside a single IDAT chunk, which keeps encoding as cheap as a
+ * copy. The image is bottom row first, as GL reads it; row holds one
+ * output row plus its filter byte.
+ */
+bool UWritePNG (const char* path, const unsigned char* rgba, int width, int height, unsigned char* row) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		return false;
+	}
+
+	UPNGStream stream;
+	stream.file = file;
+	stream.adlerA = 1;
+	stream.adlerB = 0;
+	stream.rawRemaining = (size_t) height * (width * 3 + 1);
+	stream.blockRemaining = 0;
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	fwrite(signature, 1, 8, file);
+
+	UPNGBeginChunk(&stream, 13, "IHDR");
+	UPNGPutWord(&stream, width);
+	UPNGPutWord(&stream, height);
+	// 8 bits per channel, RGB, default compression and filtering, not interlaced.
+	const unsigned char format[5] = { 8, 2, 0, 0, 0 };
+	UPNGPut(&stream, format, 5);
+	UPNGEndChunk(&stream);
+
+	size_t blocks = (stream.rawRemaining + 65534) / 65535;
+	UPNGBeginChunk(&stream, (unsigned int) (2 + stream.rawRemaining + blocks * 5 + 4), "IDAT");
+	const unsigned char zlibHeader[2] = { 0x78, 0x01 };
+	UPNGPut(&stream, zlibHeader, 2);
+	for (int y = height - 1; y >= 0; y--) {
+		const unsigned char* source = rgba + (size_t) y * width * 4;
+		row[0] = 0;
+		for (int x = 0; x < width; x++) {
+			row[1 + x * 3] = source[x * 4];
+			row[2 + x * 3] = source[x * 4 + 1];
+			row[3 + x * 3] = source[x * 4 + 2];
+		}
+		UPNGPutRaw(&stream, row, width * 3 + 1);
+	}
+	UPNGPutWord(&stream, (stream.adlerB << 16) | stream.adlerA);
+	UPNGEndChunk(&stream);
+
+	UPNGBeginChunk(&stream, 0, "IEND");
+	UPNGEndChunk(&stream);
+
+	bool written = ferror(file) == 0;
+	return fclose(file) == 0 && written;
+}
+
+/* Writes a binary PPM, the same layout as the raw RGB rows with a short header. */
+bool UWritePPM (const char* path, const unsigned char* rgba, int width, int height, unsigned char* row) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		return false;
+	}
+	fprintf(file, "P6\n%d %d\n255\n", width, height);
+	for (int y = height - 1; y >= 0; y--) {
+		const unsigned char* source = rgba + (size_t) y * width * 4;
+		for (int x = 0; x < width; x++) {
+			row[x * 3] = source[x * 4];
+			row[x * 3 + 1] = source[x * 4 + 1];
+			row[x * 3 + 2] = source[x * 4 + 2];
+		}
+		fwrite(row, 1, width * 3, file);
+	}
+	bool written = ferror(file) == 0;
+	return fclose(file) == 0 && written;
+}
+
+/* Compiles and links a program, reporting errors the way UCreateShader does. */
+GLuint UCompileProgram (const char* vertexSource, const char* fragmentSource, const char* name) {
+	GLuint shaders[2] = { glCreateShader(GL_VERTEX_SHADER), glCreateShader(GL_FRAGMENT_SHADER) };
+	const char* sources[2] = { vertexSource, fragmentSource };
+	GLuint program = glCreateProgram();
+	for (int i = 0; i < 2; i++) {
+		glShaderSource(shaders[i], 1, &sources[i], NULL);
+		glCompileShader(shaders[i]);
+
+		GLint success = 0;
+		glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &success);
+		if (success == GL_FALSE) {
+			int size;
+			char str[1024] = { 0 };
+			glGetShaderInfoLog(shaders[i], sizeof(str), &size, str);
+			printf("ERROR COMPILING %s %s SHADER.\n%s\n", name, i == 0 ? "VERTEX" : "FRAGMENT", str);
+		}
+		glAttachShader(program, shaders[i]);
+	}
+
+	glLinkProgram(program);
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (linked == GL_FALSE) {
+		int size;
+		char str[1024] = { 0 };
+		glGetProgramInfoLog(program, sizeof(str), &size, str);
+		printf("ERROR LINKING %s PROGRAM.\n%s\n", name, str);
+	}
+
+	glDeleteShader(shaders[0]);
+	glDeleteShader(shaders[1]);
+	return program;
+}
+
+/* Scatters colored lights around the table, the same way every run, and uploads them for forward shading. */
+void UCreatePointLights (void) {
+	unsigned int seed = 2024;
+	auto random = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (seed >> 8) / 16777216.0f;
+	};
+	for (int i = 0; i < MAX_POINT_LIGHTS; i++) {
+		UPointLight& light = pointLights[i];
+		light.position = glm::vec3(random() * 6.0f - 3.0f, random() * 2.0f - 0.5f, random() * 6.0f - 3.0f);
+		light.radius = 1.0f + random();
+		light.color = glm::vec3(random(), random(), random()) * 0.5f;
+	}
+
+	// The lights never move, so the texels are written once.
+	std::vector<glm::vec4> texels(MAX_POINT_LIGHTS * 2);
+	for (int i = 0; i < MAX_POINT_LIGHTS; i++) {
+		texels[i * 2] = glm::vec4(pointLights[i].position, pointLights[i].radius);
+		texels[i * 2 + 1] = glm::vec4(pointLights[i].color, 0.0f);
+	}
+	glGenBuffers(1, &pointLightBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, pointLightBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, texels.size() * sizeof(glm::vec4), &texels[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glGenTextures(1, &pointLightTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, pointLightTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, pointLightBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+/* Sends the scene lights and point lights to a program shading like the forward one, which must be in use. */
+void USendLights (GLuint program, const glm::vec3& lightPosition, const glm::vec3& lightPosition2) {
+	GLint lightColorLoc, lightPositionLoc, viewPositionLoc;
+	GLint ambientLoc, specularLoc, highlightLoc;
+
+	// Tells the shader the viewing position.
+	viewPositionLoc = glGetUniformLocation(program, "viewPosition");
+	glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+
+	// Sends data for initial light source.
+	lightColorLoc = glGetUniformLocation(program, "lightColor");
+	lightPositionLoc = glGetUniformLocation(program, "lightPos");
+	ambientLoc = glGetUniformLocation(program, "ambientStrength");
+	specularLoc = glGetUniformLocation(program, "specularIntensity");
+	highlightLoc = glGetUniformLocation(program, "highlightSize");
+
+	glUniform3f(lightColorLoc, lightColor.r, lightColor.g, lightColor.b);
+	glUniform3f(lightPositionLoc, lightPosition.x, lightPosition.y, lightPosition.z);
+	glUniform1f(ambientLoc, 0.1);
+	glUniform1f(specularLoc, 1.0);
+	glUniform1f(highlightLoc, 16.0);
+
+	// Sends data for second light source.
+	lightColorLoc = glGetUniformLocation(program, "lightColor2");
+	lightPositionLoc = glGetUniformLocation(program, "lightPos2");
+	ambientLoc = glGetUniformLocation(program, "ambientStrength2");
+	specularLoc = glGetUniformLocation(program, "specularIntensity2");
+	highlightLoc = glGetUniformLocation(program, "highlightSize2");
+
+	glUniform3f(lightColorLoc, lightColor2.r, lightColor2.g, lightColor2.b);
+	glUniform3f(lightPositionLoc, lightPosition2.x, lightPosition2.y, lightPosition2.z);
+	glUniform1f(ambientLoc, 0.1);
+	glUniform1f(specularLoc, 0.1 );
+	glUniform1f(highlightLoc, 16.0);
+
+	glUniform1f(glGetUniformLocation(program, "shadowFar"), shadowMapping ? shadowFar : 0.0f);
+	UForwardPointLights(program);
+}
+
+/* Points a forward shading program, which must be in use, at this frame's point lights. */
+void UForwardPointLights (GLuint program) {
+	glUniform1i(glGetUniformLocation(program, "pointLightCount"), activePointLights);
+	glUniform1f(glGetUniformLocation(program, "pointLightSpecular"), 0.5f);
+	glUniform1i(glGetUniformLocation(program, "pointLights"), POINT_LIGHT_UNIT);
+	glActiveTexture(GL_TEXTURE0 + POINT_LIGHT_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, pointLightTexture);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void UDeferredCreate (void) {
+	gbufferProgram = UCompileProgram(vertexShaderSource, gbufferShaderSource, "G-BUFFER");
+	lightingProgram = UCompileProgram(lightingVertexShaderSource, lightingShaderSource, "LIGHTING");
+
+	// Core profiles need a vertex array bound to draw, even with no attributes.
+	glGenVertexArrays(1, &lightingVAO);
+
+	glUseProgram(lightingProgram);
+	glUniform1i(glGetUniformLocation(lightingProgram, "gAlbedo"), 0);
+	glUniform1i(glGetUniformLocation(lightingProgram, "gNormal"), 1);
+	glUniform1i(glGetUniformLocation(lightingProgram, "gDepth"), 2);
+	glUseProgram(gbufferProgram);
+	glUniform1f(glGetUniformLocation(gbufferProgram, "materialSpecular"), 1.0f);
+	glUniform1f(glGetUniformLocation(gbufferProgram, "materialShininess"), 16.0f);
+	UTextureTableSetup(gbufferProgram);
+	glUseProgram(shaderProgram);
+}
+
+GLuint UCreateTarget (GLenum internalFormat, GLenum format, GLenum type, int width, int height) {
+	GLuint target;
+	glGenTextures(1, &target);
+	glBindTexture(GL_TEXTURE_2D, target);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	return target;
+}
+
+/* Recreates the G-buffer at a new size; nothing happens when the size is unchanged. */
+void UDeferredResize (int width, int height) {
+	if (gbuffer.framebuffer != 0 && gbuffer.width == width && gbuffer.height == height) {
+		return;
+	}
+	if (gbuffer.framebuffer != 0) {
+		GLuint targets[3] = { gbuffer.albedo, gbuffer.normal, gbuffer.depth };
+		glDeleteTextures(3, targets);
+		glDeleteFramebuffers(1, &gbuffer.framebuffer);
+	}
+
+	gbuffer.width = width;
+	gbuffer.height = height;
+	gbuffer.albedo = UCreateTarget(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, width, height);
+	gbuffer.normal = UCreateTarget(GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT, width, height);
+	gbuffer.depth = UCreateTarget(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, width, height);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	glGenFramebuffers(1, &gbuffer.framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gbuffer.albedo, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gbuffer.normal, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, gbuffer.depth, 0);
+	const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers(2, drawBuffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "ERROR: G-buffer is incomplete.\n");
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, renderTarget);
+	allocationWarmup = ALLOCATION_WARMUP_FRAMES;
+}
+
+void UDeferredBeginGeometry (void) {
+	UDeferredResize(renderWidth, renderHeight);
+	glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.framebuffer);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+/*
+ * Bounds of a light's sphere on screen, in normalized device coordinates.
+ * Returns false when the sphere is off screen. A sphere reaching the near
+ * plane gets the whole screen, since its corners cannot be projected.
+ */
+bool ULightScreenRect (const glm::vec3& position, GLfloat radius, const glm::mat4& view, const glm::mat4& projection, glm::vec4& rect) {
+	glm::vec3 center(view * glm::vec4(position, 1.0f));
+	if (projection[2][3] != 0.0f && -center.z - radius < 0.1f) {
+		rect = glm::vec4(-1.0f, -1.0f, 1.0f, 1.0f);
+		return -center.z + radius > 0.1f;
+	}
+
+	rect = glm::vec4(1e30f, 1e30f, -1e30f, -1e30f);
+	for (int corner = 0; corner < 8; corner++) {
+		glm::vec3 offset((corner & 1) ? radius : -radius, (corner & 2) ? radius : -radius, (corner & 4) ? radius : -radius);
+		glm::vec4 clip = projection * glm::vec4(center + offset, 1.0f);
+		rect.x = std::min(rect.x, clip.x / clip.w);
+		rect.y = std::min(rect.y, clip.y / clip.w);
+		rect.z = std::max(rect.z, clip.x / clip.w);
+		rect.w = std::max(rect.w, clip.y / clip.w);
+	}
+	rect = glm::vec4(std::max(rect.x, -1.0f), std::max(rect.y, -1.0f), std::min(rect.z, 1.0f), std::min(rect.w, 1.0f));
+	return rect.x < rect.z && rect.y < rect.w;
+}
+
+void UDeferredLighting (const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightPosition, const glm::vec3& lightPosition2) {
+	glBindFramebuffer(GL_FRAMEBUFFER, renderTarget);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glUseProgram(lightingProgram);
+	glBindVertexArray(lightingVAO);
+
+	GLuint targets[3] = { gbuffer.albedo, gbuffer.normal, gbuffer.depth };
+	for (int i = 0; i < 3; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, targets[i]);
+	}
+
+	glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+	glUniformMatrix4fv(glGetUniformLocation(lightingProgram, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+	glUniform2f(glGetUniformLocation(lightingProgram, "screenSize"), (GLfloat) gbuffer.width, (GLfloat) gbuffer.height);
+	glUniform3f(glGetUniformLocation(lightingProgram, "viewPosition"), cameraPosition.x, cameraPosition.y, cameraPosition.z);
+
+	GLint rectLoc = glGetUniformLocation(lightingProgram, "screenRect");
+	GLint positionLoc = glGetUniformLocation(lightingProgram, "lightPos");
+	GLint colorLoc = glGetUniformLocation(lightingProgram, "lightColor");
+	GLint radiusLoc = glGetUniformLocation(lightingProgram, "lightRadius");
+	GLint ambientLoc = glGetUniformLocation(lightingProgram, "ambientStrength");
+	GLint specularLoc = glGetUniformLocation(lightingProgram, "specularIntensity");
+	GLint writeDepthLoc = glGetUniformLocation(lightingProgram, "writeDepth");
+	GLint shadowMapLoc = glGetUniformLocation(lightingProgram, "shadowMap");
+	GLint shadowFarLoc = glGetUniformLocation(lightingProgram, "shadowFar");
+	glUniform1f(shadowFarLoc, shadowMapping ? shadowFar : 0.0f);
+	glUniform1i(shadowMapLoc, 5);
+
+	// The scene lights cover everything; the first also lays down depth.
+	glDepthFunc(GL_ALWAYS);
+	glUniform4f(rectLoc, -1.0f, -1.0f, 1.0f, 1.0f);
+	glUniform1f(radiusLoc, 0.0f);
+	glUniform1f(ambientLoc, 0.1f);
+	glUniform1i(writeDepthLoc, 1);
+	glUniform3f(positionLoc, lightPosition.x, lightPosition.y, lightPosition.z);
+	glUniform3f(colorLoc, lightColor.r, lightColor.g, lightColor.b);
+	glUniform1f(specularLoc, 1.0f);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	glDepthMask(GL_FALSE);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	glUniform1i(writeDepthLoc, 0);
+	glUniform3f(positionLoc, lightPosition2.x, lightPosition2.y, lightPosition2.z);
+	glUniform3f(colorLoc, lightColor2.r, lightColor2.g, lightColor2.b);
+	glUniform1f(specularLoc, 0.1f);
+	glUniform1i(shadowMapLoc, 6);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	// Point lights only shade the pixels inside their projected bounds.
+	deferredLightQuads = 0;
+	glUniform1f(shadowFarLoc, 0.0f);
+	glUniform1f(ambientLoc, 0.0f);
+	glUniform1f(specularLoc, 0.5f);
+	for (int i = 0; i < activePointLights; i++) {
+		const UPointLight& light = pointLights[i];
+		glm::vec4 rect;
+		if (!ULightScreenRect(light.position, light.radius, view, projection, rect)) {
+			continue;
+		}
+		glUniform4f(rectLoc, rect.x, rect.y, rect.z, rect.w);
+		glUniform1f(radiusLoc, light.radius);
+		glUniform3f(positionLoc, light.position.x, light.position.y, light.position.z);
+		glUniform3f(colorLoc, light.color.r, light.color.g, light.color.b);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		deferredLightQuads++;
+	}
+
+	glDisable(GL_BLEND);
+	glDepthMask(GL_TRUE);
+	glDepthFunc(GL_LESS);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glBindVertexArray(VAO);
+	glUseProgram(shaderProgram);
+}
+
+/* Adds another table, with its own nodes and objects, at position. Copies take turns with the textures in the table. */
+void UAddTableCopy (glm::vec3 position) {
+	int root = USceneAddNode(&scene, -1, position, glm::vec3(2.0f));
+	int copy = (int) (sceneObjects.size() / meshParts.size());
+	for (int i = 0; i < (int) meshParts.size(); i++) {
+		USceneObject object;
+		object.node = USceneAddNode(&scene, root, glm::vec3(0.0f), glm::vec3(1.0f));
+		object.part = i;
+		object.texture = copy % std::max(textureTable.count, 1);
+		sceneObjects.push_back(object);
+	}
+	objectBoundsMin.resize(sceneObjects.size());
+	objectBoundsMax.resize(sceneObjects.size());
+	objectVisible.resize(sceneObjects.size());
+
+	USceneUpdate(&scene);
+	UUpdateObjectBounds();
+	UBVHBuild(&sceneBVH, &objectBoundsMin[0], &objectBoundsMax[0], (int) sceneObjects.size());
+	allocationWarmup = ALLOCATION_WARMUP_FRAMES;
+}
+
+/* Creates the visibility buffer programs and the texture buffer over the vertex buffer. */
+void UVisibilityCreate (void) {
+	visibilityIdProgram = UCompileProgram(vertexShaderSource, visibilityIdShaderSource, "VISIBILITY");
+	visibilityResolveProgram = UCompileProgram(lightingVertexShaderSource, visibilityResolveShaderSource, "VISIBILITY RESOLVE");
+
+	glUseProgram(visibilityResolveProgram);
+	UTextureTableSetup(visibilityResolveProgram);
+	glUniform1i(glGetUniformLocation(visibilityResolveProgram, "visibilityIds"), 1);
+	glUniform1i(glGetUniformLocation(visibilityResolveProgram, "visibilityDepth"), 2);
+	glUniform1i(glGetUniformLocation(visibilityResolveProgram, "vertices"), 3);
+	glUniform1i(glGetUniformLocation(visibilityResolveProgram, "transforms"), 4);
+	glUseProgram(shaderProgram);
+
+	// Each vertex is 8 floats, read as two RGBA32F texels.
+	GLint vertexBytes = 0, maxTexels = 0;
+	glBindBuffer(GL_ARRAY_BUFFER, VBO);
+	glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &vertexBytes);
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+	if (vertexBytes / 16 > maxTexels) {
+		printf("WARNING: %d vertex texels exceed the texture buffer limit of %d.\n", vertexBytes / 16, maxTexels);
+	}
+
+	glGenTextures(1, &visibility.vertexTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, visibility.vertexTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, VBO);
+
+	// A buffer name only becomes a buffer once it has been bound.
+	glGenBuffers(1, &visibility.transformBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, visibility.transformBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glGenTextures(1, &visibility.transformTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, visibility.transformTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, visibility.transformBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+	glGenQueries(2, shadingSampleQueries);
+}
+
+void UVisibilityResize (int width, int height) {
+	if (visibility.framebuffer != 0 && visibility.width == width && visibility.height == height) {
+		return;
+	}
+	if (visibility.framebuffer != 0) {
+		GLuint targets[2] = { visibility.ids, visibility.depth };
+		glDeleteTextures(2, targets);
+		glDeleteFramebuffers(1, &visibility.framebuffer);
+	}
+
+	visibility.width = width;
+	visibility.height = height;
+	visibility.ids = UCreateTarget(GL_RG32UI, GL_RG_INTEGER, GL_UNSIGNED_INT, width, height);
+	visibility.depth = UCreateTarget(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, width, height);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	glGenFramebuffers(1, &visibility.framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, visibility.framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, visibility.ids, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, visibility.depth, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "ERROR: Visibility buffer is incomplete.\n");
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, renderTarget);
+	allocationWarmup = ALLOCATION_WARMUP_FRAMES;
+}
+
+void UVisibilityBeginGeometry (void) {
+	UVisibilityResize(renderWidth, renderHeight);
+	glBindFramebuffer(GL_FRAMEBUFFER, visibility.framebuffer);
+	const GLuint none[4] = { 0, 0, 0, 0 };
+	glClearBufferuiv(GL_COLOR, 0, none);
+	glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+/* Uploads the transforms of this frame's drawn objects, indexed by object. */
+void UVisibilityUploadTransforms (const glm::vec4* transforms, int objectCount) {
+	if (transforms == NULL) {
+		return;
+	}
+	GLsizeiptr size = (GLsizeiptr) objectCount * VISIBILITY_TRANSFORM_TEXELS * sizeof(glm::vec4);
+	glBindBuffer(GL_TEXTURE_BUFFER, visibility.transformBuffer);
+	if (objectCount > visibility.transformCapacity) {
+		glBufferData(GL_TEXTURE_BUFFER, size, NULL, GL_STREAM_DRAW);
+		visibility.transformCapacity = objectCount;
+	}
+	glBufferSubData(GL_TEXTURE_BUFFER, 0, size, transforms);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void UVisibilityResolve (const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightPosition, const glm::vec3& lightPosition2) {
+	glBindFramebuffer(GL_FRAMEBUFFER, renderTarget);
+	glUseProgram(visibilityResolveProgram);
+	glBindVertexArray(lightingVAO);
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, visibility.ids);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, visibility.depth);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_BUFFER, visibility.vertexTexture);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_BUFFER, visibility.transformTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+	glUniformMatrix4fv(glGetUniformLocation(visibilityResolveProgram, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+	glUniform2f(glGetUniformLocation(visibilityResolveProgram, "screenSize"), (GLfloat) visibility.width, (GLfloat) visibility.height);
+	glUniform4f(glGetUniformLocation(visibilityResolveProgram, "screenRect"), -1.0f, -1.0f, 1.0f, 1.0f);
+	USendLights(visibilityResolveProgram, lightPosition, lightPosition2);
+
+	// Copies depth along with the color, as deferred lighting does.
+	glDepthFunc(GL_ALWAYS);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glDepthFunc(GL_LESS);
+
+	glBindVertexArray(VAO);
+	glUseProgram(shaderProgram);
+}
+
+GLuint UCreateShadowCube (void) {
+	GLuint cube;
+	glGenTextures(1, &cube);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, cube);
+	for (int face = 0; face < 6; face++) {
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 0,
+			GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+	}
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	return cube;
+}
+
+void UShadowCreate (void) {
+	shadowProgram = UCompileProgram(shadowVertexShaderSource, shadowShaderSource, "SHADOW");
+	shadowCopyImage = GLEW_ARB_copy_image;
+	if (!shadowCopyImage) {
+		printf("WARNING: Copying the cached shadow cubes needs ARB_copy_image, static casters are redrawn each frame a dynamic one is in view.\n");
+	}
+	for (int i = 0; i < SHADOW_LIGHTS; i++) {
+		shadowLights[i].staticMap = UCreateShadowCube();
+		shadowLights[i].dynamicMap = UCreateShadowCube();
+		shadowLights[i].sampled = shadowLights[i].staticMap;
+	}
+
+	// Depth only, so the framebuffer has no color to draw to.
+	glGenFramebuffers(1, &shadowFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffer);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	glBindFramebuffer(GL_FRAMEBUFFER, offscreen.framebuffer);
+
+	// The cubes live on units 5 and 6, which nothing else uses.
+	glUseProgram(shaderProgram);
+	glUniform1i(glGetUniformLocation(shaderProgram, "shadowMap"), 5);
+	glUniform1i(glGetUniformLocation(shaderProgram, "shadowMap2"), 6);
+	glUseProgram(visibilityResolveProgram);
+	glUniform1i(glGetUniformLocation(visibilityResolveProgram, "shadowMap"), 5);
+	glUniform1i(glGetUniformLocation(visibilityResolveProgram, "shadowMap2"), 6);
+	glUseProgram(shaderProgram);
+}
+
+/* Draws the marked casters into one face of a cube, over what the face already holds unless clear is set. */
+void UShadowRenderFace (GLuint cube, int face, const glm::mat4& viewProjection, const unsigned char* casters, bool clear) {
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, cube, 0);
+	if (clear) {
+		glClear(GL_DEPTH_BUFFER_BIT);
+	}
+	glUniformMatrix4fv(glGetUniformLocation(shadowProgram, "lightViewProjection"), 1, GL_FALSE, glm::value_ptr(viewProjection));
+	GLint modelLoc = glGetUniformLocation(shadowProgram, "model");
+	for (int i = 0; i < (int) sceneObjects.size(); i++) {
+		if (!casters[i]) {
+			continue;
+		}
+		const USceneObject& object = sceneObjects[i];
+		const UMeshPart& part = meshParts[object.part];
+		glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(scene.worlds[object.node]));
+		glDrawArrays(GL_TRIANGLES, part.lods[0].first, part.lods[0].count);
+		shadowStats.draws++;
+	}
+}
+
+/*
+ * Brings both lights' shadow cubes up to date and binds them for shading.
+ * Must run after the scene update, whose flags say which nodes moved.
+ */
+void UShadowUpdate (void) {
+	static const glm::vec3 faceDirections[6] = {
+		glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1)
+	};
+	static const glm::vec3 faceUps[6] = {
+		glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0)
+	};
+
+	int count = (int) sceneObjects.size();
+	bool staticChanged = false;
+	if ((int) objectStillFrames.size() != count) {
+		objectStillFrames.resize(count, 0);
+		staticChanged = true;
+	}
+
+	// An object joins or leaves the static set when it has been still long enough or starts moving.
+	shadowStats.dynamicCasters = 0;
+	for (int i = 0; i < count; i++) {
+		int& still = objectStillFrames[i];
+		if (scene.flags[sceneObjects[i].node] & NODE_WORLD_CHANGED) {
+			staticChanged |= still >= SHADOW_STATIC_FRAMES;
+			still = 0;
+		} else if (still < SHADOW_STATIC_FRAMES) {
+			staticChanged |= ++still == SHADOW_STATIC_FRAMES;
+		}
+		shadowStats.dynamicCasters += still < SHADOW_STATIC_FRAMES;
+	}
+
+	unsigned char* staticCasters = UArenaArray<unsigned char>(&frameArena, count);
+	unsigned char* dynamicCasters = UArenaArray<unsigned char>(&frameArena, count);
+	if (staticCasters == NULL || dynamicCasters == NULL) {
+		return;
+	}
+
+	shadowStats.draws = shadowStats.saved = 0;
+	glBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffer);
+	glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+	glUseProgram(shadowProgram);
+	glUniform1f(glGetUniformLocation(shadowProgram, "shadowFar"), shadowFar);
+
+	const int lightNodes[SHADOW_LIGHTS] = { lightNode, lightNode2 };
+	glm::mat4 faceProjection = glm::perspective(glm::radians(90.0f), 1.0f, 0.05f, shadowFar);
+	for (int l = 0; l < SHADOW_LIGHTS; l++) {
+		UShadowLight& light = shadowLights[l];
+		glm::vec3 position(scene.worlds[lightNodes[l]][3]);
+		if (position != light.position || staticChanged || !shadowCaching) {
+			light.position = position;
+			light.staticValid = false;
+		}
+		glUniform3f(glGetUniformLocation(shadowProgram, "lightPosition"), position.x, position.y, position.z);
+
+		glm::mat4 faceViewProjections[6];
+		UFrustum faceFrustums[6];
+		int staticDraws[6], dynamicDraws[6];
+		bool anyDynamic = false;
+		for (int face = 0; face < 6; face++) {
+			faceViewProjections[face] = faceProjection * glm::lookAt(position, position + faceDirections[face], faceUps[face]);
+			UExtractFrustum(faceViewProjections[face], &faceFrustums[face]);
+			staticDraws[face] = dynamicDraws[face] = 0;
+			for (int i = 0; i < count; i++) {
+				if (UFrustumTestBox(&faceFrustums[face], objectBoundsMin[i], objectBoundsMax[i]) != FRUSTUM_OUTSIDE) {
+					(objectStillFrames[i] < SHADOW_STATIC_FRAMES ? dynamicDraws : staticDraws)[face]++;
+				}
+			}
+			anyDynamic |= dynamicDraws[face] > 0;
+		}
+
+		// Redraws the cached cube only when it no longer matches the static casters.
+		int drawsBefore = shadowStats.draws;
+		if (!light.staticValid) {
+			for (int face = 0; face < 6; face++) {
+				for (int i = 0; i < count; i++) {
+					staticCasters[i] = objectStillFrames[i] >= SHADOW_STATIC_FRAMES &&
+						UFrustumTestBox(&faceFrustums[face], objectBoundsMin[i], objectBoundsMax[i]) != FRUSTUM_OUTSIDE;
+				}
+				UShadowRenderFace(light.staticMap, face, faceViewProjections[face], staticCasters, true);
+			}
+			light.staticValid = true;
+			shadowStats.staticRebuilds++;
+		}
+
+		// Composites the dynamic casters over a copy of the cached cube.
+		light.sampled = light.staticMap;
+		if (anyDynamic) {
+			if (shadowCopyImage) {
+				glCopyImageSubData(light.staticMap, GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0,
+					light.dynamicMap, GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 6);
+			}
+			for (int face = 0; face < 6; face++) {
+				if (shadowCopyImage && dynamicDraws[face] == 0) {
+					continue;
+				}
+				// Without the copy every face starts over from the static casters.
+				if (!shadowCopyImage) {
+					for (int i = 0; i < count; i++) {
+						staticCasters[i] = objectStillFrames[i] >= SHADOW_STATIC_FRAMES &&
+							UFrustumTestBox(&faceFrustums[face], objectBoundsMin[i], objectBoundsMax[i]) != FRUSTUM_OUTSIDE;
+					}
+					UShadowRenderFace(light.dynamicMap, face, faceViewProjections[face], staticCasters, true);
+				}
+				for (int i = 0; i < count; i++) {
+					dynamicCasters[i] = objectStillFrames[i] < SHADOW_STATIC_FRAMES &&
+						UFrustumTestBox(&faceFrustums[face], objectBoundsMin[i], objectBoundsMax[i]) != FRUSTUM_OUTSIDE;
+				}
+				UShadowRenderFace(light.dynamicMap, face, faceViewProjections[face], dynamicCasters, false);
+			}
+			light.sampled = light.dynamicMap;
+		}
+
+		int fullDraws = 0;
+		for (int face = 0; face < 6; face++) {
+			fullDraws += staticDraws[face] + dynamicDraws[face];
+		}
+		shadowStats.saved += fullDraws - (shadowStats.draws - drawsBefore);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, renderTarget);
+	glViewport(0, 0, renderWidth, renderHeight);
+	for (int l = 0; l < SHADOW_LIGHTS; l++) {
+		glActiveTexture(GL_TEXTURE5 + l);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, shadowLights[l].sampled);
+	}
+	glActiveTexture(GL_TEXTURE0);
+}
+
+/*
+ * Closest hit, or any hit when anyHit is set, of a ray against triangles
+ * stored as three corners each and indexed by a BVH over their bounds.
+ */
+bool URayIntersectTriangles (const UBoundingVolumeHierarchy* bvh, const glm::vec3* triangles, glm::vec3 origin, glm::vec3 direction,
+	float maxDistance, bool anyHit, float* hitDistance, int* hitTriangle) {
+	if (bvh->nodes.empty()) {
+		return false;
+	}
+	glm::vec3 inverse = URayInverse(direction);
+	float closest = maxDistance;
+	int found = -1;
+
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const UBVHNode& node = bvh->nodes[stack[--top]];
+
+		// Slab test against the node's box.
+		float nearest = 0.0f, farthest = closest;
+		for (int axis = 0; axis < 3; axis++) {
+			float t0 = (node.boundsMin[axis] - origin[axis]) * inverse[axis];
+			float t1 = (node.boundsMax[axis] - origin[axis]) * inverse[axis];
+			nearest = std::max(nearest, std::min(t0, t1));
+			farthest = std::min(farthest, std::max(t0, t1));
+		}
+		if (nearest > farthest) {
+			continue;
+		}
+
+		if (node.left >= 0) {
+			if (top + 2 <= 64) {
+				stack[top++] = node.left + 1;
+				stack[top++] = node.left;
+			}
+			continue;
+		}
+
+		for (int i = node.first; i < node.first + node.count; i++) {
+			int triangle = bvh->items[i];
+			const glm::vec3* corner = triangles + triangle * 3;
+			glm::vec3 edge1 = corner[1] - corner[0], edge2 = corner[2] - corner[0];
+			glm::vec3 p = glm::cross(direction, edge2);
+			float determinant = glm::dot(edge1, p);
+			if (fabsf(determinant) < 1e-12f) {
+				continue;
+			}
+			float inverseDeterminant = 1.0f / determinant;
+			glm::vec3 s = origin - corner[0];
+			float u = glm::dot(s, p) * inverseDeterminant;
+			if (u < 0.0f || u > 1.0f) {
+				continue;
+			}
+			glm::vec3 q = glm::cross(s, edge1);
+			float v = glm::dot(direction, q) * inverseDeterminant;
+			if (v < 0.0f || u + v > 1.0f) {
+				continue;
+			}
+			float t = glm::dot(edge2, q) * inverseDeterminant;
+			if (t > 0.0f && t < closest) {
+				closest = t;
+				found = triangle;
+				if (anyHit) {
+					break;
+				}
+			}
+		}
+		if (anyHit && found >= 0) {
+			break;
+		}
+	}
+
+	if (found < 0) {
+		return false;
+	}
+	if (hitDistance != NULL) {
+		*hitDistance = closest;
+	}
+	if (hitTriangle != NULL) {
+		*hitTriangle = found;
+	}
+	return true;
+}
+
+/* Light arriving at a point on a surface straight from the scene lights, shadowed by the occluders. */
+glm::vec3 ULightmapDirect (const ULightmapBake* bake, glm::vec3 position, glm::vec3 normal) {
+	glm::vec3 light(0.0f);
+	for (int l = 0; l < 2; l++) {
+		glm::vec3 toLight = bake->lightPositions[l] - position;
+		float distance = glm::length(toLight);
+		glm::vec3 direction = toLight / distance;
+		float cosine = glm::dot(normal, direction);
+		if (cosine <= 0.0f) {
+			continue;
+		}
+		if (!URayIntersectTriangles(&bake->bvh, &bake->occluders[0], position + normal * LIGHTMAP_OFFSET, direction,
+			distance - LIGHTMAP_OFFSET, true, NULL, NULL)) {
+			light += bake->lightColors[l] * cosine;
+		}
+	}
+	return light;
+}
+
+/* Path traces one range of texels; each texel seeds its own generator, so results do not depend on scheduling. */
+void ULightmapBakeTexels (void* data, int begin, int end) {
+	ULightmapBake* bake = (ULightmapBake*) data;
+	for (int i = begin; i < end; i++) {
+		const ULightmapTexel& texel = bake->texels[i];
+		const ULightmapChart& chart = bake->charts[texel.chart];
+		unsigned int seed = (unsigned int) i * 2654435761u + 1u;
+		auto random = [&seed]() {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			return (seed >> 8) / 16777216.0f;
+		};
+
+		glm::vec3 total(0.0f);
+		for (int sample = 0; sample < LIGHTMAP_SAMPLES; sample++) {
+			// Spreads samples over the texel's footprint, which also antialiases shadow edges.
+			glm::vec3 position = texel.position + chart.tangent * ((random() - 0.5f) / bake->density) +
+				chart.bitangent * ((random() - 0.5f) / bake->density);
+			glm::vec3 normal = chart.normal, tangent = chart.tangent, bitangent = chart.bitangent;
+			total += ULightmapDirect(bake, position, normal);
+
+			// Diffuse bounces, sampled by cosine so each hit's light only needs the albedo as weight.
+			float throughput = 1.0f;
+			for (int bounce = 0; bounce < LIGHTMAP_BOUNCES; bounce++) {
+				float r = sqrtf(random()), angle = 6.2831853f * random();
+				glm::vec3 direction = tangent * (r * cosf(angle)) + bitangent * (r * sinf(angle)) + normal * sqrtf(std::max(1.0f - r * r, 0.0f));
+				float distance;
+				int triangle;
+				if (!URayIntersectTriangles(&bake->bvh, &bake->occluders[0], position + normal * LIGHTMAP_OFFSET, direction,
+					1e30f, false, &distance, &triangle)) {
+					break;
+				}
+				const glm::vec3* corner = &bake->occluders[triangle * 3];
+				glm::vec3 hitNormal = glm::normalize(glm::cross(corner[1] - corner[0], corner[2] - corner[0]));
+				if (glm::dot(hitNormal, direction) > 0.0f) {
+					hitNormal = -hitNormal;
+				}
+				position = position + normal * LIGHTMAP_OFFSET + direction * distance;
+				normal = hitNormal;
+				tangent = glm::normalize(glm::cross(normal, fabsf(normal.x) < 0.9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0)));
+				bitangent = glm::cross(normal, tangent);
+
+				throughput *= LIGHTMAP_ALBEDO;
+				total += throughput * ULightmapDirect(bake, position, normal);
+			}
+		}
+		bake->colors[i] = total / (float) LIGHTMAP_SAMPLES;
+	}
+}
+
+/* Finds a representative of a triangle's chart, flattening the path on the way. */
+int ULightmapFindChart (std::vector<int>& parents, int triangle) {
+	while (parents[triangle] != triangle) {
+		parents[triangle] = parents[parents[triangle]];
+		triangle = parents[triangle];
+	}
+	return triangle;
+}
+
+/*
+ * Bakes the scene lights into a lightmap for the objects as they stand:
+ * charts from coplanar neighbouring triangles, packed on shelves into one
+ * atlas, path traced on the job system, filtered, written to lightmap.ppm
+ * and uploaded. Each mesh part is baked for the first object that uses it.
+ */
+void UBakeLightmap (void) {
+	double start = UNowMilliseconds();
+	ULightmapBake bake;
+	bake.lightPositions[0] = glm::vec3(scene.worlds[lightNode][3]);
+	bake.lightPositions[1] = glm::vec3(scene.worlds[lightNode2][3]);
+	bake.lightColors[0] = lightColor;
+	bake.lightColors[1] = lightColor2;
+
+	lightmap.objects.assign(sceneObjects.size(), 0);
+	std::vector<int> partObjects(meshParts.size(), -1);
+	for (int i = 0; i < (int) sceneObjects.size(); i++) {
+		if (partObjects[sceneObjects[i].part] < 0) {
+			partObjects[sceneObjects[i].part] = i;
+			lightmap.objects[i] = 1;
+		}
+	}
+
+	// Every vertex gets world coordinates; the full detail triangles also block light.
+	std::vector<glm::vec3> world(meshPositions.size());
+	std::vector<glm::vec3> worldNormals(meshPositions.size());
+	std::vector<int> triangleCharts;
+	std::vector<int> triangleStarts;
+	for (int p = 0; p < (int) meshParts.size(); p++) {
+		if (partObjects[p] < 0) {
+			continue;
+		}
+		const UMeshPart& part = meshParts[p];
+		const glm::mat4& model = scene.worlds[sceneObjects[partObjects[p]].node];
+		for (int l = 0; l < part.lodCount; l++) {
+			for (int v = part.lods[l].first; v < part.lods[l].first + part.lods[l].count; v++) {
+				world[v] = glm::vec3(model * glm::vec4(meshPositions[v], 1.0f));
+				worldNormals[v] = glm::mat3(model) * meshNormals[v];
+			}
+			for (int v = part.lods[l].first; v + 2 < part.lods[l].first + part.lods[l].count; v += 3) {
+				triangleStarts.push_back(v);
+				if (l == 0) {
+					bake.occluders.insert(bake.occluders.end(), &world[v], &world[v] + 3);
+				}
+			}
+		}
+	}
+
+	std::vector<glm::vec3> boundsMin(bake.occluders.size() / 3), boundsMax(bake.occluders.size() / 3);
+	for (int t = 0; t < (int) boundsMin.size(); t++) {
+		const glm::vec3* corner = &bake.occluders[t * 3];
+		boundsMin[t] = glm::min(corner[0], glm::min(corner[1], corner[2]));
+		boundsMax[t] = glm::max(corner[0], glm::max(corner[1], corner[2]));
+	}
+	if (!boundsMin.empty()) {
+		UBVHBuild(&bake.bvh, &boundsMin[0], &boundsMax[0], (int) boundsMin.size());
+	}
+
+	// Joins triangles that share an edge and face the same way.
+	int triangleCount = (int) triangleStarts.size();
+	std::vector<int> parents(triangleCount);
+	std::vector<glm::vec3> normals(triangleCount);
+	std::map<std::tuple<long, long, long, long, long, long>, int> edges;
+	for (int t = 0; t < triangleCount; t++) {
+		const glm::vec3* corner = &world[triangleStarts[t]];
+		glm::vec3 normal = glm::cross(corner[1] - corner[0], corner[2] - corner[0]);
+		float length = glm::length(normal);
+		normals[t] = length > 1e-12f ? normal / length : glm::vec3(0.0f, 0.0f, 1.0f);
+		// The winding in verts[] is not consistent, so the authored normals decide which side is lit.
+		if (glm::dot(normals[t], worldNormals[triangleStarts[t]]) < 0.0f) {
+			normals[t] = -normals[t];
+		}
+		parents[t] = t;
+
+		for (int e = 0; e < 3; e++) {
+			glm::vec3 a = corner[e], b = corner[(e + 1) % 3];
+			long ax = lroundf(a.x * 1e4f), ay = lroundf(a.y * 1e4f), az = lroundf(a.z * 1e4f);
+			long bx = lroundf(b.x * 1e4f), by = lroundf(b.y * 1e4f), bz = lroundf(b.z * 1e4f);
+			auto key = std::make_tuple(ax, ay, az, bx, by, bz);
+			if (std::make_tuple(bx, by, bz) < std::make_tuple(ax, ay, az)) {
+				key = std::make_tuple(bx, by, bz, ax, ay, az);
+			}
+			auto found = edges.find(key);
+			if (found == edges.end()) {
+				edges[key] = t;
+			} else if (glm::dot(normals[found->second], normals[t]) > 0.999f) {
+				parents[ULightmapFindChart(parents, t)] = ULightmapFindChart(parents, found->second);
+			}
+		}
+	}
+
+	// Lays each chart flat on its plane.
+	std::map<int, int> chartIndices;
+	for (int t = 0; t < triangleCount; t++) {
+		int root = ULightmapFindChart(parents, t);
+		if (chartIndices.find(root) == chartIndices.end()) {
+			chartIndices[root] = (int) bake.charts.size();
+			ULightmapChart chart;
+			chart.normal = normals[root];
+			chart.tangent = glm::normalize(glm::cross(chart.normal, fabsf(chart.normal.x) < 0.9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0)));
+			chart.bitangent = glm::cross(chart.normal, chart.tangent);
+			chart.low = glm::vec2(1e30f);
+			chart.high = glm::vec2(-1e30f);
+			bake.charts.push_back(chart);
+		}
+		triangleCharts.push_back(chartIndices[root]);
+		ULightmapChart& chart = bake.charts[triangleCharts[t]];
+		for (int c = 0; c < 3; c++) {
+			glm::vec3 corner = world[triangleStarts[t] + c];
+			glm::vec2 flat(glm::dot(corner, chart.tangent), glm::dot(corner, chart.bitangent));
+			chart.low = glm::min(chart.low, flat);
+			chart.high = glm::max(chart.high, flat);
+		}
+	}
+
+	// Packs charts tallest first onto shelves, shrinking the texel density until they fit.
+	float area = 0.0f;
+	for (const ULightmapChart& chart : bake.charts) {
+		area += (chart.high.x - chart.low.x) * (chart.high.y - chart.low.y);
+	}
+	bake.density = sqrtf(LIGHTMAP_SIZE * LIGHTMAP_SIZE * 0.5f / std::max(area, 1e-6f));
+	std::vector<int> order(bake.charts.size());
+	for (int c = 0; c < (int) order.size(); c++) {
+		order[c] = c;
+	}
+	std::sort(order.begin(), order.end(), [&](int a, int b) {
+		return bake.charts[a].high.y - bake.charts[a].low.y > bake.charts[b].high.y - bake.charts[b].low.y;
+	});
+	for (bool packed = false; !packed; bake.density *= 0.9f) {
+		int x = 0, y = 0, shelf = 0;
+		packed = true;
+		for (int c : order) {
+			ULightmapChart& chart = bake.charts[c];
+			chart.width = (int) ceilf((chart.high.x - chart.low.x) * bake.density) + 2 * LIGHTMAP_PADDING;
+			chart.height = (int) ceilf((chart.high.y - chart.low.y) * bake.density) + 2 * LIGHTMAP_PADDING;
+			if (x + chart.width > LIGHTMAP_SIZE) {
+				x = 0;
+				y += shelf;
+				shelf = 0;
+			}
+			if (chart.width > LIGHTMAP_SIZE || y + chart.height > LIGHTMAP_SIZE) {
+				packed = false;
+				break;
+			}
+			chart.x = x;
+			chart.y = y;
+			x += chart.width;
+			shelf = std::max(shelf, chart.height);
+		}
+		if (packed) {
+			break;
+		}
+	}
+
+	// Second texture coordinates, in the same order as the vertex buffer.
+	std::vector<glm::vec2> coordinates(meshPositions.size(), glm::vec2(0.0f));
+	for (int t = 0; t < triangleCount; t++) {
+		const ULightmapChart& chart = bake.charts[triangleCharts[t]];
+		for (int c = 0; c < 3; c++) {
+			glm::vec3 corner = world[triangleStarts[t] + c];
+			glm::vec2 flat(glm::dot(corner, chart.tangent), glm::dot(corner, chart.bitangent));
+			glm::vec2 texel = glm::vec2(chart.x + LIGHTMAP_PADDING, chart.y + LIGHTMAP_PADDING) + (flat - chart.low) * bake.density;
+			coordinates[triangleStarts[t] + c] = texel / (float) LIGHTMAP_SIZE;
+		}
+	}
+
+	// Finds the texels whose centers each triangle covers.
+	std::vector<int> atlas(LIGHTMAP_SIZE * LIGHTMAP_SIZE, -1);
+	for (int t = 0; t < triangleCount; t++) {
+		glm::vec2 corner[3];
+		for (int c = 0; c < 3; c++) {
+			corner[c] = coordinates[triangleStarts[t] + c] * (float) LIGHTMAP_SIZE;
+		}
+		float areaTwice = (corner[1].x - corner[0].x) * (corner[2].y - corner[0].y) - (corner[2].x - corner[0].x) * (corner[1].y - corner[0].y);
+		if (fabsf(areaTwice) < 1e-8f) {
+			continue;
+		}
+		int x0 = std::max((int) floorf(std::min(corner[0].x, std::min(corner[1].x, corner[2].x))), 0);
+		int x1 = std::min((int) ceilf(std::max(corner[0].x, std::max(corner[1].x, corner[2].x))), LIGHTMAP_SIZE - 1);
+		int y0 = std::max((int) floorf(std::min(corner[0].y, std::min(corner[1].y, corner[2].y))), 0);
+		int y1 = std::min((int) ceilf(std::max(corner[0].y, std::max(corner[1].y, corner[2].y))), LIGHTMAP_SIZE - 1);
+		for (int y = y0; y <= y1; y++) {
+			for (int x = x0; x <= x1; x++) {
+				glm::vec2 center(x + 0.5f, y + 0.5f);
+				float w1 = ((center.x - corner[0].x) * (corner[2].y - corner[0].y) - (corner[2].x - corner[0].x) * (center.y - corner[0].y)) / areaTwice;
+				float w2 = ((corner[1].x - corner[0].x) * (center.y - corner[0].y) - (center.x - corner[0].x) * (corner[1].y - corner[0].y)) / areaTwice;
+				if (w1 < -1e-4f || w2 < -1e-4f || w1 + w2 > 1.0f + 1e-4f || atlas[y * LIGHTMAP_SIZE + x] >= 0) {
+					continue;
+				}
+				const glm::vec3* position = &world[triangleStarts[t]];
+				ULightmapTexel texel;
+				texel.position = position[0] + (position[1] - position[0]) * w1 + (position[2] - position[0]) * w2;
+				texel.chart = triangleCharts[t];
+				atlas[y * LIGHTMAP_SIZE + x] = (int) bake.texels.size();
+				bake.texels.push_back(texel);
+			}
+		}
+	}
+
+	bake.colors.resize(bake.texels.size());
+	double traceStart = UNowMilliseconds();
+	UJobParallelFor((int) bake.texels.size(), 64, ULightmapBakeTexels, &bake);
+	double traceTime = UNowMilliseconds() - traceStart;
+
+	// Edge-stopping a-trous filter: wider each pass, never across charts or strong changes in light.
+	std::vector<glm::vec3> filtered(bake.colors.size());
+	const float kernel[5] = { 1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16, 1.0f / 16 };
+	for (int step = 1; step <= 4; step *= 2) {
+		for (int y = 0; y < LIGHTMAP_SIZE; y++) {
+			for (int x = 0; x < LIGHTMAP_SIZE; x++) {
+				int center = atlas[y * LIGHTMAP_SIZE + x];
+				if (center < 0) {
+					continue;
+				}
+				glm::vec3 sum(0.0f);
+				float weights = 0.0f;
+				for (int j = -2; j <= 2; j++) {
+					for (int i = -2; i <= 2; i++) {
+						int sx = x + i * step, sy = y + j * step;
+						if (sx < 0 || sy < 0 || sx >= LIGHTMAP_SIZE || sy >= LIGHTMAP_SIZE) {
+							continue;
+						}
+						int other = atlas[sy * LIGHTMAP_SIZE + sx];
+						if (other < 0 || bake.texels[other].chart != bake.texels[center].chart) {
+							continue;
+						}
+						glm::vec3 difference = bake.colors[other] - bake.colors[center];
+						float weight = kernel[i + 2] * kernel[j + 2] * expf(-glm::dot(difference, difference) / (LIGHTMAP_FILTER_SIGMA * step));
+						sum += bake.colors[other] * weight;
+						weights += weight;
+					}
+				}
+				filtered[center] = sum / weights;
+			}
+		}
+		bake.colors.swap(filtered);
+	}
 
-		// RIGHT
-		-0.55, 0.95, -0.8, 	1, 0, 0, 	1, 1,
-		-0.56, -1, -0.81, 	1, 0, 0, 	1, 0,
-		-0.56, -1, -0.89, 	1, 0, 0, 	0, 0,
-		-0.56, -1, -0.89, 	1, 0, 0, 	0, 0,
-		-0.55, 0.95, -0.9, 	1, 0, 0, 	0, 1,
-		-0.55, 0.95, -0.8, 	1, 0, 0, 	1, 1,
+	// Encodes the atlas, growing charts into their padding so filtering never reaches empty texels.
+	std::vector<unsigned char> pixels(LIGHTMAP_SIZE * LIGHTMAP_SIZE * 4, 0);
+	std::vector<unsigned char> filled(LIGHTMAP_SIZE * LIGHTMAP_SIZE, 0);
+	for (int i = 0; i < LIGHTMAP_SIZE * LIGHTMAP_SIZE; i++) {
+		if (atlas[i] >= 0) {
+			glm::vec3 color = glm::min(bake.colors[atlas[i]] / LIGHTMAP_RANGE, glm::vec3(1.0f)) * 255.0f + 0.5f;
+			pixels[i * 4] = (unsigned char) color.r;
+			pixels[i * 4 + 1] = (unsigned char) color.g;
+			pixels[i * 4 + 2] = (unsigned char) color.b;
+			pixels[i * 4 + 3] = 255;
+			filled[i] = 1;
+		}
+	}
+	for (int pass = 0; pass < LIGHTMAP_PADDING; pass++) {
+		std::vector<unsigned char> grown(filled);
+		for (int y = 0; y < LIGHTMAP_SIZE; y++) {
+			for (int x = 0; x < LIGHTMAP_SIZE; x++) {
+				if (filled[y * LIGHTMAP_SIZE + x]) {
+					continue;
+				}
+				int sum[3] = { 0, 0, 0 }, count = 0;
+				for (int j = std::max(y - 1, 0); j <= std::min(y + 1, LIGHTMAP_SIZE - 1); j++) {
+					for (int i = std::max(x - 1, 0); i <= std::min(x + 1, LIGHTMAP_SIZE - 1); i++) {
+						if (filled[j * LIGHTMAP_SIZE + i]) {
+							for (int c = 0; c < 3; c++) {
+								sum[c] += pixels[(j * LIGHTMAP_SIZE + i) * 4 + c];
+							}
+							count++;
+						}
+					}
+				}
+				if (count > 0) {
+					for (int c = 0; c < 3; c++) {
+						pixels[(y * LIGHTMAP_SIZE + x) * 4 + c] = (unsigned char) (sum[c] / count);
+					}
+					pixels[(y * LIGHTMAP_SIZE + x) * 4 + 3] = 255;
+					grown[y * LIGHTMAP_SIZE + x] = 1;
+				}
+			}
+		}
+		filled.swap(grown);
+	}
 
-		// FRONT
-		-0.56, -1, -0.89, 	0, 0, -1, 	1, 0,
-		-0.64, -1, -0.89, 	0, 0, -1, 	0, 0,
-		-0.65, 0.95, -0.9, 	0, 0, -1, 	0, 1,
-		-0.65, 0.95, -0.9, 	0, 0, -1, 	0, 1,
-		-0.55, 0.95, -0.9, 	0, 0, -1, 	1, 1,
-		-0.56, -1, -0.89, 	0, 0, -1, 	1, 0,
+	std::vector<unsigned char> row(LIGHTMAP_SIZE * 3);
+	bool written = UWritePPM("lightmap.ppm", &pixels[0], LIGHTMAP_SIZE, LIGHTMAP_SIZE, &row[0]);
 
-		// LEFT
-		-0.65, 0.95, -0.8, 	-1, 0, 0, 	1, 1,
-		-0.64, -1, -0.81, 	-1, 0, 0, 	1, 0,
-		-0.64, -1, -0.89, 	-1, 0, 0, 	0, 0,
-		-0.64, -1, -0.89, 	-1, 0, 0, 	0, 0,
-		-0.65, 0.95, -0.9, 	-1, 0, 0, 	0, 1,
-		-0.65, 0.95, -0.8, 	-1, 0, 0, 	1, 1,
+	// The shader samples exactly what went to the file.
+	if (lightmap.texture == 0) {
+		glGenTextures(1, &lightmap.texture);
+		glGenBuffers(1, &lightmap.coordinateBuffer);
+	}
+	glActiveTexture(GL_TEXTURE7);
+	glBindTexture(GL_TEXTURE_2D, lightmap.texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, LIGHTMAP_SIZE, LIGHTMAP_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glActiveTexture(GL_TEXTURE0);
+
+	glBindVertexArray(VAO);
+	glBindBuffer(GL_ARRAY_BUFFER, lightmap.coordinateBuffer);
+	glBufferData(GL_ARRAY_BUFFER, coordinates.size() * sizeof(glm::vec2), &coordinates[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (GLvoid*) 0);
+	glEnableVertexAttribArray(3);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glUseProgram(shaderProgram);
+	glUniform1i(glGetUniformLocation(shaderProgram, "lightmap"), 7);
+	glUniform1f(glGetUniformLocation(shaderProgram, "lightmapRange"), LIGHTMAP_RANGE);
+
+	lightmap.valid = true;
+	useLightmap = true;
+	allocationWarmup = ALLOCATION_WARMUP_FRAMES;
+	printf("INFO: Baked %d charts, %d texels at %.1f per unit, %d samples and %d bounces on %d workers: traced in %.0f ms, %.0f ms in all.\n",
+		(int) bake.charts.size(), (int) bake.texels.size(), bake.density, LIGHTMAP_SAMPLES, LIGHTMAP_BOUNCES,
+		std::max(jobWorkerCount, 1), traceTime, UNowMilliseconds() - start);
+	if (written) {
+		printf("INFO: Wrote lightmap.ppm.\n");
+	} else {
+		printf("WARNING: Could not write lightmap.ppm.\n");
+	}
+}
 
-		// New prism.
-		// TOP
-		0.55, 0.95, -0.8, 	0, 1, 0, 	0, 1,
-		0.55, 0.95, -0.9, 	0, 1, 0, 	0, 0,
-		0.65, 0.95, -0.9, 	0, 1, 0, 	1, 0,
-		0.65, 0.95, -0.9, 	0, 1, 0, 	1, 0,
-		0.65, 0.95, -0.8, 	0, 1, 0, 	1, 1,
-		0.55, 0.95, -0.8, 	0, 1, 0, 	0, 1,
+/* Drops the lightmap once anything it was baked for moves. */
+void ULightmapCheck (void) {
+	if (!lightmap.valid) {
+		return;
+	}
+	bool moved = (scene.flags[lightNode] | scene.flags[lightNode2]) & NODE_WORLD_CHANGED;
+	for (int i = 0; i < (int) lightmap.objects.size() && !moved; i++) {
+		moved = lightmap.objects[i] && (scene.flags[sceneObjects[i].node] & NODE_WORLD_CHANGED);
+	}
+	if (moved) {
+		lightmap.valid = false;
+		printf("INFO: The scene moved since the lightmap was baked; lighting is live again until the next bake.\n");
+	}
+}
 
-		// BOTTOM
-		0.56, -1, -0.81, 	0, -1, 0, 	0, 0,
-		0.56, -1, -0.89, 	0, -1, 0, 	0, 1,
-		0.64, -1, -0.89, 	0, -1, 0, 	1, 1,
-		0.64, -1, -0.89, 	0, -1, 0, 	1, 1,
-		0.64, -1, -0.81, 	0, -1, 0, 	1, 0,
-		0.56, -1, -0.81, 	0, -1, 0, 	0, 0,
+/*
+ * Collects finished overdraw measurements, updates the automatic choice and
+ * says whether this frame runs the pre-pass.
+ */
+bool UDepthPrepassBegin (void) {
+	for (int set = 0; set < PREPASS_QUERY_SETS; set++) {
+		if (!depthPrepass.pending[set]) {
+			continue;
+		}
+		GLint available[2] = { 0, 0 };
+		glGetQueryObjectiv(depthPrepass.queries[set][0], GL_QUERY_RESULT_AVAILABLE, &available[0]);
+		glGetQueryObjectiv(depthPrepass.queries[set][1], GL_QUERY_RESULT_AVAILABLE, &available[1]);
+		if (!available[0] || !available[1]) {
+			continue;
+		}
+		GLuint samples[2] = { 0, 0 };
+		glGetQueryObjectuiv(depthPrepass.queries[set][0], GL_QUERY_RESULT, &samples[0]);
+		glGetQueryObjectuiv(depthPrepass.queries[set][1], GL_QUERY_RESULT, &samples[1]);
+		depthPrepass.pending[set] = false;
+		if (samples[1] > 0) {
+			depthPrepass.overdraw = (double) samples[0] / samples[1];
+		}
+	}
 
-		// BACK
-		0.55, 0.95, -0.8, 	0, 0, 1, 	1, 1,
-		0.56, -1, -0.81, 	0, 0, 1, 	1, 0,
-		0.64, -1, -0.81, 	0, 0, 1, 	0, 0,
-		0.64, -1, -0.81, 	0, 0, 1, 	0, 0,
-		0.65, 0.95, -0.8, 	0, 0, 1, 	0, 1,
-		0.55, 0.95, -0.8, 	0, 0, 1, 	1, 1,
+	// Switches with some hysteresis so overdraw near the threshold does not flip it every probe.
+	bool wanted = depthPrepass.active ? depthPrepass.overdraw >= PREPASS_DISABLE_OVERDRAW : depthPrepass.overdraw > PREPASS_ENABLE_OVERDRAW;
+	if (wanted != depthPrepass.active) {
+		depthPrepass.active = wanted;
+		depthPrepass.switches++;
+	}
 
-		// RIGHT
-		0.65, 0.95, -0.8, 	1, 0, 0, 	1, 1,
-		0.64, -1, -0.81, 	1, 0, 0, 	1, 0,
-		0.64, -1, -0.89, 	1, 0, 0, 	0, 0,
-		0.64, -1, -0.89, 	1, 0, 0, 	0, 0,
-		0.65, 0.95, -0.9, 	1, 0, 0, 	0, 1,
-		0.65, 0.95, -0.8, 	1, 0, 0, 	1, 1,
+	depthPrepass.probing = false;
+	if (depthPrepass.mode == DEPTH_PREPASS_OFF) {
+		return false;
+	}
+	if (depthPrepass.mode == DEPTH_PREPASS_AUTO && !depthPrepass.active) {
+		if (profileFrameCount - depthPrepass.lastProbe < PREPASS_PROBE_INTERVAL) {
+			return false;
+		}
+		depthPrepass.probing = true;
+		depthPrepass.lastProbe = profileFrameCount;
+	}
+	return true;
+}
 
-		// FRONT
-		0.64, -1, -0.89, 	0, 0, -1, 	1, 0,
-		0.56, -1, -0.89, 	0, 0, -1, 	0, 0,
-		0.55, 0.95, -0.9, 	0, 0, -1, 	0, 1,
-		0.55, 0.95, -0.9, 	0, 0, -1, 	0, 1,
-		0.65, 0.95, -0.9, 	0, 0, -1, 	1, 1,
-		0.64, -1, -0.89, 	0, 0, -1, 	1, 0,
+/* Draws the queue's commands depth only, then sets up the equal test for the color pass. */
+void UDepthPrepassDraw (const URenderQueue* queue, const glm::mat4& view, const glm::mat4& projection) {
+	// Measures only with a free query set, and never inside a benchmark's own samples query.
+	depthPrepass.set = -1;
+	if (!measureShadingSamples && !depthPrepass.pending[depthPrepass.nextSet]) {
+		depthPrepass.set = depthPrepass.nextSet;
+		depthPrepass.nextSet = (depthPrepass.nextSet + 1) % PREPASS_QUERY_SETS;
+		glBeginQuery(GL_SAMPLES_PASSED, depthPrepass.queries[depthPrepass.set][0]);
+	}
 
-		// LEFT
-		0.55, 0.95, -0.8, 	-1, 0, 0, 	1, 1,
-		0.56, -1, -0.81, 	-1, 0, 0, 	1, 0,
-		0.56, -1, -0.89, 	-1, 0, 0, 	0, 0,
-		0.56, -1, -0.89, 	-1, 0, 0, 	0, 0,
-		0.55, 0.95, -0.9, 	-1, 0, 0, 	0, 1,
-		0.55, 0.95, -0.8, 	-1, 0, 0, 	1, 1,
+	glUseProgram(depthProgram);
+	glBindVertexArray(depthVAO);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glUniformMatrix4fv(glGetUniformLocation(depthProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+	glUniformMatrix4fv(glGetUniformLocation(depthProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	GLint modelLoc = glGetUniformLocation(depthProgram, "model");
+	for (int i = 0; i < queue->count; i++) {
+		const URenderCommand& command = queue->commands[i];
+		const UMeshPart& part = meshParts[sceneObjects[command.object].part];
+		glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(scene.worlds[sceneObjects[command.object].node]));
+		glDrawArrays(GL_TRIANGLES, part.lods[command.lod].first, part.lods[command.lod].count);
+	}
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 
-		// New prism.
-		// TOP
-		0.55, 0.95, 0.9, 	0, 1, 0, 	0, 1,
-		0.55, 0.95, 0.8, 	0, 1, 0, 	0, 0,
-		0.65, 0.95, 0.8, 	0, 1, 0, 	1, 0,
-		0.65, 0.95, 0.8, 	0, 1, 0, 	1, 0,
-		0.65, 0.95, 0.9, 	0, 1, 0, 	1, 1,
-		0.55, 0.95, 0.9, 	0, 1, 0, 	0, 1,
+	if (depthPrepass.set >= 0) {
+		glEndQuery(GL_SAMPLES_PASSED);
+		glBeginQuery(GL_SAMPLES_PASSED, depthPrepass.queries[depthPrepass.set][1]);
+	}
+	glDepthFunc(GL_EQUAL);
+	glDepthMask(GL_FALSE);
+}
 
-		// BOTTOM
-		0.56, -1, 0.89, 	0, -1, 0, 	0, 0,
-		0.56, -1, 0.81, 	0, -1, 0, 	0, 1,
-		0.64, -1, 0.81, 	0, -1, 0, 	1, 1,
-		0.64, -1, 0.81, 	0, -1, 0, 	1, 1,
-		0.64, -1, 0.89, 	0, -1, 0, 	1, 0,
-		0.56, -1, 0.89, 	0, -1, 0, 	0, 0,
+void UDepthPrepassEnd (void) {
+	if (depthPrepass.set >= 0) {
+		glEndQuery(GL_SAMPLES_PASSED);
+		depthPrepass.pending[depthPrepass.set] = true;
+	}
+	glDepthMask(GL_TRUE);
+	glDepthFunc(GL_LESS);
+}
 
-		// BACK
-		0.55, 0.95, 0.9, 	0, 0, 1, 	1, 1,
-		0.56, -1, 0.89, 	0, 0, 1, 	1, 0,
-		0.64, -1, 0.89, 	0, 0, 1, 	0, 0,
-		0.64, -1, 0.89, 	0, 0, 1, 	0, 0,
-		0.65, 0.95, 0.9, 	0, 0, 1, 	0, 1,
-		0.55, 0.95, 0.9, 	0, 0, 1, 	1, 1,
+/* Compiles and links a compute program, reporting errors the way UCompileProgram does. */
+GLuint UCompileComputeProgram (const char* source, const char* name) {
+	GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
 
-		// RIGHT
-		0.65, 0.95, 0.9, 	1, 0, 0, 	1, 1,
-		0.64, -1, 0.89, 	1, 0, 0, 	1, 0,
-		0.64, -1, 0.81, 	1, 0, 0, 	0, 0,
-		0.64, -1, 0.81, 	1, 0, 0, 	0, 0,
-		0.65, 0.95, 0.8, 	1, 0, 0, 	0, 1,
-		0.65, 0.95, 0.9, 	1, 0, 0, 	1, 1,
+	GLint success = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+	if (success == GL_FALSE) {
+		int size;
+		char str[1024] = { 0 };
+		glGetShaderInfoLog(shader, sizeof(str), &size, str);
+		printf("ERROR COMPILING %s COMPUTE SHADER.\n%s\n", name, str);
+	}
 
-		// FRONT
-		0.64, -1, 0.81, 	0, 0, -1, 	1, 0,
-		0.56, -1, 0.81, 	0, 0, -1, 	0, 0,
-		0.55, 0.95, 0.8, 	0, 0, -1, 	0, 1,
-		0.55, 0.95, 0.8, 	0, 0, -1, 	0, 1,
-		0.65, 0.95, 0.8, 	0, 0, -1, 	1, 1,
-		0.64, -1, 0.81, 	0, 0, -1, 	1, 0,
+	GLuint program = glCreateProgram();
+	glAttachShader(program, shader);
+	glLinkProgram(program);
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (linked == GL_FALSE) {
+		int size;
+		char str[1024] = { 0 };
+		glGetProgramInfoLog(program, sizeof(str), &size, str);
+		printf("ERROR LINKING %s PROGRAM.\n%s\n", name, str);
+	}
 
-		// LEFT
-		0.55, 0.95, 0.9, 	-1, 0, 0, 	1, 1,
-		0.56, -1, 0.89, 	-1, 0, 0, 	1, 0,
-		0.56, -1, 0.81, 	-1, 0, 0, 	0, 0,
-		0.56, -1, 0.81, 	-1, 0, 0, 	0, 0,
-		0.55, 0.95, 0.8, 	-1, 0, 0, 	0, 1,
-		0.55, 0.95, 0.9, 	-1, 0, 0, 	1, 1,
+	glDeleteShader(shader);
+	return program;
+}
 
-		// New prism.
-		// TOP
-		-0.6, -0.65, 0.85, 	0, 1, 0, 	0, 1,
-		-0.6, -0.65, -0.85, 	0, 1, 0, 	0, 0,
-		0.6, -0.65, -0.85, 	0, 1, 0, 	1, 0,
-		0.6, -0.65, -0.85, 	0, 1, 0, 	1, 0,
-		0.6, -0.65, 0.85, 	0, 1, 0, 	1, 1,
-		-0.6, -0.65, 0.85, 	0, 1, 0, 	0, 1,
+void UGpuCullCreate (void) {
+	// Compute shaders and storage buffers are GL 4.3, indirect draws with a base instance GL 4.2.
+	gpuCulling.supported = GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object &&
+		GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance;
+	if (!gpuCulling.supported) {
+		printf("WARNING: GPU culling needs compute shaders and indirect draws, culling stays on the CPU.\n");
+		return;
+	}
+	gpuCulling.drawCount = GLEW_ARB_indirect_parameters;
+
+	gpuCulling.cullProgram = UCompileComputeProgram(gpuCullShaderSource, "GPU CULLING");
+	gpuCulling.pyramidProgram = UCompileComputeProgram(depthPyramidShaderSource, "DEPTH PYRAMID");
+	gpuCulling.forwardProgram = UCompileProgram(gpuDrivenVertexShaderSource, fragmentShaderSource, "GPU-DRIVEN");
+	gpuCulling.gbufferProgram = UCompileProgram(gpuDrivenVertexShaderSource, gbufferShaderSource, "GPU-DRIVEN G-BUFFER");
+
+	// Same samplers and material as the programs they stand in for; objects are on unit 8.
+	glUseProgram(gpuCulling.forwardProgram);
+	glUniform1i(glGetUniformLocation(gpuCulling.forwardProgram, "shadowMap"), 5);
+	glUniform1i(glGetUniformLocation(gpuCulling.forwardProgram, "shadowMap2"), 6);
+	glUniform1i(glGetUniformLocation(gpuCulling.forwardProgram, "objects"), 8);
+	UTextureTableSetup(gpuCulling.forwardProgram);
+	glUseProgram(gpuCulling.gbufferProgram);
+	glUniform1f(glGetUniformLocation(gpuCulling.gbufferProgram, "materialSpecular"), 1.0f);
+	glUniform1f(glGetUniformLocation(gpuCulling.gbufferProgram, "materialShininess"), 16.0f);
+	glUniform1i(glGetUniformLocation(gpuCulling.gbufferProgram, "objects"), 8);
+	UTextureTableSetup(gpuCulling.gbufferProgram);
+	glUseProgram(gpuCulling.cullProgram);
+	glUniform1i(glGetUniformLocation(gpuCulling.cullProgram, "pyramid"), 9);
+	glUniform1fv(glGetUniformLocation(gpuCulling.cullProgram, "lodScreenRadius"), MESH_LOD_COUNT, lodScreenRadius);
+	glUseProgram(gpuCulling.pyramidProgram);
+	glUniform1i(glGetUniformLocation(gpuCulling.pyramidProgram, "depth"), 9);
+	glUseProgram(shaderProgram);
+
+	// Sphere and LOD ranges of every mesh part, which never change.
+	struct UGpuPart {
+		glm::vec4 sphere;
+		GLint lodFirst[4], lodCount[4];
+	};
+	std::vector<UGpuPart> parts(meshParts.size());
+	for (int i = 0; i < (int) meshParts.size(); i++) {
+		parts[i].sphere = glm::vec4(meshParts[i].sphereCenter, meshParts[i].sphereRadius);
+		for (int lod = 0; lod < 4; lod++) {
+			parts[i].lodFirst[lod] = meshParts[i].lods[std::min(lod, MESH_LOD_COUNT - 1)].first;
+			parts[i].lodCount[lod] = meshParts[i].lods[std::min(lod, MESH_LOD_COUNT - 1)].count;
+		}
+	}
+	glGenBuffers(1, &gpuCulling.partBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.partBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, parts.size() * sizeof(UGpuPart), &parts[0], GL_STATIC_DRAW);
+
+	glGenBuffers(1, &gpuCulling.counterBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.counterBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, 8 * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+
+	// Buffer names only become buffers once bound, which the buffer texture needs.
+	glGenBuffers(1, &gpuCulling.objectBuffer);
+	glGenBuffers(1, &gpuCulling.commandBuffer);
+	glGenBuffers(1, &gpuCulling.instanceBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.objectBuffer);
+	glGenTextures(1, &gpuCulling.objectTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, gpuCulling.objectTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, gpuCulling.objectBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	// Instance n of a draw reads element baseInstance + n, so element i is i.
+	glBindVertexArray(VAO);
+	glBindBuffer(GL_ARRAY_BUFFER, gpuCulling.instanceBuffer);
+	glVertexAttribIPointer(4, 1, GL_INT, sizeof(GLint), (GLvoid*) 0);
+	glVertexAttribDivisor(4, 1);
+	glEnableVertexAttribArray(4);
+	glBindVertexArray(0);
+
+	UGpuCullUpload();
+}
 
-		// BOTTOM
-		-0.6, -0.7, 0.85, 	0, -1, 0, 	0, 0,
-		-0.6, -0.7, -0.85, 	0, -1, 0, 	0, 1,
-		0.6, -0.7, -0.85, 	0, -1, 0, 	1, 1,
-		0.6, -0.7, -0.85, 	0, -1, 0, 	1, 1,
-		0.6, -0.7, 0.85, 	0, -1, 0, 	1, 0,
-		-0.6, -0.7, 0.85, 	0, -1, 0, 	0, 0,
+/* Grows the buffers with the scene, then writes the objects that moved, or all of them after a reupload. */
+void UGpuCullUpload (void) {
+	int count = (int) sceneObjects.size();
+	if (count > gpuCulling.capacity) {
+		int capacity = std::max(count, gpuCulling.capacity * 2);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.objectBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr) capacity * GPU_CULL_OBJECT_TEXELS * sizeof(glm::vec4), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.commandBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr) capacity * 4 * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+
+		std::vector<GLint> indices(capacity);
+		for (int i = 0; i < capacity; i++) {
+			indices[i] = i;
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, gpuCulling.instanceBuffer);
+		glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(GLint), &indices[0], GL_STATIC_DRAW);
 
-		// BACK
-		-0.6, -0.65, 0.85, 	0, 0, 1, 	1, 1,
-		-0.6, -0.7, 0.85, 	0, 0, 1, 	1, 0,
-		0.6, -0.7, 0.85, 	0, 0, 1, 	0, 0,
-		0.6, -0.7, 0.85, 	0, 0, 1, 	0, 0,
-		0.6, -0.65, 0.85, 	0, 0, 1, 	0, 1,
-		-0.6, -0.65, 0.85, 	0, 0, 1, 	1, 1,
+		gpuCulling.capacity = capacity;
+		gpuCulling.reupload = true;
+	}
+	if (gpuCulling.reupload) {
+		gpuCulling.uploaded = 0;
+		gpuCulling.reupload = false;
+	}
 
-		// RIGHT
-		0.6, -0.65, 0.85, 	1, 0, 0, 	1, 1,
-		0.6, -0.7, 0.85, 	1, 0, 0, 	1, 0,
-		0.6, -0.7, -0.85, 	1, 0, 0, 	0, 0,
-		0.6, -0.7, -0.85, 	1, 0, 0, 	0, 0,
-		0.6, -0.65, -0.85, 	1, 0, 0, 	0, 1,
-		0.6, -0.65, 0.85, 	1, 0, 0, 	1, 1,
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.objectBuffer);
+	glm::vec4 texels[GPU_CULL_UPLOAD_BATCH * GPU_CULL_OBJECT_TEXELS];
+	int runFirst = 0, runCount = 0;
+	auto flush = [&]() {
+		if (runCount > 0) {
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, (GLintptr) runFirst * GPU_CULL_OBJECT_TEXELS * sizeof(glm::vec4),
+				runCount * GPU_CULL_OBJECT_TEXELS * sizeof(glm::vec4), texels);
+			runCount = 0;
+		}
+	};
+	for (int i = 0; i < count; i++) {
+		const USceneObject& object = sceneObjects[i];
+		if (i < gpuCulling.uploaded && !(scene.flags[object.node] & NODE_WORLD_CHANGED)) {
+			continue;
+		}
+		if (runCount == GPU_CULL_UPLOAD_BATCH || (runCount > 0 && runFirst + runCount != i)) {
+			flush();
+		}
+		if (runCount == 0) {
+			runFirst = i;
+		}
 
-		// FRONT
-		0.6, -0.7, -0.85, 	0, 0, -1, 	1, 0,
-		-0.6, -0.7, -0.85, 	0, 0, -1, 	0, 0,
-		-0.6, -0.65, -0.85, 	0, 0, -1, 	0, 1,
-		-0.6, -0.65, -0.85, 	0, 0, -1, 	0, 1,
-		0.6, -0.65, -0.85, 	0, 0, -1, 	1, 1,
-		0.6, -0.7, -0.85, 	0, 0, -1, 	1, 0,
+		glm::vec4* texel = texels + runCount * GPU_CULL_OBJECT_TEXELS;
+		const glm::mat4& world = scene.worlds[object.node];
+		const glm::mat3& normal = scene.worldNormals[object.node];
+		for (int c = 0; c < 4; c++) {
+			texel[c] = world[c];
+		}
+		for (int c = 0; c < 3; c++) {
+			texel[4 + c] = glm::vec4(normal[c], 0.0f);
+		}
+		texel[7] = glm::vec4(objectBoundsMin[i], (GLfloat) object.part);
+		texel[8] = glm::vec4(objectBoundsMax[i], (GLfloat) object.texture);
+		runCount++;
+	}
+	flush();
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	gpuCulling.uploaded = count;
+}
 
-		// LEFT
-		-0.6, -0.65, 0.85, 	-1, 0, 0, 	1, 1,
-		-0.6, -0.7, 0.85, 	-1, 0, 0, 	1, 0,
-		-0.6, -0.7, -0.85, 	-1, 0, 0, 	0, 0,
-		-0.6, -0.7, -0.85, 	-1, 0, 0, 	0, 0,
-		-0.6, -0.65, -0.85, 	-1, 0, 0, 	0, 1,
-		-0.6, -0.65, 0.85, 	-1, 0, 0, 	1, 1,
+/* Culls every object and writes this frame's draws, without waiting on the GPU. */
+void UGpuCullDispatch (const glm::mat4& view, const glm::mat4& projection) {
+	UGpuCullUpload();
+	int count = (int) sceneObjects.size();
+
+	// Clears the counters, and without a draw count every command the draw will read.
+	const GLuint zero = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.counterBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	if (!gpuCulling.drawCount) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.commandBuffer);
+		glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, (GLsizeiptr) count * 4 * sizeof(GLuint),
+			GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	}
 
-		// New prism.
-		// TOP
-		-0.6, 0.95, 0.85, 	0, 1, 0, 	0, 1,
-		-0.6, 0.95, -0.85, 	0, 1, 0, 	0, 0,
-		0.6, 0.95, -0.85, 	0, 1, 0, 	1, 0,
-		0.6, 0.95, -0.85, 	0, 1, 0, 	1, 0,
-		0.6, 0.95, 0.85, 	0, 1, 0, 	1, 1,
-		-0.6, 0.95, 0.85, 	0, 1, 0, 	0, 1,
+	UFrustum frustum;
+	UExtractFrustum(projection * view, &frustum);
+	glm::vec4 planes[6];
+	for (int i = 0; i < 6; i++) {
+		planes[i] = glm::vec4(frustum.nx[i], frustum.ny[i], frustum.nz[i], frustum.d[i]);
+	}
+
+	GLuint program = gpuCulling.cullProgram;
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "objectCount"), count);
+	glUniform4fv(glGetUniformLocation(program, "planes"), 6, glm::value_ptr(planes[0]));
+	glUniformMatrix4fv(glGetUniformLocation(program, "view"), 1, GL_FALSE, glm::value_ptr(view));
+	glUniform1f(glGetUniformLocation(program, "lodScale"), projection[1][1] * renderHeight * 0.5f * exp2f(-lodBias));
+	glUniform1i(glGetUniformLocation(program, "perspective"), projection[2][3] != 0.0f);
+	glUniform1i(glGetUniformLocation(program, "forcedLOD"), forcedLOD);
+	bool occlusion = occlusionCulling && gpuCulling.pyramidValid;
+	glUniform1i(glGetUniformLocation(program, "occlusion"), occlusion);
+	if (occlusion) {
+		glUniform1i(glGetUniformLocation(program, "pyramidLevels"), gpuCulling.pyramidLevels);
+		glUniformMatrix4fv(glGetUniformLocation(program, "pyramidViewProjection"), 1, GL_FALSE,
+			glm::value_ptr(gpuCulling.pyramidViewProjection));
+		glActiveTexture(GL_TEXTURE9);
+		glBindTexture(GL_TEXTURE_2D, gpuCulling.pyramid);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gpuCulling.objectBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gpuCulling.partBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, gpuCulling.commandBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, gpuCulling.counterBuffer);
+	glDispatchCompute((count + GPU_CULL_GROUP_SIZE - 1) / GPU_CULL_GROUP_SIZE, 1, 1);
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+/* Draws what UGpuCullDispatch kept with the program in use, which must read the objects on unit 8. */
+void UGpuCullDraw (void) {
+	glActiveTexture(GL_TEXTURE8);
+	glBindTexture(GL_TEXTURE_BUFFER, gpuCulling.objectTexture);
+	glActiveTexture(GL_TEXTURE0);
+
+	int count = (int) sceneObjects.size();
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gpuCulling.commandBuffer);
+	if (gpuCulling.drawCount) {
+		glBindBuffer(GL_PARAMETER_BUFFER_ARB, gpuCulling.counterBuffer);
+		glMultiDrawArraysIndirectCountARB(GL_TRIANGLES, (GLvoid*) 0, 0, count, 0);
+	} else {
+		glMultiDrawArraysIndirect(GL_TRIANGLES, (GLvoid*) 0, count, 0);
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+/* Copies the GPU's counts into cullStats. This waits for the frame, so only the report calls it. */
+void UGpuCullReadStats (void) {
+	GLuint counters[3 + MESH_LOD_COUNT];
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCulling.counterBuffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	cullStats.visible = counters[0];
+	cullStats.occluded = counters[1];
+	cullStats.culled = cullStats.objects - cullStats.visible;
+	cullStats.triangles = counters[2];
+	for (int lod = 0; lod < MESH_LOD_COUNT; lod++) {
+		cullStats.lodObjects[lod] = counters[3 + lod];
+	}
+}
+
+/* Reduces the frame's depth into the pyramid the next frame culls against. */
+void UGpuCullBuildPyramid (const glm::mat4& viewProjection) {
+	if (gpuCulling.pyramidWidth != renderWidth || gpuCulling.pyramidHeight != renderHeight) {
+		if (gpuCulling.pyramid != 0) {
+			GLuint textures[2] = { gpuCulling.depthCopy, gpuCulling.pyramid };
+			glDeleteTextures(2, textures);
+		}
+		gpuCulling.pyramidLevels = 1;
+		while ((std::max(renderWidth, renderHeight) >> gpuCulling.pyramidLevels) > 0) {
+			gpuCulling.pyramidLevels++;
+		}
+
+		GLuint textures[2];
+		glGenTextures(2, textures);
+		gpuCulling.depthCopy = textures[0];
+		gpuCulling.pyramid = textures[1];
+		glBindTexture(GL_TEXTURE_2D, gpuCulling.depthCopy);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, renderWidth, renderHeight);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, gpuCulling.pyramid);
+		glTexStorage2D(GL_TEXTURE_2D, gpuCulling.pyramidLevels, GL_R32F, renderWidth, renderHeight);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		gpuCulling.pyramidWidth = renderWidth;
+		gpuCulling.pyramidHeight = renderHeight;
+		gpuCulling.pyramidValid = false;
+	}
+
+	// Depth buffers cannot be sampled directly when the window owns them, so it is copied first.
+	glActiveTexture(GL_TEXTURE9);
+	glBindTexture(GL_TEXTURE_2D, gpuCulling.depthCopy);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, renderTarget);
+	glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, renderWidth, renderHeight);
+
+	GLuint program = gpuCulling.pyramidProgram;
+	glUseProgram(program);
+	GLint fromDepthLoc = glGetUniformLocation(program, "fromDepth");
+	for (int level = 0; level < gpuCulling.pyramidLevels; level++) {
+		int width = std::max(renderWidth >> level, 1), height = std::max(renderHeight >> level, 1);
+		glUniform1i(fromDepthLoc, level == 0);
+		if (level > 0) {
+			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+			glBindImageTexture(0, gpuCulling.pyramid, level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+		}
+		glBindImageTexture(1, gpuCulling.pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		glDispatchCompute((width + 7) / 8, (height + 7) / 8, 1);
+	}
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	glActiveTexture(GL_TEXTURE0);
+
+	gpuCulling.pyramidViewProjection = viewProjection;
+	gpuCulling.pyramidValid = true;
+}
+
+/* Builds lampProgram and lightVAO, whose attributes are pointed into the stream buffer at each flush. */
+void UDebugDrawCreate (void) {
+	lampProgram = UCompileProgram(lampVertexShaderSource, lampFragmentShaderSource, "LAMP");
+	debugDraw.lines = new UDebugPrimitive[DEBUG_MAX_LINES];
+	debugDraw.shapes = new UDebugPrimitive[DEBUG_MAX_SHAPES];
+
+	glGenVertexArrays(1, &lightVAO);
+	glBindVertexArray(lightVAO);
+	for (int i = 0; i < 4; i++) {
+		glEnableVertexAttribArray(i);
+		glVertexAttribDivisor(i, 1);
+	}
+	glBindVertexArray(0);
+}
+
+GLuint UDebugColor (glm::vec3 color) {
+	glm::vec3 bytes = glm::clamp(color, 0.0f, 1.0f) * 255.0f + 0.5f;
+	return (GLuint) bytes.r | (GLuint) bytes.g << 8 | (GLuint) bytes.b << 16 | 0xFF000000u;
+}
+
+void UDebugLine (glm::vec3 from, glm::vec3 to, glm::vec3 color) {
+	if (debugDraw.lineCount == DEBUG_MAX_LINES) {
+		debugDraw.dropped++;
+		return;
+	}
+	UDebugPrimitive& line = debugDraw.lines[debugDraw.lineCount++];
+	line.a = from;
+	line.color = UDebugColor(color);
+	line.b = to;
+	line.sphere = 0.0f;
+}
+
+void UDebugBox (glm::vec3 boundsMin, glm::vec3 boundsMax, glm::vec3 color) {
+	if (debugDraw.shapeCount == DEBUG_MAX_SHAPES) {
+		debugDraw.dropped++;
+		return;
+	}
+	UDebugPrimitive& box = debugDraw.shapes[debugDraw.shapeCount++];
+	box.a = boundsMin;
+	box.color = UDebugColor(color);
+	box.b = boundsMax;
+	box.sphere = 0.0f;
+}
 
-		// BOTTOM
-		-0.6, 0.25, 0.85, 	0, -1, 0, 	0, 0,
-		-0.6, 0.25, -0.85, 	0, -1, 0, 	0, 1,
-		0.6, 0.25, -0.85, 	0, -1, 0, 	1, 1,
-		0.6, 0.25, -0.85, 	0, -1, 0, 	1, 1,
-		0.6, 0.25, 0.85, 	0, -1, 0, 	1, 0,
-		-0.6, 0.25, 0.85, 	0, -1, 0, 	0, 0,
+void UDebugSphere (glm::vec3 center, GLfloat radius, glm::vec3 color) {
+	if (debugDraw.shapeCount == DEBUG_MAX_SHAPES) {
+		debugDraw.dropped++;
+		return;
+	}
+	UDebugPrimitive& sphere = debugDraw.shapes[debugDraw.shapeCount++];
+	sphere.a = center;
+	sphere.color = UDebugColor(color);
+	sphere.b = glm::vec3(radius, 0.0f, 0.0f);
+	sphere.sphere = 1.0f;
+}
 
-		// BACK
-		-0.6, 0.95, 0.85, 	0, 0, 1, 	1, 1,
-		-0.6, 0.25, 0.85, 	0, 0, 1, 	1, 0,
-		0.6, 0.25, 0.85, 	0, 0, 1, 	0, 0,
-		0.6, 0.25, 0.85, 	0, 0, 1, 	0, 0,
-		0.6, 0.95, 0.85, 	0, 0, 1, 	0, 1,
-		-0.6, 0.95, 0.85, 	0, 0, 1, 	1, 1,
+/* A small cross at the light, and its reach when it has one. */
+void UDebugLight (glm::vec3 position, GLfloat radius, glm::vec3 color) {
+	const GLfloat size = 0.1f;
+	UDebugLine(position - glm::vec3(size, 0.0f, 0.0f), position + glm::vec3(size, 0.0f, 0.0f), color);
+	UDebugLine(position - glm::vec3(0.0f, size, 0.0f), position + glm::vec3(0.0f, size, 0.0f), color);
+	UDebugLine(position - glm::vec3(0.0f, 0.0f, size), position + glm::vec3(0.0f, 0.0f, size), color);
+	if (radius > 0.0f) {
+		UDebugSphere(position, radius, color * 0.5f);
+	}
+}
 
-		// RIGHT
-		0.6, 0.95, 0.85, 	1, 0, 0, 	1, 1,
-		0.6, 0.25, 0.85, 	1, 0, 0, 	1, 0,
-		0.6, 0.25, -0.85, 	1, 0, 0, 	0, 0,
-		0.6, 0.25, -0.85, 	1, 0, 0, 	0, 0,
-		0.6, 0.95, -0.85, 	1, 0, 0, 	0, 1,
-		0.6, 0.95, 0.85, 	1, 0, 0, 	1, 1,
+/* The edges of the volume viewProjection maps to clip space. */
+void UDebugFrustum (const glm::mat4& viewProjection, glm::vec3 color) {
+	glm::mat4 inverse = glm::inverse(viewProjection);
+	glm::vec3 corners[8];
+	for (int i = 0; i < 8; i++) {
+		glm::vec4 corner = inverse * glm::vec4((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, (i & 4) ? 1.0f : -1.0f, 1.0f);
+		corners[i] = glm::vec3(corner) / corner.w;
+	}
+	for (int i = 0; i < 8; i++) {
+		for (int bit = 1; bit < 8; bit <<= 1) {
+			if (!(i & bit)) {
+				UDebugLine(corners[i], corners[i | bit], color);
+			}
+		}
+	}
+}
 
-		// FRONT
-		0.6, 0.25, -0.85, 	0, 0, -1, 	1, 0,
-		-0.6, 0.25, -0.85, 	0, 0, -1, 	0, 0,
-		-0.6, 0.95, -0.85, 	0, 0, -1, 	0, 1,
-		-0.6, 0.95, -0.85, 	0, 0, -1, 	0, 1,
-		0.6, 0.95, -0.85, 	0, 0, -1, 	1, 1,
-		0.6, 0.25, -0.85, 	0, 0, -1, 	1, 0,
+/* Lights, object bounds, and the frustum from when drawing was turned on. */
+void UDebugDrawScene (const glm::mat4& viewProjection, const glm::vec3& lightPosition, const glm::vec3& lightPosition2, bool culledOnCPU) {
+	if (!debugDraw.frustumFrozen) {
+		debugDraw.frozenViewProjection = viewProjection;
+		debugDraw.frustumFrozen = true;
+	}
+	UDebugFrustum(debugDraw.frozenViewProjection, glm::vec3(1.0f));
 
-		// LEFT
-		-0.6, 0.95, 0.85, 	-1, 0, 0, 	1, 1,
-		-0.6, 0.25, 0.85, 	-1, 0, 0, 	1, 0,
-		-0.6, 0.25, -0.85, 	-1, 0, 0, 	0, 0,
-		-0.6, 0.25, -0.85, 	-1, 0, 0, 	0, 0,
-		-0.6, 0.95, -0.85, 	-1, 0, 0, 	0, 1,
-		-0.6, 0.95, 0.85, 	-1, 0, 0, 	1, 1,
+	UDebugLight(lightPosition, 0.0f, lightColor);
+	UDebugLight(lightPosition2, 0.0f, lightColor2);
+	for (int i = 0; i < activePointLights; i++) {
+		UDebugLight(pointLights[i].position, pointLights[i].radius, pointLights[i].color);
+	}
 
-		// New prism.
-		// TOP
-		-0.65, 0.85, 0.65, 	0, 1, 0, 	0, 1,
-		-0.65, 0.85, -0.65, 	0, 1, 0, 	0, 0,
-		-0.6, 0.85, -0.65, 	0, 1, 0, 	1, 0,
-		-0.6, 0.85, -0.65, 	0, 1, 0, 	1, 0,
-		-0.6, 0.85, 0.65, 	0, 1, 0, 	1, 1,
-		-0.65, 0.85, 0.65, 	0, 1, 0, 	0, 1,
+	// Culling results are only on the CPU when it did the culling.
+	for (int i = 0; i < (int) sceneObjects.size(); i++) {
+		glm::vec3 color = !culledOnCPU ? glm::vec3(0.0f, 0.8f, 0.8f) : objectVisible[i] ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(0.5f, 0.0f, 0.0f);
+		UDebugBox(objectBoundsMin[i], objectBoundsMax[i], color);
+	}
+}
 
-		// BOTTOM
-		-0.65, 0.35, 0.65, 	0, -1, 0, 	0, 0,
-		-0.65, 0.35, -0.65, 	0, -1, 0, 	0, 1,
-		-0.6, 0.35, -0.65, 	0, -1, 0, 	1, 1,
-		-0.6, 0.35, -0.65, 	0, -1, 0, 	1, 1,
-		-0.6, 0.35, 0.65, 	0, -1, 0, 	1, 0,
-		-0.65, 0.35, 0.65, 	0, -1, 0, 	0, 0,
+/* Draws everything added since the last flush over the current target, tested against its depth. */
+void UDebugDrawFlush (const glm::mat4& viewProjection) {
+	int lines = debugDraw.lineCount, shapes = debugDraw.shapeCount;
+	debugDraw.lineCount = debugDraw.shapeCount = 0;
+	debugDraw.drawnLines = debugDraw.drawnShapes = debugDraw.draws = 0;
+	if (lines + shapes == 0) {
+		return;
+	}
 
-		// BACK
-		-0.65, 0.85, 0.65, 	0, 0, 1, 	1, 1,
-		-0.65, 0.35, 0.65, 	0, 0, 1, 	1, 0,
-		-0.6, 0.35, 0.65, 	0, 0, 1, 	0, 0,
-		-0.6, 0.35, 0.65, 	0, 0, 1, 	0, 0,
-		-0.6, 0.85, 0.65, 	0, 0, 1, 	0, 1,
-		-0.65, 0.85, 0.65, 	0, 0, 1, 	1, 1,
+	GLintptr offset = 0;
+	UDebugPrimitive* target = (UDebugPrimitive*) UStreamAllocate(&frameStream, (lines + shapes) * sizeof(UDebugPrimitive), 16, &offset);
+	if (target == NULL) {
+		debugDraw.dropped += lines + shapes;
+		return;
+	}
+	memcpy(target, debugDraw.lines, lines * sizeof(UDebugPrimitive));
+	memcpy(target + lines, debugDraw.shapes, shapes * sizeof(UDebugPrimitive));
+	UStreamUnmap(&frameStream);
+
+	glUseProgram(lampProgram);
+	glUniformMatrix4fv(glGetUniformLocation(lampProgram, "viewProjection"), 1, GL_FALSE, glm::value_ptr(viewProjection));
+	GLint shapesLoc = glGetUniformLocation(lampProgram, "shapes");
+	glBindVertexArray(lightVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, frameStream.buffer);
+	glEnable(GL_DEPTH_TEST);
+	glDepthMask(GL_FALSE);
 
-		// RIGHT
-		-0.6, 0.85, 0.65, 	1, 0, 0, 	1, 1,
-		-0.6, 0.35, 0.65, 	1, 0, 0, 	1, 0,
-		-0.6, 0.35, -0.65, 	1, 0, 0, 	0, 0,
-		-0.6, 0.35, -0.65, 	1, 0, 0, 	0, 0,
-		-0.6, 0.85, -0.65, 	1, 0, 0, 	0, 1,
-		-0.6, 0.85, 0.65, 	1, 0, 0, 	1, 1,
+	const GLsizei stride = sizeof(UDebugPrimitive);
+	for (int pass = 0; pass < 2; pass++) {
+		int count = pass == 0 ? lines : shapes;
+		if (count == 0) {
+			continue;
+		}
+		GLintptr first = offset + (pass == 0 ? 0 : lines * stride);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (GLvoid*) (first + offsetof(UDebugPrimitive, a)));
+		glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, (GLvoid*) (first + offsetof(UDebugPrimitive, color)));
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (GLvoid*) (first + offsetof(UDebugPrimitive, b)));
+		glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, stride, (GLvoid*) (first + offsetof(UDebugPrimitive, sphere)));
+		glUniform1i(shapesLoc, pass);
+		glDrawArraysInstanced(GL_LINES, 0, pass == 0 ? 2 : 6 * DEBUG_SPHERE_SEGMENTS, count);
+		debugDraw.draws++;
+	}
+	debugDraw.drawnLines = lines;
+	debugDraw.drawnShapes = shapes;
 
-		// FRONT
-		-0.6, 0.35, -0.65, 	0, 0, -1, 	1, 0,
-		-0.65, 0.35, -0.65, 	0, 0, -1, 	0, 0,
-		-0.65, 0.85, -0.65, 	0, 0, -1, 	0, 1,
-		-0.65, 0.85, -0.65, 	0, 0, -1, 	0, 1,
-		-0.6, 0.85, -0.65, 	0, 0, -1, 	1, 1,
-		-0.6, 0.35, -0.65, 	0, 0, -1, 	1, 0,
+	glDepthMask(GL_TRUE);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(VAO);
+	glUseProgram(shaderProgram);
+}
 
-		// LEFT
-		-0.65, 0.85, 0.65, 	-1, 0, 0, 	1, 1,
-		-0.65, 0.35, 0.65, 	-1, 0, 0, 	1, 0,
-		-0.65, 0.35, -0.65, 	-1, 0, 0, 	0, 0,
-		-0.65, 0.35, -0.65, 	-1, 0, 0, 	0, 0,
-		-0.65, 0.85, -0.65, 	-1, 0, 0, 	0, 1,
-		-0.65, 0.85, 0.65, 	-1, 0, 0, 	1, 1
+/*
+ * Reads the last measurements, makes at most one quality change, and binds
+ * the frame's render target. GPU times only cover the frame two back.
+ */
+void UGovernorUpdate (void) {
+	if (governor.enabled) {
+		// Smooths out single slow frames so they do not cause changes by themselves.
+		double gpuTime = UProfileGpuTime(profileFrameCount - 2);
+		governor.cpuTime += (frameWorkTime - governor.cpuTime) * 0.1;
+		if (gpuTime >= 0.0) {
+			governor.gpuTime += (gpuTime - governor.gpuTime) * 0.1;
+		}
+		if (governor.cooldown > 0) {
+			governor.cooldown--;
+		} else {
+			UGovernorDecide(governor.cpuTime, governor.gpuTime);
+		}
+	}
+	activePointLights = std::min(pointLightCount, governor.lightLimit);
 
-	};
-	// Generate buffer IDs
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
+	if (governor.scale < 100) {
+		UGovernorResize(std::max(WindowWidth * governor.scale / 100, 1), std::max(WindowHeight * governor.scale / 100, 1));
+		renderTarget = governor.framebuffer;
+		renderWidth = governor.width;
+		renderHeight = governor.height;
+	} else {
+		renderTarget = offscreen.framebuffer;
+		renderWidth = WindowWidth;
+		renderHeight = WindowHeight;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, renderTarget);
+	glViewport(0, 0, renderWidth, renderHeight);
+}
 
-	// Activation of VAO before binding.
-    glBindVertexArray(VAO);
+void UGovernorDecide (double cpuTime, double gpuTime) {
+	double frame = std::max(cpuTime, gpuTime);
+	bool gpuBound = gpuTime > cpuTime;
+	const char* decision = NULL;
+
+	if (frame > governor.budget) {
+		if (gpuBound && governor.scale > GOVERNOR_MIN_SCALE) {
+			governor.scale -= GOVERNOR_SCALE_STEP;
+			decision = "lower resolution";
+		} else if (governor.lightLimit > 0 && pointLightCount > 0) {
+			governor.lightLimit = std::min(governor.lightLimit, pointLightCount) / 2;
+			decision = "fewer lights";
+		} else if (lodBias < GOVERNOR_MAX_LOD_BIAS) {
+			lodBias += 0.5f;
+			decision = "raise LOD bias";
+		} else if (governor.scale > GOVERNOR_MIN_SCALE) {
+			governor.scale -= GOVERNOR_SCALE_STEP;
+			decision = "lower resolution";
+		}
+	} else if (frame < governor.budget * governor.headroom) {
+		if (lodBias > 0.0f) {
+			lodBias = std::max(lodBias - 0.5f, 0.0f);
+			decision = "lower LOD bias";
+		} else if (governor.lightLimit < pointLightCount) {
+			governor.lightLimit = std::min(std::max(governor.lightLimit * 2, 1), MAX_POINT_LIGHTS);
+			decision = "more lights";
+		} else if (governor.scale < 100) {
+			governor.scale += GOVERNOR_SCALE_STEP;
+			decision = "raise resolution";
+		}
+	}
 
-	// Activates the buffer.
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	// Sends data to GPU
-	glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
+	if (decision != NULL) {
+		governor.cooldown = GOVERNOR_COOLDOWN;
+		governor.decisions++;
+		UGovernorLog(decision, cpuTime, gpuTime);
+	}
+}
 
-	// Tells GPU how to handle VBO.
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 8, (GLvoid*) 0);
-	glEnableVertexAttribArray(0); // Sets initial position of rgba in buffer.
+/* Appends a decision with the measurements behind it and the resulting settings. */
+void UGovernorLog (const char* decision, double cpuTime, double gpuTime) {
+	if (governor.log == NULL) {
+		return;
+	}
+	if (ftell(governor.log) == 0) {
+		fprintf(governor.log, "frame,decision,cpu_ms,gpu_ms,budget_ms,scale_percent,light_limit,lights,lod_bias\n");
+	}
+	fprintf(governor.log, "%ld,%s,%.3f,%.3f,%.1f,%d,%d,%d,%.1f\n", profileFrameCount, decision, cpuTime, gpuTime,
+		governor.budget, governor.scale, governor.lightLimit, pointLightCount, lodBias);
+	fflush(governor.log);
+}
 
-    // Tells GPU how to handle VBO.
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 8, (GLvoid*) (3 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(1); // Sets initial position of rgba in buffer.
+/* Recreates the scaled target at a new size; nothing happens when the size is unchanged. */
+void UGovernorResize (int width, int height) {
+	if (governor.framebuffer != 0 && governor.width == width && governor.height == height) {
+		return;
+	}
+	if (governor.framebuffer != 0) {
+		GLuint targets[2] = { governor.color, governor.depth };
+		glDeleteTextures(2, targets);
+		glDeleteFramebuffers(1, &governor.framebuffer);
+	}
 
-	// Tells GPU the Surface Normal values.
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 8, (GLvoid*) (6 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(2); // Sets initial position of rgba in buffer.
+	governor.width = width;
+	governor.height = height;
+	governor.color = UCreateTarget(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, width, height);
+	governor.depth = UCreateTarget(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, width, height);
+	glBindTexture(GL_TEXTURE_2D, texture);
 
-    glBindVertexArray(0);
+	glGenFramebuffers(1, &governor.framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, governor.framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, governor.color, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, governor.depth, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "ERROR: Scaled render target is incomplete.\n");
+	}
+	allocationWarmup = ALLOCATION_WARMUP_FRAMES;
 }
 
-void UMouseClick (int button, int state, int x, int y) {
-	/*
-	 * Possible button values:
-	 * 	GLUT_LEFT_BUTTON
-	 *	GLUT_RIGHT_BUTTON
-	 *	GLUT_MIDDLE_BUTTON
-	 *
-	 *  Possible states:
-	 * 	GLUT_DOWN
-	 * 	GLUT_UP
-	 */
+/* Stretches a scaled frame over the window, or the offscreen target, so it can be shown or captured. */
+void UGovernorPresent (void) {
+	if (renderTarget == offscreen.framebuffer) {
+		return;
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, renderTarget);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, offscreen.framebuffer);
+	glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, WindowWidth, WindowHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	glBindFramebuffer(GL_FRAMEBUFFER, offscreen.framebuffer);
+}
 
-	/* Used to create a more intuitive looking action. */
-	if (state == GLUT_UP) {
-		mouseDetected = true;
+/*
+ * Times forward, deferred and visibility buffer shading for a range of
+ * point light counts, then again with tables stacked behind each other so
+ * more fragments are drawn over. Frames go to an offscreen framebuffer, so
+ * presentation does not limit the rate. Render target traffic is estimated
+ * from the fragments each pass wrote, times the bytes each one reads and
+ * writes in that mode's targets.
+ */
+void UBenchmarkShading (void) {
+	const int lightCounts[] = { 0, 8, 32, 64, 256, 1024 };
+	const int layers[] = { 1, 4 };
+	const int frames = 30;
+	// Color and depth; G-buffer and depth; IDs and depth.
+	const int geometryBytes[SHADING_MODES] = { 8, 16, 12 };
+	// Nothing; G-buffer reads plus a blended color; IDs and depth read, color and depth written.
+	const int shadingBytes[SHADING_MODES] = { 0, 24, 20 };
+
+	offscreen.width = WindowWidth;
+	offscreen.height = WindowHeight;
+	UOffscreenCreateFramebuffer();
+	occlusionCulling = false;
+
+	printf("INFO: Shading at %dx%d on %s, ms and render target MB per frame.\n", WindowWidth, WindowHeight, glGetString(GL_RENDERER));
+	int tables = 1;
+	for (int l = 0; l < (int) (sizeof(layers) / sizeof(layers[0])); l++) {
+		// Stacks copies further along the view direction.
+		for (; tables < layers[l]; tables++) {
+			UAddTableCopy(glm::vec3(0.0f, 0.0f, -1.5f * tables));
+		}
+
+		for (int c = 0; c < (int) (sizeof(lightCounts) / sizeof(lightCounts[0])); c++) {
+			pointLightCount = lightCounts[c];
+			printf("  %d tables, %4d lights:", tables, pointLightCount);
+			for (int mode = 0; mode < SHADING_MODES; mode++) {
+				shadingMode = mode;
+				for (int frame = 0; frame < 3; frame++) {
+					URenderGraphics();
+				}
+				glFinish();
+
+				double start = UNowMilliseconds();
+				for (int frame = 0; frame < frames; frame++) {
+					URenderGraphics();
+				}
+				glFinish();
+				double time = (UNowMilliseconds() - start) / frames;
+
+				measureShadingSamples = true;
+				URenderGraphics();
+				measureShadingSamples = false;
+				GLuint samples[2] = { 0, 0 };
+				glGetQueryObjectuiv(shadingSampleQueries[0], GL_QUERY_RESULT, &samples[0]);
+				if (mode != SHADING_FORWARD) {
+					glGetQueryObjectuiv(shadingSampleQueries[1], GL_QUERY_RESULT, &samples[1]);
+				}
+				double bytes = (double) samples[0] * geometryBytes[mode] + (double) samples[1] * shadingBytes[mode];
+				printf(" %s %.3f ms %.1f MB", shadingModeNames[mode], time, bytes / 1048576.0);
+			}
+			printf("\n");
+		}
 	}
+	shadingMode = SHADING_FORWARD;
+}
 
-	switch (button) {
-		case GLUT_LEFT_BUTTON:
-			leftIsPressed = (state == GLUT_DOWN);
-			/* Determines if the alt key is also being pressed. */
-			altIsPressed = (leftIsPressed && (glutGetModifiers() == GLUT_ACTIVE_ALT));
-			break;
-		case GLUT_RIGHT_BUTTON:
-			rightIsPressed = (state == GLUT_DOWN);
-			/* Determines if the alt key is also being pressed. */
-			altIsPressed = (rightIsPressed && (glutGetModifiers() == GLUT_ACTIVE_ALT));
-			break;
-		default:
-			break;
+/*
+ * Compares CPU and GPU culling as the table grid grows, with and without
+ * occlusion culling. CPU time is what the profiler's culling, shadow and
+ * draw zones took to return. Shadows still test and draw every object on
+ * the CPU, so only the culling and draw part stays flat on the GPU path;
+ * frame time waits for the GPU.
+ */
+void UBenchmarkGpuCulling (void) {
+	if (!gpuCulling.supported) {
+		printf("WARNING: GPU culling is not supported here, nothing to compare.\n");
+		return;
 	}
+	const int tableCounts[] = { 1, 64, 512, 2048 };
+	const int frames = 30;
+
+	offscreen.width = WindowWidth;
+	offscreen.height = WindowHeight;
+	UOffscreenCreateFramebuffer();
+	occlusionSource = OCCLUSION_FROM_GPU;
+
+	// CPU time of the zones that cull and submit, shadows included, in the newest recorded frame.
+	auto submitTime = [] () {
+		const UProfileFrame& record = profileFrames[(profileFrameCount - 1) % PROFILE_HISTORY];
+		double time = 0.0;
+		for (int i = 0; i < record.zoneCount; i++) {
+			const char* name = record.zones[i].name;
+			if (strcmp(name, "Culling") == 0 || strcmp(name, "Shadows") == 0 || strcmp(name, "Draw") == 0) {
+				time += record.zones[i].duration;
+			}
+		}
+		return time;
+	};
+
+	printf("INFO: Culling at %dx%d on %s.\n", WindowWidth, WindowHeight, glGetString(GL_RENDERER));
+	int tables = 1;
+	for (int t = 0; t < (int) (sizeof(tableCounts) / sizeof(tableCounts[0])); t++) {
+		// Rows of 32 tables going away from the camera.
+		for (; tables < tableCounts[t]; tables++) {
+			UAddTableCopy(glm::vec3(4.0f * (tables % 32 - 16), 0.0f, -4.0f * (tables / 32 + 1)));
+		}
 
+		for (int occlusion = 0; occlusion < 2; occlusion++) {
+			occlusionCulling = occlusion != 0;
+			printf("  %4d tables (%6d objects), occlusion %s:", tables, (int) sceneObjects.size(), occlusionCulling ? "on " : "off");
+			for (int gpu = 0; gpu < 2; gpu++) {
+				gpuCulling.enabled = gpu != 0;
+				for (int frame = 0; frame < 3; frame++) {
+					URenderGraphics();
+				}
+				glFinish();
+
+				double cpuTime = 0.0;
+				double start = UNowMilliseconds();
+				for (int frame = 0; frame < frames; frame++) {
+					URenderGraphics();
+					cpuTime += submitTime();
+				}
+				glFinish();
+				double time = (UNowMilliseconds() - start) / frames;
+
+				if (gpuCulling.enabled) {
+					UGpuCullReadStats();
+				}
+				printf("  %s culling %.3f ms CPU, %.3f ms frame, %d drawn.", gpuCulling.enabled ? "GPU" : "CPU", cpuTime / frames, time, cullStats.visible);
+			}
+			printf("\n");
+		}
+	}
+	gpuCulling.enabled = false;
 }
-void UMousePressedMove (int x, int y) {
-	/* This first portion just updates the state of the mouse and how it has moved. */
-	if (mouseDetected) {
-		lastMouseX = x;
-		lastMouseY = y;
-		mouseDetected = false;
+
+/* Builds the triangle BVH of every mesh part and the buffer ID reads land in. */
+void UPickCreate (void) {
+	picking.meshes.resize(meshParts.size());
+	for (int i = 0; i < (int) meshParts.size(); i++) {
+		const UMeshPart& part = meshParts[i];
+		UPickMesh& mesh = picking.meshes[i];
+		mesh.triangles.assign(meshPositions.begin() + part.first, meshPositions.begin() + part.first + part.count);
+
+		int count = part.count / 3;
+		std::vector<glm::vec3> boundsMin(count), boundsMax(count);
+		for (int t = 0; t < count; t++) {
+			const glm::vec3* corner = &mesh.triangles[t * 3];
+			boundsMin[t] = glm::min(corner[0], glm::min(corner[1], corner[2]));
+			boundsMax[t] = glm::max(corner[0], glm::max(corner[1], corner[2]));
+		}
+		if (count > 0) {
+			UBVHBuild(&mesh.bvh, &boundsMin[0], &boundsMax[0], count);
+		}
 	}
 
-	mouseXOffset = x - lastMouseX;
-	mouseYOffset = lastMouseY - y;
+	picking.selected = PICK_NONE;
+	picking.node = tableNode;
+	glGenBuffers(1, &picking.idBuffer);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, picking.idBuffer);
+	glBufferData(GL_PIXEL_PACK_BUFFER, 2 * sizeof(GLuint), NULL, GL_STREAM_READ);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
 
-	lastMouseX = x;
-	lastMouseY = y;
+/*
+ * Reciprocal of a ray direction for slab tests. Zero components become a
+ * tiny value of the same sign, so a ray lying on a slab plane gives a huge
+ * distance instead of 0 * inf = NaN, which SIMD min and max resolve
+ * differently from lane to lane.
+ */
+glm::vec3 URayInverse (glm::vec3 direction) {
+	glm::vec3 inverse;
+	for (int axis = 0; axis < 3; axis++) {
+		float d = direction[axis];
+		inverse[axis] = 1.0f / (fabsf(d) > 1e-20f ? d : copysignf(1e-20f, d));
+	}
+	return inverse;
+}
 
-	mouseXOffset *= sensitivity;
-	mouseYOffset *= sensitivity;
+/* Slab test of a ray against up to four boxes. Returns a bit per box hit before maxDistance and where the ray enters each. */
+int URayTestBoxes (const URayBoxes* boxes, int count, const glm::vec3& origin, const glm::vec3& inverse, float maxDistance, float* entries) {
+	int lanes = (1 << count) - 1;
+#if defined(__AVX2__)
+	__m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	__m128 ix = _mm_set1_ps(inverse.x), iy = _mm_set1_ps(inverse.y), iz = _mm_set1_ps(inverse.z);
+	__m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(boxes->minX), ox), ix), x1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(boxes->maxX), ox), ix);
+	__m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(boxes->minY), oy), iy), y1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(boxes->maxY), oy), iy);
+	__m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(boxes->minZ), oz), iz), z1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(boxes->maxZ), oz), iz);
+	__m128 nearest = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1), _mm_setzero_ps()));
+	__m128 farthest = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_min_ps(_mm_max_ps(z0, z1), _mm_set1_ps(maxDistance)));
+	_mm_storeu_ps(entries, nearest);
+	return _mm_movemask_ps(_mm_cmple_ps(nearest, farthest)) & lanes;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	float32x4_t ox = vdupq_n_f32(origin.x), oy = vdupq_n_f32(origin.y), oz = vdupq_n_f32(origin.z);
+	float32x4_t ix = vdupq_n_f32(inverse.x), iy = vdupq_n_f32(inverse.y), iz = vdupq_n_f32(inverse.z);
+	float32x4_t x0 = vmulq_f32(vsubq_f32(vld1q_f32(boxes->minX), ox), ix), x1 = vmulq_f32(vsubq_f32(vld1q_f32(boxes->maxX), ox), ix);
+	float32x4_t y0 = vmulq_f32(vsubq_f32(vld1q_f32(boxes->minY), oy), iy), y1 = vmulq_f32(vsubq_f32(vld1q_f32(boxes->maxY), oy), iy);
+	float32x4_t z0 = vmulq_f32(vsubq_f32(vld1q_f32(boxes->minZ), oz), iz), z1 = vmulq_f32(vsubq_f32(vld1q_f32(boxes->maxZ), oz), iz);
+	float32x4_t nearest = vmaxq_f32(vmaxq_f32(vminq_f32(x0, x1), vminq_f32(y0, y1)), vmaxq_f32(vminq_f32(z0, z1), vdupq_n_f32(0.0f)));
+	float32x4_t farthest = vminq_f32(vminq_f32(vmaxq_f32(x0, x1), vmaxq_f32(y0, y1)), vminq_f32(vmaxq_f32(z0, z1), vdupq_n_f32(maxDistance)));
+	vst1q_f32(entries, nearest);
+	const uint32_t bits[4] = { 1, 2, 4, 8 };
+	return (int) vaddvq_u32(vandq_u32(vcleq_f32(nearest, farthest), vld1q_u32(bits))) & lanes;
+#else
+	int hits = 0;
+	for (int i = 0; i < count; i++) {
+		float x0 = (boxes->minX[i] - origin.x) * inverse.x, x1 = (boxes->maxX[i] - origin.x) * inverse.x;
+		float y0 = (boxes->minY[i] - origin.y) * inverse.y, y1 = (boxes->maxY[i] - origin.y) * inverse.y;
+		float z0 = (boxes->minZ[i] - origin.z) * inverse.z, z1 = (boxes->maxZ[i] - origin.z) * inverse.z;
+		float nearest = std::max(std::max(std::min(x0, x1), std::min(y0, y1)), std::max(std::min(z0, z1), 0.0f));
+		float farthest = std::min(std::min(std::max(x0, x1), std::max(y0, y1)), std::min(std::max(z0, z1), maxDistance));
+		entries[i] = nearest;
+		if (nearest <= farthest) {
+			hits |= 1 << i;
+		}
+	}
+	return hits & lanes;
+#endif
+}
 
-	/* Handles what type of action is being performed. */
-	if (altIsPressed) {
-		if (leftIsPressed) {
-			/* Changes orientation of objet based on mouse movement. */
-			object_yaw += mouseXOffset;
-			object_pitch += mouseYOffset;
+void URaySetBox (URayBoxes* boxes, int lane, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	boxes->minX[lane] = boundsMin.x;
+	boxes->minY[lane] = boundsMin.y;
+	boxes->minZ[lane] = boundsMin.z;
+	boxes->maxX[lane] = boundsMax.x;
+	boxes->maxY[lane] = boundsMax.y;
+	boxes->maxZ[lane] = boundsMax.z;
+}
 
-			/* CLAMPING to 180 degrees. */
-			/* 3.14159 is approximately 180 degrees in radians.*/
-			if (object_yaw > 3.14159) {
-				object_yaw = 3.14159;
-			} else if (object_yaw < -3.14159) {
-				object_yaw = -3.14159;
-			}
+/* Closest hit of a world space ray on one object's triangles, at full detail. */
+bool UPickTestObject (int object, glm::vec3 origin, glm::vec3 direction, float maxDistance, float* hitDistance) {
+	const USceneObject& sceneObject = sceneObjects[object];
+	if (sceneObject.part >= (int) picking.meshes.size() || picking.meshes[sceneObject.part].triangles.empty()) {
+		return false;
+	}
+	const UPickMesh& mesh = picking.meshes[sceneObject.part];
+	picking.meshTests++;
+
+	// The direction is not renormalized, so distances along the ray mean the same in model space.
+	glm::mat4 toModel = glm::inverse(scene.worlds[sceneObject.node]);
+	return URayIntersectTriangles(&mesh.bvh, &mesh.triangles[0], glm::vec3(toModel * glm::vec4(origin, 1.0f)),
+		glm::vec3(toModel * glm::vec4(direction, 0.0f)), maxDistance, false, hitDistance, NULL);
+}
 
-			if (object_pitch > 3.14159) {
-				object_pitch = 3.14159;
-			} else if (object_pitch < -3.14159) {
-				object_pitch = -3.14159;
+/* Object closest along a world space ray, or PICK_NONE. Distances are in multiples of the direction's length. */
+int UPickRay (glm::vec3 origin, glm::vec3 direction, float* hitDistance) {
+	picking.boxTests = picking.meshTests = 0;
+	if (sceneBVH.nodes.empty()) {
+		return PICK_NONE;
+	}
+	glm::vec3 inverse = URayInverse(direction);
+	float closest = 1e30f;
+	int found = PICK_NONE;
+
+	// Nodes left to visit and where the ray enters them, the nearest on top.
+	int stack[64];
+	float entries[64];
+	int top = 0;
+	stack[top] = 0;
+	entries[top++] = 0.0f;
+	URayBoxes boxes;
+	float entry[4];
+	while (top > 0) {
+		top--;
+		// Something nearer was hit since this node was pushed.
+		if (entries[top] > closest) {
+			continue;
+		}
+		const UBVHNode& node = sceneBVH.nodes[stack[top]];
+
+		if (node.left >= 0) {
+			URaySetBox(&boxes, 0, sceneBVH.nodes[node.left].boundsMin, sceneBVH.nodes[node.left].boundsMax);
+			URaySetBox(&boxes, 1, sceneBVH.nodes[node.left + 1].boundsMin, sceneBVH.nodes[node.left + 1].boundsMax);
+			int hits = URayTestBoxes(&boxes, 2, origin, inverse, closest, entry);
+			picking.boxTests += 2;
+
+			// Pushes the farther child first so the nearer one is visited next.
+			int nearer = (hits == 3 && entry[1] < entry[0]) ? 1 : 0;
+			for (int c = 1 - nearer, n = 0; n < 2; c = 1 - c, n++) {
+				if ((hits & (1 << c)) && top < 64) {
+					stack[top] = node.left + c;
+					entries[top++] = entry[c];
+				}
 			}
+			continue;
+		}
 
-		} else if (rightIsPressed) {
-			/* This code affect zooming in and out in non-ortho mode. */
-			if (mouseYOffset > 0) {
-				cameraPosition += cameraSpeed * CameraForwardZ;
-			} else {
-				cameraPosition -= cameraSpeed * CameraForwardZ;
+		for (int i = 0; i < node.count; i++) {
+			int item = sceneBVH.items[node.first + i];
+			URaySetBox(&boxes, i, objectBoundsMin[item], objectBoundsMax[item]);
+		}
+		int hits = URayTestBoxes(&boxes, node.count, origin, inverse, closest, entry);
+		picking.boxTests += node.count;
+		for (int i = 0; i < node.count; i++) {
+			int item = sceneBVH.items[node.first + i];
+			float distance;
+			if ((hits & (1 << i)) && entry[i] <= closest && UPickTestObject(item, origin, direction, closest, &distance)) {
+				closest = distance;
+				found = item;
 			}
 		}
 	}
+
+	if (found != PICK_NONE && hitDistance != NULL) {
+		*hitDistance = closest;
+	}
+	return found;
 }
 
-void UKeyboard (unsigned char key, GLint x, GLint y) {
-	if (key == 'o') {
-		/* Toggles orthogonal view with 'o'. */
-		isOrtho = !isOrtho;
+/* World space ray through a window pixel, from the near plane to the far plane of the last frame drawn. */
+void UPickCursorRay (int x, int y, glm::vec3* origin, glm::vec3* direction) {
+	glm::mat4 inverse = glm::inverse(picking.viewProjection);
+	GLfloat ndcX = 2.0f * (x + 0.5f) / WindowWidth - 1.0f;
+	GLfloat ndcY = 1.0f - 2.0f * (y + 0.5f) / WindowHeight;
+	glm::vec4 nearPoint = inverse * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+	glm::vec4 farPoint = inverse * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+	*origin = glm::vec3(nearPoint) / nearPoint.w;
+	*direction = glm::vec3(farPoint) / farPoint.w - *origin;
+}
+
+/* Picks the object under a window pixel, at once with a ray or a frame later from the visibility buffer. */
+void UPickAt (int x, int y) {
+	if (picking.fromIds && shadingMode == SHADING_VISIBILITY && picking.idBuffer != 0) {
+		picking.requested = true;
+		picking.requestX = x;
+		picking.requestY = y;
+		picking.requestFrame = profileFrameCount;
+		return;
+	}
+
+	glm::vec3 origin, direction;
+	UPickCursorRay(x, y, &origin, &direction);
+	float distance = 0.0f;
+	double start = UNowMilliseconds();
+	int object = UPickRay(origin, direction, &distance);
+	picking.time = UNowMilliseconds() - start;
+
+	UPickSelect(object);
+	if (object == PICK_NONE) {
+		printf("INFO: Nothing picked in %.1f us, %d boxes and %d meshes tested.\n", picking.time * 1000.0, picking.boxTests, picking.meshTests);
+	} else {
+		printf("INFO: Picked object %d (part %d) at distance %.2f in %.1f us, %d boxes and %d meshes tested.\n",
+			object, sceneObjects[object].part, distance * glm::length(direction), picking.time * 1000.0, picking.boxTests, picking.meshTests);
 	}
 }
 
-void UGenerateTexture (void) {
-	// Creates and binds texture.
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
+void UPickSelect (int object) {
+	picking.selected = object;
+	// Turning a part turns the whole table it belongs to.
+	picking.node = tableNode;
+	if (object != PICK_NONE) {
+		picking.node = sceneObjects[object].node;
+		while (scene.parents[picking.node] >= 0) {
+			picking.node = scene.parents[picking.node];
+		}
+	}
+}
 
-	int width, height;
-	// Reads texture from file.
-	unsigned char* image = SOIL_load_image("wood.jpg", &width, &height, 0, SOIL_LOAD_RGB);
+/* Collects a finished ID read, then starts one for a pending click while the visibility buffer holds this frame. */
+void UPickReadIds (void) {
+	if (picking.idFence != 0) {
+		GLenum status = glClientWaitSync(picking.idFence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+			return;
+		}
+		glDeleteSync(picking.idFence);
+		picking.idFence = 0;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, picking.idBuffer);
+		const GLuint* ids = (const GLuint*) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 2 * sizeof(GLuint), GL_MAP_READ_BIT);
+		if (ids != NULL) {
+			// IDs are stored one above the object index so that zero is empty.
+			int object = (ids[0] > 0 && ids[0] <= sceneObjects.size()) ? (int) ids[0] - 1 : PICK_NONE;
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			UPickSelect(object);
+			printf("INFO: Picked object %d from the visibility buffer, %ld frames after the click.\n", object, profileFrameCount - picking.requestFrame);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
 
-	// Writes image data to texture.
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-	glGenerateMipmap(GL_TEXTURE_2D);
+	if (!picking.requested) {
+		return;
+	}
+	picking.requested = false;
 
-	// Frees image and unbinds texture.
-	SOIL_free_image_data(image);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	// The shading mode changed since the click, so there is no ID buffer to read; the ray answers instead.
+	if (shadingMode != SHADING_VISIBILITY) {
+		UPickAt(picking.requestX, picking.requestY);
+		return;
+	}
+
+	// The target is at render resolution, which the governor may have scaled from the window.
+	int x = std::min(picking.requestX * visibility.width / WindowWidth, visibility.width - 1);
+	int y = std::min((WindowHeight - 1 - picking.requestY) * visibility.height / WindowHeight, visibility.height - 1);
+	if (x < 0 || y < 0) {
+		return;
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, visibility.framebuffer);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, picking.idBuffer);
+	glReadPixels(x, y, 1, 1, GL_RG_INTEGER, GL_UNSIGNED_INT, (GLvoid*) 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, renderTarget);
+	picking.idFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* Times ray picks over growing rows of tables, checked against testing every object. */
+void UBenchmarkPicking (void) {
+	const int tableCounts[] = { 1, 64, 512, 4096 };
+	const int picks = 10000, checks = 200;
+
+	// Looks down the rows of tables from above the first one.
+	glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 6.0f, 4.0f), glm::vec3(0.0f, 0.0f, -40.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 projection = glm::perspective(glm::radians(60.0f), (GLfloat) WindowWidth / (GLfloat) WindowHeight, 0.1f, 100.0f);
+	picking.viewProjection = projection * view;
+
+	printf("INFO: Picking at %dx%d, %d picks per scene.\n", WindowWidth, WindowHeight, picks);
+	int tables = 1;
+	for (int t = 0; t < (int) (sizeof(tableCounts) / sizeof(tableCounts[0])); t++) {
+		// Rows of 32 tables going away from the camera.
+		for (; tables < tableCounts[t]; tables++) {
+			UAddTableCopy(glm::vec3(4.0f * (tables % 32 - 16), 0.0f, -4.0f * (tables / 32 + 1)));
+		}
+		long triangles = 0;
+		for (int i = 0; i < (int) sceneObjects.size(); i++) {
+			triangles += meshParts[sceneObjects[i].part].count / 3;
+		}
+
+		// The same pixels for every scene.
+		unsigned int seed = 12345;
+		int hits = 0, disagreements = 0;
+		long boxTests = 0, meshTests = 0;
+		double pickTime = 0.0, bruteTime = 0.0;
+		for (int i = 0; i < picks; i++) {
+			seed = seed * 1664525u + 1013904223u;
+			int x = (seed >> 8) % WindowWidth;
+			seed = seed * 1664525u + 1013904223u;
+			int y = (seed >> 8) % WindowHeight;
+			glm::vec3 origin, direction;
+			UPickCursorRay(x, y, &origin, &direction);
+
+			float distance = 0.0f;
+			double start = UNowMilliseconds();
+			int object = UPickRay(origin, direction, &distance);
+			pickTime += UNowMilliseconds() - start;
+			hits += object != PICK_NONE;
+			boxTests += picking.boxTests;
+			meshTests += picking.meshTests;
+
+			// Every object against the same ray, without the scene BVH.
+			if (i < checks) {
+				float closest = 1e30f, bruteDistance;
+				int bruteObject = PICK_NONE;
+				start = UNowMilliseconds();
+				for (int j = 0; j < (int) sceneObjects.size(); j++) {
+					if (UPickTestObject(j, origin, direction, closest, &bruteDistance)) {
+						closest = bruteDistance;
+						bruteObject = j;
+					}
+				}
+				bruteTime += UNowMilliseconds() - start;
+				if (bruteObject != object && (object == PICK_NONE || bruteObject == PICK_NONE || fabsf(closest - distance) > 1e-5f)) {
+					disagreements++;
+				}
+			}
+		}
+
+		printf("  %4d tables (%6d objects, %8ld triangles): %7.2f us per pick, %5.1f boxes and %5.2f meshes tested, %3d%% hit;"
+			" every object %9.2f us, %d disagreements.\n",
+			tables, (int) sceneObjects.size(), triangles, pickTime * 1000.0 / picks, (double) boxTests / picks, (double) meshTests / picks,
+			hits * 100 / picks, bruteTime * 1000.0 / checks, disagreements);
+	}
 }